@@ -319,7 +319,12 @@ static THD_FUNCTION(ap_thread, arg) {
 	chRegSetThreadName("Autopilot");
 
 	for(;;) {
+		// How late the loop wakes up, e.g. while the config is stored
+		rtcnt_t sleep_start = chSysGetRealtimeCounterX();
 		chThdSleep(CH_CFG_ST_FREQUENCY / AP_HZ);
+		conf_general_report_loop_period(
+				(float)RTC2US(STM32_SYSCLK, chSysGetRealtimeCounterX() - sleep_start),
+				(float)ST2US(CH_CFG_ST_FREQUENCY / AP_HZ));
 
 		bool route_end = false;
 
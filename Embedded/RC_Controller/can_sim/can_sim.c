@@ -0,0 +1,872 @@
+/*
+	Copyright 2016 - 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host test harness for the CAN buffer transport in comm_can.c. The real
+ * comm_can.c runs on pthreads through the ChibiOS and HAL stubs in ch.h and
+ * hal.h. The frames go over a SocketCAN interface, such as vcan0, when one
+ * is given with -i, and over a simulated 500 kbit/s bus otherwise. The
+ * simulated bus has three transmit mailboxes per node that are sent in
+ * request order, arbitrates between nodes on the frame id and can be
+ * stopped to simulate a bus without ACK.
+ *
+ * Frames sent by comm_can.c are looped back to it, so buffers that it
+ * sends to its own id are received and checked by it. The other nodes are
+ * simulated here with the same fragmentation as comm_can_send_buffer.
+ *
+ * Cases:
+ * - Several threads send buffers through comm_can_send_buffer while
+ *   another thread sends single frames with comm_can_transmit_sid. All
+ *   buffers must arrive intact, and the time that the single frames wait
+ *   is measured.
+ * - Several other nodes send buffers to us at the same time. The fill
+ *   frames do not carry the sender, so interleaved buffers are dropped.
+ *   The loss is reported, and no buffer may be accepted corrupted.
+ * - The bus stops while a buffer is sent. The buffer must be aborted
+ *   after one TX timeout, and a single frame from another thread must not
+ *   wait for the whole buffer. Simulated bus only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include "ch.h"
+#include "hal.h"
+#include "comm_can.h"
+#include "bldc_interface.h"
+#include "commands.h"
+#include "terminal.h"
+#include "crc.h"
+
+// Settings
+#define MAIN_ID					10
+#define NODES					4 // Node 0 is comm_can.c
+#define MAILBOXES				3
+#define RX_FIFO_LEN				64
+#define BITRATE					500000
+#define SENDER_THREADS			3
+#define BUFFER_LEN_MIN			7
+#define BUFFER_LEN_MAX			600
+
+// Global variables
+int main_id = MAIN_ID;
+CANDriver CAND1;
+
+// Private types
+typedef struct {
+	int node;
+	int id;
+	volatile bool run;
+	uint32_t sent;
+	pthread_t pt;
+} sender_t;
+
+typedef struct {
+	uint32_t ok[NODES * SENDER_THREADS];
+	uint32_t corrupted;
+	uint64_t bytes;
+} rx_stats_t;
+
+// Private variables
+static __thread thread_t *m_self = 0;
+static struct timespec m_start;
+static int m_sock_rx = -1;
+static int m_sock_tx[NODES];
+static bool m_socketcan = false;
+
+static pthread_mutex_t m_bus_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t m_bus_cond = PTHREAD_COND_INITIALIZER;
+static CANTxFrame m_mailbox[NODES][MAILBOXES];
+static int m_mailbox_len[NODES];
+static CANRxFrame m_rx_fifo[RX_FIFO_LEN];
+static int m_rx_read;
+static int m_rx_count;
+static uint32_t m_rx_overruns;
+static bool m_bus_stuck;
+static uint64_t m_bus_bits;
+
+static pthread_mutex_t m_stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+static rx_stats_t m_stats;
+static void(*m_can_status_cmd)(int argc, const char **argv) = 0;
+static int m_failures = 0;
+
+// Private functions
+static double time_s(void);
+static void check(bool ok, const char *what);
+static void rx_push(const CANRxFrame *frame);
+static msg_t bus_transmit(int node, const CANTxFrame *frame, systime_t timeout);
+static void *bus_thread(void *arg);
+static void *socketcan_rx_thread(void *arg);
+static bool socketcan_open(const char *ifname);
+static int buffer_len(int id, uint32_t seq);
+static void buffer_fill(uint8_t *buf, int id, uint32_t seq, int len);
+static void remote_send_buffer(int node, uint8_t dest, uint8_t *data, unsigned int len);
+static void *sender_thread(void *arg);
+static void start_senders(sender_t *senders, int count, int node_first);
+static uint32_t stop_senders(sender_t *senders, int count);
+static void reset_stats(void);
+static void case_local_threads(double duration);
+static void case_remote_nodes(double duration);
+static void case_stuck_bus(void);
+
+/*
+ * ChibiOS stubs
+ */
+
+static void *thread_trampoline(void *arg) {
+	thread_t *tp = (thread_t*)arg;
+	m_self = tp;
+	tp->func(tp->arg);
+	return 0;
+}
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio,
+		void (*pf)(void *arg), void *arg) {
+	(void)wsp;
+	(void)size;
+	(void)prio;
+
+	thread_t *tp = calloc(1, sizeof(thread_t));
+	pthread_mutex_init(&tp->lock, 0);
+	pthread_cond_init(&tp->cond, 0);
+	tp->func = pf;
+	tp->arg = arg;
+	pthread_create(&tp->pt, 0, thread_trampoline, tp);
+	pthread_detach(tp->pt);
+	return tp;
+}
+
+thread_t *chThdGetSelfX(void) {
+	return m_self;
+}
+
+bool chThdShouldTerminateX(void) {
+	return false;
+}
+
+void chRegSetThreadName(const char *name) {
+	(void)name;
+}
+
+void chMtxObjectInit(mutex_t *mp) {
+	pthread_mutex_init(&mp->mtx, 0);
+}
+
+void chMtxLock(mutex_t *mp) {
+	pthread_mutex_lock(&mp->mtx);
+}
+
+void chMtxUnlock(mutex_t *mp) {
+	pthread_mutex_unlock(&mp->mtx);
+}
+
+void chEvtRegister(event_source_t *esp, event_listener_t *elp, int id) {
+	(void)elp;
+	esp->mask = EVENT_MASK(id);
+	__atomic_store_n(&esp->listener, chThdGetSelfX(), __ATOMIC_RELEASE);
+}
+
+void chEvtUnregister(event_source_t *esp, event_listener_t *elp) {
+	(void)elp;
+	__atomic_store_n(&esp->listener, 0, __ATOMIC_RELEASE);
+}
+
+eventmask_t chEvtWaitAnyTimeout(eventmask_t mask, systime_t timeout) {
+	thread_t *tp = m_self;
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	uint64_t ns = (uint64_t)timeout * (1000000000ULL / CH_CFG_ST_FREQUENCY);
+	deadline.tv_sec += ns / 1000000000ULL;
+	deadline.tv_nsec += ns % 1000000000ULL;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&tp->lock);
+	while (!(tp->pending & mask)) {
+		if (timeout == TIME_INFINITE) {
+			pthread_cond_wait(&tp->cond, &tp->lock);
+		} else if (pthread_cond_timedwait(&tp->cond, &tp->lock, &deadline) == ETIMEDOUT) {
+			pthread_mutex_unlock(&tp->lock);
+			return 0;
+		}
+	}
+
+	eventmask_t res = tp->pending & mask;
+	tp->pending &= ~res;
+	pthread_mutex_unlock(&tp->lock);
+	return res;
+}
+
+eventmask_t chEvtWaitAny(eventmask_t mask) {
+	return chEvtWaitAnyTimeout(mask, TIME_INFINITE);
+}
+
+void chEvtSignal(thread_t *tp, eventmask_t mask) {
+	if (!tp) {
+		return;
+	}
+
+	pthread_mutex_lock(&tp->lock);
+	tp->pending |= mask;
+	pthread_cond_signal(&tp->cond);
+	pthread_mutex_unlock(&tp->lock);
+}
+
+systime_t chVTGetSystemTime(void) {
+	return (systime_t)(time_s() * CH_CFG_ST_FREQUENCY);
+}
+
+/*
+ * CAN driver stubs
+ */
+
+void canStart(CANDriver *canp, const CANConfig *config) {
+	(void)canp;
+	(void)config;
+}
+
+msg_t canTransmit(CANDriver *canp, int mailbox, const CANTxFrame *ctfp, systime_t timeout) {
+	(void)canp;
+	(void)mailbox;
+	return bus_transmit(0, ctfp, timeout);
+}
+
+msg_t canReceive(CANDriver *canp, int mailbox, CANRxFrame *crfp, systime_t timeout) {
+	(void)canp;
+	(void)mailbox;
+	(void)timeout;
+
+	msg_t res = MSG_TIMEOUT;
+
+	pthread_mutex_lock(&m_bus_mtx);
+	if (m_rx_count > 0) {
+		*crfp = m_rx_fifo[m_rx_read];
+		m_rx_read = (m_rx_read + 1) % RX_FIFO_LEN;
+		m_rx_count--;
+		res = MSG_OK;
+	}
+	pthread_mutex_unlock(&m_bus_mtx);
+
+	return res;
+}
+
+/*
+ * Stubs for the rest of the firmware
+ */
+
+void bldc_interface_init(void(*func)(unsigned char *data, unsigned int len)) {
+	(void)func;
+}
+
+void bldc_interface_set_rx_printf_func(void(*func)(char *str)) {
+	(void)func;
+}
+
+// Every buffer that comm_can.c accepts ends up here
+void bldc_interface_process_packet(unsigned char *data, unsigned int len) {
+	static uint8_t expected[BUFFER_LEN_MAX];
+	bool ok = false;
+	int id = 0;
+
+	if (len >= BUFFER_LEN_MIN && len <= BUFFER_LEN_MAX) {
+		id = data[0];
+		uint32_t seq = (uint32_t)data[1] << 24 | (uint32_t)data[2] << 16 |
+				(uint32_t)data[3] << 8 | (uint32_t)data[4];
+
+		if (id < NODES * SENDER_THREADS && buffer_len(id, seq) == (int)len) {
+			buffer_fill(expected, id, seq, len);
+			ok = memcmp(expected, data, len) == 0;
+		}
+	}
+
+	pthread_mutex_lock(&m_stats_mtx);
+	if (ok) {
+		m_stats.ok[id]++;
+		m_stats.bytes += len;
+	} else {
+		m_stats.corrupted++;
+	}
+	pthread_mutex_unlock(&m_stats_mtx);
+}
+
+void commands_printf(const char* format, ...) {
+	va_list arg;
+	va_start(arg, format);
+	printf("  ");
+	vprintf(format, arg);
+	printf("\n");
+	va_end(arg);
+}
+
+void terminal_register_command_callback(
+		const char* command,
+		const char *help,
+		const char *arg_names,
+		void(*cbf)(int argc, const char **argv)) {
+	(void)help;
+	(void)arg_names;
+
+	if (strcmp(command, "can_status") == 0) {
+		m_can_status_cmd = cbf;
+	}
+}
+
+/*
+ * Bus
+ */
+
+static double time_s(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)(ts.tv_sec - m_start.tv_sec) + (double)(ts.tv_nsec - m_start.tv_nsec) * 1e-9;
+}
+
+static void check(bool ok, const char *what) {
+	printf("  %s: %s\n", ok ? "ok" : "FAILED", what);
+	if (!ok) {
+		m_failures++;
+	}
+}
+
+// Must be called with m_bus_mtx locked
+static void rx_push(const CANRxFrame *frame) {
+	if (m_rx_count >= RX_FIFO_LEN) {
+		m_rx_overruns++;
+		return;
+	}
+
+	m_rx_fifo[(m_rx_read + m_rx_count) % RX_FIFO_LEN] = *frame;
+	m_rx_count++;
+	chEvtSignal(__atomic_load_n(&CAND1.rxfull_event.listener, __ATOMIC_ACQUIRE),
+			CAND1.rxfull_event.mask);
+}
+
+static msg_t bus_transmit(int node, const CANTxFrame *frame, systime_t timeout) {
+	double deadline = time_s() + (double)timeout / (double)CH_CFG_ST_FREQUENCY;
+
+	if (m_socketcan) {
+		struct can_frame cf;
+		memset(&cf, 0, sizeof(cf));
+		cf.can_id = frame->IDE == CAN_IDE_EXT ? (frame->EID | CAN_EFF_FLAG) : frame->SID;
+		cf.can_dlc = frame->DLC;
+		memcpy(cf.data, frame->data8, frame->DLC);
+
+		for (;;) {
+			if (write(m_sock_tx[node], &cf, sizeof(cf)) == (ssize_t)sizeof(cf)) {
+				return MSG_OK;
+			}
+
+			if ((errno != ENOBUFS && errno != EAGAIN) || time_s() >= deadline) {
+				return MSG_TIMEOUT;
+			}
+
+			struct pollfd pfd = {m_sock_tx[node], POLLOUT, 0};
+			poll(&pfd, 1, 1);
+		}
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	double wait = (double)timeout / (double)CH_CFG_ST_FREQUENCY;
+	ts.tv_sec += (time_t)wait;
+	ts.tv_nsec += (long)((wait - (double)(time_t)wait) * 1e9);
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&m_bus_mtx);
+	while (m_mailbox_len[node] >= MAILBOXES) {
+		if (timeout == TIME_IMMEDIATE ||
+				pthread_cond_timedwait(&m_bus_cond, &m_bus_mtx, &ts) == ETIMEDOUT) {
+			pthread_mutex_unlock(&m_bus_mtx);
+			return MSG_TIMEOUT;
+		}
+	}
+
+	m_mailbox[node][m_mailbox_len[node]++] = *frame;
+	pthread_cond_broadcast(&m_bus_cond);
+	pthread_mutex_unlock(&m_bus_mtx);
+
+	return MSG_OK;
+}
+
+// Arbitration order: the base id first, and standard before extended
+static uint32_t arbitration_key(const CANTxFrame *f) {
+	if (f->IDE == CAN_IDE_EXT) {
+		return ((f->EID >> 18) << 19) | (1 << 18) | (f->EID & 0x3FFFF);
+	} else {
+		return f->SID << 19;
+	}
+}
+
+static void *bus_thread(void *arg) {
+	(void)arg;
+
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (;;) {
+		pthread_mutex_lock(&m_bus_mtx);
+
+		int node = -1;
+		for (;;) {
+			if (!m_bus_stuck) {
+				for (int i = 0;i < NODES;i++) {
+					if (m_mailbox_len[i] > 0 && (node < 0 ||
+							arbitration_key(&m_mailbox[i][0]) <
+							arbitration_key(&m_mailbox[node][0]))) {
+						node = i;
+					}
+				}
+			}
+
+			if (node >= 0) {
+				break;
+			}
+
+			pthread_cond_wait(&m_bus_cond, &m_bus_mtx);
+			clock_gettime(CLOCK_MONOTONIC, &next);
+		}
+
+		CANTxFrame frame = m_mailbox[node][0];
+		pthread_mutex_unlock(&m_bus_mtx);
+
+		// Frame length including stuff bits, on average
+		int bits = (frame.IDE == CAN_IDE_EXT ? 67 : 47) + 8 * frame.DLC;
+		bits += bits / 10;
+		m_bus_bits += bits;
+
+		long ns = (long)bits * (1000000000L / BITRATE);
+		next.tv_nsec += ns;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0);
+
+		// The mailbox is freed when the frame is sent, which is when the
+		// other nodes have received it. Our frames are looped back.
+		pthread_mutex_lock(&m_bus_mtx);
+		m_mailbox_len[node]--;
+		memmove(&m_mailbox[node][0], &m_mailbox[node][1], m_mailbox_len[node] * sizeof(CANTxFrame));
+		rx_push(&frame);
+		pthread_cond_broadcast(&m_bus_cond);
+		pthread_mutex_unlock(&m_bus_mtx);
+	}
+
+	return 0;
+}
+
+static void *socketcan_rx_thread(void *arg) {
+	(void)arg;
+
+	for (;;) {
+		struct can_frame cf;
+		if (read(m_sock_rx, &cf, sizeof(cf)) != (ssize_t)sizeof(cf)) {
+			continue;
+		}
+
+		CANRxFrame frame;
+		memset(&frame, 0, sizeof(frame));
+		if (cf.can_id & CAN_EFF_FLAG) {
+			frame.IDE = CAN_IDE_EXT;
+			frame.EID = cf.can_id & CAN_EFF_MASK;
+		} else {
+			frame.IDE = CAN_IDE_STD;
+			frame.SID = cf.can_id & CAN_SFF_MASK;
+		}
+		frame.DLC = cf.can_dlc;
+		memcpy(frame.data8, cf.data, cf.can_dlc);
+
+		pthread_mutex_lock(&m_bus_mtx);
+		m_bus_bits += (frame.IDE == CAN_IDE_EXT ? 67 : 47) + 8 * frame.DLC;
+		rx_push(&frame);
+		pthread_mutex_unlock(&m_bus_mtx);
+	}
+
+	return 0;
+}
+
+/*
+ * One socket to receive everything, and one socket per node to send.
+ * Frames that are sent on one socket are looped back to the other sockets
+ * on the same interface, so the receive socket sees all of them.
+ */
+static bool socketcan_open(const char *ifname) {
+	struct sockaddr_can addr;
+	struct ifreq ifr;
+
+	for (int i = 0;i <= NODES;i++) {
+		int s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+		if (s < 0) {
+			perror("socket");
+			return false;
+		}
+
+		memset(&ifr, 0, sizeof(ifr));
+		strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+		if (ioctl(s, SIOCGIFINDEX, &ifr) < 0) {
+			perror(ifname);
+			return false;
+		}
+
+		memset(&addr, 0, sizeof(addr));
+		addr.can_family = AF_CAN;
+		addr.can_ifindex = ifr.ifr_ifindex;
+		if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+			perror("bind");
+			return false;
+		}
+
+		if (i == NODES) {
+			int rcvbuf = 4 * 1024 * 1024;
+			setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+			m_sock_rx = s;
+		} else {
+			// Only the receive socket reads
+			setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, 0, 0);
+			m_sock_tx[i] = s;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Traffic
+ */
+
+// Every sender and sequence number has its own length and content
+static int buffer_len(int id, uint32_t seq) {
+	return BUFFER_LEN_MIN + (int)((seq * 97 + (uint32_t)id * 13) %
+			(BUFFER_LEN_MAX - BUFFER_LEN_MIN + 1));
+}
+
+static void buffer_fill(uint8_t *buf, int id, uint32_t seq, int len) {
+	buf[0] = id;
+	buf[1] = seq >> 24;
+	buf[2] = seq >> 16;
+	buf[3] = seq >> 8;
+	buf[4] = seq;
+	for (int i = 5;i < len;i++) {
+		buf[i] = (uint8_t)(seq * 31 + (uint32_t)i * 7 + (uint32_t)id);
+	}
+}
+
+/*
+ * The fragmentation of comm_can_send_buffer, for the other nodes. Their
+ * frames do not interleave with each other within a node.
+ */
+static void remote_send_buffer(int node, uint8_t dest, uint8_t *data, unsigned int len) {
+	CANTxFrame f;
+	f.IDE = CAN_IDE_EXT;
+	f.RTR = CAN_RTR_DATA;
+	unsigned int end_a = 0;
+
+	for (unsigned int i = 0;i < len && i <= 255;i += 7) {
+		end_a = i + 7;
+		unsigned int send_len = (i + 7) <= len ? 7 : len - i;
+		f.EID = dest | ((uint32_t)CAN_PACKET_FILL_RX_BUFFER << 8);
+		f.DLC = send_len + 1;
+		f.data8[0] = i;
+		memcpy(f.data8 + 1, data + i, send_len);
+		bus_transmit(node, &f, MS2ST(20));
+	}
+
+	for (unsigned int i = end_a;i < len;i += 6) {
+		unsigned int send_len = (i + 6) <= len ? 6 : len - i;
+		f.EID = dest | ((uint32_t)CAN_PACKET_FILL_RX_BUFFER_LONG << 8);
+		f.DLC = send_len + 2;
+		f.data8[0] = i >> 8;
+		f.data8[1] = i & 0xFF;
+		memcpy(f.data8 + 2, data + i, send_len);
+		bus_transmit(node, &f, MS2ST(20));
+	}
+
+	unsigned short crc = crc16(data, len);
+	f.EID = dest | ((uint32_t)CAN_PACKET_PROCESS_RX_BUFFER << 8);
+	f.DLC = 6;
+	f.data8[0] = node;
+	f.data8[1] = 0;
+	f.data8[2] = len >> 8;
+	f.data8[3] = len & 0xFF;
+	f.data8[4] = crc >> 8;
+	f.data8[5] = crc & 0xFF;
+	bus_transmit(node, &f, MS2ST(20));
+}
+
+static void *sender_thread(void *arg) {
+	sender_t *s = (sender_t*)arg;
+	uint8_t buf[BUFFER_LEN_MAX];
+
+	while (s->run) {
+		int len = buffer_len(s->id, s->sent);
+		buffer_fill(buf, s->id, s->sent, len);
+
+		if (s->node == 0) {
+			comm_can_send_buffer(MAIN_ID, buf, len, false);
+		} else {
+			remote_send_buffer(s->node, MAIN_ID, buf, len);
+		}
+
+		s->sent++;
+	}
+
+	return 0;
+}
+
+static void start_senders(sender_t *senders, int count, int node_first) {
+	for (int i = 0;i < count;i++) {
+		senders[i].node = node_first == 0 ? 0 : node_first + i;
+		senders[i].id = senders[i].node * SENDER_THREADS + (node_first == 0 ? i : 0);
+		senders[i].run = true;
+		senders[i].sent = 0;
+		pthread_create(&senders[i].pt, 0, sender_thread, &senders[i]);
+	}
+}
+
+static uint32_t stop_senders(sender_t *senders, int count) {
+	uint32_t sent = 0;
+
+	for (int i = 0;i < count;i++) {
+		senders[i].run = false;
+	}
+
+	for (int i = 0;i < count;i++) {
+		pthread_join(senders[i].pt, 0);
+		sent += senders[i].sent;
+	}
+
+	// Let the bus and the receiver finish
+	usleep(200000);
+	return sent;
+}
+
+static void reset_stats(void) {
+	pthread_mutex_lock(&m_stats_mtx);
+	memset(&m_stats, 0, sizeof(m_stats));
+	pthread_mutex_unlock(&m_stats_mtx);
+
+	pthread_mutex_lock(&m_bus_mtx);
+	m_bus_bits = 0;
+	m_rx_overruns = 0;
+	pthread_mutex_unlock(&m_bus_mtx);
+}
+
+static uint32_t stats_ok_total(void) {
+	uint32_t ok = 0;
+	for (int i = 0;i < NODES * SENDER_THREADS;i++) {
+		ok += m_stats.ok[i];
+	}
+	return ok;
+}
+
+static void print_stats(uint32_t sent, double duration) {
+	uint32_t ok = stats_ok_total();
+
+	printf("  Buffers sent: %u, received: %u, lost: %u (%.2f %%), corrupted: %u\n",
+			sent, ok, sent - ok, sent > 0 ? 100.0 * (double)(sent - ok) / (double)sent : 0.0,
+			m_stats.corrupted);
+	printf("  Payload: %.1f kB/s, bus load: %.1f %% of %d kbit/s, RX overruns: %u\n",
+			(double)m_stats.bytes / duration / 1000.0,
+			100.0 * (double)m_bus_bits / duration / (double)BITRATE, BITRATE / 1000,
+			m_rx_overruns);
+
+	if (m_can_status_cmd) {
+		m_can_status_cmd(0, 0);
+	}
+}
+
+static void case_local_threads(double duration) {
+	sender_t senders[SENDER_THREADS];
+	uint8_t data[8] = {0};
+	double lat_max = 0.0;
+	double lat_sum = 0.0;
+	int lat_num = 0;
+
+	printf("%d threads sending buffers, single frames every 2 ms\n", SENDER_THREADS);
+	reset_stats();
+	start_senders(senders, SENDER_THREADS, 0);
+
+	double start = time_s();
+	while (time_s() - start < duration) {
+		double t = time_s();
+		comm_can_transmit_sid(0x123, data, 8);
+		t = time_s() - t;
+
+		lat_sum += t;
+		lat_num++;
+		if (t > lat_max) {
+			lat_max = t;
+		}
+
+		usleep(2000);
+	}
+
+	uint32_t sent = stop_senders(senders, SENDER_THREADS);
+	print_stats(sent, duration);
+	printf("  Single frame wait: %.3f ms average, %.3f ms max\n",
+			lat_sum / (double)lat_num * 1e3, lat_max * 1e3);
+
+	check(m_stats.corrupted == 0, "no corrupted buffers");
+	if (!m_socketcan) {
+		check(stats_ok_total() == sent, "no lost buffers");
+		// A buffer of BUFFER_LEN_MAX bytes is about 100 frames or 27 ms. The
+		// pthread mutexes are not fair like the ChibiOS ones, so a single
+		// frame can wait for a few frames from each sender thread.
+		check(lat_max < 0.015, "single frames do not wait for whole buffers");
+	}
+}
+
+static void case_remote_nodes(double duration) {
+	sender_t senders[NODES - 1];
+
+	printf("%d other nodes sending buffers to us at the same time\n", NODES - 1);
+	reset_stats();
+	start_senders(senders, NODES - 1, 1);
+	usleep((useconds_t)(duration * 1e6));
+	uint32_t sent = stop_senders(senders, NODES - 1);
+	print_stats(sent, duration);
+
+	check(m_stats.corrupted == 0, "no corrupted buffers");
+}
+
+typedef struct {
+	double delay;
+	double time;
+	bool buffer;
+} timed_send_t;
+
+static void *timed_send_thread(void *arg) {
+	timed_send_t *t = (timed_send_t*)arg;
+	uint8_t buf[BUFFER_LEN_MAX];
+
+	usleep((useconds_t)(t->delay * 1e6));
+	buffer_fill(buf, 0, 0, BUFFER_LEN_MAX);
+
+	double start = time_s();
+	if (t->buffer) {
+		comm_can_send_buffer(MAIN_ID, buf, BUFFER_LEN_MAX, false);
+	} else {
+		comm_can_transmit_sid(0x123, buf, 8);
+	}
+	t->time = time_s() - start;
+
+	return 0;
+}
+
+static void case_stuck_bus(void) {
+	timed_send_t buffer = {0.0, 0.0, true};
+	timed_send_t frame = {0.005, 0.0, false};
+	pthread_t pt_buffer, pt_frame;
+
+	printf("The bus stops while a %d byte buffer is sent\n", BUFFER_LEN_MAX);
+	reset_stats();
+
+	pthread_mutex_lock(&m_bus_mtx);
+	m_bus_stuck = true;
+	pthread_mutex_unlock(&m_bus_mtx);
+
+	pthread_create(&pt_buffer, 0, timed_send_thread, &buffer);
+	pthread_create(&pt_frame, 0, timed_send_thread, &frame);
+	pthread_join(pt_buffer, 0);
+	pthread_join(pt_frame, 0);
+
+	pthread_mutex_lock(&m_bus_mtx);
+	m_bus_stuck = false;
+	pthread_cond_broadcast(&m_bus_cond);
+	pthread_mutex_unlock(&m_bus_mtx);
+	usleep(200000);
+
+	printf("  Buffer: %.1f ms, single frame: %.1f ms\n", buffer.time * 1e3, frame.time * 1e3);
+	if (m_can_status_cmd) {
+		m_can_status_cmd(0, 0);
+	}
+
+	// One TX timeout for the buffer, and at most one more for the frame
+	// while it waits for the TX mutex.
+	check(buffer.time < 0.030, "the buffer is aborted after one TX timeout");
+	check(frame.time < 0.050, "the single frame does not wait for the whole buffer");
+	check(m_stats.corrupted == 0 && stats_ok_total() == 0, "the aborted buffer is not accepted");
+}
+
+int main(int argc, char **argv) {
+	const char *ifname = 0;
+	double duration = 2.0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:t:")) != -1) {
+		switch (opt) {
+		case 'i': ifname = optarg; break;
+		case 't': duration = atof(optarg); break;
+		default:
+			fprintf(stderr, "Usage: %s [-i vcan0] [-t seconds per case]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &m_start);
+	pthread_t pt;
+
+	if (ifname) {
+		if (!socketcan_open(ifname)) {
+			return 2;
+		}
+
+		m_socketcan = true;
+		pthread_create(&pt, 0, socketcan_rx_thread, 0);
+		printf("SocketCAN on %s. Bus load is relative to %d kbit/s, "
+				"but the interface may be faster.\n\n", ifname, BITRATE / 1000);
+	} else {
+		pthread_create(&pt, 0, bus_thread, 0);
+		printf("Simulated %d kbit/s bus\n\n", BITRATE / 1000);
+	}
+
+	comm_can_init();
+	usleep(50000);
+
+	case_local_threads(duration);
+	printf("\n");
+	case_remote_nodes(duration);
+	printf("\n");
+
+	if (!m_socketcan) {
+		case_stuck_bus();
+		printf("\n");
+	}
+
+	if (m_failures == 0) {
+		printf("All checks passed\n");
+	} else {
+		printf("%d checks FAILED\n", m_failures);
+	}
+
+	return m_failures == 0 ? 0 : 1;
+}
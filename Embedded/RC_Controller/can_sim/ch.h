@@ -0,0 +1,93 @@
+/*
+	Copyright 2016 - 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The parts of the ChibiOS kernel API that comm_can.c uses, on pthreads,
+ * for the host test harness. Implemented in can_sim.c.
+ */
+
+#ifndef CH_H_
+#define CH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+typedef uint32_t systime_t;
+typedef int32_t msg_t;
+typedef uint32_t eventmask_t;
+typedef int tprio_t;
+
+#define MSG_OK					0
+#define MSG_TIMEOUT				-1
+#define TIME_IMMEDIATE			((systime_t)0)
+#define TIME_INFINITE			((systime_t)-1)
+#define ALL_EVENTS				((eventmask_t)-1)
+#define EVENT_MASK(eid)			((eventmask_t)1 << (eid))
+#define NORMALPRIO				128
+
+#define CH_CFG_ST_FREQUENCY		10000
+#define MS2ST(msec)				((systime_t)((msec) * (CH_CFG_ST_FREQUENCY / 1000)))
+#define ST2MS(n)				((n) / (CH_CFG_ST_FREQUENCY / 1000))
+
+typedef struct {
+	pthread_mutex_t mtx;
+} mutex_t;
+
+typedef struct thread {
+	pthread_t pt;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	eventmask_t pending;
+	void (*func)(void *arg);
+	void *arg;
+} thread_t;
+
+typedef struct {
+	thread_t *listener;
+	eventmask_t mask;
+} event_source_t;
+
+typedef struct {
+	int unused;
+} event_listener_t;
+
+#define THD_WORKING_AREA(s, n)	char s[n]
+#define THD_FUNCTION(tname, arg)	void tname(void *arg)
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio,
+		void (*pf)(void *arg), void *arg);
+thread_t *chThdGetSelfX(void);
+bool chThdShouldTerminateX(void);
+void chRegSetThreadName(const char *name);
+
+void chMtxObjectInit(mutex_t *mp);
+void chMtxLock(mutex_t *mp);
+void chMtxUnlock(mutex_t *mp);
+
+void chEvtRegister(event_source_t *esp, event_listener_t *elp, int id);
+void chEvtUnregister(event_source_t *esp, event_listener_t *elp);
+eventmask_t chEvtWaitAny(eventmask_t mask);
+eventmask_t chEvtWaitAnyTimeout(eventmask_t mask, systime_t timeout);
+void chEvtSignal(thread_t *tp, eventmask_t mask);
+
+systime_t chVTGetSystemTime(void);
+#define chVTGetSystemTimeX()		chVTGetSystemTime()
+#define chVTTimeElapsedSinceX(start)	((systime_t)(chVTGetSystemTimeX() - (start)))
+
+#endif /* CH_H_ */
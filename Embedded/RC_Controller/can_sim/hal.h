@@ -0,0 +1,73 @@
+/*
+	Copyright 2016 - 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The parts of the ChibiOS HAL that comm_can.c uses, for the host test
+ * harness. The CAN driver is implemented in can_sim.c, on SocketCAN or on
+ * a simulated bus.
+ */
+
+#ifndef HAL_H_
+#define HAL_H_
+
+#include "ch.h"
+
+#define CAN_IDE_STD				0
+#define CAN_IDE_EXT				1
+#define CAN_RTR_DATA			0
+#define CAN_ANY_MAILBOX			0
+
+#define CAN_MCR_ABOM			(1 << 6)
+#define CAN_MCR_AWUM			(1 << 5)
+#define CAN_MCR_TXFP			(1 << 2)
+#define CAN_BTR_SJW(n)			((uint32_t)(n) << 24)
+#define CAN_BTR_TS2(n)			((uint32_t)(n) << 20)
+#define CAN_BTR_TS1(n)			((uint32_t)(n) << 16)
+#define CAN_BTR_BRP(n)			((uint32_t)(n) << 0)
+
+#define GPIOD					0
+#define GPIO_AF_CAN1			9
+#define PAL_MODE_ALTERNATE(n)	(n)
+#define palSetPadMode(port, pad, mode)	((void)(port), (void)(pad), (void)(mode))
+
+typedef struct {
+	uint8_t DLC;
+	uint8_t RTR;
+	uint8_t IDE;
+	uint32_t SID;
+	uint32_t EID;
+	uint8_t data8[8];
+} CANTxFrame;
+
+typedef CANTxFrame CANRxFrame;
+
+typedef struct {
+	uint32_t mcr;
+	uint32_t btr;
+} CANConfig;
+
+typedef struct {
+	event_source_t rxfull_event;
+} CANDriver;
+
+extern CANDriver CAND1;
+
+void canStart(CANDriver *canp, const CANConfig *config);
+msg_t canTransmit(CANDriver *canp, int mailbox, const CANTxFrame *ctfp, systime_t timeout);
+msg_t canReceive(CANDriver *canp, int mailbox, CANRxFrame *crfp, systime_t timeout);
+
+#endif /* HAL_H_ */
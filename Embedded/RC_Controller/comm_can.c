@@ -27,12 +27,16 @@
 #include "bldc_interface.h"
 #include "commands.h"
 #include "radar_cont.h"
+#include "terminal.h"
 
 // Settings
 #define CANDx						CAND1
 #define RX_FRAMES_SIZE				100
 #define RX_BUFFER_SIZE				PACKET_MAX_PL_LEN
 #define CAN_STATUS_MSGS_TO_STORE	10
+#define CAN_STATUS_TIMEOUT_MS		500 // Status older than this is considered stale
+#define RX_BUFFER_TIMEOUT_MS		100 // Max time between the fragments of a buffer
+#define TX_TIMEOUT_MS				20
 
 // Threads
 static THD_WORKING_AREA(cancom_read_thread_wa, 512);
@@ -42,9 +46,19 @@ static THD_FUNCTION(cancom_process_thread, arg);
 
 // Variables
 static can_status_msg stat_msgs[CAN_STATUS_MSGS_TO_STORE];
-static mutex_t can_mtx;
+static int8_t stat_msg_index[256]; // Controller id to index in stat_msgs, -1 if none
+static int stat_msgs_used;
+static mutex_t can_mtx; // Held for one frame at a time
+static mutex_t can_buffer_mtx; // Held for whole buffers
 static uint8_t rx_buffer[RX_BUFFER_SIZE];
 static unsigned int rx_buffer_last_id;
+static unsigned int rx_buffer_len; // Bytes received in order since the fragment at offset 0
+static bool rx_buffer_ok;
+static systime_t rx_buffer_time;
+static uint32_t rx_buffers_ok;
+static uint32_t rx_buffers_dropped;
+static uint32_t tx_buffers_ok;
+static uint32_t tx_buffers_aborted;
 static CANRxFrame rx_frames[RX_FRAMES_SIZE];
 static int rx_frame_read;
 static int rx_frame_write;
@@ -64,6 +78,12 @@ static const CANConfig cancfg = {
 // Private functions
 static void send_packet_wrapper(unsigned char *data, unsigned int len);
 static void printf_wrapper(char *str);
+static bool is_buffer_for_me(uint8_t id);
+static void rx_buffer_fill(unsigned int offset, uint8_t *data, unsigned int len);
+static bool transmit_eid(uint32_t id, uint8_t *data, uint8_t len);
+static can_status_msg *get_or_add_status_msg(uint8_t id);
+static bool is_status_fresh(uint32_t rx_time);
+static void terminal_can_status(int argc, const char **argv);
 
 // Function pointers
 static void(*m_range_func)(uint8_t id, uint8_t dest, float range) = 0;
@@ -73,10 +93,22 @@ void comm_can_init(void) {
 		stat_msgs[i].id = -1;
 	}
 
+	memset(stat_msg_index, -1, sizeof(stat_msg_index));
+	stat_msgs_used = 0;
+
 	rx_frame_read = 0;
 	rx_frame_write = 0;
 
+	rx_buffer_len = 0;
+	rx_buffer_ok = false;
+	rx_buffer_time = 0;
+	rx_buffers_ok = 0;
+	rx_buffers_dropped = 0;
+	tx_buffers_ok = 0;
+	tx_buffers_aborted = 0;
+
 	chMtxObjectInit(&can_mtx);
+	chMtxObjectInit(&can_buffer_mtx);
 
 	palSetPadMode(GPIOD, 0, PAL_MODE_ALTERNATE(GPIO_AF_CAN1));
 	palSetPadMode(GPIOD, 1, PAL_MODE_ALTERNATE(GPIO_AF_CAN1));
@@ -86,6 +118,12 @@ void comm_can_init(void) {
 	bldc_interface_init(send_packet_wrapper);
 	bldc_interface_set_rx_printf_func(printf_wrapper);
 
+	terminal_register_command_callback(
+			"can_status",
+			"Print the latest status received from the VESCs on the CAN-bus",
+			"",
+			terminal_can_status);
+
 	chThdCreateStatic(cancom_read_thread_wa, sizeof(cancom_read_thread_wa), NORMALPRIO + 1,
 			cancom_read_thread, NULL);
 	chThdCreateStatic(cancom_process_thread_wa, sizeof(cancom_process_thread_wa), NORMALPRIO,
@@ -151,38 +189,51 @@ static THD_FUNCTION(cancom_process_thread, arg) {
 
 				switch (cmd) {
 				case CAN_PACKET_FILL_RX_BUFFER:
-					memcpy(rx_buffer + rxmsg.data8[0], rxmsg.data8 + 1, rxmsg.DLC - 1);
+					if (is_buffer_for_me(id) && rxmsg.DLC > 1) {
+						rx_buffer_fill(rxmsg.data8[0], rxmsg.data8 + 1, rxmsg.DLC - 1);
+					}
 					break;
 
 				case CAN_PACKET_FILL_RX_BUFFER_LONG:
-					rxbuf_ind = (unsigned int)rxmsg.data8[0] << 8;
-					rxbuf_ind |= rxmsg.data8[1];
-					if (rxbuf_ind < RX_BUFFER_SIZE) {
-						memcpy(rx_buffer + rxbuf_ind, rxmsg.data8 + 2, rxmsg.DLC - 2);
+					if (is_buffer_for_me(id) && rxmsg.DLC > 2) {
+						rxbuf_ind = (unsigned int)rxmsg.data8[0] << 8;
+						rxbuf_ind |= rxmsg.data8[1];
+						rx_buffer_fill(rxbuf_ind, rxmsg.data8 + 2, rxmsg.DLC - 2);
 					}
 					break;
 
 				case CAN_PACKET_PROCESS_RX_BUFFER:
+					if (!is_buffer_for_me(id)) {
+						break;
+					}
+
 					ind = 0;
 					rx_buffer_last_id = rxmsg.data8[ind++];
 					commands_send = rxmsg.data8[ind++];
 					rxbuf_len = (unsigned int)rxmsg.data8[ind++] << 8;
 					rxbuf_len |= (unsigned int)rxmsg.data8[ind++];
 
-					if (rxbuf_len > RX_BUFFER_SIZE) {
-						break;
-					}
-
 					crc_high = rxmsg.data8[ind++];
 					crc_low = rxmsg.data8[ind++];
 
-					if (crc16(rx_buffer, rxbuf_len)
+					// Only process buffers whose fragments all arrived in order
+					// and in time. Otherwise the fragments of several senders may
+					// have been mixed up.
+					if (rx_buffer_ok && rxbuf_len == rx_buffer_len &&
+							chVTTimeElapsedSinceX(rx_buffer_time) < MS2ST(RX_BUFFER_TIMEOUT_MS) &&
+							crc16(rx_buffer, rxbuf_len)
 							== ((unsigned short) crc_high << 8
 									| (unsigned short) crc_low)) {
 
 						(void)commands_send;
+						rx_buffers_ok++;
 						bldc_interface_process_packet(rx_buffer, rxbuf_len);
+					} else {
+						rx_buffers_dropped++;
 					}
+
+					rx_buffer_ok = false;
+					rx_buffer_len = 0;
 					break;
 
 				case CAN_PACKET_PROCESS_SHORT_BUFFER:
@@ -194,17 +245,53 @@ static THD_FUNCTION(cancom_process_thread, arg) {
 					break;
 
 				case CAN_PACKET_STATUS:
-					for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-						stat_tmp = &stat_msgs[i];
-						if (stat_tmp->id == id || stat_tmp->id == -1) {
-							ind = 0;
-							stat_tmp->id = id;
-							stat_tmp->rx_time = chVTGetSystemTime();
-							stat_tmp->rpm = (float)buffer_get_int32(rxmsg.data8, &ind);
-							stat_tmp->current = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
-							stat_tmp->duty = (float)buffer_get_int16(rxmsg.data8, &ind) / 1000.0;
-							break;
-						}
+					stat_tmp = get_or_add_status_msg(id);
+					if (stat_tmp) {
+						ind = 0;
+						stat_tmp->rx_time = chVTGetSystemTime();
+						stat_tmp->rpm = (float)buffer_get_int32(rxmsg.data8, &ind);
+						stat_tmp->current = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
+						stat_tmp->duty = (float)buffer_get_int16(rxmsg.data8, &ind) / 1000.0;
+					}
+					break;
+
+				case CAN_PACKET_STATUS_2:
+					stat_tmp = get_or_add_status_msg(id);
+					if (stat_tmp) {
+						ind = 0;
+						stat_tmp->amp_hours = (float)buffer_get_int32(rxmsg.data8, &ind) / 1e4;
+						stat_tmp->amp_hours_charged = (float)buffer_get_int32(rxmsg.data8, &ind) / 1e4;
+					}
+					break;
+
+				case CAN_PACKET_STATUS_3:
+					stat_tmp = get_or_add_status_msg(id);
+					if (stat_tmp) {
+						ind = 0;
+						stat_tmp->watt_hours = (float)buffer_get_int32(rxmsg.data8, &ind) / 1e4;
+						stat_tmp->watt_hours_charged = (float)buffer_get_int32(rxmsg.data8, &ind) / 1e4;
+					}
+					break;
+
+				case CAN_PACKET_STATUS_4:
+					stat_tmp = get_or_add_status_msg(id);
+					if (stat_tmp) {
+						ind = 0;
+						stat_tmp->rx_time_4 = chVTGetSystemTime();
+						stat_tmp->temp_fet = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
+						stat_tmp->temp_motor = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
+						stat_tmp->current_in = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
+						stat_tmp->pid_pos_now = (float)buffer_get_int16(rxmsg.data8, &ind) / 50.0;
+					}
+					break;
+
+				case CAN_PACKET_STATUS_5:
+					stat_tmp = get_or_add_status_msg(id);
+					if (stat_tmp) {
+						ind = 0;
+						stat_tmp->rx_time_5 = chVTGetSystemTime();
+						stat_tmp->tacho_value = buffer_get_int32(rxmsg.data8, &ind);
+						stat_tmp->v_in = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
 					}
 					break;
 
@@ -255,16 +342,7 @@ static THD_FUNCTION(cancom_process_thread, arg) {
 }
 
 void comm_can_transmit_eid(uint32_t id, uint8_t *data, uint8_t len) {
-	CANTxFrame txmsg;
-	txmsg.IDE = CAN_IDE_EXT;
-	txmsg.EID = id;
-	txmsg.RTR = CAN_RTR_DATA;
-	txmsg.DLC = len;
-	memcpy(txmsg.data8, data, len);
-
-	chMtxLock(&can_mtx);
-	canTransmit(&CANDx, CAN_ANY_MAILBOX, &txmsg, MS2ST(20));
-	chMtxUnlock(&can_mtx);
+	transmit_eid(id, data, len);
 }
 
 void comm_can_transmit_sid(uint32_t id, uint8_t *data, uint8_t len) {
@@ -276,7 +354,7 @@ void comm_can_transmit_sid(uint32_t id, uint8_t *data, uint8_t len) {
 	memcpy(txmsg.data8, data, len);
 
 	chMtxLock(&can_mtx);
-	canTransmit(&CANDx, CAN_ANY_MAILBOX, &txmsg, MS2ST(20));
+	canTransmit(&CANDx, CAN_ANY_MAILBOX, &txmsg, MS2ST(TX_TIMEOUT_MS));
 	chMtxUnlock(&can_mtx);
 }
 
@@ -297,9 +375,19 @@ void comm_can_transmit_sid(uint32_t id, uint8_t *data, uint8_t len) {
  * @param send
  * If true, this packet will be passed to the send function of commands.
  * Otherwise, it will be passed to the process function (DON'T CARE HERE, only for VESC).
+ *
+ * Buffers are sent one at a time, so that the fragments of buffers from
+ * different threads are not interleaved. Single frames from other threads
+ * can go out between the fragments, as the TX mutex only is held for one
+ * frame at a time. If a frame cannot be queued within TX_TIMEOUT_MS the
+ * rest of the buffer is not sent, as the receiver drops incomplete buffers
+ * anyway.
  */
 void comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len, bool send) {
 	uint8_t send_buffer[8];
+	bool ok = true;
+
+	chMtxLock(&can_buffer_mtx);
 
 	if (len <= 6) {
 		uint32_t ind = 0;
@@ -307,10 +395,10 @@ void comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len
 		send_buffer[ind++] = send;
 		memcpy(send_buffer + ind, data, len);
 		ind += len;
-		comm_can_transmit_eid(controller_id | ((uint32_t)CAN_PACKET_PROCESS_SHORT_BUFFER << 8), send_buffer, ind);
+		ok = transmit_eid(controller_id | ((uint32_t)CAN_PACKET_PROCESS_SHORT_BUFFER << 8), send_buffer, ind);
 	} else {
 		unsigned int end_a = 0;
-		for (unsigned int i = 0;i < len;i += 7) {
+		for (unsigned int i = 0;i < len && ok;i += 7) {
 			if (i > 255) {
 				break;
 			}
@@ -327,10 +415,10 @@ void comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len
 				memcpy(send_buffer + 1, data + i, send_len);
 			}
 
-			comm_can_transmit_eid(controller_id | ((uint32_t)CAN_PACKET_FILL_RX_BUFFER << 8), send_buffer, send_len + 1);
+			ok = transmit_eid(controller_id | ((uint32_t)CAN_PACKET_FILL_RX_BUFFER << 8), send_buffer, send_len + 1);
 		}
 
-		for (unsigned int i = end_a;i < len;i += 6) {
+		for (unsigned int i = end_a;i < len && ok;i += 6) {
 			uint8_t send_len = 6;
 			send_buffer[0] = i >> 8;
 			send_buffer[1] = i & 0xFF;
@@ -342,7 +430,7 @@ void comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len
 				memcpy(send_buffer + 2, data + i, send_len);
 			}
 
-			comm_can_transmit_eid(controller_id | ((uint32_t)CAN_PACKET_FILL_RX_BUFFER_LONG << 8), send_buffer, send_len + 2);
+			ok = transmit_eid(controller_id | ((uint32_t)CAN_PACKET_FILL_RX_BUFFER_LONG << 8), send_buffer, send_len + 2);
 		}
 
 		uint32_t ind = 0;
@@ -354,8 +442,18 @@ void comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len
 		send_buffer[ind++] = (uint8_t)(crc >> 8);
 		send_buffer[ind++] = (uint8_t)(crc & 0xFF);
 
-		comm_can_transmit_eid(controller_id | ((uint32_t)CAN_PACKET_PROCESS_RX_BUFFER << 8), send_buffer, ind++);
+		if (ok) {
+			ok = transmit_eid(controller_id | ((uint32_t)CAN_PACKET_PROCESS_RX_BUFFER << 8), send_buffer, ind++);
+		}
 	}
+
+	if (ok) {
+		tx_buffers_ok++;
+	} else {
+		tx_buffers_aborted++;
+	}
+
+	chMtxUnlock(&can_buffer_mtx);
 }
 
 /**
@@ -418,13 +516,54 @@ can_status_msg *comm_can_get_status_msg_index(int index) {
  * The message or 0 for an invalid id.
  */
 can_status_msg *comm_can_get_status_msg_id(int id) {
-	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-		if (stat_msgs[i].id == id) {
-			return &stat_msgs[i];
+	if (id < 0 || id > 255 || stat_msg_index[id] < 0) {
+		return 0;
+	}
+
+	return &stat_msgs[(int)stat_msg_index[id]];
+}
+
+/**
+ * Get a summary of the status of all VESCs on the CAN-bus. Values that
+ * have not been updated within CAN_STATUS_TIMEOUT_MS are left out.
+ *
+ * @param health
+ * Pointer to store the summary to.
+ */
+void comm_can_get_health(CAN_HEALTH *health) {
+	memset(health, 0, sizeof(CAN_HEALTH));
+	health->v_in_min = -1.0;
+
+	for (int i = 0;i < stat_msgs_used;i++) {
+		can_status_msg *msg = &stat_msgs[i];
+		health->nodes++;
+
+		if (is_status_fresh(msg->rx_time)) {
+			health->nodes_alive++;
+		}
+
+		if (is_status_fresh(msg->rx_time_4)) {
+			if (msg->temp_fet > health->temp_fet_max) {
+				health->temp_fet_max = msg->temp_fet;
+			}
+
+			if (msg->temp_motor > health->temp_motor_max) {
+				health->temp_motor_max = msg->temp_motor;
+			}
+
+			health->current_in_tot += msg->current_in;
+		}
+
+		if (is_status_fresh(msg->rx_time_5)) {
+			if (health->v_in_min < 0.0 || msg->v_in < health->v_in_min) {
+				health->v_in_min = msg->v_in;
+			}
 		}
 	}
 
-	return 0;
+	if (health->v_in_min < 0.0) {
+		health->v_in_min = 0.0;
+	}
 }
 
 static void send_packet_wrapper(unsigned char *data, unsigned int len) {
@@ -434,3 +573,108 @@ static void send_packet_wrapper(unsigned char *data, unsigned int len) {
 static void printf_wrapper(char *str) {
 	commands_printf(str);
 }
+
+/*
+ * Buffers are addressed to the sender id that was given in the process
+ * frame, which is main_id + 128 for buffers sent from here.
+ */
+static bool is_buffer_for_me(uint8_t id) {
+	return id == (uint8_t)(main_id + 128) || id == (uint8_t)main_id;
+}
+
+/*
+ * Add a fragment to the reassembly buffer. A fragment at offset 0 starts a
+ * new buffer, and every other fragment has to continue exactly where the
+ * previous one ended within RX_BUFFER_TIMEOUT_MS. Anything else means that
+ * fragments were lost or that several nodes are sending to us at the same
+ * time, and the buffer is dropped.
+ */
+static void rx_buffer_fill(unsigned int offset, uint8_t *data, unsigned int len) {
+	if (offset == 0) {
+		if (rx_buffer_ok && rx_buffer_len > 0) {
+			rx_buffers_dropped++;
+		}
+
+		rx_buffer_ok = true;
+		rx_buffer_len = 0;
+	} else if (rx_buffer_ok &&
+			chVTTimeElapsedSinceX(rx_buffer_time) >= MS2ST(RX_BUFFER_TIMEOUT_MS)) {
+		rx_buffer_ok = false;
+	}
+
+	if (!rx_buffer_ok || offset != rx_buffer_len || (offset + len) > RX_BUFFER_SIZE) {
+		rx_buffer_ok = false;
+		return;
+	}
+
+	memcpy(rx_buffer + offset, data, len);
+	rx_buffer_len += len;
+	rx_buffer_time = chVTGetSystemTimeX();
+}
+
+static bool transmit_eid(uint32_t id, uint8_t *data, uint8_t len) {
+	CANTxFrame txmsg;
+	txmsg.IDE = CAN_IDE_EXT;
+	txmsg.EID = id;
+	txmsg.RTR = CAN_RTR_DATA;
+	txmsg.DLC = len;
+	memcpy(txmsg.data8, data, len);
+
+	// The STM32 has three mailboxes that are sent in request order
+	// (CAN_MCR_TXFP), so this only blocks when all of them are busy.
+	chMtxLock(&can_mtx);
+	msg_t res = canTransmit(&CANDx, CAN_ANY_MAILBOX, &txmsg, MS2ST(TX_TIMEOUT_MS));
+	chMtxUnlock(&can_mtx);
+
+	return res == MSG_OK;
+}
+
+static can_status_msg *get_or_add_status_msg(uint8_t id) {
+	int ind = stat_msg_index[id];
+
+	if (ind < 0) {
+		if (stat_msgs_used >= CAN_STATUS_MSGS_TO_STORE) {
+			return 0;
+		}
+
+		ind = stat_msgs_used;
+		memset(&stat_msgs[ind], 0, sizeof(can_status_msg));
+		stat_msgs[ind].id = id;
+		stat_msg_index[id] = ind;
+		stat_msgs_used++;
+	}
+
+	return &stat_msgs[ind];
+}
+
+static bool is_status_fresh(uint32_t rx_time) {
+	return rx_time != 0 && chVTTimeElapsedSinceX(rx_time) < MS2ST(CAN_STATUS_TIMEOUT_MS);
+}
+
+static void terminal_can_status(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
+
+	for (int i = 0;i < stat_msgs_used;i++) {
+		can_status_msg *msg = &stat_msgs[i];
+
+		commands_printf("ID %d (age %d ms)", msg->id, (int)ST2MS(chVTTimeElapsedSinceX(msg->rx_time)));
+		commands_printf("  RPM: %.1f, Current: %.2f A, Duty: %.3f",
+				(double)msg->rpm, (double)msg->current, (double)msg->duty);
+		commands_printf("  Input: %.1f V, %.2f A, Tacho: %d",
+				(double)msg->v_in, (double)msg->current_in, (int)msg->tacho_value);
+		commands_printf("  Temp FET: %.1f C, Temp Motor: %.1f C",
+				(double)msg->temp_fet, (double)msg->temp_motor);
+		commands_printf("  Ah: %.3f / %.3f, Wh: %.3f / %.3f",
+				(double)msg->amp_hours, (double)msg->amp_hours_charged,
+				(double)msg->watt_hours, (double)msg->watt_hours_charged);
+	}
+
+	CAN_HEALTH health;
+	comm_can_get_health(&health);
+	commands_printf("Nodes: %d, alive: %d", health.nodes, health.nodes_alive);
+	commands_printf("RX buffers: %u ok, %u dropped",
+			(unsigned int)rx_buffers_ok, (unsigned int)rx_buffers_dropped);
+	commands_printf("TX buffers: %u ok, %u aborted\n",
+			(unsigned int)tx_buffers_ok, (unsigned int)tx_buffers_aborted);
+}
@@ -27,5 +27,8 @@ void comm_can_transmit_sid(uint32_t id, uint8_t *data, uint8_t len);
 void comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len, bool send);
 void comm_can_dw_range(uint8_t id, uint8_t dest, int samples);
 void comm_can_set_range_func(void(*func)(uint8_t id, uint8_t dest, float range));
+can_status_msg *comm_can_get_status_msg_index(int index);
+can_status_msg *comm_can_get_status_msg_id(int id);
+void comm_can_get_health(CAN_HEALTH *health);
 
 #endif /* COMM_CAN_H_ */
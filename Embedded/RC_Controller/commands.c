@@ -36,6 +36,7 @@
 #include "comm_cc1120.h"
 #include "mr_control.h"
 #include "adconv.h"
+#include "comm_can.h"
 
 #include <math.h>
 #include <string.h>
@@ -44,6 +45,7 @@
 
 // Defines
 #define FWD_TIME		20000
+#define BATCH_OUT_LEN	240 // Captured output per reply packet, keep it below the radio packet size
 
 // Private variables
 static uint8_t m_send_buffer[PACKET_MAX_PL_LEN];
@@ -52,10 +54,20 @@ static virtual_timer_t vt;
 static mutex_t m_print_gps;
 static bool m_init_done = false;
 
+// Output capture for CMD_TERMINAL_BATCH, protected by m_print_gps
+static thread_t *m_capture_thd = 0;
+static uint8_t m_capture_buffer[BATCH_OUT_LEN + 5];
+static int m_capture_len = 0;
+static uint8_t m_capture_seq = 0;
+static uint8_t m_capture_cmd = 0;
+
 // Private functions
 static void stop_forward(void *p);
 static void rtcm_rx(uint8_t *data, int len, int type);
 static void rtcm_base_rx(rtcm_ref_sta_pos_t *pos);
+static void process_terminal_batch(char *str, uint8_t seq);
+static void capture_append(const char *str, int len);
+static void capture_flush(bool done, bool found);
 
 // Private variables
 static rtcm3_state rtcm_state;
@@ -148,6 +160,18 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			terminal_process_string((char*)data);
 		} break;
 
+		case CMD_TERMINAL_BATCH: {
+			timeout_reset();
+			commands_set_send_func(func);
+
+			if (len < 1) {
+				break;
+			}
+
+			data[len] = '\0';
+			process_terminal_batch((char*)data + 1, data[0]);
+		} break;
+
 		// ==================== Vehicle commands ==================== //
 #if MAIN_MODE_IS_VEHICLE
 		case CMD_SET_POS:
@@ -789,6 +813,7 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			float gyro[3];
 			float mag[3];
 			ROUTE_POINT rp_goal;
+			CAN_HEALTH can_health;
 
 			commands_set_send_func(func);
 
@@ -796,6 +821,7 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			pos_get_pos(&pos);
 			pos_get_mc_val(&mcval);
 			autopilot_get_goal_now(&rp_goal);
+			comm_can_get_health(&can_health);
 
 			int32_t send_index = 0;
 			m_send_buffer[send_index++] = main_id; // 1
@@ -826,6 +852,12 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			buffer_append_float32(m_send_buffer, rp_goal.py, 1e4, &send_index); // 89
 			buffer_append_float32(m_send_buffer, autopilot_get_rad_now(), 1e6, &send_index); // 93
 			buffer_append_int32(m_send_buffer, pos_get_ms_today(), &send_index); // 97
+			m_send_buffer[send_index++] = can_health.nodes; // 98
+			m_send_buffer[send_index++] = can_health.nodes_alive; // 99
+			buffer_append_float32(m_send_buffer, can_health.v_in_min, 1e3, &send_index); // 103
+			buffer_append_float32(m_send_buffer, can_health.temp_fet_max, 1e3, &send_index); // 107
+			buffer_append_float32(m_send_buffer, can_health.temp_motor_max, 1e3, &send_index); // 111
+			buffer_append_float32(m_send_buffer, can_health.current_in_tot, 1e3, &send_index); // 115
 			commands_send_packet(m_send_buffer, send_index);
 		} break;
 
@@ -1039,7 +1071,12 @@ void commands_printf(const char* format, ...) {
 	va_end (arg);
 
 	if(len > 0) {
-		commands_send_packet((unsigned char*)print_buffer, (len<253) ? len + 2: 255);
+		if (m_capture_thd == chThdGetSelfX()) {
+			capture_append(print_buffer + 2, (len < 253) ? len : 253);
+			capture_append("\n", 1);
+		} else {
+			commands_send_packet((unsigned char*)print_buffer, (len<253) ? len + 2: 255);
+		}
 	}
 	chMtxUnlock(&m_print_gps);
 }
@@ -1163,3 +1200,85 @@ static void rtcm_rx(uint8_t *data, int len, int type) {
 static void rtcm_base_rx(rtcm_ref_sta_pos_t *pos) {
 	pos_set_enu_ref(pos->lat, pos->lon, pos->height);
 }
+
+/**
+ * Run newline-separated terminal commands and send their output back in
+ * CMD_TERMINAL_BATCH packets instead of as CMD_PRINTF lines. Each reply is
+ *
+ * [seq] [command index] [flags] [output]
+ *
+ * where bit 0 of flags is set if the command exists and bit 1 is set on the
+ * last packet of the command. Output printed later, e.g. from callbacks of
+ * measurements started by the command, is sent with CMD_PRINTF as usual.
+ *
+ * @param str
+ * The commands. The string is modified.
+ *
+ * @param seq
+ * Sequence number from the request, echoed in the replies.
+ */
+static void process_terminal_batch(char *str, uint8_t seq) {
+	uint8_t cmd_ind = 0;
+
+	while (*str) {
+		char *next = strchr(str, '\n');
+		if (next) {
+			*next++ = '\0';
+		} else {
+			next = str + strlen(str);
+		}
+
+		int cmd_len = strlen(str);
+		if (cmd_len > 0 && str[cmd_len - 1] == '\r') {
+			str[cmd_len - 1] = '\0';
+		}
+
+		if (str[0] != '\0') {
+			chMtxLock(&m_print_gps);
+			m_capture_thd = chThdGetSelfX();
+			m_capture_seq = seq;
+			m_capture_cmd = cmd_ind;
+			m_capture_len = 0;
+			chMtxUnlock(&m_print_gps);
+
+			bool found = terminal_process_string(str);
+
+			chMtxLock(&m_print_gps);
+			capture_flush(true, found);
+			m_capture_thd = 0;
+			chMtxUnlock(&m_print_gps);
+
+			cmd_ind++;
+		}
+
+		str = next;
+	}
+}
+
+static void capture_append(const char *str, int len) {
+	while (len > 0) {
+		int n = BATCH_OUT_LEN - m_capture_len;
+		if (n > len) {
+			n = len;
+		}
+
+		memcpy(m_capture_buffer + 5 + m_capture_len, str, n);
+		m_capture_len += n;
+		str += n;
+		len -= n;
+
+		if (m_capture_len == BATCH_OUT_LEN) {
+			capture_flush(false, true);
+		}
+	}
+}
+
+static void capture_flush(bool done, bool found) {
+	m_capture_buffer[0] = main_id;
+	m_capture_buffer[1] = CMD_TERMINAL_BATCH;
+	m_capture_buffer[2] = m_capture_seq;
+	m_capture_buffer[3] = m_capture_cmd;
+	m_capture_buffer[4] = (found ? 1 : 0) | (done ? 2 : 0);
+	commands_send_packet(m_capture_buffer, m_capture_len + 5);
+	m_capture_len = 0;
+}
@@ -21,10 +21,29 @@
 #include "stm32f4xx_conf.h"
 #include "eeprom.h"
 #include "utils.h"
+#include "crc.h"
+#include "commands.h"
+#include "pos.h"
+#include "autopilot.h"
+#include "mr_control.h"
 #include <string.h>
+#include <math.h>
 
 // Settings
 #define EEPROM_BASE_MAINCONF		1000
+#define MAIN_CONFIG_WORDS			(sizeof(MAIN_CONFIG) / 2)
+#define EEPROM_ADDR_VERSION			(EEPROM_BASE_MAINCONF + MAIN_CONFIG_WORDS)
+#define EEPROM_ADDR_CRC				(EEPROM_BASE_MAINCONF + MAIN_CONFIG_WORDS + 1)
+
+// Bump this when the layout of MAIN_CONFIG changes in a way that is not
+// reflected in its size.
+#define MAIN_CONFIG_VERSION			1
+#define MAIN_CONFIG_SIGNATURE		((MAIN_CONFIG_VERSION << 12) | (sizeof(MAIN_CONFIG) & 0x0FFF))
+
+// Background store settings
+#define STORE_SLICE_WORDS			4 // Words to program before letting the control loops run
+#define STORE_SLICE_SLEEP_MS		2
+#define STORE_STOPPED_SPEED			0.1 // Sector erases are held until the car is slower than this (m/s)
 
 // Global variables
 MAIN_CONFIG main_config;
@@ -35,6 +54,29 @@ int main_id = 0;
 #endif
 uint16_t VirtAddVarTab[NB_OF_VAR];
 
+// Private variables
+static float m_last_load_ms = 0.0;
+static float m_last_store_ms = 0.0;
+static float m_max_lock_ms = 0.0;
+static float m_store_jitter_max = 0.0; // Control loop jitter during the last store, us
+static float m_idle_jitter_max = 0.0; // Control loop jitter outside of stores, us
+static MAIN_CONFIG m_store_conf;
+static volatile bool m_store_pending = false;
+static volatile bool m_store_busy = false;
+static volatile bool m_store_writing = false;
+static bool m_store_last_ok = true;
+static mutex_t m_store_mutex;
+static thread_t *store_tp;
+
+// Threads
+static THD_WORKING_AREA(store_thread_wa, 512);
+static THD_FUNCTION(store_thread, arg);
+
+// Private functions
+static bool store_main_config(MAIN_CONFIG *conf);
+static uint16_t config_word(uint8_t *conf_addr, uint16_t crc, unsigned int i);
+static bool is_vehicle_stopped(void);
+
 void conf_general_init(void) {
 	palSetPadMode(GPIOE, 8, PAL_MODE_INPUT_PULLUP);
 	palSetPadMode(GPIOE, 9, PAL_MODE_INPUT_PULLUP);
@@ -50,9 +92,8 @@ void conf_general_init(void) {
 	// Read address from switches
 	main_id = (~(palReadPort(GPIOE) >> 8)) & 0x0F;
 
-	memset(VirtAddVarTab, 0, sizeof(VirtAddVarTab));
-
-	for (unsigned int i = 0;i < (sizeof(MAIN_CONFIG) / 2);i++) {
+	// The configuration words followed by the version and CRC words
+	for (unsigned int i = 0;i < NB_OF_VAR;i++) {
 		VirtAddVarTab[i] = EEPROM_BASE_MAINCONF + i;
 	}
 
@@ -62,6 +103,10 @@ void conf_general_init(void) {
 	EE_Init();
 
 	conf_general_read_main_conf(&main_config);
+
+	chMtxObjectInit(&m_store_mutex);
+	store_tp = chThdCreateStatic(store_thread_wa, sizeof(store_thread_wa),
+			NORMALPRIO - 1, store_thread, NULL);
 }
 
 /**
@@ -256,15 +301,22 @@ void conf_general_get_default_main_config(MAIN_CONFIG *conf) {
 /**
  * Read MAIN_CONFIG from EEPROM. If this fails, default values will be used.
  *
+ * The configuration is followed by a version word and a CRC of the whole
+ * struct. If they do not match, e.g. because MAIN_CONFIG changed or because
+ * the last store was interrupted, the defaults are used as well. Stores
+ * from before the version and CRC words were added are accepted as they are.
+ *
  * @param conf
  * A pointer to a MAIN_CONFIG struct to write the configuration to.
  */
 void conf_general_read_main_conf(MAIN_CONFIG *conf) {
+	systime_t time_start = chVTGetSystemTimeX();
+
 	bool is_ok = true;
 	uint8_t *conf_addr = (uint8_t*)conf;
 	uint16_t var;
 
-	for (unsigned int i = 0;i < (sizeof(MAIN_CONFIG) / 2);i++) {
+	for (unsigned int i = 0;i < MAIN_CONFIG_WORDS;i++) {
 		if (EE_ReadVariable(EEPROM_BASE_MAINCONF + i, &var) == 0) {
 			conf_addr[2 * i] = (var >> 8) & 0xFF;
 			conf_addr[2 * i + 1] = var & 0xFF;
@@ -274,41 +326,230 @@ void conf_general_read_main_conf(MAIN_CONFIG *conf) {
 		}
 	}
 
+	uint16_t version, crc;
+	bool has_version = EE_ReadVariable(EEPROM_ADDR_VERSION, &version) == 0;
+	bool has_crc = EE_ReadVariable(EEPROM_ADDR_CRC, &crc) == 0;
+
+	if (is_ok && (has_version || has_crc)) {
+		if (!has_version || !has_crc ||
+				version != MAIN_CONFIG_SIGNATURE ||
+				crc != crc16(conf_addr, MAIN_CONFIG_WORDS * 2)) {
+			is_ok = false;
+		}
+	}
+
 	// Set the default configuration
 	if (!is_ok) {
 		conf_general_get_default_main_config(conf);
 	}
+
+	m_last_load_ms = (float)ST2US(chVTTimeElapsedSinceX(time_start)) / 1000.0;
 }
 
 /**
- * Write MAIN_CONFIG to EEPROM.
+ * Write MAIN_CONFIG to EEPROM. The configuration is copied and written by a
+ * low priority thread a few words at a time, so this returns right away and
+ * the control loops keep running during the store. Only the words that
+ * differ from what is already stored are written, followed by the version
+ * and CRC words. If the active page does not have room for all changed
+ * words, the store would need a sector erase, which stalls the CPU for
+ * hundreds of milliseconds. Such a store does not start until the vehicle
+ * has stopped, and a store that has started is always written to the end.
  *
  * @param conf
  * A pointer to the configuration that should be stored.
+ *
+ * @return
+ * true if the previous store succeeded.
  */
 bool conf_general_store_main_config(MAIN_CONFIG *conf) {
-	utils_sys_lock_cnt();
-//	RCC_APB1PeriphClockCmd(RCC_APB1Periph_WWDG, DISABLE);
+	chMtxLock(&m_store_mutex);
+	m_store_conf = *conf;
+	m_store_pending = true;
+	chMtxUnlock(&m_store_mutex);
+
+	chEvtSignal(store_tp, (eventmask_t) 1);
+
+	return m_store_last_ok;
+}
+
+/**
+ * Check if a configuration store is pending or in progress.
+ *
+ * @return
+ * true if the stored configuration is not up to date yet.
+ */
+bool conf_general_store_busy(void) {
+	return m_store_pending || m_store_busy;
+}
+
+/**
+ * Report the period of a control loop iteration, so that the jitter of the
+ * control loops during stores can be compared to the jitter outside of them.
+ * Called by the autopilot and multirotor control threads.
+ *
+ * @param period_us
+ * The measured time since the previous iteration.
+ *
+ * @param nominal_us
+ * The period the loop is scheduled with.
+ */
+void conf_general_report_loop_period(float period_us, float nominal_us) {
+	float jitter = fabsf(period_us - nominal_us);
+
+	if (m_store_writing) {
+		if (jitter > m_store_jitter_max) {
+			m_store_jitter_max = jitter;
+		}
+	} else if (jitter > m_idle_jitter_max) {
+		m_idle_jitter_max = jitter;
+	}
+}
+
+/**
+ * Print how long the last configuration load and store took, together with
+ * the flash write and erase counters of the EEPROM emulation.
+ */
+void conf_general_print_stats(void) {
+	EE_STATS stats;
+	EE_GetStats(&stats);
+
+	commands_printf("Last load:       %.1f ms", (double)m_last_load_ms);
+	commands_printf("Last store:      %.1f ms (%s)", (double)m_last_store_ms,
+			m_store_last_ok ? "ok" : "failed");
+	commands_printf("Store busy:      %s", conf_general_store_busy() ? "yes" : "no");
+	commands_printf("Max lock time:   %.1f ms", (double)m_max_lock_ms);
+	commands_printf("Loop jitter:     %.1f us max during the last store, %.1f us max otherwise",
+			(double)m_store_jitter_max, (double)m_idle_jitter_max);
+	commands_printf("Words written:   %u", (unsigned int)stats.words_written);
+	commands_printf("Words skipped:   %u", (unsigned int)stats.words_skipped);
+	commands_printf("Page transfers:  %u", (unsigned int)stats.page_transfers);
+	commands_printf("Sector erases:   %u\n", (unsigned int)stats.sector_erases);
+}
+
+static bool store_main_config(MAIN_CONFIG *conf) {
+	systime_t time_start = chVTGetSystemTimeX();
 
 	bool is_ok = true;
 	uint8_t *conf_addr = (uint8_t*)conf;
-	uint16_t var;
+	uint16_t crc = crc16(conf_addr, MAIN_CONFIG_WORDS * 2);
+	uint16_t changed = 0;
+
+	for (unsigned int i = 0;i < NB_OF_VAR;i++) {
+		uint16_t current;
+		if (EE_ReadVariable(EEPROM_BASE_MAINCONF + i, &current) != 0 ||
+				current != config_word(conf_addr, crc, i)) {
+			changed++;
+		}
+	}
 
-	FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
-			FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+	// If the active page does not have room for every changed word, the
+	// record would need a page transfer with a sector erase partway through.
+	// Nothing is written until there is room or the vehicle has stopped, so
+	// that a started record is always written to the end and the flash never
+	// holds a partial record for longer than the store itself takes.
+	while (changed > 0 && EE_GetFreeSlots() < changed && !is_vehicle_stopped()) {
+		// A newer configuration supersedes this one
+		if (m_store_pending) {
+			return false;
+		}
 
-	for (unsigned int i = 0;i < (sizeof(MAIN_CONFIG) / 2);i++) {
-		var = (conf_addr[2 * i] << 8) & 0xFF00;
-		var |= conf_addr[2 * i + 1] & 0xFF;
+		chThdSleepMilliseconds(100);
+	}
 
-		if (EE_WriteVariable(EEPROM_BASE_MAINCONF + i, var) != FLASH_COMPLETE) {
-			is_ok = false;
+	m_store_jitter_max = 0.0;
+	m_store_writing = true;
+
+	int written = 0;
+
+	// The CRC is written last so that an interrupted store is detected
+	for (unsigned int i = 0;i < NB_OF_VAR && changed > 0;i++) {
+		uint16_t var = config_word(conf_addr, crc, i);
+		uint16_t current;
+
+		if (EE_ReadVariable(EEPROM_BASE_MAINCONF + i, &current) == 0 && current == var) {
+			continue;
+		}
+
+		systime_t lock_start = chVTGetSystemTimeX();
+
+		utils_sys_lock_cnt();
+		FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
+				FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+		is_ok = EE_WriteVariable(EEPROM_BASE_MAINCONF + i, var) == FLASH_COMPLETE;
+		utils_sys_unlock_cnt();
+
+		float lock_ms = (float)ST2US(chVTTimeElapsedSinceX(lock_start)) / 1000.0;
+		if (lock_ms > m_max_lock_ms) {
+			m_max_lock_ms = lock_ms;
+		}
+
+		if (!is_ok) {
 			break;
 		}
+
+		written++;
+		if ((written % STORE_SLICE_WORDS) == 0) {
+			chThdSleepMilliseconds(STORE_SLICE_SLEEP_MS);
+		}
 	}
 
-//	RCC_APB1PeriphClockCmd(RCC_APB1Periph_WWDG, ENABLE);
-	utils_sys_unlock_cnt();
+	m_store_writing = false;
+	m_last_store_ms = (float)ST2US(chVTTimeElapsedSinceX(time_start)) / 1000.0;
 
 	return is_ok;
 }
+
+/*
+ * Word i of the stored record: the MAIN_CONFIG words followed by the
+ * signature and the CRC.
+ */
+static uint16_t config_word(uint8_t *conf_addr, uint16_t crc, unsigned int i) {
+	if (i < MAIN_CONFIG_WORDS) {
+		return ((conf_addr[2 * i] << 8) & 0xFF00) | (conf_addr[2 * i + 1] & 0xFF);
+	} else if (i == MAIN_CONFIG_WORDS) {
+		return MAIN_CONFIG_SIGNATURE;
+	} else {
+		return crc;
+	}
+}
+
+static bool is_vehicle_stopped(void) {
+#if MAIN_MODE == MAIN_MODE_CAR
+	return fabsf(pos_get_speed()) < STORE_STOPPED_SPEED && !autopilot_is_active();
+#elif MAIN_MODE == MAIN_MODE_MULTIROTOR
+	return !mr_control_is_throttle_over_tres();
+#else
+	return true;
+#endif
+}
+
+static THD_FUNCTION(store_thread, arg) {
+	(void)arg;
+
+	chRegSetThreadName("Conf store");
+
+	// Static to keep the stack small
+	static MAIN_CONFIG conf;
+
+	for(;;) {
+		chEvtWaitAny((eventmask_t) 1);
+
+		while (m_store_pending) {
+			chMtxLock(&m_store_mutex);
+			conf = m_store_conf;
+			m_store_pending = false;
+			m_store_busy = true;
+			chMtxUnlock(&m_store_mutex);
+
+			bool ok = store_main_config(&conf);
+			m_store_busy = false;
+
+			// A superseded store did not write anything, the newer
+			// configuration is stored next and sets the result.
+			if (!m_store_pending) {
+				m_store_last_ok = ok;
+			}
+		}
+	}
+}
@@ -123,5 +123,8 @@ void conf_general_init(void);
 void conf_general_get_default_main_config(MAIN_CONFIG *conf);
 void conf_general_read_main_conf(MAIN_CONFIG *conf);
 bool conf_general_store_main_config(MAIN_CONFIG *conf);
+bool conf_general_store_busy(void);
+void conf_general_report_loop_period(float period_us, float nominal_us);
+void conf_general_print_stats(void);
 
 #endif /* CONF_GENERAL_H_ */
@@ -135,7 +135,11 @@ typedef enum {
 	CAN_PACKET_FILL_RX_BUFFER_LONG,
 	CAN_PACKET_PROCESS_RX_BUFFER,
 	CAN_PACKET_PROCESS_SHORT_BUFFER,
-	CAN_PACKET_STATUS
+	CAN_PACKET_STATUS,
+	CAN_PACKET_STATUS_2 = 14,
+	CAN_PACKET_STATUS_3,
+	CAN_PACKET_STATUS_4,
+	CAN_PACKET_STATUS_5 = 27
 } CAN_PACKET_ID;
 
 // Commands
@@ -143,6 +147,7 @@ typedef enum {
 	// General commands
 	CMD_PRINTF = 0,
 	CMD_TERMINAL_CMD,
+	CMD_TERMINAL_BATCH,
 
 	// Common vehicle commands
 	CMD_VESC_FWD = 50,
@@ -333,6 +338,18 @@ typedef struct {
 	MAIN_CONFIG_MULTIROTOR mr;
 } MAIN_CONFIG;
 
+// Local ENU frame with the reference ECEF position and rotation
+// matrix precalculated.
+typedef struct {
+	double lat;
+	double lon;
+	double height;
+	double ix;
+	double iy;
+	double iz;
+	double r[9];
+} ENU_FRAME;
+
 typedef struct {
 	// GPS position
 	double lat;
@@ -350,14 +367,8 @@ typedef struct {
 	float lx;
 	float ly;
 	float lz;
-	// Initial local position
-	double ix;
-	double iy;
-	double iz;
-	// Rotation matrix for local position
-	float r1c1, r1c2, r1c3;
-	float r2c1, r2c2, r2c3;
-	float r3c1, r3c2, r3c3;
+	// Reference frame for local position
+	ENU_FRAME enu;
 } GPS_STATE;
 
 // DW Logging Info
@@ -706,8 +717,33 @@ typedef struct {
 	float rpm;
 	float current;
 	float duty;
+	// CAN_PACKET_STATUS_2 and CAN_PACKET_STATUS_3
+	float amp_hours;
+	float amp_hours_charged;
+	float watt_hours;
+	float watt_hours_charged;
+	// CAN_PACKET_STATUS_4
+	uint32_t rx_time_4;
+	float temp_fet;
+	float temp_motor;
+	float current_in;
+	float pid_pos_now;
+	// CAN_PACKET_STATUS_5
+	uint32_t rx_time_5;
+	int32_t tacho_value;
+	float v_in;
 } can_status_msg;
 
+// Summary of the status of all VESCs on the CAN-bus
+typedef struct {
+	int nodes; // Controllers that have sent status
+	int nodes_alive; // Controllers that have sent status recently
+	float v_in_min;
+	float temp_fet_max;
+	float temp_motor_max;
+	float current_in_tot;
+} CAN_HEALTH;
+
 typedef enum {
 	PWM_MODE_NONSYNCHRONOUS_HISW = 0, // This mode is not recommended
 	PWM_MODE_SYNCHRONOUS, // The recommended and most tested mode
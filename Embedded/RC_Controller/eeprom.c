@@ -25,6 +25,7 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "eeprom.h"
+#include <string.h>
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
@@ -80,6 +81,20 @@ uint16_t DataVar = 0;
 /* Virtual address defined by the user: 0xFFFF value is prohibited */
 extern uint16_t VirtAddVarTab[NB_OF_VAR];
 
+/*
+ * Offset from EEPROM_START_ADDRESS to the latest copy of each variable in
+ * VirtAddVarTab, or 0 if the variable has not been written. This is built
+ * once after the pages are restored so that reads do not have to scan the
+ * page backwards.
+ */
+static uint16_t ee_index[NB_OF_VAR];
+static bool ee_index_valid = false;
+
+/* Address where the search for the next free slot starts */
+static uint32_t ee_write_hint = 0;
+
+static EE_STATS ee_stats;
+
 /* Private function prototypes -----------------------------------------------*/
 /* Private functions ---------------------------------------------------------*/
 static FLASH_Status EE_Format(void);
@@ -88,6 +103,9 @@ static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Da
 static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data);
 static uint16_t EE_EraseSectorIfNotEmpty(uint32_t FLASH_Sector, uint8_t VoltageRange);
 static uint8_t* EE_get_sector_address(uint32_t fsector);
+static uint16_t EE_RestorePages(void);
+static int EE_VarIndex(uint16_t VirtAddress);
+static void EE_BuildIndex(void);
 
 /**
  * @brief  Restore the pages to a known good state in case of page's status
@@ -97,6 +115,49 @@ static uint8_t* EE_get_sector_address(uint32_t fsector);
  *         - FLASH_COMPLETE: on success
  */
 uint16_t EE_Init(void)
+{
+	uint16_t Status = EE_RestorePages();
+	EE_BuildIndex();
+	return Status;
+}
+
+/**
+ * @brief  Copy the flash write, skip and erase counters.
+ * @param  stats: Where to store the counters.
+ * @retval None
+ */
+void EE_GetStats(EE_STATS *stats)
+{
+	*stats = ee_stats;
+}
+
+/**
+ * @brief  Number of variables that can be written before the active page is
+ *   full and the next write triggers a page transfer with a sector erase.
+ * @param  None.
+ * @retval Free slots in the active page, 0 if unknown.
+ */
+uint16_t EE_GetFreeSlots(void)
+{
+	uint16_t ValidPage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+
+	if (!ee_index_valid || ValidPage == NO_VALID_PAGE)
+	{
+		return 0;
+	}
+
+	uint32_t PageStartAddress = EEPROM_START_ADDRESS + (uint32_t)(ValidPage * PAGE_SIZE);
+	uint32_t PageEndAddress = PageStartAddress + PAGE_SIZE;
+
+	if (ee_write_hint <= PageStartAddress || ee_write_hint >= PageEndAddress)
+	{
+		return 0;
+	}
+
+	return (uint16_t)((PageEndAddress - ee_write_hint) / 4);
+}
+
+static uint16_t EE_RestorePages(void)
 {
 	uint16_t PageStatus0 = 6, PageStatus1 = 6;
 	uint16_t VarIdx = 0;
@@ -317,6 +378,23 @@ uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data)
 	uint16_t AddressValue = 0x5555, ReadStatus = 1;
 	uint32_t Address = EEPROM_START_ADDRESS, PageStartAddress = EEPROM_START_ADDRESS;
 
+	/* Look up the latest copy in the index if possible */
+	if (ee_index_valid)
+	{
+		int VarIdx = EE_VarIndex(VirtAddress);
+
+		if (VarIdx >= 0)
+		{
+			if (ee_index[VarIdx] == 0)
+			{
+				return 1;
+			}
+
+			*Data = (*(__IO uint16_t*)(EEPROM_START_ADDRESS + ee_index[VarIdx]));
+			return 0;
+		}
+	}
+
 	/* Get active Page for read operation */
 	ValidPage = EE_FindValidPage(READ_FROM_VALID_PAGE);
 
@@ -373,6 +451,14 @@ uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data)
 uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data)
 {
 	uint16_t Status = 0;
+	uint16_t Current = 0;
+
+	/* Nothing to do if the variable already has this value */
+	if (EE_ReadVariable(VirtAddress, &Current) == 0 && Current == Data)
+	{
+		ee_stats.words_skipped++;
+		return FLASH_COMPLETE;
+	}
 
 	/* Write the variable virtual address and value in the EEPROM */
 	Status = EE_VerifyPageFullWriteVariable(VirtAddress, Data);
@@ -382,6 +468,10 @@ uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data)
 	{
 		/* Perform Page transfer */
 		Status = EE_PageTransfer(VirtAddress, Data);
+		ee_stats.page_transfers++;
+
+		/* All variables have moved to the new page */
+		EE_BuildIndex();
 	}
 
 	/* Return last operation status */
@@ -407,6 +497,8 @@ static FLASH_Status EE_Format(void)
 		return FlashStatus;
 	}
 
+	ee_write_hint = 0;
+
 	/* Set Page0 as valid page: Write VALID_PAGE at Page0 base address */
 	FlashStatus = FLASH_ProgramHalfWord(PAGE0_BASE_ADDRESS, VALID_PAGE);
 
@@ -525,12 +617,20 @@ static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Da
 	/* Get the valid Page end Address */
 	PageEndAddress = (uint32_t)((EEPROM_START_ADDRESS - 2) + (uint32_t)((1 + ValidPage) * PAGE_SIZE));
 
+	/* Slots are used in order, so start from the last known free one if it is in this page */
+	if (ee_write_hint > Address && ee_write_hint < PageEndAddress)
+	{
+		Address = ee_write_hint;
+	}
+
 	/* Check each active page address starting from begining */
 	while (Address < PageEndAddress)
 	{
 		/* Verify if Address and Address+2 contents are 0xFFFFFFFF */
 		if ((*(__IO uint32_t*)Address) == 0xFFFFFFFF)
 		{
+			int VarIdx = EE_VarIndex(VirtAddress);
+
 			/* Set variable data */
 			FlashStatus = FLASH_ProgramHalfWord(Address, Data);
 			/* If program operation was failed, a Flash error code is returned */
@@ -540,6 +640,18 @@ static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Da
 			}
 			/* Set variable virtual address */
 			FlashStatus = FLASH_ProgramHalfWord(Address + 2, VirtAddress);
+
+			if (FlashStatus == FLASH_COMPLETE)
+			{
+				ee_stats.words_written++;
+				ee_write_hint = Address + 4;
+
+				if (VarIdx >= 0)
+				{
+					ee_index[VarIdx] = (uint16_t)(Address - EEPROM_START_ADDRESS);
+				}
+			}
+
 			/* Return program operation status */
 			return FlashStatus;
 		}
@@ -663,6 +775,7 @@ static uint16_t EE_EraseSectorIfNotEmpty(uint32_t FLASH_Sector, uint8_t VoltageR
 
 	for (unsigned int i = 0;i < PAGE_SIZE;i++) {
 		if (addr[i] != 0xFF) {
+			ee_stats.sector_erases++;
 			return FLASH_EraseSector(FLASH_Sector, VoltageRange);
 		}
 	}
@@ -670,6 +783,62 @@ static uint16_t EE_EraseSectorIfNotEmpty(uint32_t FLASH_Sector, uint8_t VoltageR
 	return FLASH_COMPLETE;
 }
 
+/*
+ * Position of a virtual address in VirtAddVarTab, or -1 if it is not there.
+ * The table is filled with consecutive addresses, so the position can be
+ * computed directly in the common case.
+ */
+static int EE_VarIndex(uint16_t VirtAddress) {
+	unsigned int ind = (unsigned int)(VirtAddress - VirtAddVarTab[0]);
+
+	if (VirtAddress >= VirtAddVarTab[0] && ind < NB_OF_VAR &&
+			VirtAddVarTab[ind] == VirtAddress) {
+		return ind;
+	}
+
+	for (int i = 0;i < NB_OF_VAR;i++) {
+		if (VirtAddVarTab[i] == VirtAddress) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Scan the valid page once from the start and record where the latest copy
+ * of each variable is, as well as the first free slot.
+ */
+static void EE_BuildIndex(void) {
+	memset(ee_index, 0, sizeof(ee_index));
+	ee_index_valid = false;
+	ee_write_hint = 0;
+
+	uint16_t ValidPage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+	if (ValidPage == NO_VALID_PAGE) {
+		return;
+	}
+
+	uint32_t Address = EEPROM_START_ADDRESS + (uint32_t)(ValidPage * PAGE_SIZE) + 4;
+	uint32_t PageEndAddress = (uint32_t)((EEPROM_START_ADDRESS - 2) + (uint32_t)((1 + ValidPage) * PAGE_SIZE));
+
+	while (Address < PageEndAddress) {
+		if ((*(__IO uint32_t*)Address) == 0xFFFFFFFF) {
+			break;
+		}
+
+		int VarIdx = EE_VarIndex(*(__IO uint16_t*)(Address + 2));
+		if (VarIdx >= 0) {
+			ee_index[VarIdx] = (uint16_t)(Address - EEPROM_START_ADDRESS);
+		}
+
+		Address += 4;
+	}
+
+	ee_write_hint = Address;
+	ee_index_valid = true;
+}
+
 static uint8_t* EE_get_sector_address(uint32_t fsector) {
 	uint8_t *res = 0;
 
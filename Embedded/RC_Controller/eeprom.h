@@ -69,15 +69,24 @@
 /* Page full define */
 #define PAGE_FULL             ((uint8_t)0x80)
 
-/* Variables' number */
-#define NB_OF_VAR             ((uint16_t)sizeof(MAIN_CONFIG))
+/* Variables' number: the MAIN_CONFIG words followed by its version and CRC words */
+#define NB_OF_VAR             ((uint16_t)(sizeof(MAIN_CONFIG) / 2 + 2))
 
 /* Exported types ------------------------------------------------------------*/
+typedef struct {
+	uint32_t words_written;
+	uint32_t words_skipped;
+	uint32_t page_transfers;
+	uint32_t sector_erases;
+} EE_STATS;
+
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions ------------------------------------------------------- */
 uint16_t EE_Init(void);
 uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data);
 uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data);
+void EE_GetStats(EE_STATS *stats);
+uint16_t EE_GetFreeSlots(void);
 
 #endif /* __EEPROM_H */
 
@@ -0,0 +1,485 @@
+/*
+	Copyright 2016 - 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host simulation of the EEPROM emulation in eeprom.c, together with the
+ * MAIN_CONFIG record that conf_general.c stores in it. Sectors 1 and 2 are
+ * mapped at their real addresses, and the flash functions work on them the
+ * way the flash does: programming can only clear bits and erasing sets a
+ * whole sector to 0xFF. A power cut is simulated by stopping after a given
+ * number of flash operations, leaving the flash as it is.
+ *
+ * The record is written and checked the same way as in
+ * conf_general_store_main_config and conf_general_read_main_conf: only
+ * changed words, with the signature and CRC words last.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <setjmp.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "eeprom.h"
+#include "crc.h"
+
+// Settings
+#define FLASH_BASE				0x08000000
+#define FLASH_SIM_SIZE			0x0C000 // Sectors 0 to 2
+#define SECTOR1_BASE			0x08004000
+#define SECTOR2_BASE			0x08008000
+#define EEPROM_BASE_MAINCONF	1000
+#define MAIN_CONFIG_WORDS		(sizeof(MAIN_CONFIG) / 2)
+#define MAIN_CONFIG_VERSION		1
+#define MAIN_CONFIG_SIGNATURE	((MAIN_CONFIG_VERSION << 12) | (sizeof(MAIN_CONFIG) & 0x0FFF))
+#define SLOTS_PER_PAGE			(PAGE_SIZE / 4 - 1)
+
+typedef enum {
+	LOAD_OLD = 0,
+	LOAD_NEW,
+	LOAD_DEFAULTS,
+	LOAD_MIXED
+} LOAD_RES;
+
+// Global variables
+uint16_t VirtAddVarTab[NB_OF_VAR];
+
+// Private variables
+static uint8_t *m_flash;
+static long m_ops_left = -1; // Flash operations until the power cut, -1 for none
+static jmp_buf m_power_cut;
+static unsigned long m_ops = 0;
+static unsigned long m_bad_programs = 0;
+static int m_failures = 0;
+
+// Private functions
+static double time_us(void);
+static void check(bool ok, const char *what);
+static void flash_op(void);
+static void random_config(uint8_t *conf);
+static void change_words(uint8_t *conf, int words);
+static uint16_t record_word(const uint8_t *conf, uint16_t crc, unsigned int i);
+static bool store_record(const uint8_t *conf);
+static bool load_record(uint8_t *conf);
+static bool scan_read(uint16_t VirtAddress, uint16_t *Data);
+static bool index_matches_scan(void);
+static LOAD_RES load_after_cut(const uint8_t *conf_old, const uint8_t *conf_new);
+static void case_wear(void);
+static void case_transfer(void);
+static void case_power_cut(bool transfer);
+
+FLASH_Status FLASH_ProgramHalfWord(uint32_t Address, uint16_t Data) {
+	flash_op();
+
+	uint16_t *p = (uint16_t*)(uintptr_t)Address;
+
+	// Programming can only clear bits
+	if ((*p & Data) != Data) {
+		m_bad_programs++;
+	}
+
+	*p &= Data;
+	return FLASH_COMPLETE;
+}
+
+FLASH_Status FLASH_EraseSector(uint32_t FLASH_Sector, uint8_t VoltageRange) {
+	(void)VoltageRange;
+
+	uint8_t *base = (uint8_t*)(uintptr_t)(FLASH_Sector == FLASH_Sector_1 ?
+			SECTOR1_BASE : SECTOR2_BASE);
+
+	// A cut erase leaves the sector partly erased
+	if (m_ops_left == 0) {
+		memset(base, 0xFF, PAGE_SIZE / 2);
+	}
+
+	flash_op();
+	memset(base, 0xFF, PAGE_SIZE);
+	return FLASH_COMPLETE;
+}
+
+int main(void) {
+	m_flash = mmap((void*)FLASH_BASE, FLASH_SIM_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	if (m_flash == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	for (unsigned int i = 0;i < NB_OF_VAR;i++) {
+		VirtAddVarTab[i] = EEPROM_BASE_MAINCONF + i;
+	}
+
+	srand(1);
+
+	printf("MAIN_CONFIG: %u words, %u variables, %d slots per page\n\n",
+			(unsigned int)MAIN_CONFIG_WORDS, (unsigned int)NB_OF_VAR, SLOTS_PER_PAGE);
+
+	case_wear();
+	case_transfer();
+	case_power_cut(false);
+	case_power_cut(true);
+
+	check(m_bad_programs == 0, "no half-word is programmed over set bits");
+
+	if (m_failures > 0) {
+		printf("\n%d checks FAILED\n", m_failures);
+		return 1;
+	}
+
+	printf("\nAll checks passed\n");
+	return 0;
+}
+
+static double time_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec * 1e-3;
+}
+
+static void check(bool ok, const char *what) {
+	if (!ok) {
+		printf("  FAIL: %s\n", what);
+		m_failures++;
+	}
+}
+
+static void flash_op(void) {
+	m_ops++;
+
+	if (m_ops_left == 0) {
+		m_ops_left = -1;
+		longjmp(m_power_cut, 1);
+	} else if (m_ops_left > 0) {
+		m_ops_left--;
+	}
+}
+
+static void format_flash(void) {
+	memset(m_flash, 0xFF, FLASH_SIM_SIZE);
+	EE_Init();
+}
+
+static void random_config(uint8_t *conf) {
+	for (unsigned int i = 0;i < sizeof(MAIN_CONFIG);i++) {
+		conf[i] = rand();
+	}
+}
+
+static void change_words(uint8_t *conf, int words) {
+	for (int i = 0;i < words;i++) {
+		unsigned int ind = rand() % MAIN_CONFIG_WORDS;
+		conf[2 * ind] = rand();
+		conf[2 * ind + 1] ^= 0x01;
+	}
+}
+
+static uint16_t record_word(const uint8_t *conf, uint16_t crc, unsigned int i) {
+	if (i < MAIN_CONFIG_WORDS) {
+		return ((conf[2 * i] << 8) & 0xFF00) | (conf[2 * i + 1] & 0xFF);
+	} else if (i == MAIN_CONFIG_WORDS) {
+		return MAIN_CONFIG_SIGNATURE;
+	} else {
+		return crc;
+	}
+}
+
+static bool store_record(const uint8_t *conf) {
+	uint16_t crc = crc16((unsigned char*)conf, MAIN_CONFIG_WORDS * 2);
+
+	for (unsigned int i = 0;i < NB_OF_VAR;i++) {
+		uint16_t var = record_word(conf, crc, i);
+		uint16_t current;
+
+		if (EE_ReadVariable(EEPROM_BASE_MAINCONF + i, &current) == 0 && current == var) {
+			continue;
+		}
+
+		if (EE_WriteVariable(EEPROM_BASE_MAINCONF + i, var) != FLASH_COMPLETE) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool load_record(uint8_t *conf) {
+	uint16_t var;
+
+	for (unsigned int i = 0;i < MAIN_CONFIG_WORDS;i++) {
+		if (EE_ReadVariable(EEPROM_BASE_MAINCONF + i, &var) != 0) {
+			return false;
+		}
+
+		conf[2 * i] = (var >> 8) & 0xFF;
+		conf[2 * i + 1] = var & 0xFF;
+	}
+
+	uint16_t version, crc;
+	bool has_version = EE_ReadVariable(EEPROM_BASE_MAINCONF + MAIN_CONFIG_WORDS, &version) == 0;
+	bool has_crc = EE_ReadVariable(EEPROM_BASE_MAINCONF + MAIN_CONFIG_WORDS + 1, &crc) == 0;
+
+	if (has_version || has_crc) {
+		if (!has_version || !has_crc ||
+				version != MAIN_CONFIG_SIGNATURE ||
+				crc != crc16(conf, MAIN_CONFIG_WORDS * 2)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Read a variable by scanning the valid page backwards, the way eeprom.c
+ * did before the index.
+ */
+static bool scan_read(uint16_t VirtAddress, uint16_t *Data) {
+	uint32_t page;
+
+	if (*(uint16_t*)(uintptr_t)SECTOR1_BASE == VALID_PAGE) {
+		page = SECTOR1_BASE;
+	} else if (*(uint16_t*)(uintptr_t)SECTOR2_BASE == VALID_PAGE) {
+		page = SECTOR2_BASE;
+	} else {
+		return false;
+	}
+
+	for (uint32_t addr = page + PAGE_SIZE - 2;addr > page + 2;addr -= 4) {
+		if (*(uint16_t*)(uintptr_t)addr == VirtAddress) {
+			*Data = *(uint16_t*)(uintptr_t)(addr - 2);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool index_matches_scan(void) {
+	for (unsigned int i = 0;i < NB_OF_VAR;i++) {
+		uint16_t a = 0, b = 0;
+		bool found_a = EE_ReadVariable(VirtAddVarTab[i], &a) == 0;
+		bool found_b = scan_read(VirtAddVarTab[i], &b);
+
+		if (found_a != found_b || a != b) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Reboot after a power cut and check that the load gives one of the two
+ * records or the defaults, never a mix of them.
+ */
+static LOAD_RES load_after_cut(const uint8_t *conf_old, const uint8_t *conf_new) {
+	static MAIN_CONFIG conf;
+
+	EE_Init();
+
+	if (!load_record((uint8_t*)&conf)) {
+		return LOAD_DEFAULTS;
+	} else if (memcmp(&conf, conf_old, sizeof(MAIN_CONFIG)) == 0) {
+		return LOAD_OLD;
+	} else if (memcmp(&conf, conf_new, sizeof(MAIN_CONFIG)) == 0) {
+		return LOAD_NEW;
+	}
+
+	return LOAD_MIXED;
+}
+
+/*
+ * Many stores with a few changed words each, compared to rewriting every
+ * word, and the time to load the record with the index and with a scan.
+ */
+static void case_wear(void) {
+	static MAIN_CONFIG conf, read;
+	const int stores = 2000;
+
+	printf("Wear: %d stores with up to 40 changed words\n", stores);
+
+	format_flash();
+	random_config((uint8_t*)&conf);
+	check(store_record((uint8_t*)&conf), "initial store");
+
+	EE_STATS start;
+	EE_GetStats(&start);
+	unsigned long ops_start = m_ops;
+
+	for (int i = 0;i < stores;i++) {
+		change_words((uint8_t*)&conf, rand() % 41);
+
+		if (!store_record((uint8_t*)&conf)) {
+			check(false, "store");
+			return;
+		}
+
+		if ((i % 100) == 0) {
+			EE_Init();
+			check(index_matches_scan(), "index after reboot matches scan");
+		}
+
+		if (!load_record((uint8_t*)&read) || memcmp(&conf, &read, sizeof(conf)) != 0) {
+			check(false, "load after store");
+			return;
+		}
+	}
+
+	EE_STATS end;
+	EE_GetStats(&end);
+
+	unsigned long all_words = (unsigned long)stores * NB_OF_VAR;
+	printf("  Changed words only: %u words, %u page transfers, %lu flash operations\n",
+			end.words_written - start.words_written,
+			end.page_transfers - start.page_transfers,
+			m_ops - ops_start);
+	printf("  Every word (computed): %lu words, about %lu page transfers\n",
+			all_words, all_words / (SLOTS_PER_PAGE - NB_OF_VAR));
+
+	const int loads = 1000;
+	double t = time_us();
+	for (int i = 0;i < loads;i++) {
+		EE_Init();
+		load_record((uint8_t*)&read);
+	}
+	double t_index = (time_us() - t) / loads;
+
+	volatile uint16_t sum = 0;
+	t = time_us();
+	for (int i = 0;i < loads;i++) {
+		uint16_t var = 0;
+		for (unsigned int j = 0;j < NB_OF_VAR;j++) {
+			scan_read(VirtAddVarTab[j], &var);
+			sum += var;
+		}
+	}
+	double t_scan = (time_us() - t) / loads;
+
+	printf("  Load on this host: %.1f us with the index (including the scan in EE_Init), "
+			"%.1f us with a backwards scan per word\n", t_index, t_scan);
+}
+
+/*
+ * Store until several page transfers have happened, and check the index
+ * against a scan after every store and after every reboot.
+ */
+static void case_transfer(void) {
+	static MAIN_CONFIG conf, read;
+
+	printf("Page transfer: index and values across transfers and reboots\n");
+
+	format_flash();
+	random_config((uint8_t*)&conf);
+
+	EE_STATS stats;
+	EE_GetStats(&stats);
+	uint32_t transfers_start = stats.page_transfers;
+	int stores = 0;
+
+	do {
+		change_words((uint8_t*)&conf, 200);
+		check(store_record((uint8_t*)&conf), "store");
+		stores++;
+
+		bool ok = index_matches_scan();
+		EE_Init();
+		ok = ok && index_matches_scan();
+		ok = ok && load_record((uint8_t*)&read) && memcmp(&conf, &read, sizeof(conf)) == 0;
+
+		if (!ok) {
+			check(false, "index and record across a page transfer");
+			return;
+		}
+
+		EE_GetStats(&stats);
+	} while ((stats.page_transfers - transfers_start) < 5);
+
+	printf("  %d stores, %u page transfers\n", stores,
+			stats.page_transfers - transfers_start);
+}
+
+/*
+ * Cut the power after every possible flash operation of one store and check
+ * that the reboot loads the old record, the new record or the defaults, and
+ * that the next store works. With transfer set, the page is nearly full so
+ * that the store does a page transfer partway through.
+ */
+static void case_power_cut(bool transfer) {
+	static MAIN_CONFIG conf_old, conf_new, read;
+	static uint8_t snapshot[FLASH_SIM_SIZE];
+	const int changed = 40;
+
+	printf("Power cut during a store%s\n", transfer ? " with a page transfer" : "");
+
+	format_flash();
+	random_config((uint8_t*)&conf_old);
+	check(store_record((uint8_t*)&conf_old), "initial store");
+
+	if (transfer) {
+		while (EE_GetFreeSlots() >= (changed / 2)) {
+			change_words((uint8_t*)&conf_old, 1);
+			store_record((uint8_t*)&conf_old);
+		}
+	}
+
+	conf_new = conf_old;
+	change_words((uint8_t*)&conf_new, changed);
+	memcpy(snapshot, m_flash, FLASH_SIM_SIZE);
+
+	// Count the operations of the whole store
+	EE_Init();
+	unsigned long ops_start = m_ops;
+	check(store_record((uint8_t*)&conf_new), "uncut store");
+	long ops = m_ops - ops_start;
+
+	int results[4] = {0, 0, 0, 0};
+
+	for (long cut = 0;cut <= ops;cut++) {
+		memcpy(m_flash, snapshot, FLASH_SIM_SIZE);
+		EE_Init();
+
+		m_ops_left = cut;
+		if (setjmp(m_power_cut) == 0) {
+			store_record((uint8_t*)&conf_new);
+		}
+		m_ops_left = -1;
+
+		LOAD_RES res = load_after_cut((uint8_t*)&conf_old, (uint8_t*)&conf_new);
+		results[res]++;
+
+		if (res == LOAD_MIXED) {
+			printf("  Cut after %ld of %ld operations loaded a mixed record\n", cut, ops);
+		}
+
+		bool ok = index_matches_scan();
+		ok = ok && store_record((uint8_t*)&conf_new);
+		ok = ok && load_record((uint8_t*)&read) &&
+				memcmp(&conf_new, &read, sizeof(read)) == 0;
+
+		if (!ok) {
+			printf("  Cut after %ld of %ld operations: ", cut, ops);
+			check(false, "store after the reboot");
+		}
+	}
+
+	printf("  %ld cut points: %d loaded the old record, %d the new record, "
+			"%d fell back to the defaults\n", ops + 1, results[LOAD_OLD],
+			results[LOAD_NEW], results[LOAD_DEFAULTS]);
+	check(results[LOAD_MIXED] == 0, "no mixed record is ever loaded");
+}
@@ -234,9 +234,9 @@ static THD_FUNCTION(log_thread, arg) {
 					(double)gps.lx,
 					(double)gps.ly,
 					(double)gps.lz,
-					gps.ix,
-					gps.iy,
-					gps.iz,
+					gps.enu.ix,
+					gps.enu.iy,
+					gps.enu.iz,
 					(double)pos.speed,
 					(double)pos.roll,
 					(double)pos.pitch,
@@ -303,9 +303,9 @@ static THD_FUNCTION(log_thread, arg) {
 					(double)gps.lx,
 					(double)gps.ly,
 					(double)gps.lz,
-					gps.ix,
-					gps.iy,
-					gps.iz,
+					gps.enu.ix,
+					gps.enu.iy,
+					gps.enu.iz,
 					(double)accel[0],
 					(double)accel[1],
 					(double)accel[2],
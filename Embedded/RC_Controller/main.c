@@ -48,6 +48,7 @@
 #include "pwm_esc.h"
 #include "mr_control.h"
 #include "radar_cont.h"
+#include "terminal.h"
 
 /*
  * Timers used:
@@ -80,6 +81,7 @@ int main(void) {
 
 	led_init();
 	ext_cb_init();
+	terminal_init();
 
 #if MAIN_MODE == MAIN_MODE_CAR
 	conf_general_init();
@@ -19,8 +19,11 @@
 #include "pos.h"
 #include "utils.h"
 #include "actuator.h"
+#include "terminal.h"
+#include "commands.h"
 
 #include <math.h>
+#include <string.h>
 
 // Settings
 #define INPUT_TIMEOUT_MS				1000
@@ -28,6 +31,10 @@
 #define AUTOPILOT_TIMEOUT_MS			1000
 #define MIN_THROTTLE					0.1
 #define THROTTLE_OVERRIDE_LIM			0.85
+#define LOOP_RATE_HZ_DEFAULT			500
+#define LOOP_RATE_HZ_MIN				50
+#define LOOP_RATE_HZ_MAX				1000 // The IMU is sampled at 1 kHz
+#define D_FILTER_HZ						40.0 // Cutoff of the low-pass filter on the derivative terms
 
 // Private types
 typedef struct {
@@ -43,6 +50,12 @@ typedef struct {
 	float last_pitch_error;
 	float last_yaw_process;
 	float last_yaw_error;
+	float d_roll_process;
+	float d_roll_error;
+	float d_pitch_process;
+	float d_pitch_error;
+	float d_yaw_process;
+	float d_yaw_error;
 } MR_CONTROL_STATE;
 
 typedef struct {
@@ -60,6 +73,17 @@ typedef struct {
 	float yaw;
 } MR_OUTPUT;
 
+// Timing of the control loop, in microseconds
+typedef struct {
+	uint32_t iterations;
+	uint32_t overruns; // Iterations that started after the next one was due
+	float latency_max; // From the scheduled start to the actual start
+	float latency_sum;
+	float jitter_max; // Deviation of the period from the nominal period
+	float exec_max;
+	float exec_sum;
+} MR_LOOP_STATS;
+
 // Private variables
 static MR_CONTROL_STATE m_ctrl;
 static MR_RC_STATE m_rc;
@@ -67,9 +91,17 @@ static POS_STATE m_pos_last;
 static MR_OUTPUT m_output;
 static float m_power_override[4];
 static float m_power_override_time;
+static volatile int m_loop_rate_hz;
+static MR_LOOP_STATS m_loop_stats;
+
+// Threads
+static THD_WORKING_AREA(mr_thread_wa, 2048);
+static THD_FUNCTION(mr_thread, arg);
 
 // Private functions
 static void update_rc_control(MR_CONTROL_STATE *ctrl, MR_RC_STATE *rc, POS_STATE *pos, float dt);
+static void terminal_loop_stats(int argc, const char **argv);
+static void terminal_loop_rate(int argc, const char **argv);
 
 void mr_control_init(void) {
 	memset(&m_rc, 0, sizeof(MR_RC_STATE));
@@ -78,6 +110,23 @@ void mr_control_init(void) {
 	memset(&m_output, 0, sizeof(MR_OUTPUT));
 	memset(m_power_override, 0, sizeof(m_power_override));
 	m_power_override_time = 0.0;
+	memset(&m_loop_stats, 0, sizeof(MR_LOOP_STATS));
+	m_loop_rate_hz = LOOP_RATE_HZ_DEFAULT;
+
+	terminal_register_command_callback(
+			"mr_loop_stats",
+			"Print and reset the timing statistics of the attitude control loop",
+			"",
+			terminal_loop_stats);
+
+	terminal_register_command_callback(
+			"mr_loop_rate",
+			"Set the rate of the attitude control loop",
+			"[hz]",
+			terminal_loop_rate);
+
+	chThdCreateStatic(mr_thread_wa, sizeof(mr_thread_wa),
+			NORMALPRIO + 2, mr_thread, NULL);
 }
 
 systime_t mr_control_time_since_input_update(void) {
@@ -177,12 +226,23 @@ void mr_control_run_iteration(float dt) {
 		utils_truncate_number_abs(&m_ctrl.pitch_integrator, 1.0 / main_config.mr.ctrl_gain_pitch_i);
 		utils_truncate_number_abs(&m_ctrl.yaw_integrator, 1.0 / main_config.mr.ctrl_gain_yaw_i);
 
-		float d_roll_sample_process = -utils_angle_difference(m_pos_last.roll, m_ctrl.last_roll_process) / dt;
-		float d_roll_sample_error = (roll_error - m_ctrl.last_roll_error) / dt;
-		float d_pitch_sample_process = -utils_angle_difference(m_pos_last.pitch, m_ctrl.last_pitch_process) / dt;
-		float d_pitch_sample_error = (pitch_error - m_ctrl.last_pitch_error) / dt;
-		float d_yaw_sample_process = -utils_angle_difference(m_pos_last.yaw, m_ctrl.last_yaw_process) / dt;
-		float d_yaw_sample_error = (yaw_error - m_ctrl.last_yaw_error) / dt;
+		// Low-pass filter the derivative terms, as differentiating amplifies
+		// the sensor noise.
+		const float d_filter = dt / (dt + 1.0 / (2.0 * M_PI * D_FILTER_HZ));
+
+		UTILS_LP_FAST(m_ctrl.d_roll_process, -utils_angle_difference(m_pos_last.roll, m_ctrl.last_roll_process) / dt, d_filter);
+		UTILS_LP_FAST(m_ctrl.d_roll_error, (roll_error - m_ctrl.last_roll_error) / dt, d_filter);
+		UTILS_LP_FAST(m_ctrl.d_pitch_process, -utils_angle_difference(m_pos_last.pitch, m_ctrl.last_pitch_process) / dt, d_filter);
+		UTILS_LP_FAST(m_ctrl.d_pitch_error, (pitch_error - m_ctrl.last_pitch_error) / dt, d_filter);
+		UTILS_LP_FAST(m_ctrl.d_yaw_process, -utils_angle_difference(m_pos_last.yaw, m_ctrl.last_yaw_process) / dt, d_filter);
+		UTILS_LP_FAST(m_ctrl.d_yaw_error, (yaw_error - m_ctrl.last_yaw_error) / dt, d_filter);
+
+		float d_roll_sample_process = m_ctrl.d_roll_process;
+		float d_roll_sample_error = m_ctrl.d_roll_error;
+		float d_pitch_sample_process = m_ctrl.d_pitch_process;
+		float d_pitch_sample_error = m_ctrl.d_pitch_error;
+		float d_yaw_sample_process = m_ctrl.d_yaw_process;
+		float d_yaw_sample_error = m_ctrl.d_yaw_error;
 
 		m_ctrl.last_roll_process = m_pos_last.roll;
 		m_ctrl.last_roll_error = roll_error;
@@ -251,3 +311,108 @@ static void update_rc_control(MR_CONTROL_STATE *ctrl, MR_RC_STATE *rc, POS_STATE
 	ctrl->pitch_goal = pitch;
 	ctrl->yaw_goal = yaw;
 }
+
+/*
+ * Runs the control loop at a fixed rate, independent of the timing of the
+ * IMU samples. The period is a whole number of system ticks, so dt is
+ * computed from the ticks between the iterations and not from the nominal
+ * rate. After an overrun dt covers the real gap.
+ */
+static THD_FUNCTION(mr_thread, arg) {
+	(void)arg;
+
+	chRegSetThreadName("MR Control");
+
+	systime_t time_next = chVTGetSystemTimeX();
+	rtcnt_t start_last = chSysGetRealtimeCounterX();
+	bool first = true;
+
+	for(;;) {
+		int rate = m_loop_rate_hz;
+		systime_t period = CH_CFG_ST_FREQUENCY / rate;
+		systime_t time_prev = time_next;
+		time_next += period;
+
+		// Returns right away if the next iteration is already due
+		if (chVTTimeElapsedSinceX(time_prev) >= period) {
+			m_loop_stats.overruns++;
+			time_next = chVTGetSystemTimeX();
+		} else {
+			chThdSleepUntilWindowed(time_prev, time_next);
+		}
+
+		rtcnt_t start = chSysGetRealtimeCounterX();
+		float latency = (float)ST2US(chVTTimeElapsedSinceX(time_next));
+		float period_us = (float)RTC2US(STM32_SYSCLK, start - start_last);
+		start_last = start;
+
+		float dt = (float)(systime_t)(time_next - time_prev) / (float)CH_CFG_ST_FREQUENCY;
+		mr_control_run_iteration(dt);
+
+		float exec = (float)RTC2US(STM32_SYSCLK, chSysGetRealtimeCounterX() - start);
+
+		if (first) {
+			first = false;
+			continue;
+		}
+
+		float jitter = fabsf(period_us - (float)ST2US(period));
+		conf_general_report_loop_period(period_us, (float)ST2US(period));
+
+		m_loop_stats.iterations++;
+		m_loop_stats.latency_sum += latency;
+		m_loop_stats.exec_sum += exec;
+
+		if (latency > m_loop_stats.latency_max) {
+			m_loop_stats.latency_max = latency;
+		}
+
+		if (jitter > m_loop_stats.jitter_max) {
+			m_loop_stats.jitter_max = jitter;
+		}
+
+		if (exec > m_loop_stats.exec_max) {
+			m_loop_stats.exec_max = exec;
+		}
+	}
+}
+
+static void terminal_loop_stats(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
+
+	MR_LOOP_STATS stats = m_loop_stats;
+	memset(&m_loop_stats, 0, sizeof(MR_LOOP_STATS));
+
+	float n = stats.iterations > 0 ? (float)stats.iterations : 1.0;
+
+	commands_printf("Rate:          %d Hz", m_loop_rate_hz);
+	commands_printf("Iterations:    %u", (unsigned int)stats.iterations);
+	commands_printf("Overruns:      %u", (unsigned int)stats.overruns);
+	commands_printf("Latency mean:  %.1f us", (double)(stats.latency_sum / n));
+	commands_printf("Latency max:   %.1f us", (double)stats.latency_max);
+	commands_printf("Jitter max:    %.1f us", (double)stats.jitter_max);
+	commands_printf("Exec mean:     %.1f us", (double)(stats.exec_sum / n));
+	commands_printf("Exec max:      %.1f us\n", (double)stats.exec_max);
+}
+
+static void terminal_loop_rate(int argc, const char **argv) {
+	if (argc == 2) {
+		int rate = -1;
+
+		if (terminal_arg_int(argc, argv, 1, LOOP_RATE_HZ_MIN, LOOP_RATE_HZ_MAX, &rate)) {
+			m_loop_rate_hz = rate;
+			memset(&m_loop_stats, 0, sizeof(MR_LOOP_STATS));
+
+			// The period is rounded down to whole system ticks
+			int period = CH_CFG_ST_FREQUENCY / rate;
+			commands_printf("Control loop rate set to %d Hz (actual: %.1f Hz)\n",
+					rate, (double)CH_CFG_ST_FREQUENCY / (double)period);
+		} else {
+			commands_printf("Invalid rate, must be %d - %d Hz\n",
+					LOOP_RATE_HZ_MIN, LOOP_RATE_HZ_MAX);
+		}
+	} else {
+		commands_printf("This command requires one argument.\n");
+	}
+}
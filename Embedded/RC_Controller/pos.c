@@ -232,33 +232,12 @@ void pos_set_yaw_offset(float angle) {
 }
 
 void pos_set_enu_ref(double lat, double lon, double height) {
-	double x, y, z;
-	utils_llh_to_xyz(lat, lon, height, &x, &y, &z);
+	ENU_FRAME frame;
+	utils_enu_frame_init(&frame, lat, lon, height);
 
 	chMtxLock(&m_mutex_gps);
 
-	m_gps.ix = x;
-	m_gps.iy = y;
-	m_gps.iz = z;
-
-	float so = sinf((float)lon * M_PI / 180.0);
-	float co = cosf((float)lon * M_PI / 180.0);
-	float sa = sinf((float)lat * M_PI / 180.0);
-	float ca = cosf((float)lat * M_PI / 180.0);
-
-	// ENU
-	m_gps.r1c1 = -so;
-	m_gps.r1c2 = co;
-	m_gps.r1c3 = 0.0;
-
-	m_gps.r2c1 = -sa * co;
-	m_gps.r2c2 = -sa * so;
-	m_gps.r2c3 = ca;
-
-	m_gps.r3c1 = ca * co;
-	m_gps.r3c2 = ca * so;
-	m_gps.r3c3 = sa;
-
+	m_gps.enu = frame;
 	m_gps.lx = 0.0;
 	m_gps.ly = 0.0;
 	m_gps.lz = 0.0;
@@ -270,7 +249,9 @@ void pos_set_enu_ref(double lat, double lon, double height) {
 
 void pos_get_enu_ref(double *llh) {
 	chMtxLock(&m_mutex_gps);
-	utils_xyz_to_llh(m_gps.ix, m_gps.iy, m_gps.iz, &llh[0], &llh[1], &llh[2]);
+	llh[0] = m_gps.enu.lat;
+	llh[1] = m_gps.enu.lon;
+	llh[2] = m_gps.enu.height;
 	chMtxUnlock(&m_mutex_gps);
 }
 
@@ -413,12 +394,8 @@ bool pos_input_nmea(const char *data) {
 	// Only use valid fixes
 	if (fix_type == 1 || fix_type == 2 || fix_type == 4 || fix_type == 5) {
 		// Convert llh to ecef
-		double sinp = sin(lat * D_PI / D(180.0));
-		double cosp = cos(lat * D_PI / D(180.0));
-		double sinl = sin(lon * D_PI / D(180.0));
-		double cosl = cos(lon * D_PI / D(180.0));
-		double e2 = FE_WGS84 * (D(2.0) - FE_WGS84);
-		double v = RE_WGS84 / sqrt(D(1.0) - e2 * sinp * sinp);
+		double x, y, z;
+		utils_llh_to_xyz(lat, lon, height, &x, &y, &z);
 
 		chMtxLock(&m_mutex_gps);
 
@@ -428,19 +405,20 @@ bool pos_input_nmea(const char *data) {
 		m_gps.fix_type = fix_type;
 		m_gps.sats = sats;
 		m_gps.ms = ms;
-		m_gps.x = (v + height) * cosp * cosl;
-		m_gps.y = (v + height) * cosp * sinl;
-		m_gps.z = (v * (D(1.0) - e2) + height) * sinp;
+		m_gps.x = x;
+		m_gps.y = y;
+		m_gps.z = z;
 
 		// Continue if ENU frame is initialized
 		if (m_gps.local_init_done) {
-			float dx = (float)(m_gps.x - m_gps.ix);
-			float dy = (float)(m_gps.y - m_gps.iy);
-			float dz = (float)(m_gps.z - m_gps.iz);
+			// The rotation is done in double precision, as the ECEF
+			// coordinates are far too large for float.
+			double enu[3];
+			utils_enu_frame_xyz_to_enu(&m_gps.enu, x, y, z, enu);
 
-			m_gps.lx = m_gps.r1c1 * dx + m_gps.r1c2 * dy + m_gps.r1c3 * dz;
-			m_gps.ly = m_gps.r2c1 * dx + m_gps.r2c2 * dy + m_gps.r2c3 * dz;
-			m_gps.lz = m_gps.r3c1 * dx + m_gps.r3c2 * dy + m_gps.r3c3 * dz;
+			m_gps.lx = (float)enu[0];
+			m_gps.ly = (float)enu[1];
+			m_gps.lz = (float)enu[2];
 
 			float px = m_gps.lx;
 			float py = m_gps.ly;
@@ -574,10 +552,6 @@ static void mpu9150_read(void) {
 			m_ms_today -= MS_PER_DAY;
 		}
 	}
-
-#if MAIN_MODE == MAIN_MODE_MULTIROTOR
-	mr_control_run_iteration(dt);
-#endif
 }
 
 static void update_orientation_angles(float *accel, float *gyro, float *mag, float dt) {
@@ -696,27 +670,7 @@ static void update_orientation_angles(float *accel, float *gyro, float *mag, flo
 }
 
 static void init_gps_local(GPS_STATE *gps) {
-	gps->ix = gps->x;
-	gps->iy = gps->y;
-	gps->iz = gps->z;
-
-	float so = sinf((float)gps->lon * M_PI / 180.0);
-	float co = cosf((float)gps->lon * M_PI / 180.0);
-	float sa = sinf((float)gps->lat * M_PI / 180.0);
-	float ca = cosf((float)gps->lat * M_PI / 180.0);
-
-	// ENU
-	gps->r1c1 = -so;
-	gps->r1c2 = co;
-	gps->r1c3 = 0.0;
-
-	gps->r2c1 = -sa * co;
-	gps->r2c2 = -sa * so;
-	gps->r2c3 = ca;
-
-	gps->r3c1 = ca * co;
-	gps->r3c2 = ca * so;
-	gps->r3c3 = sa;
+	utils_enu_frame_init(&gps->enu, gps->lat, gps->lon, gps->height);
 
 	gps->lx = 0.0;
 	gps->ly = 0.0;
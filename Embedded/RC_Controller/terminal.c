@@ -28,10 +28,11 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 
 // Settings
-#define CALLBACK_LEN						25
+#define CALLBACK_LEN						48
 
 // Private types
 typedef struct _terminal_callback_struct {
@@ -42,20 +43,107 @@ typedef struct _terminal_callback_struct {
 } terminal_callback_struct;
 
 // Private variables
-static terminal_callback_struct callbacks[CALLBACK_LEN];
-static int callback_write = 0;
+static terminal_callback_struct callbacks[CALLBACK_LEN]; // Sorted by command
+static int callback_num = 0;
+static bool m_init_done = false;
 
 // Private functions
+static int find_command(const char *command, bool *found);
 static void range_callback(uint8_t id, uint8_t dest, float range);
+static void enu_test(int points);
+static void enu_test_point(int ind, int points, double *xyz);
+
+// Built-in commands
+static void cmd_help(int argc, const char **argv);
+static void cmd_ping(int argc, const char **argv);
+static void cmd_mem(int argc, const char **argv);
+static void cmd_threads(int argc, const char **argv);
+#if MAIN_MODE == MAIN_MODE_CAR
+static void cmd_vesc(int argc, const char **argv);
+#if RADAR_EN
+static void cmd_radar_sample(int argc, const char **argv);
+static void cmd_radar_cmd(int argc, const char **argv);
+static void cmd_radar_reset(int argc, const char **argv);
+#endif
+#endif
+static void cmd_reset_att(int argc, const char **argv);
+static void cmd_reset_enu(int argc, const char **argv);
+static void cmd_cc1120_state(int argc, const char **argv);
+static void cmd_cc1120_update_rf(int argc, const char **argv);
+static void cmd_dw_range(int argc, const char **argv);
+static void cmd_enu_test(int argc, const char **argv);
+static void cmd_conf_stats(int argc, const char **argv);
 
-void terminal_process_string(char *str) {
-	enum { kMaxArgs = 64 };
-	int argc = 0;
-	char *argv[kMaxArgs];
+/**
+ * Register the built-in commands. Modules can register their commands
+ * before or after this, as the table is kept sorted on every insert.
+ */
+void terminal_init(void) {
+	if (m_init_done) {
+		return;
+	}
+
+	terminal_register_command_callback("help", "Show this help", 0, cmd_help);
+	terminal_register_command_callback("ping", "Print pong here to see if the reply works", 0, cmd_ping);
+	terminal_register_command_callback("mem", "Show memory usage", 0, cmd_mem);
+	terminal_register_command_callback("threads", "List all threads", 0, cmd_threads);
 
 #if MAIN_MODE == MAIN_MODE_CAR
-	static char buffer[256];
+	terminal_register_command_callback("vesc", "Forward command to VESC", "[cmd]", cmd_vesc);
+
+#if RADAR_EN
+	terminal_register_command_callback("radar_sample", "Start radar sampling", 0, cmd_radar_sample);
+	terminal_register_command_callback("radar_cmd", "Forward command to radar", "[cmd]", cmd_radar_cmd);
+	terminal_register_command_callback("radar_reset", "Reset and setup the radar", 0, cmd_radar_reset);
 #endif
+#endif
+
+	terminal_register_command_callback("reset_att",
+			"Re-initialize the attitude estimation", 0, cmd_reset_att);
+	terminal_register_command_callback("reset_enu",
+			"Re-initialize the ENU reference on the next GNSS sample", 0, cmd_reset_enu);
+	terminal_register_command_callback("cc1120_state",
+			"Print the state of the CC1120", 0, cmd_cc1120_state);
+	terminal_register_command_callback("cc1120_update_rf",
+			"Set one of the cc1120 RF settings\n"
+			"  0: CC1120_SET_434_0M_1_2K_2FSK_BW25K_4K\n"
+			"  1: CC1120_SET_434_0M_1_2K_2FSK_BW50K_20K\n"
+			"  2: CC1120_SET_434_0M_1_2K_2FSK_BW10K_4K\n"
+			"  3: CC1120_SET_434_0M_50K_2GFSK_BW100K_25K\n"
+			"  4: CC1120_SET_434_0M_100K_4FSK_BW100K_25K\n"
+			"  5: CC1120_SET_434_0M_4_8K_2FSK_BW40K_9K\n"
+			"  6: CC1120_SET_434_0M_4_8K_2FSK_BW50K_14K\n"
+			"  7: CC1120_SET_434_0M_4_8K_2FSK_BW100K_39K\n"
+			"  8: CC1120_SET_434_0M_9_6K_2FSK_BW50K_12K\n"
+			"  9: CC1120_SET_452_0M_9_6K_2GFSK_BW33K_2_4K\n"
+			"  10: CC1120_SET_452_0M_9_6K_2GFSK_BW50K_2_4K",
+			"[rf_setting]", cmd_cc1120_update_rf);
+	terminal_register_command_callback("dw_range",
+			"Measure the distance to DW module [dest] with ultra wideband.",
+			"[dest]", cmd_dw_range);
+	terminal_register_command_callback("enu_test",
+			"Measure the time and round-trip error of ENU conversions.",
+			"[points]", cmd_enu_test);
+	terminal_register_command_callback("conf_stats",
+			"Print the configuration load/store time and flash wear counters.",
+			0, cmd_conf_stats);
+
+	m_init_done = true;
+}
+
+/**
+ * Split a string into arguments and run the matching command.
+ *
+ * @param str
+ * The string to process. It is modified.
+ *
+ * @return
+ * true if the command was found, false otherwise.
+ */
+bool terminal_process_string(char *str) {
+	enum { kMaxArgs = 64 };
+	int argc = 0;
+	char *argv[kMaxArgs];
 
 	char *p2 = strtok(str, " ");
 	while (p2 && argc < kMaxArgs) {
@@ -65,247 +153,429 @@ void terminal_process_string(char *str) {
 
 	if (argc == 0) {
 		commands_printf("No command received\n");
-		return;
+		return false;
 	}
 
-	if (strcmp(argv[0], "ping") == 0) {
-		commands_printf("pong\n");
-	} else if (strcmp(argv[0], "mem") == 0) {
-		size_t n, size;
-		n = chHeapStatus(NULL, &size);
-		commands_printf("core free memory : %u bytes", chCoreGetStatusX());
-		commands_printf("heap fragments   : %u", n);
-		commands_printf("heap free total  : %u bytes\n", size);
-	} else if (strcmp(argv[0], "threads") == 0) {
-		thread_t *tp;
-		static const char *states[] = {CH_STATE_NAMES};
-		commands_printf("    addr    stack prio refs     state           name time    ");
-		commands_printf("-------------------------------------------------------------");
-		tp = chRegFirstThread();
-		do {
-			commands_printf("%.8lx %.8lx %4lu %4lu %9s %14s %lu",
-					(uint32_t)tp, (uint32_t)tp->p_ctx.r13,
-					(uint32_t)tp->p_prio, (uint32_t)(tp->p_refs - 1),
-					states[tp->p_state], tp->p_name, (uint32_t)tp->p_time);
-			tp = chRegNextThread(tp);
-		} while (tp != NULL);
-		commands_printf(" ");
+	bool found = false;
+	int ind = find_command(argv[0], &found);
+
+	if (!found) {
+		commands_printf("Invalid command: %s\n"
+				"type help to list all available commands\n", argv[0]);
+		return false;
 	}
 
-#if MAIN_MODE == MAIN_MODE_CAR
-	else if (strcmp(argv[0], "vesc") == 0) {
-		buffer[0] = '\0';
-		int ind = 0;
-		for (int i = 1;i < argc;i++) {
-			sprintf(buffer + ind, " %s", argv[i]);
-			ind += strlen(argv[i]) + 1;
+	callbacks[ind].cbf(argc, (const char**)argv);
+	return true;
+}
+
+/**
+ * Register a custom command  callback to the terminal. If the command
+ * is already registered the old command callback will be replaced.
+ *
+ * @param command
+ * The command name.
+ *
+ * @param help
+ * A help text for the command. Can be NULL.
+ *
+ * @param arg_names
+ * The argument names for the command, e.g. [arg_a] [arg_b]
+ * Can be NULL.
+ *
+ * @param cbf
+ * The callback function for the command.
+ */
+void terminal_register_command_callback(
+		const char* command,
+		const char *help,
+		const char *arg_names,
+		void(*cbf)(int argc, const char **argv)) {
+
+	bool found = false;
+	int ind = find_command(command, &found);
+
+	if (!found) {
+		if (callback_num >= CALLBACK_LEN) {
+			return;
 		}
-		bldc_interface_terminal_cmd(buffer);
+
+		memmove(callbacks + ind + 1, callbacks + ind,
+				(callback_num - ind) * sizeof(terminal_callback_struct));
+		callback_num++;
 	}
 
-#if RADAR_EN
-	else if (strcmp(argv[0], "radar_sample") == 0) {
-		commands_printf("Sampling radar...");
-		radar_setup_measurement_default();
-		radar_sample();
-	} else if (strcmp(argv[0], "radar_cmd") == 0) {
-		buffer[0] = '\0';
-		int ind = 0;
-		for (int i = 1;i < argc;i++) {
-			if (i == 1) {
-				sprintf(buffer + ind, "%s", argv[i]);
-				ind += strlen(argv[i]);
-			} else {
-				sprintf(buffer + ind, " %s", argv[i]);
-				ind += strlen(argv[i]) + 1;
-			}
+	callbacks[ind].command = command;
+	callbacks[ind].help = help;
+	callbacks[ind].arg_names = arg_names;
+	callbacks[ind].cbf = cbf;
+}
+
+/**
+ * Parse an integer argument.
+ *
+ * @param argc
+ * The argument count.
+ *
+ * @param argv
+ * The arguments.
+ *
+ * @param ind
+ * The index of the argument to parse.
+ *
+ * @param min
+ * The lowest accepted value.
+ *
+ * @param max
+ * The highest accepted value.
+ *
+ * @param res
+ * The parsed value. Only written on success.
+ *
+ * @return
+ * true if the argument exists, is a number and is in range.
+ */
+bool terminal_arg_int(int argc, const char **argv, int ind,
+		int min, int max, int *res) {
+	if (ind >= argc) {
+		return false;
+	}
+
+	char *end;
+	long val = strtol(argv[ind], &end, 0);
+
+	if (end == argv[ind] || *end != '\0' || val < min || val > max) {
+		return false;
+	}
+
+	*res = (int)val;
+	return true;
+}
+
+/**
+ * Parse a float argument. Works like terminal_arg_int.
+ */
+bool terminal_arg_float(int argc, const char **argv, int ind,
+		float min, float max, float *res) {
+	if (ind >= argc) {
+		return false;
+	}
+
+	char *end;
+	float val = strtof(argv[ind], &end);
+
+	if (end == argv[ind] || *end != '\0' || !(val >= min && val <= max)) {
+		return false;
+	}
+
+	*res = val;
+	return true;
+}
+
+/**
+ * Join arguments with spaces, e.g. to forward a command to another device.
+ *
+ * @param argc
+ * The argument count.
+ *
+ * @param argv
+ * The arguments.
+ *
+ * @param first
+ * The first argument to include.
+ *
+ * @param buffer
+ * The buffer to write the result to.
+ *
+ * @param size
+ * The size of the buffer. The result is truncated to fit.
+ *
+ * @return
+ * The length of the result.
+ */
+int terminal_arg_join(int argc, const char **argv, int first,
+		char *buffer, int size) {
+	int len = 0;
+
+	if (size <= 0) {
+		return 0;
+	}
+
+	buffer[0] = '\0';
+
+	for (int i = first;i < argc;i++) {
+		int res = snprintf(buffer + len, size - len, "%s%s",
+				i == first ? "" : " ", argv[i]);
+
+		if (res < 0) {
+			break;
+		}
+
+		len += res;
+		if (len >= size - 1) {
+			len = size - 1;
+			break;
 		}
-		radar_cmd(buffer);
-	} else if (strcmp(argv[0], "radar_reset") == 0) {
-		commands_printf("Resetting radar...");
-		radar_reset_setup();
 	}
-#endif
-#endif
 
-	else if (strcmp(argv[0], "reset_att") == 0) {
-		pos_reset_attitude();
-	} else if (strcmp(argv[0], "reset_enu") == 0) {
-		pos_reset_enu_ref();
-	} else if (strcmp(argv[0], "cc1120_state") == 0) {
-		commands_printf("%s\n", cc1120_state_name());
-	} else if (strcmp(argv[0], "cc1120_update_rf") == 0) {
-		if (argc != 2) {
-			commands_printf("Invalid number of arguments\n");
+	return len;
+}
+
+/**
+ * Binary search in the sorted command table.
+ *
+ * @param command
+ * The command to look for.
+ *
+ * @param found
+ * Set to true if the command is registered.
+ *
+ * @return
+ * The index of the command, or where it should be inserted if it is not
+ * registered.
+ */
+static int find_command(const char *command, bool *found) {
+	int low = 0;
+	int high = callback_num;
+
+	while (low < high) {
+		int mid = (low + high) / 2;
+		int res = strcmp(callbacks[mid].command, command);
+
+		if (res == 0) {
+			*found = true;
+			return mid;
+		} else if (res < 0) {
+			low = mid + 1;
 		} else {
-			int set = -1;
-			sscanf(argv[1], "%d", &set);
-
-			if (set < 0) {
-				commands_printf("Invalid argument\n");
-			} else {
-				cc1120_update_rf(set);
-				commands_printf("Done\n");
-			}
+			high = mid;
 		}
-	} else if (strcmp(argv[0], "dw_range") == 0) {
-		if (argc != 2) {
-			commands_printf("Invalid number of arguments\n");
+	}
+
+	*found = false;
+	return low;
+}
+
+static void cmd_help(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
+
+	commands_printf("Valid commands are:");
+
+	for (int i = 0;i < callback_num;i++) {
+		if (callbacks[i].arg_names) {
+			commands_printf("%s %s", callbacks[i].command, callbacks[i].arg_names);
 		} else {
-			int dest = -1;
-			sscanf(argv[1], "%d", &dest);
-
-			if (dest < 0 || dest > 254) {
-				commands_printf("Invalid argument\n");
-			} else {
-				comm_can_set_range_func(range_callback);
-				comm_can_dw_range(CAN_DW_ID_ANY, dest, 5);
-			}
+			commands_printf(callbacks[i].command);
+		}
+
+		if (callbacks[i].help) {
+			commands_printf("  %s", callbacks[i].help);
+		} else {
+			commands_printf("  There is no help available for this command.");
 		}
 	}
 
-	// The help command
-	else if (strcmp(argv[0], "help") == 0) {
-		commands_printf("Valid commands are:");
-		commands_printf("help");
-		commands_printf("  Show this help");
+	commands_printf(" ");
+}
+
+static void cmd_ping(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
+	commands_printf("pong\n");
+}
 
-		commands_printf("ping");
-		commands_printf("  Print pong here to see if the reply works");
+static void cmd_mem(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
 
-		commands_printf("mem");
-		commands_printf("  Show memory usage");
+	size_t n, size;
+	n = chHeapStatus(NULL, &size);
+	commands_printf("core free memory : %u bytes", chCoreGetStatusX());
+	commands_printf("heap fragments   : %u", n);
+	commands_printf("heap free total  : %u bytes\n", size);
+}
 
-		commands_printf("threads");
-		commands_printf("  List all threads");
+static void cmd_threads(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
+
+	thread_t *tp;
+	static const char *states[] = {CH_STATE_NAMES};
+	commands_printf("    addr    stack prio refs     state           name time    ");
+	commands_printf("-------------------------------------------------------------");
+	tp = chRegFirstThread();
+	do {
+		commands_printf("%.8lx %.8lx %4lu %4lu %9s %14s %lu",
+				(uint32_t)tp, (uint32_t)tp->p_ctx.r13,
+				(uint32_t)tp->p_prio, (uint32_t)(tp->p_refs - 1),
+				states[tp->p_state], tp->p_name, (uint32_t)tp->p_time);
+		tp = chRegNextThread(tp);
+	} while (tp != NULL);
+	commands_printf(" ");
+}
 
 #if MAIN_MODE == MAIN_MODE_CAR
-		commands_printf("vesc");
-		commands_printf("  Forward command to VESC");
+static void cmd_vesc(int argc, const char **argv) {
+	static char buffer[256];
+	buffer[0] = '\0';
+
+	// The VESC expects the arguments with a leading space each
+	if (argc > 1) {
+		buffer[0] = ' ';
+		terminal_arg_join(argc, argv, 1, buffer + 1, sizeof(buffer) - 1);
+	}
+
+	bldc_interface_terminal_cmd(buffer);
+}
 
 #if RADAR_EN
-		commands_printf("radar_sample");
-		commands_printf("  Start radar sampling");
+static void cmd_radar_sample(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
+	commands_printf("Sampling radar...");
+	radar_setup_measurement_default();
+	radar_sample();
+}
 
-		commands_printf("radar_cmd");
-		commands_printf("  Forward command to radar");
+static void cmd_radar_cmd(int argc, const char **argv) {
+	static char buffer[256];
+	terminal_arg_join(argc, argv, 1, buffer, sizeof(buffer));
+	radar_cmd(buffer);
+}
 
-		commands_printf("radar_reset");
-		commands_printf("  Reset and setup the radar");
+static void cmd_radar_reset(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
+	commands_printf("Resetting radar...");
+	radar_reset_setup();
+}
 #endif
 #endif
 
-		commands_printf("reset_att");
-		commands_printf("  Re-initialize the attitude estimation");
-
-		commands_printf("reset_enu");
-		commands_printf("  Re-initialize the ENU reference on the next GNSS sample");
-
-		commands_printf("cc1120_state");
-		commands_printf("  Print the state of the CC1120");
-
-		commands_printf("cc1120_update_rf [rf_setting]");
-		commands_printf("  Set one of the cc1120 RF settings");
-		int ind = 0;
-		commands_printf("  %d: %s", ind++, "CC1120_SET_434_0M_1_2K_2FSK_BW25K_4K");
-		commands_printf("  %d: %s", ind++, "CC1120_SET_434_0M_1_2K_2FSK_BW50K_20K");
-		commands_printf("  %d: %s", ind++, "CC1120_SET_434_0M_1_2K_2FSK_BW10K_4K");
-		commands_printf("  %d: %s", ind++, "CC1120_SET_434_0M_50K_2GFSK_BW100K_25K");
-		commands_printf("  %d: %s", ind++, "CC1120_SET_434_0M_100K_4FSK_BW100K_25K");
-		commands_printf("  %d: %s", ind++, "CC1120_SET_434_0M_4_8K_2FSK_BW40K_9K");
-		commands_printf("  %d: %s", ind++, "CC1120_SET_434_0M_4_8K_2FSK_BW50K_14K");
-		commands_printf("  %d: %s", ind++, "CC1120_SET_434_0M_4_8K_2FSK_BW100K_39K");
-		commands_printf("  %d: %s", ind++, "CC1120_SET_434_0M_9_6K_2FSK_BW50K_12K");
-		commands_printf("  %d: %s", ind++, "CC1120_SET_452_0M_9_6K_2GFSK_BW33K_2_4K");
-		commands_printf("  %d: %s", ind++, "CC1120_SET_452_0M_9_6K_2GFSK_BW50K_2_4K");
-
-		commands_printf("dw_range [dest]");
-		commands_printf("  Measure the distance to DW module [dest] with ultra wideband.");
-
-		for (int i = 0;i < callback_write;i++) {
-			if (callbacks[i].arg_names) {
-				commands_printf("%s %s", callbacks[i].command, callbacks[i].arg_names);
-			} else {
-				commands_printf(callbacks[i].command);
-			}
-
-			if (callbacks[i].help) {
-				commands_printf("  %s", callbacks[i].help);
-			} else {
-				commands_printf("  There is no help available for this command.");
-			}
-		}
+static void cmd_reset_att(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
+	pos_reset_attitude();
+}
+
+static void cmd_reset_enu(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
+	pos_reset_enu_ref();
+}
+
+static void cmd_cc1120_state(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
+	commands_printf("%s\n", cc1120_state_name());
+}
 
-		commands_printf(" ");
+static void cmd_cc1120_update_rf(int argc, const char **argv) {
+	int set = -1;
+
+	if (argc != 2) {
+		commands_printf("Invalid number of arguments\n");
+	} else if (!terminal_arg_int(argc, argv, 1, 0, 255, &set)) {
+		commands_printf("Invalid argument\n");
 	} else {
-		bool found = false;
-		for (int i = 0;i < callback_write;i++) {
-			if (strcmp(argv[0], callbacks[i].command) == 0) {
-				callbacks[i].cbf(argc, (const char**)argv);
-				found = true;
-				break;
-			}
-		}
+		cc1120_update_rf(set);
+		commands_printf("Done\n");
+	}
+}
 
-		if (!found) {
-			commands_printf("Invalid command: %s\n"
-					"type help to list all available commands\n", argv[0]);
-		}
+static void cmd_dw_range(int argc, const char **argv) {
+	int dest = -1;
+
+	if (argc != 2) {
+		commands_printf("Invalid number of arguments\n");
+	} else if (!terminal_arg_int(argc, argv, 1, 0, 254, &dest)) {
+		commands_printf("Invalid argument\n");
+	} else {
+		comm_can_set_range_func(range_callback);
+		comm_can_dw_range(CAN_DW_ID_ANY, dest, 5);
+	}
+}
+
+static void cmd_enu_test(int argc, const char **argv) {
+	int points = 100;
+
+	if (argc == 2 && !terminal_arg_int(argc, argv, 1, 1, 10000, &points)) {
+		commands_printf("Invalid argument\n");
+	} else {
+		enu_test(points);
 	}
 }
 
+static void cmd_conf_stats(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
+	conf_general_print_stats();
+}
+
+static void range_callback(uint8_t id, uint8_t dest, float range) {
+	commands_printf("Distance between %d (connected over CAN) and %d: %.1f cm\n", id, dest, (double)range * D(100.0));
+}
+
 /**
- * Register a custom command  callback to the terminal. If the command
- * is already registered the old command callback will be replaced.
- *
- * @param command
- * The command name.
+ * Convert points around the ENU reference back and forth to measure how
+ * long the conversions take and how large the round-trip error is.
  *
- * @param help
- * A help text for the command. Can be NULL.
- *
- * @param arg_names
- * The argument names for the command, e.g. [arg_a] [arg_b]
- * Can be NULL.
- *
- * @param cbf
- * The callback function for the command.
+ * @param points
+ * The number of points to convert.
  */
-void terminal_register_command_callback(
-		const char* command,
-		const char *help,
-		const char *arg_names,
-		void(*cbf)(int argc, const char **argv)) {
+static void enu_test(int points) {
+	double i_llh[3];
+	pos_get_enu_ref(i_llh);
 
-	int callback_num = callback_write;
+	ENU_FRAME frame;
+	utils_enu_frame_init(&frame, i_llh[0], i_llh[1], i_llh[2]);
 
-	for (int i = 0;i < callback_write;i++) {
-		// First check the address in case the same callback is registered more than once.
-		if (callbacks[i].command == command) {
-			callback_num = i;
-			break;
-		}
+	double err_max = 0.0;
 
-		// Check by string comparison.
-		if (strcmp(callbacks[i].command, command) == 0) {
-			callback_num = i;
-			break;
+	// The system timer resolution is low, so measure the whole loops.
+	systime_t t_start = chVTGetSystemTimeX();
+
+	for (int i = 0;i < points;i++) {
+		double xyz[3], llh[3], xyz2[3];
+		enu_test_point(i, points, xyz);
+		utils_enu_frame_enu_to_llh(&frame, xyz, llh);
+		utils_enu_frame_llh_to_enu(&frame, llh, xyz2);
+
+		double err = sqrt(SQ(xyz2[0] - xyz[0]) + SQ(xyz2[1] - xyz[1]) + SQ(xyz2[2] - xyz[2]));
+		if (err > err_max) {
+			err_max = err;
 		}
 	}
 
-	callbacks[callback_num].command = command;
-	callbacks[callback_num].help = help;
-	callbacks[callback_num].arg_names = arg_names;
-	callbacks[callback_num].cbf = cbf;
+	systime_t t_frame = chVTTimeElapsedSinceX(t_start);
+	t_start = chVTGetSystemTimeX();
 
-	if (callback_num == callback_write) {
-		callback_write++;
-		if (callback_write >= CALLBACK_LEN) {
-			callback_write = 0;
-		}
+	for (int i = 0;i < points;i++) {
+		double xyz[3], llh[3], xyz2[3];
+		enu_test_point(i, points, xyz);
+		utils_enu_to_llh(i_llh, xyz, llh);
+		utils_llh_to_enu(i_llh, llh, xyz2);
 	}
+
+	systime_t t_noframe = chVTTimeElapsedSinceX(t_start);
+
+	commands_printf(
+			"Points:                    %d\n"
+			"Round trip with frame:     %.2f us/point\n"
+			"Round trip without frame:  %.2f us/point\n"
+			"Max round trip error:      %.3f mm\n",
+			points,
+			(double)t_frame * D(1e6) / (double)CH_CFG_ST_FREQUENCY / (double)points,
+			(double)t_noframe * D(1e6) / (double)CH_CFG_ST_FREQUENCY / (double)points,
+			err_max * D(1000.0));
 }
 
-static void range_callback(uint8_t id, uint8_t dest, float range) {
-	commands_printf("Distance between %d (connected over CAN) and %d: %.1f cm\n", id, dest, (double)range * D(100.0));
+static void enu_test_point(int ind, int points, double *xyz) {
+	// Spiral out to 1 km from the reference
+	double ang = (double)ind * D(0.1);
+	double rad = D(1000.0) * (double)ind / (double)points;
+	xyz[0] = rad * cos(ang);
+	xyz[1] = rad * sin(ang);
+	xyz[2] = D(10.0) * sin(ang);
 }
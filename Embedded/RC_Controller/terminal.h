@@ -21,11 +21,18 @@
 #include "datatypes.h"
 
 // Functions
-void terminal_process_string(char *str);
+void terminal_init(void);
+bool terminal_process_string(char *str);
 void terminal_register_command_callback(
 		const char* command,
 		const char *help,
 		const char *arg_names,
 		void(*cbf)(int argc, const char **argv));
+bool terminal_arg_int(int argc, const char **argv, int ind,
+		int min, int max, int *res);
+bool terminal_arg_float(int argc, const char **argv, int ind,
+		float min, float max, float *res);
+int terminal_arg_join(int argc, const char **argv, int first,
+		char *buffer, int size);
 
 #endif /* TERMINAL_H_ */
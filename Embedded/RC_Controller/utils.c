@@ -743,38 +743,127 @@ void utils_create_enu_matrix(double lat, double lon, double *enuMat) {
 }
 
 void utils_llh_to_enu(const double *iLlh, const double *llh, double *xyz) {
-	double ix, iy, iz;
-	utils_llh_to_xyz(iLlh[0], iLlh[1], iLlh[2], &ix, &iy, &iz);
+	ENU_FRAME frame;
+	utils_enu_frame_init(&frame, iLlh[0], iLlh[1], iLlh[2]);
+	utils_enu_frame_llh_to_enu(&frame, llh, xyz);
+}
 
-	double x, y, z;
-	utils_llh_to_xyz(llh[0], llh[1], llh[2], &x, &y, &z);
+void utils_enu_to_llh(const double *iLlh, const double *xyz, double *llh) {
+	ENU_FRAME frame;
+	utils_enu_frame_init(&frame, iLlh[0], iLlh[1], iLlh[2]);
+	utils_enu_frame_enu_to_llh(&frame, xyz, llh);
+}
 
-	double enuMat[9];
-	utils_create_enu_matrix(iLlh[0], iLlh[1], enuMat);
+/**
+ * Set up an ENU frame. The reference position in ECEF and the rotation
+ * matrix are calculated once here, so that converting points with the
+ * frame does not have to redo it for every point.
+ *
+ * @param frame
+ * The frame to set up.
+ *
+ * @param lat
+ * Reference latitude.
+ *
+ * @param lon
+ * Reference longitude.
+ *
+ * @param height
+ * Reference height.
+ */
+void utils_enu_frame_init(ENU_FRAME *frame, double lat, double lon, double height) {
+	frame->lat = lat;
+	frame->lon = lon;
+	frame->height = height;
+	utils_llh_to_xyz(lat, lon, height, &frame->ix, &frame->iy, &frame->iz);
+	utils_create_enu_matrix(lat, lon, frame->r);
+}
 
-	double dx = x - ix;
-	double dy = y - iy;
-	double dz = z - iz;
+/**
+ * Convert an ECEF position to the ENU frame.
+ *
+ * @param frame
+ * The ENU frame.
+ *
+ * @param x
+ * ECEF X
+ *
+ * @param y
+ * ECEF Y
+ *
+ * @param z
+ * ECEF Z
+ *
+ * @param enu
+ * Array to store east, north and up in.
+ */
+void utils_enu_frame_xyz_to_enu(const ENU_FRAME *frame, double x, double y, double z, double *enu) {
+	double dx = x - frame->ix;
+	double dy = y - frame->iy;
+	double dz = z - frame->iz;
 
-	xyz[0] = enuMat[0] * dx + enuMat[1] * dy + enuMat[2] * dz;
-	xyz[1] = enuMat[3] * dx + enuMat[4] * dy + enuMat[5] * dz;
-	xyz[2] = enuMat[6] * dx + enuMat[7] * dy + enuMat[8] * dz;
+	enu[0] = frame->r[0] * dx + frame->r[1] * dy + frame->r[2] * dz;
+	enu[1] = frame->r[3] * dx + frame->r[4] * dy + frame->r[5] * dz;
+	enu[2] = frame->r[6] * dx + frame->r[7] * dy + frame->r[8] * dz;
 }
 
-void utils_enu_to_llh(const double *iLlh, const double *xyz, double *llh) {
-	double ix, iy, iz;
-	utils_llh_to_xyz(iLlh[0], iLlh[1], iLlh[2], &ix, &iy, &iz);
-
-	double enuMat[9];
-	utils_create_enu_matrix(iLlh[0], iLlh[1], enuMat);
+void utils_enu_frame_llh_to_enu(const ENU_FRAME *frame, const double *llh, double *xyz) {
+	double x, y, z;
+	utils_llh_to_xyz(llh[0], llh[1], llh[2], &x, &y, &z);
+	utils_enu_frame_xyz_to_enu(frame, x, y, z, xyz);
+}
 
-	double x = enuMat[0] * xyz[0] + enuMat[3] * xyz[1] + enuMat[6] * xyz[2] + ix;
-	double y = enuMat[1] * xyz[0] + enuMat[4] * xyz[1] + enuMat[7] * xyz[2] + iy;
-	double z = enuMat[2] * xyz[0] + enuMat[5] * xyz[1] + enuMat[8] * xyz[2] + iz;
+void utils_enu_frame_enu_to_llh(const ENU_FRAME *frame, const double *xyz, double *llh) {
+	const double *r = frame->r;
+	double x = r[0] * xyz[0] + r[3] * xyz[1] + r[6] * xyz[2] + frame->ix;
+	double y = r[1] * xyz[0] + r[4] * xyz[1] + r[7] * xyz[2] + frame->iy;
+	double z = r[2] * xyz[0] + r[5] * xyz[1] + r[8] * xyz[2] + frame->iz;
 
 	utils_xyz_to_llh(x, y, z, &llh[0], &llh[1], &llh[2]);
 }
 
+/**
+ * Convert an array of points from llh to the ENU frame.
+ *
+ * @param frame
+ * The ENU frame.
+ *
+ * @param llh
+ * Input array with 3 * points elements.
+ *
+ * @param xyz
+ * Output array with 3 * points elements.
+ *
+ * @param points
+ * The number of points to convert.
+ */
+void utils_enu_frame_llh_to_enu_batch(const ENU_FRAME *frame, const double *llh, double *xyz, int points) {
+	for (int i = 0;i < points;i++) {
+		utils_enu_frame_llh_to_enu(frame, llh + 3 * i, xyz + 3 * i);
+	}
+}
+
+/**
+ * Convert an array of points from the ENU frame to llh.
+ *
+ * @param frame
+ * The ENU frame.
+ *
+ * @param xyz
+ * Input array with 3 * points elements.
+ *
+ * @param llh
+ * Output array with 3 * points elements.
+ *
+ * @param points
+ * The number of points to convert.
+ */
+void utils_enu_frame_enu_to_llh_batch(const ENU_FRAME *frame, const double *xyz, double *llh, int points) {
+	for (int i = 0;i < points;i++) {
+		utils_enu_frame_enu_to_llh(frame, xyz + 3 * i, llh + 3 * i);
+	}
+}
+
 /**
  * Create string representation of the binary content of a byte
  *
@@ -54,6 +54,12 @@ void utils_xyz_to_llh(double x, double y, double z, double *lat, double *lon, do
 void utils_create_enu_matrix(double lat, double lon, double *enuMat);
 void utils_llh_to_enu(const double *iLlh, const double *llh, double *xyz);
 void utils_enu_to_llh(const double *iLlh, const double *xyz, double *llh);
+void utils_enu_frame_init(ENU_FRAME *frame, double lat, double lon, double height);
+void utils_enu_frame_xyz_to_enu(const ENU_FRAME *frame, double x, double y, double z, double *enu);
+void utils_enu_frame_llh_to_enu(const ENU_FRAME *frame, const double *llh, double *xyz);
+void utils_enu_frame_enu_to_llh(const ENU_FRAME *frame, const double *xyz, double *llh);
+void utils_enu_frame_llh_to_enu_batch(const ENU_FRAME *frame, const double *llh, double *xyz, int points);
+void utils_enu_frame_enu_to_llh_batch(const ENU_FRAME *frame, const double *xyz, double *llh, int points);
 void utils_byte_to_binary(int x, char *b);
 bool utils_time_before(int32_t t1, int32_t t2);
 void utils_ms_to_hhmmss(int ms, int *hh, int *mm, int *ss);
@@ -93,12 +93,18 @@ void MainWindow::udpReadReady()
 
 void MainWindow::on_sendButton_clicked()
 {
+    QByteArray msg = ui->outgoingEdit->toPlainText().toUtf8();
+    int repeat = ui->sendRepeatBox->value();
+
     if (ui->tcpButton->isChecked()) {
-        mTcpSocket->write(ui->outgoingEdit->toPlainText().toUtf8());
+        // Write all repetitions at once so that the server sees them
+        // back-to-back in as few reads as possible.
+        mTcpSocket->write(msg.repeated(repeat));
     } else if (ui->udpButton->isChecked()) {
-
-        mUdpSocket->writeDatagram(ui->outgoingEdit->toPlainText().toUtf8(),
-                                  QHostAddress(ui->serverEdit->text()), ui->portBox->value());
+        for (int i = 0;i < repeat;i++) {
+            mUdpSocket->writeDatagram(msg, QHostAddress(ui->serverEdit->text()),
+                                      ui->portBox->value());
+        }
     } else {
         QMessageBox::warning(this, "Send Error",
         "You are not connected.");
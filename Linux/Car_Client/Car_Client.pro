@@ -23,8 +23,15 @@ SOURCES += main.cpp \
     nmeaserver.cpp \
     packet.cpp \
     tcpserversimple.cpp \
+    tcppacketserver.cpp \
+    eventloop.cpp \
+    packetlog.cpp \
+    headlessclient.cpp \
+    carbenchmark.cpp \
+    tcpbroadcasttest.cpp \
     chronos.cpp \
-    vbytearray.cpp
+    vbytearray.cpp \
+    enuframe.cpp
 
 HEADERS += \
     packetinterface.h \
@@ -39,6 +46,13 @@ HEADERS += \
     nmeaserver.h \
     packet.h \
     tcpserversimple.h \
+    tcppacketserver.h \
+    eventloop.h \
+    packetlog.h \
+    headlessclient.h \
+    carbenchmark.h \
+    tcpbroadcasttest.h \
     chronos.h \
-    vbytearray.h
+    vbytearray.h \
+    enuframe.h
 
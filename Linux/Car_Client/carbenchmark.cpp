@@ -0,0 +1,308 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "carbenchmark.h"
+#include "carclient.h"
+#include "headlessclient.h"
+#include "packet.h"
+#include "datatypes.h"
+#include <QDebug>
+#include <QEventLoop>
+#include <QSocketNotifier>
+#include <thread>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <arpa/inet.h>
+#include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+namespace {
+int64_t clockNs(clockid_t clock)
+{
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void stopHeadless(void *arg, uint32_t events)
+{
+    (void)events;
+    ((HeadlessClient*)arg)->stop();
+}
+}
+
+/**
+ * @brief CarBenchmark::run
+ * Run the benchmark with both clients and print the results.
+ *
+ * @param seconds
+ * Duration of the load for each client.
+ *
+ * @param udpPort
+ * UDP port of the clients. The load receives on udpPort + 1.
+ *
+ * @return
+ * true if both runs completed.
+ */
+bool CarBenchmark::run(int seconds, int udpPort)
+{
+    int masterFd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (masterFd < 0 || grantpt(masterFd) < 0 || unlockpt(masterFd) < 0) {
+        qCritical() << "Creating pseudo terminal failed";
+        return false;
+    }
+
+    termios options;
+    tcgetattr(masterFd, &options);
+    cfmakeraw(&options);
+    tcsetattr(masterFd, TCSANOW, &options);
+
+    QByteArray tty = QByteArray(ptsname(masterFd));
+    qDebug() << "Benchmark:" << RATE_HZ << "packets/s of" << PACKET_LEN
+             << "bytes for" << seconds << "s through" << tty;
+
+    // Both sides always run, so that a failure on one side does not hide
+    // the result of the other.
+    Result resQt, resHeadless;
+    bool okQt = runQt(tty.constData(), masterFd, udpPort, seconds, &resQt);
+    bool okHeadless = runHeadless(tty.constData(), masterFd, udpPort, seconds, &resHeadless);
+
+    close(masterFd);
+
+    if (okQt) {
+        print("Qt      ", resQt);
+    } else {
+        qCritical() << "Qt run failed";
+    }
+
+    if (okHeadless) {
+        print("Headless", resHeadless);
+    } else {
+        qCritical() << "Headless run failed";
+    }
+
+    return okQt && okHeadless;
+}
+
+bool CarBenchmark::runQt(const char *tty, int masterFd, int udpPort, int seconds, CarBenchmark::Result *res)
+{
+    int doneFd = eventfd(0, EFD_CLOEXEC);
+    CarClient car;
+    car.connectSerial(tty, 115200);
+    car.startUdpServer(udpPort);
+
+    QEventLoop loop;
+    QSocketNotifier notifier(doneFd, QSocketNotifier::Read);
+    QObject::connect(&notifier, SIGNAL(activated(int)), &loop, SLOT(quit()));
+
+    tcflush(masterFd, TCIOFLUSH);
+    std::thread t(load, masterFd, udpPort, seconds, doneFd, res);
+    loop.exec();
+    t.join();
+    close(doneFd);
+
+    return res->sent > 0;
+}
+
+bool CarBenchmark::runHeadless(const char *tty, int masterFd, int udpPort, int seconds, CarBenchmark::Result *res)
+{
+    int doneFd = eventfd(0, EFD_CLOEXEC);
+    HeadlessClient h;
+
+    if (!h.openSerial(tty) || !h.startUdpServer(udpPort)) {
+        close(doneFd);
+        return false;
+    }
+
+    h.loop()->addFd(doneFd, EPOLLIN, stopHeadless, &h);
+
+    tcflush(masterFd, TCIOFLUSH);
+    std::thread t(load, masterFd, udpPort, seconds, doneFd, res);
+    h.run();
+    t.join();
+    h.loop()->removeFd(doneFd);
+    close(doneFd);
+
+    return res->sent > 0;
+}
+
+/**
+ * @brief CarBenchmark::load
+ * Send packets from the car side of the pseudo terminal and receive them on
+ * UDP until the client has delivered one, then measure for the duration.
+ * Writes doneFd when finished.
+ */
+void CarBenchmark::load(int masterFd, int udpPort, int seconds, int doneFd, CarBenchmark::Result *res)
+{
+    memset(res, 0, sizeof(Result));
+
+    int sinkFd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(udpPort + 1);
+    bind(sinkFd, (sockaddr*)&addr, sizeof(addr));
+    addr.sin_port = htons(udpPort);
+
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    itimerspec ts;
+    ts.it_value.tv_sec = 0;
+    ts.it_value.tv_nsec = 1000000000 / RATE_HZ;
+    ts.it_interval = ts.it_value;
+    timerfd_settime(timerFd, 0, &ts, 0);
+
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    int fds[] = {timerFd, sinkFd, masterFd};
+    for (int fd: fds) {
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    uint8_t payload[PACKET_LEN];
+    memset(payload, 0, sizeof(payload));
+    payload[0] = 0;
+    payload[1] = CMD_VESC_FWD;
+
+    uint8_t frame[PACKET_LEN + 6];
+    uint8_t buffer[4096];
+    uint32_t seq = 0;
+    uint32_t seqFirst = 0;
+    bool measuring = false;
+    int64_t start = clockNs(CLOCK_MONOTONIC);
+    int64_t end = start + 10000000000LL;
+    int64_t helloLast = 0;
+    int64_t cpuProcStart = 0, cpuThreadStart = 0;
+    double latencySum = 0.0;
+
+    for (;;) {
+        int64_t now = clockNs(CLOCK_MONOTONIC);
+
+        if (now > end) {
+            break;
+        }
+
+        // The client sends to the last UDP peer it has heard from
+        if (!measuring && (now - helloLast) > 50000000LL) {
+            helloLast = now;
+            uint8_t hello[2] = {0, CMD_GET_STATE};
+            sendto(sinkFd, hello, sizeof(hello), 0, (sockaddr*)&addr, sizeof(addr));
+        }
+
+        epoll_event events[4];
+        int n = epoll_wait(epollFd, events, 4, 10);
+
+        for (int i = 0;i < n;i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == timerFd) {
+                uint64_t exp = 0;
+                if (read(timerFd, &exp, sizeof(exp)) != sizeof(exp)) {
+                    continue;
+                }
+
+                for (uint64_t j = 0;j < exp;j++) {
+                    int64_t t = clockNs(CLOCK_MONOTONIC);
+                    memcpy(payload + 2, &seq, sizeof(seq));
+                    memcpy(payload + 6, &t, sizeof(t));
+                    seq++;
+
+                    unsigned short crc = Packet::crc16(payload, PACKET_LEN);
+                    frame[0] = 2;
+                    frame[1] = PACKET_LEN;
+                    memcpy(frame + 2, payload, PACKET_LEN);
+                    frame[PACKET_LEN + 2] = crc >> 8;
+                    frame[PACKET_LEN + 3] = crc & 0xFF;
+                    frame[PACKET_LEN + 4] = 3;
+
+                    if (write(masterFd, frame, PACKET_LEN + 5) == PACKET_LEN + 5 && measuring &&
+                            now < (end - 200000000LL)) {
+                        res->sent++;
+                    }
+                }
+            } else if (fd == sinkFd) {
+                int len;
+                while ((len = recv(sinkFd, buffer, sizeof(buffer), 0)) > 0) {
+                    if (len != PACKET_LEN) {
+                        continue;
+                    }
+
+                    uint32_t s;
+                    int64_t t;
+                    memcpy(&s, buffer + 2, sizeof(s));
+                    memcpy(&t, buffer + 6, sizeof(t));
+
+                    if (!measuring) {
+                        // Start with the next packet
+                        measuring = true;
+                        seqFirst = seq;
+                        end = clockNs(CLOCK_MONOTONIC) + (int64_t)seconds * 1000000000LL + 200000000LL;
+                        cpuProcStart = clockNs(CLOCK_PROCESS_CPUTIME_ID);
+                        cpuThreadStart = clockNs(CLOCK_THREAD_CPUTIME_ID);
+                    } else if (s >= seqFirst && (int)(s - seqFirst) < res->sent) {
+                        double lat = (double)(clockNs(CLOCK_MONOTONIC) - t) / 1000.0;
+                        latencySum += lat;
+                        if (lat > res->latencyMaxUs) {
+                            res->latencyMaxUs = lat;
+                        }
+                        res->received++;
+                    }
+                }
+            } else {
+                // Packets from the client to the car
+                while (read(masterFd, buffer, sizeof(buffer)) > 0) {
+                }
+            }
+        }
+    }
+
+    if (measuring) {
+        // The last 200 ms are only for the packets in flight
+        double wall = (double)seconds;
+        double cpu = (double)((clockNs(CLOCK_PROCESS_CPUTIME_ID) - cpuProcStart) -
+                              (clockNs(CLOCK_THREAD_CPUTIME_ID) - cpuThreadStart)) / 1e9;
+        res->cpuPercent = cpu / (wall + 0.2) * 100.0;
+        res->cpuPerPacketUs = res->received > 0 ? cpu * 1e6 / (double)res->received : 0.0;
+        res->latencyAvgUs = res->received > 0 ? latencySum / (double)res->received : 0.0;
+    }
+
+    close(epollFd);
+    close(timerFd);
+    close(sinkFd);
+
+    uint64_t one = 1;
+    if (write(doneFd, &one, sizeof(one)) != sizeof(one)) {
+        qWarning() << "Could not stop the benchmark";
+    }
+}
+
+void CarBenchmark::print(const char *name, const CarBenchmark::Result &res)
+{
+    qDebug().nospace() << name << ": delivered " << res.received << " / " << res.sent
+                       << ", CPU " << QString::number(res.cpuPercent, 'f', 1) << " % ("
+                       << QString::number(res.cpuPerPacketUs, 'f', 1) << " us/packet)"
+                       << ", latency avg " << QString::number(res.latencyAvgUs, 'f', 0)
+                       << " us, max " << QString::number(res.latencyMaxUs, 'f', 0) << " us";
+}
@@ -0,0 +1,55 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef CARBENCHMARK_H
+#define CARBENCHMARK_H
+
+/**
+ * @brief The CarBenchmark class
+ *
+ * Compares the Qt based CarClient with HeadlessClient under a synthetic
+ * load. A pseudo terminal stands in for the car, which sends 1000 packets
+ * per second, and the packets are routed to a UDP peer. The load runs in
+ * its own thread and measures the delivered packets and their latency,
+ * and the CPU time of the rest of the process is that of the router.
+ */
+class CarBenchmark
+{
+public:
+    typedef struct {
+        int sent;
+        int received;
+        double latencyAvgUs;
+        double latencyMaxUs;
+        double cpuPercent;
+        double cpuPerPacketUs;
+    } Result;
+
+    static const int RATE_HZ = 1000;
+    static const int PACKET_LEN = 64;
+
+    static bool run(int seconds, int udpPort = 18300);
+
+private:
+    static bool runQt(const char *tty, int masterFd, int udpPort, int seconds, Result *res);
+    static bool runHeadless(const char *tty, int masterFd, int udpPort, int seconds, Result *res);
+    static void load(int masterFd, int udpPort, int seconds, int doneFd, Result *res);
+    static void print(const char *name, const Result &res);
+
+};
+
+#endif // CARBENCHMARK_H
@@ -52,14 +52,16 @@ CarClient::CarClient(QObject *parent) : QObject(parent)
     mUbxBroadcaster = new TcpBroadcast(this);
     mUblox = new Ublox(this);
     mTcpSocket = new QTcpSocket(this);
-    mTcpServer = new TcpServerSimple(this);
+    mTcpServer = new TcpPacketServer(this);
     mCarId = 255;
     mReconnectTimer = new QTimer(this);
     mReconnectTimer->start(2000);
     mTcpConnected = false;
     mLogFlushTimer = new QTimer(this);
     mLogFlushTimer->start(2000);
+    mTcpStatsTimer = new QTimer(this);
     mRtklibRunning = false;
+    mPacketLog = new PacketLog(this);
 
     mHostAddress = QHostAddress("0.0.0.0");
     mUdpPort = 0;
@@ -69,8 +71,6 @@ CarClient::CarClient(QObject *parent) : QObject(parent)
     rtcm3_init_state(&rtcmState);
     rtcm3_set_rx_callback(rtcm_rx, &rtcmState);
 
-    mTcpServer->setUsePacket(true);
-
     connect(mSerialPort, SIGNAL(serial_data_available()),
             this, SLOT(serialDataAvailable()));
     connect(mSerialPort, SIGNAL(serial_port_error(int)),
@@ -96,19 +96,22 @@ CarClient::CarClient(QObject *parent) : QObject(parent)
             this, SLOT(logLineUsbReceived(quint8,QString)));
     connect(mLogFlushTimer, SIGNAL(timeout()),
             this, SLOT(logFlushTimerSlot()));
+    connect(mTcpStatsTimer, SIGNAL(timeout()),
+            this, SLOT(tcpStatsTimerSlot()));
     connect(mPacketInterface, SIGNAL(systemTimeReceived(quint8,qint32,qint32)),
             this, SLOT(systemTimeReceived(quint8,qint32,qint32)));
     connect(mPacketInterface, SIGNAL(rebootSystemReceived(quint8,bool)),
             this, SLOT(rebootSystemReceived(quint8,bool)));
     connect(mUblox, SIGNAL(ubxRx(QByteArray)), this, SLOT(ubxRx(QByteArray)));
     connect(mUblox, SIGNAL(rxRawx(ubx_rxm_rawx)), this, SLOT(rxRawx(ubx_rxm_rawx)));
-    connect(mTcpServer->packet(), SIGNAL(packetReceived(QByteArray&)),
+    connect(mTcpServer, SIGNAL(packetReceived(QByteArray&)),
             this, SLOT(tcpRx(QByteArray&)));
 }
 
 CarClient::~CarClient()
 {
     logStop();
+    mPacketLog->stopLog();
 }
 
 void CarClient::connectSerial(QString port, int baudrate)
@@ -222,6 +225,21 @@ void CarClient::logStop()
     }
 }
 
+/**
+ * @brief CarClient::enablePacketLog
+ * Record all packets to and from the car in binary segments.
+ *
+ * @param directory
+ * Directory for the segments.
+ *
+ * @return
+ * true for success, false otherwise.
+ */
+bool CarClient::enablePacketLog(QString directory)
+{
+    return mPacketLog->startLog(directory);
+}
+
 void CarClient::rtcmRx(QByteArray data, int type)
 {
     (void)type;
@@ -349,6 +367,46 @@ quint8 CarClient::carId()
     return mCarId;
 }
 
+/**
+ * @brief CarClient::setTcpSlowClientPolicy
+ * Set what the RTCM and UBX servers do with clients that do not keep up.
+ *
+ * @param policy
+ * Drop data for slow clients, or disconnect them.
+ */
+void CarClient::setTcpSlowClientPolicy(TcpBroadcast::SLOW_CLIENT_POLICY policy)
+{
+    mRtcmBroadcaster->setSlowClientPolicy(policy);
+    mUbxBroadcaster->setSlowClientPolicy(policy);
+}
+
+/**
+ * @brief CarClient::setTcpWatermarks
+ * Set the client backlog limits of the RTCM and UBX servers, see
+ * TcpBroadcast::setWatermarks.
+ */
+void CarClient::setTcpWatermarks(int low, int high)
+{
+    mRtcmBroadcaster->setWatermarks(low, high);
+    mUbxBroadcaster->setWatermarks(low, high);
+}
+
+/**
+ * @brief CarClient::setTcpStatsInterval
+ * Print the client statistics of the RTCM and UBX servers periodically.
+ *
+ * @param seconds
+ * Interval in seconds, 0 disables the printing.
+ */
+void CarClient::setTcpStatsInterval(int seconds)
+{
+    if (seconds > 0) {
+        mTcpStatsTimer->start(seconds * 1000);
+    } else {
+        mTcpStatsTimer->stop();
+    }
+}
+
 void CarClient::serialDataAvailable()
 {
     while (mSerialPort->bytesAvailable() > 0) {
@@ -416,6 +474,14 @@ void CarClient::serialRtcmPortError(QSerialPort::SerialPortError error)
 
 void CarClient::packetDataToSend(QByteArray &data)
 {
+    // Log the payload without the framing
+    if (data.size() > 5 && data.at(0) == 2) {
+        mPacketLog->log(PacketLog::DIR_TO_CAR, data.constData() + 2, (quint8)data.at(1));
+    } else if (data.size() > 6 && data.at(0) == 3) {
+        int len = (quint8)data.at(1) << 8 | (quint8)data.at(2);
+        mPacketLog->log(PacketLog::DIR_TO_CAR, data.constData() + 3, len);
+    }
+
     if (mSerialPort->isOpen()) {
         mSerialPort->writeData(data);
     }
@@ -474,6 +540,29 @@ void CarClient::logFlushTimerSlot()
     }
 }
 
+void CarClient::tcpStatsTimerSlot()
+{
+    TcpBroadcast *servers[] = {mRtcmBroadcaster, mUbxBroadcaster};
+    const char *names[] = {"RTCM", "UBX"};
+
+    for (int i = 0;i < 2;i++) {
+        if (servers[i]->clientsDisconnected() > 0) {
+            qDebug() << names[i] << "slow clients disconnected:"
+                     << servers[i]->clientsDisconnected();
+        }
+
+        for (TcpBroadcast::ClientStats s: servers[i]->getClientStats()) {
+            qDebug().nospace() << names[i] << " " << s.address
+                               << ": sent " << s.bytesSent
+                               << ", dropped " << s.bytesDropped
+                               << ", backlog " << s.backlog
+                               << ", lag " << s.lagMs << " ms, "
+                               << s.bytesPerSec << " B/s"
+                               << (s.dropping ? ", dropping" : "");
+        }
+    }
+}
+
 void CarClient::readPendingDatagrams()
 {
     while (mUdpSocket->hasPendingDatagrams()) {
@@ -491,6 +580,7 @@ void CarClient::readPendingDatagrams()
 void CarClient::carPacketRx(quint8 id, CMD_PACKET cmd, const QByteArray &data)
 {
     mCarId = id;
+    mPacketLog->log(PacketLog::DIR_FROM_CAR, data.constData(), data.size());
 
     if (QString::compare(mHostAddress.toString(), "0.0.0.0") != 0) {
         if (cmd != CMD_LOG_LINE_USB) {
@@ -498,7 +588,7 @@ void CarClient::carPacketRx(quint8 id, CMD_PACKET cmd, const QByteArray &data)
         }
     }
 
-    mTcpServer->packet()->sendPacket(data);
+    mTcpServer->sendPacket(data);
 }
 
 void CarClient::logLineUsbReceived(quint8 id, QString str)
@@ -562,6 +652,8 @@ void CarClient::rxRawx(ubx_rxm_rawx rawx)
     dateGps = dateGps.addDays(rawx.week * 7);
     dateGps = dateGps.addMSecs((rawx.rcv_tow - (double)rawx.leaps) * 1000.0);
 
+    mPacketLog->setGnssTime(dateGps.toMSecsSinceEpoch());
+
     QDateTime date = QDateTime::currentDateTime();
     qint64 diff = dateGps.toMSecsSinceEpoch() - date.toMSecsSinceEpoch();
 
@@ -29,7 +29,8 @@
 #include "tcpbroadcast.h"
 #include "serialport.h"
 #include "ublox.h"
-#include "tcpserversimple.h"
+#include "tcppacketserver.h"
+#include "packetlog.h"
 
 class CarClient : public QObject
 {
@@ -61,11 +62,15 @@ public:
     bool startTcpServer(int port = 8300);
     bool enableLogging(QString directory);
     void logStop();
+    bool enablePacketLog(QString directory);
     void rtcmRx(QByteArray data, int type);
     void restartRtklib();
     PacketInterface* packetInterface();
     bool isRtklibRunning();
     quint8 carId();
+    void setTcpSlowClientPolicy(TcpBroadcast::SLOW_CLIENT_POLICY policy);
+    void setTcpWatermarks(int low, int high);
+    void setTcpStatsInterval(int seconds);
 
 signals:
 
@@ -81,6 +86,7 @@ public slots:
     void rtcmUsbRx(quint8 id, QByteArray data);
     void reconnectTimerSlot();
     void logFlushTimerSlot();
+    void tcpStatsTimerSlot();
     void readPendingDatagrams();
     void carPacketRx(quint8 id, CMD_PACKET cmd, const QByteArray &data);
     void logLineUsbReceived(quint8 id, QString str);
@@ -97,10 +103,11 @@ private:
     SerialPort *mSerialPort;
     QSerialPort *mSerialPortRtcm;
     QTcpSocket *mTcpSocket;
-    TcpServerSimple *mTcpServer;
+    TcpPacketServer *mTcpServer;
     int mCarId;
     QTimer *mReconnectTimer;
     QTimer *mLogFlushTimer;
+    QTimer *mTcpStatsTimer;
     settings_t mSettings;
     bool mTcpConnected;
     QUdpSocket *mUdpSocket;
@@ -109,6 +116,7 @@ private:
     QFile mLog;
     Ublox *mUblox;
     bool mRtklibRunning;
+    PacketLog *mPacketLog;
 
     void rebootSystem(bool powerOff = false);
     bool setUnixTime(qint64 t);
@@ -153,7 +153,7 @@ void Chronos::stateReceived(quint8 id, CAR_STATE state)
     xyz[1] = state.py;
     xyz[2] = 0.0;
 
-    utility::enuToLlh(mLlhRef, xyz, llh);
+    mEnuFrame.enuToLlh(xyz, llh);
 
     monr.lat = llh[0];
     monr.lon = llh[1];
@@ -323,6 +323,7 @@ void Chronos::processOsem(chronos_osem osem)
     mLlhRef[0] = osem.lat;
     mLlhRef[1] = osem.lon;
     mLlhRef[2] = osem.alt;
+    mEnuFrame.setRef(mLlhRef);
 
     // TODO: Rotate route with heading
 
@@ -8,6 +8,7 @@
 #include "tcpserversimple.h"
 #include "packetinterface.h"
 #include "vbytearray.h"
+#include "enuframe.h"
 
 class Chronos : public QObject
 {
@@ -39,6 +40,7 @@ private:
 
     int mHeabPollCnt;
     double mLlhRef[3];
+    EnuFrame mEnuFrame;
     QList<LocPoint> mRouteLast;
     chronos_sypm mSypmLast;
 
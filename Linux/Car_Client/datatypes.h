@@ -73,6 +73,13 @@ typedef struct {
     double ap_goal_py;
     double ap_rad;
     int32_t ms_today;
+    // Summary of the VESCs on the CAN-bus
+    int can_nodes;
+    int can_nodes_alive;
+    double can_vin_min;
+    double can_temp_fet_max;
+    double can_temp_motor_max;
+    double can_current_in_tot;
 } CAR_STATE;
 
 typedef struct {
@@ -239,6 +246,7 @@ typedef enum {
     // General commands
     CMD_PRINTF = 0,
     CMD_TERMINAL_CMD,
+    CMD_TERMINAL_BATCH,
 
     // Common vehicle commands
     CMD_VESC_FWD = 50,
@@ -0,0 +1,141 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "enuframe.h"
+#include "utility.h"
+
+EnuFrame::EnuFrame()
+{
+    setRef(0.0, 0.0, 0.0);
+}
+
+EnuFrame::EnuFrame(double lat, double lon, double height)
+{
+    setRef(lat, lon, height);
+}
+
+EnuFrame::EnuFrame(const double *llh)
+{
+    setRef(llh);
+}
+
+void EnuFrame::setRef(double lat, double lon, double height)
+{
+    mRefLlh[0] = lat;
+    mRefLlh[1] = lon;
+    mRefLlh[2] = height;
+
+    utility::llhToXyz(lat, lon, height, &mRefXyz[0], &mRefXyz[1], &mRefXyz[2]);
+    utility::createEnuMatrix(lat, lon, mEnuMat);
+}
+
+void EnuFrame::setRef(const double *llh)
+{
+    setRef(llh[0], llh[1], llh[2]);
+}
+
+void EnuFrame::getRef(double *llh) const
+{
+    llh[0] = mRefLlh[0];
+    llh[1] = mRefLlh[1];
+    llh[2] = mRefLlh[2];
+}
+
+/**
+ * @brief EnuFrame::hasRef
+ * Check if this frame already uses a reference point, so that the
+ * frame only has to be updated when the reference changes.
+ *
+ * @param llh
+ * The reference point to compare with.
+ *
+ * @return
+ * true if the reference point is the same.
+ */
+bool EnuFrame::hasRef(const double *llh) const
+{
+    return llh[0] == mRefLlh[0] &&
+            llh[1] == mRefLlh[1] &&
+            llh[2] == mRefLlh[2];
+}
+
+void EnuFrame::llhToEnu(const double *llh, double *xyz) const
+{
+    double x, y, z;
+    utility::llhToXyz(llh[0], llh[1], llh[2], &x, &y, &z);
+    ecefToEnu(x, y, z, xyz);
+}
+
+void EnuFrame::enuToLlh(const double *xyz, double *llh) const
+{
+    double x = mEnuMat[0] * xyz[0] + mEnuMat[3] * xyz[1] + mEnuMat[6] * xyz[2] + mRefXyz[0];
+    double y = mEnuMat[1] * xyz[0] + mEnuMat[4] * xyz[1] + mEnuMat[7] * xyz[2] + mRefXyz[1];
+    double z = mEnuMat[2] * xyz[0] + mEnuMat[5] * xyz[1] + mEnuMat[8] * xyz[2] + mRefXyz[2];
+
+    utility::xyzToLlh(x, y, z, &llh[0], &llh[1], &llh[2]);
+}
+
+void EnuFrame::ecefToEnu(double x, double y, double z, double *xyz) const
+{
+    double dx = x - mRefXyz[0];
+    double dy = y - mRefXyz[1];
+    double dz = z - mRefXyz[2];
+
+    xyz[0] = mEnuMat[0] * dx + mEnuMat[1] * dy + mEnuMat[2] * dz;
+    xyz[1] = mEnuMat[3] * dx + mEnuMat[4] * dy + mEnuMat[5] * dz;
+    xyz[2] = mEnuMat[6] * dx + mEnuMat[7] * dy + mEnuMat[8] * dz;
+}
+
+/**
+ * @brief EnuFrame::llhToEnu
+ * Convert an array of points.
+ *
+ * @param llh
+ * Input array with 3 * points elements.
+ *
+ * @param xyz
+ * Output array with 3 * points elements.
+ *
+ * @param points
+ * The number of points to convert.
+ */
+void EnuFrame::llhToEnu(const double *llh, double *xyz, int points) const
+{
+    for (int i = 0;i < points;i++) {
+        llhToEnu(llh + 3 * i, xyz + 3 * i);
+    }
+}
+
+/**
+ * @brief EnuFrame::enuToLlh
+ * Convert an array of points.
+ *
+ * @param xyz
+ * Input array with 3 * points elements.
+ *
+ * @param llh
+ * Output array with 3 * points elements.
+ *
+ * @param points
+ * The number of points to convert.
+ */
+void EnuFrame::enuToLlh(const double *xyz, double *llh, int points) const
+{
+    for (int i = 0;i < points;i++) {
+        enuToLlh(xyz + 3 * i, llh + 3 * i);
+    }
+}
@@ -0,0 +1,58 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef ENUFRAME_H
+#define ENUFRAME_H
+
+/**
+ * @brief The EnuFrame class
+ *
+ * Local east-north-up frame with a fixed reference point. The ECEF position
+ * and the rotation matrix of the reference point are calculated once when
+ * the reference is set, so that converting many points only costs the
+ * ECEF conversion of the points themselves.
+ *
+ * All arrays are in the same order as for utility::llhToEnu, that is
+ * lat, lon, height and east, north, up.
+ */
+class EnuFrame
+{
+public:
+    EnuFrame();
+    EnuFrame(double lat, double lon, double height);
+    explicit EnuFrame(const double *llh);
+
+    void setRef(double lat, double lon, double height);
+    void setRef(const double *llh);
+    void getRef(double *llh) const;
+    bool hasRef(const double *llh) const;
+
+    void llhToEnu(const double *llh, double *xyz) const;
+    void enuToLlh(const double *xyz, double *llh) const;
+    void ecefToEnu(double x, double y, double z, double *xyz) const;
+
+    void llhToEnu(const double *llh, double *xyz, int points) const;
+    void enuToLlh(const double *xyz, double *llh, int points) const;
+
+private:
+    double mRefLlh[3];
+    double mRefXyz[3];
+    double mEnuMat[9];
+
+};
+
+#endif // ENUFRAME_H
@@ -0,0 +1,266 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "eventloop.h"
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <cerrno>
+
+EventLoop::EventLoop()
+{
+    mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    mStop = 0;
+
+    for (int i = 0;i < SOURCES_MAX;i++) {
+        mSources[i].fd = -1;
+        mSources[i].generation = 0;
+    }
+}
+
+EventLoop::~EventLoop()
+{
+    for (int i = 0;i < SOURCES_MAX;i++) {
+        if (mSources[i].fd >= 0 && mSources[i].timer) {
+            close(mSources[i].fd);
+        }
+    }
+
+    if (mEpollFd >= 0) {
+        close(mEpollFd);
+    }
+}
+
+bool EventLoop::isValid() const
+{
+    return mEpollFd >= 0;
+}
+
+/**
+ * @brief EventLoop::addFd
+ * Watch a file descriptor. The descriptor is not owned by the loop.
+ *
+ * @param fd
+ * The file descriptor.
+ *
+ * @param events
+ * epoll events, e.g. EPOLLIN.
+ *
+ * @param cb
+ * Called with the events that occurred.
+ *
+ * @param arg
+ * Passed to the callback.
+ *
+ * @return
+ * true for success, false if the table is full or epoll failed.
+ */
+bool EventLoop::addFd(int fd, uint32_t events, EventLoop::Callback cb, void *arg)
+{
+    return addSource(fd, events, false, cb, arg) >= 0;
+}
+
+bool EventLoop::modifyFd(int fd, uint32_t events)
+{
+    Source *s = findSource(fd);
+    if (!s || s->events == events) {
+        return s != 0;
+    }
+
+    epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = (uint64_t)s->generation << 32 | (uint64_t)(s - mSources);
+
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        return false;
+    }
+
+    s->events = events;
+    return true;
+}
+
+void EventLoop::removeFd(int fd)
+{
+    Source *s = findSource(fd);
+    if (s) {
+        epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, 0);
+        s->fd = -1;
+        // Events for the old source that are already fetched are ignored
+        s->generation++;
+    }
+}
+
+/**
+ * @brief EventLoop::addTimer
+ * Add a timer.
+ *
+ * @param periodUs
+ * Period, or the delay for single shot timers, in microseconds.
+ *
+ * @param cb
+ * Called with the number of expirations.
+ *
+ * @param arg
+ * Passed to the callback.
+ *
+ * @param singleShot
+ * Only fire once. The timer still has to be removed.
+ *
+ * @return
+ * The timerfd of the timer, used to remove it, or -1 on failure.
+ */
+int EventLoop::addTimer(int periodUs, EventLoop::Callback cb, void *arg, bool singleShot)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    itimerspec ts;
+    ts.it_value.tv_sec = periodUs / 1000000;
+    ts.it_value.tv_nsec = (periodUs % 1000000) * 1000;
+    ts.it_interval.tv_sec = singleShot ? 0 : ts.it_value.tv_sec;
+    ts.it_interval.tv_nsec = singleShot ? 0 : ts.it_value.tv_nsec;
+
+    if (timerfd_settime(fd, 0, &ts, 0) < 0 || addSource(fd, EPOLLIN, true, cb, arg) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void EventLoop::removeTimer(int fd)
+{
+    if (findSource(fd)) {
+        removeFd(fd);
+        close(fd);
+    }
+}
+
+/**
+ * @brief EventLoop::runOnce
+ * Wait for events and run the callbacks.
+ *
+ * @param timeoutMs
+ * Maximum time to wait. -1 waits until something happens.
+ *
+ * @return
+ * The number of events, or -1 on error.
+ */
+int EventLoop::runOnce(int timeoutMs)
+{
+    epoll_event events[16];
+    int n = epoll_wait(mEpollFd, events, 16, timeoutMs);
+
+    if (n < 0) {
+        // A signal, e.g. the one that stops the loop
+        return errno == EINTR ? 0 : -1;
+    }
+
+    for (int i = 0;i < n;i++) {
+        Source *s = &mSources[events[i].data.u64 & 0xFFFFFFFF];
+        uint32_t generation = events[i].data.u64 >> 32;
+
+        if (s->fd < 0 || s->generation != generation) {
+            continue;
+        }
+
+        if (s->timer) {
+            uint64_t expirations = 0;
+            if (read(s->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+                continue;
+            }
+            s->cb(s->arg, (uint32_t)expirations);
+        } else {
+            s->cb(s->arg, events[i].events);
+        }
+    }
+
+    return n;
+}
+
+void EventLoop::run()
+{
+    mStop = 0;
+
+    while (!mStop) {
+        if (runOnce(-1) < 0) {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief EventLoop::stop
+ * Stop run(). Can be called from a signal handler.
+ */
+void EventLoop::stop()
+{
+    mStop = 1;
+}
+
+bool EventLoop::isStopped() const
+{
+    return mStop;
+}
+
+EventLoop::Source *EventLoop::findSource(int fd)
+{
+    if (fd < 0) {
+        return 0;
+    }
+
+    for (int i = 0;i < SOURCES_MAX;i++) {
+        if (mSources[i].fd == fd) {
+            return &mSources[i];
+        }
+    }
+
+    return 0;
+}
+
+int EventLoop::addSource(int fd, uint32_t events, bool timer, EventLoop::Callback cb, void *arg)
+{
+    if (fd < 0 || findSource(fd)) {
+        return -1;
+    }
+
+    for (int i = 0;i < SOURCES_MAX;i++) {
+        Source *s = &mSources[i];
+        if (s->fd >= 0) {
+            continue;
+        }
+
+        epoll_event ev;
+        ev.events = events;
+        ev.data.u64 = (uint64_t)s->generation << 32 | (uint64_t)i;
+
+        if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            return -1;
+        }
+
+        s->fd = fd;
+        s->events = events;
+        s->timer = timer;
+        s->cb = cb;
+        s->arg = arg;
+        return i;
+    }
+
+    return -1;
+}
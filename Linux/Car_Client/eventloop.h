@@ -0,0 +1,78 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <cstdint>
+#include <csignal>
+
+/**
+ * @brief The EventLoop class
+ *
+ * Minimal event loop on top of epoll and timerfd, for running without Qt.
+ * File descriptors and timers are registered with a plain callback and an
+ * argument, and are kept in a fixed table so that nothing is allocated
+ * while the loop runs.
+ *
+ * Sources can be removed from their own callbacks, and from callbacks of
+ * other sources in the same batch of events.
+ */
+class EventLoop
+{
+public:
+    // For fds the events are the epoll events, for timers the number of
+    // expirations since the last callback.
+    typedef void (*Callback)(void *arg, uint32_t events);
+
+    static const int SOURCES_MAX = 64;
+
+    EventLoop();
+    ~EventLoop();
+    bool isValid() const;
+
+    bool addFd(int fd, uint32_t events, Callback cb, void *arg);
+    bool modifyFd(int fd, uint32_t events);
+    void removeFd(int fd);
+    int addTimer(int periodUs, Callback cb, void *arg, bool singleShot = false);
+    void removeTimer(int fd);
+
+    int runOnce(int timeoutMs);
+    void run();
+    void stop();
+    bool isStopped() const;
+
+private:
+    typedef struct {
+        int fd;
+        uint32_t events;
+        uint32_t generation;
+        bool timer;
+        Callback cb;
+        void *arg;
+    } Source;
+
+    int mEpollFd;
+    Source mSources[SOURCES_MAX];
+    volatile sig_atomic_t mStop;
+
+    Source *findSource(int fd);
+    int addSource(int fd, uint32_t events, bool timer, Callback cb, void *arg);
+
+};
+
+#endif // EVENTLOOP_H
@@ -0,0 +1,725 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "headlessclient.h"
+#include "packet.h"
+#include "datatypes.h"
+#include <QDebug>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+namespace {
+speed_t baudToSpeed(int baudrate)
+{
+    switch (baudrate) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+    default: return B115200;
+    }
+}
+}
+
+HeadlessClient::HeadlessClient()
+{
+    memset(&mStats, 0, sizeof(mStats));
+
+    mSerialFd = -1;
+    mSerialPort[0] = '\0';
+    mSerialBaud = 115200;
+    mReconnectTimer = -1;
+    mSerialDec.state = 0;
+    mSerialDec.lastRx = 0;
+    mSerialTx.buf = 0;
+
+    mUdpFd = -1;
+    mUdpPort = 0;
+    mUdpPeerValid = false;
+    memset(&mUdpPeer, 0, sizeof(mUdpPeer));
+
+    mTcpFd = -1;
+    mRtcmFd = -1;
+    mTcpListener.owner = this;
+    mTcpListener.rtcm = false;
+    mRtcmListener.owner = this;
+    mRtcmListener.rtcm = true;
+
+    for (int i = 0;i < CLIENTS_MAX;i++) {
+        mClients[i].owner = this;
+        mClients[i].fd = -1;
+        mClients[i].tx.buf = 0;
+    }
+
+    mStatsTimer = -1;
+}
+
+HeadlessClient::~HeadlessClient()
+{
+    for (int i = 0;i < CLIENTS_MAX;i++) {
+        closeClient(&mClients[i]);
+    }
+
+    int fds[] = {mSerialFd, mUdpFd, mTcpFd, mRtcmFd};
+    for (int fd: fds) {
+        if (fd >= 0) {
+            mLoop.removeFd(fd);
+            close(fd);
+        }
+    }
+
+    if (mStatsTimer >= 0) {
+        mLoop.removeTimer(mStatsTimer);
+    }
+
+    if (mReconnectTimer >= 0) {
+        mLoop.removeTimer(mReconnectTimer);
+    }
+
+    ringFree(mSerialTx);
+}
+
+/**
+ * @brief HeadlessClient::openSerial
+ * Open the serial port to the car. If the port cannot be opened, or if it
+ * is closed later, e.g. when the USB cable is unplugged, it is reopened
+ * every RECONNECT_MS like in CarClient.
+ *
+ * @return
+ * true if the port was opened right away, false if it is retried later.
+ */
+bool HeadlessClient::openSerial(const char *port, int baudrate)
+{
+    strncpy(mSerialPort, port, sizeof(mSerialPort) - 1);
+    mSerialPort[sizeof(mSerialPort) - 1] = '\0';
+    mSerialBaud = baudrate;
+
+    if (!mSerialTx.buf && !ringAlloc(mSerialTx, SERIAL_TX_BUF)) {
+        return false;
+    }
+
+    if (!connectSerial()) {
+        qWarning() << "Opening serial port failed:" << strerror(errno);
+        startReconnect();
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief HeadlessClient::startUdpServer
+ * Receive packets for the car on a UDP port. Like in CarClient, packets from
+ * the car are sent to port + 1 of the last sender.
+ *
+ * @param port
+ * The port.
+ *
+ * @return
+ * true for success, false otherwise.
+ */
+bool HeadlessClient::startUdpServer(int port)
+{
+    mUdpFd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (mUdpFd < 0) {
+        return false;
+    }
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(mUdpFd, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+            !mLoop.addFd(mUdpFd, EPOLLIN, udpEvent, this)) {
+        qCritical() << "Starting UDP server failed:" << strerror(errno);
+        close(mUdpFd);
+        mUdpFd = -1;
+        return false;
+    }
+
+    mUdpPort = port + 1;
+    return true;
+}
+
+bool HeadlessClient::startTcpServer(int port)
+{
+    mTcpFd = listenTcp(port, &mTcpListener);
+    return mTcpFd >= 0;
+}
+
+bool HeadlessClient::startRtcmServer(int port)
+{
+    mRtcmFd = listenTcp(port, &mRtcmListener);
+    return mRtcmFd >= 0;
+}
+
+/**
+ * @brief HeadlessClient::setStatsInterval
+ * Print the statistics periodically.
+ *
+ * @param seconds
+ * Interval in seconds. 0 to disable.
+ */
+void HeadlessClient::setStatsInterval(int seconds)
+{
+    if (mStatsTimer >= 0) {
+        mLoop.removeTimer(mStatsTimer);
+        mStatsTimer = -1;
+    }
+
+    if (seconds > 0) {
+        mStatsTimer = mLoop.addTimer(seconds * 1000000, statsEvent, this);
+    }
+}
+
+EventLoop *HeadlessClient::loop()
+{
+    return &mLoop;
+}
+
+HeadlessClient::Stats HeadlessClient::stats() const
+{
+    return mStats;
+}
+
+void HeadlessClient::run()
+{
+    mLoop.run();
+}
+
+void HeadlessClient::stop()
+{
+    mLoop.stop();
+}
+
+void HeadlessClient::serialEvent(void *arg, uint32_t events)
+{
+    HeadlessClient *h = (HeadlessClient*)arg;
+
+    if (events & EPOLLIN) {
+        uint8_t buffer[4096];
+        int res;
+
+        while ((res = read(h->mSerialFd, buffer, sizeof(buffer))) > 0) {
+            h->mStats.serialBytesRx += res;
+            h->decodeChunk(h->mSerialDec, buffer, res, true);
+        }
+    }
+
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        qCritical() << "Serial port closed";
+        h->serialLost();
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        ringFlush(h->mSerialTx, h->mSerialFd);
+        h->updateSerialEvents();
+    }
+}
+
+void HeadlessClient::udpEvent(void *arg, uint32_t events)
+{
+    (void)events;
+    HeadlessClient *h = (HeadlessClient*)arg;
+    uint8_t buffer[PACKET_MAX];
+    sockaddr_in from;
+    socklen_t fromLen = sizeof(from);
+    int res;
+
+    while ((res = recvfrom(h->mUdpFd, buffer, sizeof(buffer), 0,
+                           (sockaddr*)&from, &fromLen)) >= 0) {
+        h->mUdpPeer = from;
+        h->mUdpPeer.sin_port = htons(h->mUdpPort);
+        h->mUdpPeerValid = true;
+
+        if (res > 0) {
+            h->mStats.clientPackets++;
+            h->toCar(buffer, res);
+        }
+
+        fromLen = sizeof(from);
+    }
+}
+
+void HeadlessClient::listenEvent(void *arg, uint32_t events)
+{
+    (void)events;
+    Listener *l = (Listener*)arg;
+    HeadlessClient *h = l->owner;
+    int listenFd = l->rtcm ? h->mRtcmFd : h->mTcpFd;
+    int fd;
+
+    while ((fd = accept4(listenFd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        Client *c = 0;
+        for (int i = 0;i < CLIENTS_MAX;i++) {
+            if (h->mClients[i].fd < 0) {
+                c = &h->mClients[i];
+                break;
+            }
+        }
+
+        if (!c || !ringAlloc(c->tx, CLIENT_TX_BUF)) {
+            qWarning() << "Too many TCP clients, closing the new one";
+            close(fd);
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        c->fd = fd;
+        c->rtcm = l->rtcm;
+        c->dec.state = 0;
+        c->dec.lastRx = 0;
+
+        if (!h->mLoop.addFd(fd, EPOLLIN | EPOLLRDHUP, clientEvent, c)) {
+            h->closeClient(c);
+        }
+    }
+}
+
+void HeadlessClient::clientEvent(void *arg, uint32_t events)
+{
+    Client *c = (Client*)arg;
+    HeadlessClient *h = c->owner;
+
+    if (events & EPOLLIN) {
+        uint8_t buffer[4096];
+        int res;
+
+        while ((res = read(c->fd, buffer, sizeof(buffer))) > 0) {
+            // RTCM clients only listen
+            if (!c->rtcm) {
+                h->decodeChunk(c->dec, buffer, res, false);
+            }
+        }
+
+        if (res == 0 || (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            h->closeClient(c);
+            return;
+        }
+    }
+
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        h->closeClient(c);
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        if (!ringFlush(c->tx, c->fd)) {
+            h->closeClient(c);
+            return;
+        }
+
+        if (c->tx.len == 0) {
+            h->mLoop.modifyFd(c->fd, EPOLLIN | EPOLLRDHUP);
+        }
+    }
+}
+
+void HeadlessClient::statsEvent(void *arg, uint32_t events)
+{
+    (void)events;
+    HeadlessClient *h = (HeadlessClient*)arg;
+    int clients = 0;
+
+    for (int i = 0;i < CLIENTS_MAX;i++) {
+        if (h->mClients[i].fd >= 0) {
+            clients++;
+        }
+    }
+
+    qDebug() << "Car packets:" << h->mStats.carPackets
+             << "Client packets:" << h->mStats.clientPackets
+             << "Serial rx/tx:" << h->mStats.serialBytesRx << h->mStats.serialBytesTx
+             << "Dropped bytes:" << h->mStats.bytesDropped
+             << "CRC errors:" << h->mStats.crcErrors
+             << "TCP clients:" << clients;
+}
+
+void HeadlessClient::reconnectEvent(void *arg, uint32_t events)
+{
+    (void)events;
+    HeadlessClient *h = (HeadlessClient*)arg;
+
+    qDebug() << "Trying to reconnect serial...";
+
+    if (h->connectSerial()) {
+        qDebug() << "Serial port reconnected";
+        h->mLoop.removeTimer(h->mReconnectTimer);
+        h->mReconnectTimer = -1;
+    }
+}
+
+/**
+ * @brief HeadlessClient::decodeByte
+ * The same framing as Packet and PacketInterface.
+ *
+ * @return
+ * true when d.buf holds a complete packet of d.len bytes.
+ */
+bool HeadlessClient::decodeByte(HeadlessClient::Decoder &d, uint8_t b, bool *crcError)
+{
+    switch (d.state) {
+    case 0:
+        if (b == 2) {
+            d.state = 2;
+            d.len = 0;
+        } else if (b == 3) {
+            d.state = 1;
+            d.len = 0;
+        }
+        break;
+
+    case 1:
+        d.len = (unsigned int)b << 8;
+        d.state++;
+        break;
+
+    case 2:
+        d.len |= (unsigned int)b;
+        d.ind = 0;
+        d.state = (d.len > 0 && d.len <= PACKET_MAX) ? 3 : 0;
+        break;
+
+    case 3:
+        d.buf[d.ind++] = b;
+        if (d.ind == d.len) {
+            d.state++;
+        }
+        break;
+
+    case 4:
+        d.crcHigh = b;
+        d.state++;
+        break;
+
+    case 5:
+        d.crcLow = b;
+        d.state++;
+        break;
+
+    case 6:
+        d.state = 0;
+        if (b == 3) {
+            if (Packet::crc16(d.buf, d.len) == ((unsigned short)d.crcHigh << 8 | d.crcLow)) {
+                return true;
+            }
+            *crcError = true;
+        }
+        break;
+
+    default:
+        d.state = 0;
+        break;
+    }
+
+    return false;
+}
+
+int HeadlessClient::frame(const uint8_t *data, int len, uint8_t *out)
+{
+    int ind = 0;
+
+    if (len <= 256) {
+        out[ind++] = 2;
+        out[ind++] = len;
+    } else {
+        out[ind++] = 3;
+        out[ind++] = len >> 8;
+        out[ind++] = len & 0xFF;
+    }
+
+    memcpy(out + ind, data, len);
+    ind += len;
+
+    unsigned short crc = Packet::crc16(data, len);
+    out[ind++] = crc >> 8;
+    out[ind++] = crc & 0xFF;
+    out[ind++] = 3;
+
+    return ind;
+}
+
+int64_t HeadlessClient::timeMs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool HeadlessClient::ringAlloc(HeadlessClient::Ring &r, int size)
+{
+    r.buf = new uint8_t[size];
+    r.size = size;
+    r.head = 0;
+    r.len = 0;
+    return r.buf != 0;
+}
+
+void HeadlessClient::ringFree(HeadlessClient::Ring &r)
+{
+    delete[] r.buf;
+    r.buf = 0;
+}
+
+/**
+ * @brief HeadlessClient::ringPush
+ * Queue data, all of it or nothing so that packets are never cut.
+ */
+bool HeadlessClient::ringPush(HeadlessClient::Ring &r, const uint8_t *data, int len)
+{
+    if ((r.size - r.len) < len) {
+        return false;
+    }
+
+    int tail = (r.head + r.len) % r.size;
+    int first = len < (r.size - tail) ? len : (r.size - tail);
+    memcpy(r.buf + tail, data, first);
+    memcpy(r.buf, data + first, len - first);
+    r.len += len;
+    return true;
+}
+
+/**
+ * @brief HeadlessClient::ringFlush
+ * Write as much of the queued data as the fd takes.
+ *
+ * @return
+ * false if writing failed for another reason than a full buffer.
+ */
+bool HeadlessClient::ringFlush(HeadlessClient::Ring &r, int fd)
+{
+    while (r.len > 0) {
+        int chunk = r.len < (r.size - r.head) ? r.len : (r.size - r.head);
+        int res = write(fd, r.buf + r.head, chunk);
+
+        if (res < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        r.head = (r.head + res) % r.size;
+        r.len -= res;
+    }
+
+    r.head = 0;
+    return true;
+}
+
+int HeadlessClient::listenTcp(int port, HeadlessClient::Listener *listener)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0 ||
+            !mLoop.addFd(fd, EPOLLIN, listenEvent, listener)) {
+        qCritical() << "Starting TCP server failed:" << strerror(errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void HeadlessClient::decodeChunk(HeadlessClient::Decoder &d, const uint8_t *data, int len, bool fromCar)
+{
+    // Start over on a partial packet after a pause, like the Qt decoders
+    int64_t now = timeMs();
+    if ((now - d.lastRx) > RX_TIMEOUT_MS) {
+        d.state = 0;
+    }
+    d.lastRx = now;
+
+    for (int i = 0;i < len;i++) {
+        bool crcError = false;
+
+        if (decodeByte(d, data[i], &crcError)) {
+            if (fromCar) {
+                carPacket(d.buf, d.len);
+            } else {
+                mStats.clientPackets++;
+                toCar(d.buf, d.len);
+            }
+        }
+
+        if (crcError) {
+            mStats.crcErrors++;
+        }
+    }
+}
+
+void HeadlessClient::carPacket(const uint8_t *data, int len)
+{
+    mStats.carPackets++;
+
+    if (len < 2) {
+        return;
+    }
+
+    int cmd = data[1];
+
+    if (mUdpPeerValid && cmd != CMD_LOG_LINE_USB) {
+        if (sendto(mUdpFd, data, len, 0, (sockaddr*)&mUdpPeer, sizeof(mUdpPeer)) == len) {
+            mStats.udpTx++;
+        }
+    }
+
+    if (cmd == CMD_SEND_RTCM_USB) {
+        toClients(data + 2, len - 2, true);
+    }
+
+    toClients(mFrame, frame(data, len, mFrame), false);
+}
+
+void HeadlessClient::toCar(const uint8_t *data, int len)
+{
+    if (mSerialFd < 0) {
+        return;
+    }
+
+    int frameLen = frame(data, len, mFrame);
+
+    if (ringPush(mSerialTx, mFrame, frameLen)) {
+        mStats.serialBytesTx += frameLen;
+        ringFlush(mSerialTx, mSerialFd);
+    } else {
+        mStats.bytesDropped += frameLen;
+    }
+
+    updateSerialEvents();
+}
+
+void HeadlessClient::toClients(const uint8_t *data, int len, bool rtcm)
+{
+    for (int i = 0;i < CLIENTS_MAX;i++) {
+        Client *c = &mClients[i];
+        if (c->fd < 0 || c->rtcm != rtcm) {
+            continue;
+        }
+
+        // A client that does not keep up loses data, it never blocks the loop
+        if (!ringPush(c->tx, data, len)) {
+            mStats.bytesDropped += len;
+            continue;
+        }
+
+        if (!ringFlush(c->tx, c->fd)) {
+            closeClient(c);
+            continue;
+        }
+
+        if (c->tx.len > 0) {
+            mLoop.modifyFd(c->fd, EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+        }
+    }
+}
+
+bool HeadlessClient::connectSerial()
+{
+    mSerialFd = open(mSerialPort, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (mSerialFd < 0) {
+        return false;
+    }
+
+    termios options;
+    if (tcgetattr(mSerialFd, &options) == 0) {
+        cfmakeraw(&options);
+        options.c_cflag |= CLOCAL | CREAD;
+        options.c_cflag &= ~CRTSCTS;
+        options.c_cc[VMIN] = 0;
+        options.c_cc[VTIME] = 0;
+        cfsetispeed(&options, baudToSpeed(mSerialBaud));
+        cfsetospeed(&options, baudToSpeed(mSerialBaud));
+        tcsetattr(mSerialFd, TCSANOW, &options);
+    }
+
+    if (!mLoop.addFd(mSerialFd, EPOLLIN, serialEvent, this)) {
+        close(mSerialFd);
+        mSerialFd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief HeadlessClient::serialLost
+ * Close the serial port and start trying to reopen it. Queued data and a
+ * partly decoded packet belong to the old connection and are discarded.
+ */
+void HeadlessClient::serialLost()
+{
+    mLoop.removeFd(mSerialFd);
+    close(mSerialFd);
+    mSerialFd = -1;
+
+    mStats.bytesDropped += mSerialTx.len;
+    mSerialTx.head = 0;
+    mSerialTx.len = 0;
+    mSerialDec.state = 0;
+
+    startReconnect();
+}
+
+void HeadlessClient::startReconnect()
+{
+    if (mReconnectTimer < 0) {
+        mReconnectTimer = mLoop.addTimer(RECONNECT_MS * 1000, reconnectEvent, this);
+    }
+}
+
+void HeadlessClient::updateSerialEvents()
+{
+    mLoop.modifyFd(mSerialFd, mSerialTx.len > 0 ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+}
+
+void HeadlessClient::closeClient(HeadlessClient::Client *c)
+{
+    if (c->fd < 0) {
+        return;
+    }
+
+    mLoop.removeFd(c->fd);
+    close(c->fd);
+    c->fd = -1;
+    ringFree(c->tx);
+}
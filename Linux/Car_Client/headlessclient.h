@@ -0,0 +1,157 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef HEADLESSCLIENT_H
+#define HEADLESSCLIENT_H
+
+#include <cstdint>
+#include <netinet/in.h>
+#include "eventloop.h"
+
+/**
+ * @brief The HeadlessClient class
+ *
+ * Headless alternative to CarClient that routes packets between the car,
+ * UDP and TCP clients from a single EventLoop, without Qt. All buffers are
+ * allocated when a port is opened or a client connects, so routing a
+ * packet does not allocate.
+ *
+ * It forwards packets the same way as CarClient: packets from the car go
+ * to the last UDP peer and to the TCP packet clients, RTCM from the car
+ * goes to the RTCM clients, and packets from UDP and TCP go to the car.
+ * RTKLIB, NMEA, UBX, logging, RTCM serial input, CHRONOS, setting the
+ * system time and rebooting on request are only available in the Qt mode.
+ * Like CarClient, a serial port that is closed is reopened periodically.
+ */
+class HeadlessClient
+{
+public:
+    typedef struct {
+        uint64_t serialBytesRx;
+        uint64_t serialBytesTx;
+        uint64_t carPackets;
+        uint64_t clientPackets;
+        uint64_t udpTx;
+        uint64_t bytesDropped;
+        uint64_t crcErrors;
+    } Stats;
+
+    HeadlessClient();
+    ~HeadlessClient();
+
+    bool openSerial(const char *port, int baudrate = 115200);
+    bool startUdpServer(int port = 8300);
+    bool startTcpServer(int port = 8300);
+    bool startRtcmServer(int port = 8200);
+    void setStatsInterval(int seconds);
+    EventLoop *loop();
+    Stats stats() const;
+    void run();
+    void stop();
+
+private:
+    static const int PACKET_MAX = 4096;
+    static const int FRAME_MAX = PACKET_MAX + 6;
+    static const int SERIAL_TX_BUF = 64 * 1024;
+    static const int CLIENT_TX_BUF = 64 * 1024;
+    static const int CLIENTS_MAX = 16;
+    static const int RX_TIMEOUT_MS = 500;
+    static const int RECONNECT_MS = 2000;
+
+    typedef struct {
+        int state;
+        unsigned int len;
+        unsigned int ind;
+        uint8_t crcHigh;
+        uint8_t crcLow;
+        int64_t lastRx;
+        uint8_t buf[PACKET_MAX];
+    } Decoder;
+
+    typedef struct {
+        uint8_t *buf;
+        int size;
+        int head;
+        int len;
+    } Ring;
+
+    typedef struct {
+        HeadlessClient *owner;
+        int fd;
+        bool rtcm;
+        Decoder dec;
+        Ring tx;
+    } Client;
+
+    typedef struct {
+        HeadlessClient *owner;
+        bool rtcm;
+    } Listener;
+
+    EventLoop mLoop;
+    Stats mStats;
+
+    int mSerialFd;
+    char mSerialPort[256];
+    int mSerialBaud;
+    int mReconnectTimer;
+    Decoder mSerialDec;
+    Ring mSerialTx;
+
+    int mUdpFd;
+    int mUdpPort;
+    bool mUdpPeerValid;
+    sockaddr_in mUdpPeer;
+
+    int mTcpFd;
+    int mRtcmFd;
+    Listener mTcpListener;
+    Listener mRtcmListener;
+    Client mClients[CLIENTS_MAX];
+
+    int mStatsTimer;
+    uint8_t mFrame[FRAME_MAX];
+
+    static void serialEvent(void *arg, uint32_t events);
+    static void udpEvent(void *arg, uint32_t events);
+    static void listenEvent(void *arg, uint32_t events);
+    static void clientEvent(void *arg, uint32_t events);
+    static void statsEvent(void *arg, uint32_t events);
+    static void reconnectEvent(void *arg, uint32_t events);
+
+    static bool decodeByte(Decoder &d, uint8_t b, bool *crcError);
+    static int frame(const uint8_t *data, int len, uint8_t *out);
+    static int64_t timeMs();
+    static bool ringAlloc(Ring &r, int size);
+    static void ringFree(Ring &r);
+    static bool ringPush(Ring &r, const uint8_t *data, int len);
+    static bool ringFlush(Ring &r, int fd);
+
+    int listenTcp(int port, Listener *listener);
+    bool connectSerial();
+    void serialLost();
+    void startReconnect();
+    void decodeChunk(Decoder &d, const uint8_t *data, int len, bool fromCar);
+    void carPacket(const uint8_t *data, int len);
+    void toCar(const uint8_t *data, int len);
+    void toClients(const uint8_t *data, int len, bool rtcm);
+    void updateSerialEvents();
+    void closeClient(Client *c);
+
+};
+
+#endif // HEADLESSCLIENT_H
@@ -22,6 +22,11 @@
 
 #include "carclient.h"
 #include "chronos.h"
+#include "headlessclient.h"
+#include "carbenchmark.h"
+#include "tcpbroadcasttest.h"
+
+static HeadlessClient *m_headless = 0;
 
 void showHelp()
 {
@@ -29,7 +34,7 @@ void showHelp()
     qDebug() << "-h, --help : Show help text";
     qDebug() << "-p, --ttyport : Serial port, e.g. /dev/ttyUSB0";
     qDebug() << "-b, --baudrate : Serial baud rate, e.g. 9600";
-    qDebug() << "-l, --log : Log to file, e.g. /tmp/logfile.bin (TODO!)";
+    qDebug() << "-l, --log : Record the car packets to binary segments in a directory, e.g. /tmp/packets";
     qDebug() << "--tcprtcmport : TCP server port for RTCM data";
     qDebug() << "--tcpubxport : TCP server port for UBX data";
     qDebug() << "--tcpnmeasrv : NMEA server address";
@@ -44,12 +49,24 @@ void showHelp()
     qDebug() << "--ttyportrtcm : Serial port for RTCM, e.g. /dev/ttyUSB0";
     qDebug() << "--rtcmbaud : RTCM port baud rate, e.g. 9600";
     qDebug() << "--chronos : Run CHRONOS client";
+    qDebug() << "--headless : Route packets without Qt, only serial, UDP, TCP and RTCM server";
+    qDebug() << "--benchmark : Compare the Qt and headless modes for the given number of seconds";
+    qDebug() << "--tcpslowclient : What the RTCM and UBX servers do with slow clients, drop or disconnect";
+    qDebug() << "--tcpwatermarks : Low and high client backlog in kB for the RTCM and UBX servers, e.g. 128,512";
+    qDebug() << "--tcpstats : Print the RTCM and UBX server client statistics every given number of seconds";
+    qDebug() << "--tcpselftest : Test the slow client handling of the TCP servers";
 }
 
 static void m_cleanup(int sig)
 {
     (void)sig;
-    qApp->quit();
+
+    if (m_headless) {
+        m_headless->stop();
+    } else {
+        qApp->quit();
+    }
+
     qDebug() << "Bye :)";
 }
 
@@ -75,6 +92,14 @@ int main(int argc, char *argv[])
     QString ttyPortRtcm = "/dev/ttyUSB0";
     int rtcmBaud = 9600;
     bool useChronos = false;
+    bool headless = false;
+    int benchmarkTime = 0;
+    TcpBroadcast::SLOW_CLIENT_POLICY tcpSlowClient = TcpBroadcast::SLOW_CLIENT_DROP;
+    int tcpLowWatermark = 128 * 1024;
+    int tcpHighWatermark = 512 * 1024;
+    int tcpStatsInterval = 0;
+    bool tcpBroadcastArgs = false;
+    bool tcpSelfTest = false;
 
     signal(SIGINT, m_cleanup);
     signal(SIGTERM, m_cleanup);
@@ -229,6 +254,65 @@ int main(int argc, char *argv[])
             found = true;
         }
 
+        if (str == "--headless") {
+            headless = true;
+            found = true;
+        }
+
+        if (str == "--benchmark") {
+            if ((i - 1) < args.size()) {
+                i++;
+                bool ok;
+                benchmarkTime = args.at(i).toInt(&ok);
+                found = ok;
+            }
+        }
+
+        if (str == "--tcpslowclient") {
+            if ((i - 1) < args.size()) {
+                i++;
+                tcpBroadcastArgs = true;
+                QString policy = args.at(i).toLower();
+                if (policy == "drop") {
+                    tcpSlowClient = TcpBroadcast::SLOW_CLIENT_DROP;
+                    found = true;
+                } else if (policy == "disconnect") {
+                    tcpSlowClient = TcpBroadcast::SLOW_CLIENT_DISCONNECT;
+                    found = true;
+                }
+            }
+        }
+
+        if (str == "--tcpwatermarks") {
+            if ((i - 1) < args.size()) {
+                i++;
+                tcpBroadcastArgs = true;
+                QStringList marks = args.at(i).split(",");
+                if (marks.size() == 2) {
+                    bool okLow, okHigh;
+                    tcpLowWatermark = marks.at(0).toInt(&okLow) * 1024;
+                    tcpHighWatermark = marks.at(1).toInt(&okHigh) * 1024;
+                    found = okLow && okHigh && tcpLowWatermark > 0 &&
+                            tcpHighWatermark >= tcpLowWatermark;
+                }
+            }
+        }
+
+        if (str == "--tcpstats") {
+            if ((i - 1) < args.size()) {
+                i++;
+                tcpBroadcastArgs = true;
+                bool ok;
+                tcpStatsInterval = args.at(i).toInt(&ok);
+                found = ok;
+            }
+        }
+
+        if (str == "--tcpselftest") {
+            tcpSelfTest = true;
+            found = true;
+        }
+
         if (!found) {
             if (dash) {
                 qCritical() << "At least one of the flags is invalid:" << str;
@@ -241,12 +325,54 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (benchmarkTime > 0) {
+        return CarBenchmark::run(benchmarkTime) ? 0 : 1;
+    }
+
+    if (tcpSelfTest) {
+        return TcpBroadcastTest::run() ? 0 : 1;
+    }
+
+    if (headless) {
+        if (logUsb || !logFile.isEmpty() || inputRtcm || useChronos) {
+            qWarning() << "Logging, RTCM input and CHRONOS are not available in headless mode";
+        }
+
+        if (tcpBroadcastArgs) {
+            qWarning() << "The TCP slow client settings and statistics are not available in headless mode";
+        }
+
+        HeadlessClient h;
+        m_headless = &h;
+
+        // Retried in the background if the port is not there yet
+        h.openSerial(ttyPort.toLocal8Bit().constData(), baudrate);
+
+        h.startRtcmServer(tcpRtcmPort);
+
+        if (useUdp) {
+            h.startUdpServer(udpPort);
+        }
+
+        if (useTcp) {
+            h.startTcpServer(tcpPort);
+        }
+
+        h.setStatsInterval(60);
+        h.run();
+        m_headless = 0;
+        return 0;
+    }
+
     CarClient car;
     Chronos chronos;
 
     car.connectSerial(ttyPort, baudrate);
     car.startRtcmServer(tcpRtcmPort);
     car.startUbxServer(tcpUbxPort);
+    car.setTcpSlowClientPolicy(tcpSlowClient);
+    car.setTcpWatermarks(tcpLowWatermark, tcpHighWatermark);
+    car.setTcpStatsInterval(tcpStatsInterval);
     car.restartRtklib();
 
     if (car.isRtklibRunning()) {
@@ -265,6 +391,10 @@ int main(int argc, char *argv[])
         car.enableLogging(logUsbDir);
     }
 
+    if (!logFile.isEmpty()) {
+        car.enablePacketLog(logFile);
+    }
+
     if (inputRtcm) {
         car.connectSerialRtcm(ttyPortRtcm, rtcmBaud);
     }
@@ -354,6 +354,15 @@ void PacketInterface::processPacket(const unsigned char *data, int len)
         emit printReceived(id, QString::fromLatin1(tmpArray));
     } break;
 
+    case CMD_TERMINAL_BATCH: {
+        if (len < 3) {
+            break;
+        }
+
+        QString output = QString::fromLatin1((const char*)data + 3, len - 3);
+        emit terminalBatchReceived(id, data[0], data[1], data[2] & 1, data[2] & 2, output);
+    } break;
+
     case CMD_GET_ENU_REF: {
         int32_t ind = 0;
         double lat, lon, height;
@@ -630,6 +639,24 @@ void PacketInterface::processPacket(const unsigned char *data, int len)
         state.ap_goal_py = utility::buffer_get_double32(data, 1e4, &ind);
         state.ap_rad = utility::buffer_get_double32(data, 1e6, &ind);
         state.ms_today = utility::buffer_get_int32(data, &ind);
+
+        // Older firmwares do not send the CAN health block
+        if (len >= (ind + 18)) {
+            state.can_nodes = data[ind++];
+            state.can_nodes_alive = data[ind++];
+            state.can_vin_min = utility::buffer_get_double32(data, 1e3, &ind);
+            state.can_temp_fet_max = utility::buffer_get_double32(data, 1e3, &ind);
+            state.can_temp_motor_max = utility::buffer_get_double32(data, 1e3, &ind);
+            state.can_current_in_tot = utility::buffer_get_double32(data, 1e3, &ind);
+        } else {
+            state.can_nodes = 0;
+            state.can_nodes_alive = 0;
+            state.can_vin_min = 0.0;
+            state.can_temp_fet_max = 0.0;
+            state.can_temp_motor_max = 0.0;
+            state.can_current_in_tot = 0.0;
+        }
+
         emit stateReceived(id, state);
     } break;
 
@@ -1113,6 +1140,32 @@ void PacketInterface::sendTerminalCmd(quint8 id, QString cmd)
     sendPacket(packet);
 }
 
+/**
+ * @brief PacketInterface::sendTerminalBatch
+ * Run several terminal commands in one packet. The output of each command
+ * is returned through terminalBatchReceived instead of printReceived, split
+ * over several packets if it is long.
+ *
+ * @param id
+ * The vehicle ID.
+ *
+ * @param seq
+ * Sequence number that is echoed in the replies.
+ *
+ * @param cmds
+ * The commands to run, in order.
+ */
+void PacketInterface::sendTerminalBatch(quint8 id, quint8 seq, QStringList cmds)
+{
+    QByteArray packet;
+    packet.clear();
+    packet.append(id);
+    packet.append((char)CMD_TERMINAL_BATCH);
+    packet.append((char)seq);
+    packet.append(cmds.join("\n").toLatin1());
+    sendPacket(packet);
+}
+
 void PacketInterface::forwardVesc(quint8 id, QByteArray data)
 {
     QByteArray packet;
@@ -21,6 +21,7 @@
 #include <QObject>
 #include <QTimer>
 #include <QVector>
+#include <QStringList>
 #include <QUdpSocket>
 #include "datatypes.h"
 #include "locpoint.h"
@@ -75,6 +76,7 @@ signals:
     void dataToSend(QByteArray &data);
     void packetReceived(quint8 id, CMD_PACKET cmd, const QByteArray &data);
     void printReceived(quint8 id, QString str);
+    void terminalBatchReceived(quint8 id, quint8 seq, int cmd, bool found, bool done, QString output);
     void stateReceived(quint8 id, CAR_STATE state);
     void mrStateReceived(quint8 id, MULTIROTOR_STATE state);
     void vescFwdReceived(quint8 id, QByteArray data);
@@ -99,6 +101,7 @@ public slots:
     void getState(quint8 id);
     void getMrState(quint8 id);
     void sendTerminalCmd(quint8 id, QString cmd);
+    void sendTerminalBatch(quint8 id, quint8 seq, QStringList cmds);
     void forwardVesc(quint8 id, QByteArray data);
     void setRcControlCurrent(quint8 id, double current, double steering);
     void setRcControlCurrentBrake(quint8 id, double current, double steering);
@@ -0,0 +1,526 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "packetlog.h"
+#include <QDir>
+#include <QDateTime>
+#include <QDebug>
+#include <cstring>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
+
+const char PacketLog::SEGMENT_MAGIC[9] = "RCPKTLG1";
+const char PacketLog::INDEX_MAGIC[9] = "RCPKTIX1";
+
+namespace {
+void putInt64(char *buffer, int64_t value)
+{
+    memcpy(buffer, &value, sizeof(value));
+}
+}
+
+PacketLog::PacketLog(QObject *parent) : QThread(parent)
+{
+    for (int i = 0;i < BLOCKS;i++) {
+        mBlocks[i].data = new char[BLOCK_SIZE];
+        mBlocks[i].len = 0;
+        mBlocks[i].firstMonoUs = 0;
+    }
+
+    mFree.reserve(BLOCKS);
+    mFull.reserve(BLOCKS);
+    mCurrent = 0;
+    mRunning = false;
+    mStop = false;
+    mClock.start();
+    mUtcOffsetMs = 0;
+    mUtcValid = false;
+    memset(&mStats, 0, sizeof(mStats));
+
+    mSegmentBytesMax = 64 * 1024 * 1024;
+    mSegmentSecondsMax = 3600;
+    mSegmentStartUs = 0;
+    mIndexLastUs = 0;
+    mSyncLastUs = 0;
+}
+
+PacketLog::~PacketLog()
+{
+    stopLog();
+
+    for (int i = 0;i < BLOCKS;i++) {
+        delete[] mBlocks[i].data;
+    }
+}
+
+/**
+ * @brief PacketLog::startLog
+ * Start recording.
+ *
+ * @param directory
+ * Directory for the segments. It is created if it does not exist.
+ *
+ * @return
+ * true for success, false otherwise.
+ */
+bool PacketLog::startLog(QString directory)
+{
+    stopLog();
+
+    QDir dir;
+    if (!dir.mkpath(directory)) {
+        qWarning() << "Could not create packet log directory" << directory;
+        return false;
+    }
+
+    mDirectory = directory;
+
+    mMutex.lock();
+    mFree.clear();
+    mFull.clear();
+    for (int i = 0;i < BLOCKS;i++) {
+        mFree.append(&mBlocks[i]);
+    }
+    mCurrent = 0;
+    mStop = false;
+    mRunning = true;
+    mMutex.unlock();
+
+    start();
+    return true;
+}
+
+/**
+ * @brief PacketLog::stopLog
+ * Write everything that is recorded and close the segment.
+ */
+void PacketLog::stopLog()
+{
+    mMutex.lock();
+    mStop = true;
+    mCondition.wakeOne();
+    mMutex.unlock();
+
+    wait();
+
+    mMutex.lock();
+    mRunning = false;
+    mMutex.unlock();
+}
+
+/**
+ * @brief PacketLog::setRotation
+ * Set when a new segment is started. Takes effect at the next segment.
+ *
+ * @param segmentBytes
+ * Maximum size of a segment.
+ *
+ * @param segmentSeconds
+ * Maximum age of a segment.
+ */
+void PacketLog::setRotation(qint64 segmentBytes, int segmentSeconds)
+{
+    QMutexLocker locker(&mMutex);
+    mSegmentBytesMax = segmentBytes;
+    mSegmentSecondsMax = segmentSeconds;
+}
+
+/**
+ * @brief PacketLog::setGnssTime
+ * Set the current UTC time from the GNSS receiver. The offset to the
+ * monotonic clock is used for the UTC time of the following records.
+ *
+ * @param utcMs
+ * Milliseconds since the epoch.
+ */
+void PacketLog::setGnssTime(qint64 utcMs)
+{
+    qint64 monoMs = mClock.nsecsElapsed() / 1000000;
+
+    QMutexLocker locker(&mMutex);
+    mUtcOffsetMs = utcMs - monoMs;
+    mUtcValid = true;
+}
+
+/**
+ * @brief PacketLog::log
+ * Record a packet. Can be called from any thread, and only copies the
+ * packet.
+ *
+ * @param dir
+ * The direction.
+ *
+ * @param data
+ * The packet payload.
+ *
+ * @param len
+ * Length of the payload.
+ *
+ * @return
+ * true if the packet was recorded, false if the log is stopped, the packet
+ * is too large or all blocks are full.
+ */
+bool PacketLog::log(PacketLog::DIRECTION dir, const char *data, int len)
+{
+    int recLen = sizeof(RecordHeader) + len;
+    if (len < 0 || len > 0xFFFF || recLen > BLOCK_SIZE) {
+        return false;
+    }
+
+    qint64 monoUs = mClock.nsecsElapsed() / 1000;
+
+    QMutexLocker locker(&mMutex);
+
+    if (!mRunning || mStop) {
+        return false;
+    }
+
+    if (!mCurrent || (mCurrent->len + recLen) > BLOCK_SIZE) {
+        if (mCurrent) {
+            mFull.append(mCurrent);
+            mCurrent = 0;
+            mCondition.wakeOne();
+        }
+
+        if (mFree.isEmpty()) {
+            mStats.dropped++;
+            return false;
+        }
+
+        mCurrent = mFree.takeLast();
+        mCurrent->len = 0;
+        mCurrent->firstMonoUs = monoUs;
+    }
+
+    RecordHeader *h = (RecordHeader*)(mCurrent->data + mCurrent->len);
+    h->sync = RECORD_SYNC;
+    h->len = len;
+    h->dir = dir;
+    h->flags = mUtcValid ? RECORD_FLAG_UTC : 0;
+    h->reserved = 0;
+    h->monoUs = monoUs;
+    h->utcMs = mUtcValid ? (monoUs / 1000 + mUtcOffsetMs) : 0;
+    h->crc = 0;
+    memcpy(h + 1, data, len);
+
+    mCurrent->len += recLen;
+    mStats.records++;
+    mStats.bytes += recLen;
+
+    return true;
+}
+
+PacketLog::Stats PacketLog::stats()
+{
+    QMutexLocker locker(&mMutex);
+    return mStats;
+}
+
+uint32_t PacketLog::crc32(const uint8_t *data, int len, uint32_t crc)
+{
+    // Built once, also when the writer and a reader get here at the same time
+    static const QVector<uint32_t> table = []() {
+        QVector<uint32_t> t(256);
+        for (uint32_t i = 0;i < 256;i++) {
+            uint32_t c = i;
+            for (int j = 0;j < 8;j++) {
+                c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (int i = 0;i < len;i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+void PacketLog::run()
+{
+    for (;;) {
+        Block *b = 0;
+        bool stop = false;
+
+        mMutex.lock();
+        if (mFull.isEmpty() && !mStop) {
+            mCondition.wait(&mMutex, FLUSH_MS);
+        }
+
+        // Write partial blocks too, so that the log is never far behind
+        qint64 nowUs = mClock.nsecsElapsed() / 1000;
+        if (mFull.isEmpty() && mCurrent && mCurrent->len > 0 &&
+                (mStop || (nowUs - mCurrent->firstMonoUs) >= (FLUSH_MS * 1000))) {
+            mFull.append(mCurrent);
+            mCurrent = 0;
+        }
+
+        if (!mFull.isEmpty()) {
+            b = mFull.takeFirst();
+        } else {
+            stop = mStop;
+        }
+        mMutex.unlock();
+
+        if (b) {
+            writeBlock(b);
+
+            mMutex.lock();
+            mFree.append(b);
+            mMutex.unlock();
+        }
+
+        if ((nowUs - mSyncLastUs) >= (SYNC_MS * 1000)) {
+            sync();
+            mSyncLastUs = nowUs;
+        }
+
+        if (stop) {
+            break;
+        }
+    }
+
+    closeSegment();
+}
+
+bool PacketLog::openSegment(qint64 monoUs)
+{
+    closeSegment();
+
+    mMutex.lock();
+    int segment = mStats.segments;
+    mMutex.unlock();
+
+    QString name = QDateTime::currentDateTime().
+            toString("PKT_yyyy-MM-dd_hh.mm.ss");
+    name += QString("_%1.bin").arg(segment, 4, 10, QChar('0'));
+
+    mSegment.setFileName(mDirectory + "/" + name);
+    mIndex.setFileName(mDirectory + "/" + name + ".idx");
+
+    if (!mSegment.open(QIODevice::WriteOnly | QIODevice::Append) ||
+            !mIndex.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        qWarning() << "Could not open packet log segment" << mSegment.fileName();
+        closeSegment();
+        return false;
+    }
+
+    char header[FILE_HEADER_LEN];
+    memset(header, 0, sizeof(header));
+    memcpy(header, SEGMENT_MAGIC, 8);
+    putInt64(header + 8, monoUs);
+    putInt64(header + 16, QDateTime::currentMSecsSinceEpoch());
+    mSegment.write(header, sizeof(header));
+
+    memcpy(header, INDEX_MAGIC, 8);
+    mIndex.write(header, sizeof(header));
+
+    mSegmentStartUs = monoUs;
+    mIndexLastUs = monoUs - INDEX_INTERVAL_US;
+
+    mMutex.lock();
+    mStats.segments++;
+    mMutex.unlock();
+
+    return true;
+}
+
+void PacketLog::closeSegment()
+{
+    if (mSegment.isOpen()) {
+        sync();
+        mSegment.close();
+    }
+
+    if (mIndex.isOpen()) {
+        mIndex.close();
+    }
+}
+
+void PacketLog::writeBlock(PacketLog::Block *b)
+{
+    mMutex.lock();
+    qint64 bytesMax = mSegmentBytesMax;
+    qint64 ageMaxUs = (qint64)mSegmentSecondsMax * 1000000;
+    mMutex.unlock();
+
+    // Blocks only contain whole records, so a block never spans segments
+    if (!mSegment.isOpen() ||
+            (mSegment.size() + b->len) > bytesMax ||
+            (b->firstMonoUs - mSegmentStartUs) > ageMaxUs) {
+        if (!openSegment(b->firstMonoUs)) {
+            return;
+        }
+    }
+
+    qint64 offset = mSegment.size();
+    int ind = 0;
+
+    while (ind < b->len) {
+        RecordHeader *h = (RecordHeader*)(b->data + ind);
+        int recLen = sizeof(RecordHeader) + h->len;
+
+        h->crc = crc32((const uint8_t*)h, recLen);
+
+        if ((h->monoUs - mIndexLastUs) >= INDEX_INTERVAL_US) {
+            IndexEntry e;
+            e.monoUs = h->monoUs;
+            e.offset = offset + ind;
+            mIndex.write((const char*)&e, sizeof(e));
+            mIndexLastUs = h->monoUs;
+        }
+
+        ind += recLen;
+    }
+
+    mSegment.write(b->data, b->len);
+}
+
+void PacketLog::sync()
+{
+    if (mSegment.isOpen()) {
+        mSegment.flush();
+        mIndex.flush();
+#ifdef Q_OS_UNIX
+        fdatasync(mSegment.handle());
+        fdatasync(mIndex.handle());
+#endif
+    }
+}
+
+bool PacketLogReader::open(QString segment)
+{
+    close();
+
+    mFile.setFileName(segment);
+    if (!mFile.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QByteArray header = mFile.read(PacketLog::FILE_HEADER_LEN);
+    if (header.size() != PacketLog::FILE_HEADER_LEN ||
+            !header.startsWith(PacketLog::SEGMENT_MAGIC)) {
+        close();
+        return false;
+    }
+
+    // Without an index, seek() reads from the start
+    QFile index(segment + ".idx");
+    if (index.open(QIODevice::ReadOnly)) {
+        QByteArray data = index.readAll();
+        if (data.startsWith(PacketLog::INDEX_MAGIC)) {
+            int n = (data.size() - PacketLog::FILE_HEADER_LEN) / sizeof(PacketLog::IndexEntry);
+            mIndex.resize(qMax(n, 0));
+            if (n > 0) {
+                memcpy(mIndex.data(), data.constData() + PacketLog::FILE_HEADER_LEN,
+                       n * sizeof(PacketLog::IndexEntry));
+            }
+        }
+    }
+
+    return true;
+}
+
+void PacketLogReader::close()
+{
+    mFile.close();
+    mIndex.clear();
+}
+
+/**
+ * @brief PacketLogReader::seek
+ * Go to the first record at or after a time.
+ *
+ * @param monoUs
+ * Monotonic time in microseconds.
+ *
+ * @return
+ * true if there is such a record.
+ */
+bool PacketLogReader::seek(qint64 monoUs)
+{
+    // Last index entry at or before the time
+    int lo = 0;
+    int hi = mIndex.size() - 1;
+    qint64 offset = PacketLog::FILE_HEADER_LEN;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (mIndex.at(mid).monoUs <= monoUs) {
+            offset = mIndex.at(mid).offset;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    if (!mFile.seek(offset)) {
+        return false;
+    }
+
+    PacketLog::RecordHeader h;
+    QByteArray payload;
+
+    for (;;) {
+        qint64 pos = mFile.pos();
+        if (!next(h, payload)) {
+            return false;
+        }
+
+        if (h.monoUs >= monoUs) {
+            return mFile.seek(pos);
+        }
+    }
+}
+
+/**
+ * @brief PacketLogReader::next
+ * Read the next record.
+ *
+ * @return
+ * true if a complete record with a valid checksum was read.
+ */
+bool PacketLogReader::next(PacketLog::RecordHeader &header, QByteArray &payload)
+{
+    if (mFile.read((char*)&header, sizeof(header)) != sizeof(header) ||
+            header.sync != PacketLog::RECORD_SYNC) {
+        return false;
+    }
+
+    payload = mFile.read(header.len);
+    if (payload.size() != header.len) {
+        return false;
+    }
+
+    uint32_t crc = header.crc;
+    header.crc = 0;
+    uint32_t calc = PacketLog::crc32((const uint8_t*)&header, sizeof(header));
+    calc = PacketLog::crc32((const uint8_t*)payload.constData(), payload.size(), calc);
+    header.crc = crc;
+
+    return calc == crc;
+}
+
+const QVector<PacketLog::IndexEntry> &PacketLogReader::index() const
+{
+    return mIndex;
+}
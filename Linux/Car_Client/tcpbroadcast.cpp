@@ -16,16 +16,27 @@
     */
 
 #include "tcpbroadcast.h"
+#include <QTimer>
 
 TcpBroadcast::TcpBroadcast(QObject *parent) : QObject(parent)
 {
     mTcpServer = new QTcpServer(this);
+    mClock.start();
+    mLowWatermark = 128 * 1024;
+    mHighWatermark = 512 * 1024;
+    mPolicy = SLOW_CLIENT_DROP;
+    mClientsDisconnected = 0;
+
     connect(mTcpServer, SIGNAL(newConnection()), this, SLOT(newTcpConnection()));
 }
 
 TcpBroadcast::~TcpBroadcast()
 {
     logStop();
+
+    while (!mClients.isEmpty()) {
+        delete mClients.takeFirst();
+    }
 }
 
 bool TcpBroadcast::startTcpServer(int port)
@@ -46,31 +57,55 @@ QString TcpBroadcast::getLastError()
 void TcpBroadcast::stopServer()
 {
     mTcpServer->close();
-    QMutableListIterator<QTcpSocket*> itr(mSockets);
 
-    while(itr.hasNext()) {
-        QTcpSocket *socket = itr.next();
-        socket->deleteLater();
-        itr.remove();
+    while (!mClients.isEmpty()) {
+        removeClient(mClients.first());
     }
 }
 
 void TcpBroadcast::broadcastData(QByteArray data)
 {
-    QMutableListIterator<QTcpSocket*> itr(mSockets);
-
     if (mLog.isOpen()) {
         mLog.write(data);
     }
 
-    while(itr.hasNext()) {
-        QTcpSocket *socket = itr.next();
-        if (socket->isOpen()) {
-            socket->write(data);
-        } else {
-            socket->deleteLater();
-            itr.remove();
+    Payload p;
+    p.data = data;
+    p.time = mClock.elapsed();
+
+    QList<Client*> clients = mClients;
+    for (Client *c: clients) {
+        if (!c->socket->isOpen()) {
+            removeClient(c);
+            continue;
+        }
+
+        int backlog = c->queued + (int)c->socket->bytesToWrite();
+
+        if (c->dropping && backlog < mLowWatermark) {
+            c->dropping = false;
+        }
+
+        if (!c->dropping && (backlog + data.size()) > mHighWatermark) {
+            if (mPolicy == SLOW_CLIENT_DISCONNECT) {
+                qDebug() << "TCP client too slow, disconnecting:" << c->socket->peerAddress();
+                mClientsDisconnected++;
+                removeClient(c);
+                continue;
+            }
+
+            c->dropping = true;
         }
+
+        if (c->dropping) {
+            c->bytesDropped += data.size();
+            continue;
+        }
+
+        // Only the reference is stored, the data is shared by all clients.
+        c->queue.append(p);
+        c->queued += data.size();
+        flush(c);
     }
 }
 
@@ -92,9 +127,158 @@ void TcpBroadcast::logStop()
     }
 }
 
+/**
+ * @brief TcpBroadcast::setWatermarks
+ * Set the backlog limits of the clients.
+ *
+ * @param low
+ * Payloads are written to a socket while its write buffer is smaller than
+ * this, and a client that was dropping data gets it again when its backlog
+ * is smaller than this.
+ *
+ * @param high
+ * A client with a backlog larger than this is slow.
+ */
+void TcpBroadcast::setWatermarks(int low, int high)
+{
+    mLowWatermark = low;
+    mHighWatermark = high;
+}
+
+void TcpBroadcast::setSlowClientPolicy(TcpBroadcast::SLOW_CLIENT_POLICY policy)
+{
+    mPolicy = policy;
+}
+
+int TcpBroadcast::clientCount()
+{
+    return mClients.size();
+}
+
+/**
+ * @brief TcpBroadcast::getClientStats
+ * Get the statistics of the connected clients. The throughput is averaged
+ * since the previous call, if that was at least a second ago.
+ *
+ * @return
+ * The statistics, one entry per client.
+ */
+QList<TcpBroadcast::ClientStats> TcpBroadcast::getClientStats()
+{
+    QList<ClientStats> res;
+    qint64 now = mClock.elapsed();
+
+    for (Client *c: mClients) {
+        if ((now - c->rateTime) >= 1000) {
+            c->bytesPerSec = (double)(c->bytesSent - c->rateBytes) * 1000.0 /
+                    (double)(now - c->rateTime);
+            c->rateBytes = c->bytesSent;
+            c->rateTime = now;
+        }
+
+        ClientStats s;
+        s.address = QString("%1:%2").
+                arg(c->socket->peerAddress().toString()).
+                arg(c->socket->peerPort());
+        s.bytesSent = c->bytesSent;
+        s.bytesDropped = c->bytesDropped;
+        s.backlog = c->queued + (int)c->socket->bytesToWrite();
+        s.lagMs = c->queue.isEmpty() ? 0.0 : (double)(now - c->queue.first().time);
+        s.bytesPerSec = c->bytesPerSec;
+        s.dropping = c->dropping;
+        res.append(s);
+    }
+
+    return res;
+}
+
+/**
+ * @brief TcpBroadcast::clientsDisconnected
+ * @return
+ * The number of clients that were disconnected for being too slow.
+ */
+int TcpBroadcast::clientsDisconnected()
+{
+    return mClientsDisconnected;
+}
+
 void TcpBroadcast::newTcpConnection()
 {
-    mSockets.append(mTcpServer->nextPendingConnection());
-    qDebug() << "TCP connection accepted:" << mSockets[mSockets.size() - 1]->peerAddress();
+    while (mTcpServer->hasPendingConnections()) {
+        Client *c = new Client;
+        c->socket = mTcpServer->nextPendingConnection();
+        c->queued = 0;
+        c->dropping = false;
+        c->bytesSent = 0;
+        c->bytesDropped = 0;
+        c->rateBytes = 0;
+        c->rateTime = mClock.elapsed();
+        c->bytesPerSec = 0.0;
+        mClients.append(c);
+
+        connect(c->socket, SIGNAL(bytesWritten(qint64)),
+                this, SLOT(socketBytesWritten(qint64)));
+        connect(c->socket, SIGNAL(disconnected()),
+                this, SLOT(socketDisconnected()));
+
+        qDebug() << "TCP connection accepted:" << c->socket->peerAddress();
+    }
+}
+
+void TcpBroadcast::socketBytesWritten(qint64 bytes)
+{
+    Client *c = findClient(sender());
+    if (c) {
+        c->bytesSent += bytes;
+        flush(c);
+    }
+}
+
+void TcpBroadcast::socketDisconnected()
+{
+    Client *c = findClient(sender());
+    if (c) {
+        removeClient(c);
+    }
 }
 
+TcpBroadcast::Client *TcpBroadcast::findClient(QObject *socket)
+{
+    for (Client *c: mClients) {
+        if (c->socket == socket) {
+            return c;
+        }
+    }
+
+    return 0;
+}
+
+void TcpBroadcast::removeClient(TcpBroadcast::Client *c)
+{
+    mClients.removeOne(c);
+    disconnect(c->socket, 0, this, 0);
+
+    // Close gracefully, so that the client gets what the socket has buffered
+    // and then the end of the stream. Aborting would reset the connection,
+    // which the client cannot tell apart from an error. A client that does
+    // not read what is left is aborted after a while.
+    QTcpSocket *socket = c->socket;
+    connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+    QTimer::singleShot(CLOSE_TIMEOUT_MS, socket, SLOT(abort()));
+    socket->disconnectFromHost();
+
+    if (socket->state() == QAbstractSocket::UnconnectedState) {
+        socket->deleteLater();
+    }
+
+    delete c;
+}
+
+void TcpBroadcast::flush(TcpBroadcast::Client *c)
+{
+    while (!c->queue.isEmpty() && c->socket->bytesToWrite() < mLowWatermark) {
+        Payload p = c->queue.takeFirst();
+        c->queued -= p.data.size();
+        c->socket->write(p.data);
+    }
+}
@@ -0,0 +1,265 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "tcpbroadcasttest.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <functional>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+namespace {
+bool waitFor(std::function<bool()> cond, int timeoutMs)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    while (!cond()) {
+        if (timer.elapsed() > timeoutMs) {
+            return false;
+        }
+
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+    }
+
+    return true;
+}
+
+bool check(bool ok, const char *what)
+{
+    if (!ok) {
+        qCritical() << "  FAIL:" << what;
+    }
+
+    return ok;
+}
+
+// A plain socket with a small receive buffer, so that the kernel does not
+// absorb the backlog. Qt sockets read into their own buffer in the event
+// loop, which would hide the slow client.
+int connectSlowClient(int port, int *localPort)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int rcvBuf = 4096;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (sockaddr*)&addr, &len);
+    *localPort = ntohs(addr.sin_port);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return fd;
+}
+
+// Read everything the slow client has pending. Returns DRAIN_EOF at a clean
+// end of stream, i.e. when the server has closed the connection, and
+// DRAIN_ERROR if it was reset or failed.
+typedef enum {
+    DRAIN_PENDING = 0,
+    DRAIN_EOF,
+    DRAIN_ERROR
+} DRAIN_RESULT;
+
+DRAIN_RESULT drainSlowClient(int fd, int *err)
+{
+    char buf[4096];
+
+    for (;;) {
+        ssize_t res = read(fd, buf, sizeof(buf));
+        if (res > 0) {
+            continue;
+        }
+
+        if (res == 0) {
+            return DRAIN_EOF;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return DRAIN_PENDING;
+        }
+
+        *err = errno;
+        return DRAIN_ERROR;
+    }
+}
+
+bool findStats(TcpBroadcast &server, int port, TcpBroadcast::ClientStats *stats)
+{
+    QString suffix = QString(":%1").arg(port);
+
+    for (TcpBroadcast::ClientStats s: server.getClientStats()) {
+        if (s.address.endsWith(suffix)) {
+            *stats = s;
+            return true;
+        }
+    }
+
+    return false;
+}
+}
+
+/**
+ * @brief TcpBroadcastTest::run
+ * Run the test with both slow client policies and print the results.
+ *
+ * @param port
+ * TCP port of the server, it has to be free.
+ *
+ * @return
+ * true if all checks passed.
+ */
+bool TcpBroadcastTest::run(int port)
+{
+    bool drop = runPolicy(TcpBroadcast::SLOW_CLIENT_DROP, port);
+    qDebug() << "TCP broadcast self test, drop policy:" << (drop ? "PASS" : "FAIL");
+
+    bool disconnect = runPolicy(TcpBroadcast::SLOW_CLIENT_DISCONNECT, port + 1);
+    qDebug() << "TCP broadcast self test, disconnect policy:" << (disconnect ? "PASS" : "FAIL");
+
+    return drop && disconnect;
+}
+
+bool TcpBroadcastTest::runPolicy(TcpBroadcast::SLOW_CLIENT_POLICY policy, int port)
+{
+    TcpBroadcast server;
+    server.setWatermarks(LOW_WATERMARK, HIGH_WATERMARK);
+    server.setSlowClientPolicy(policy);
+
+    if (!server.startTcpServer(port)) {
+        return false;
+    }
+
+    QTcpSocket reader;
+    qint64 readerBytes = 0;
+    QObject::connect(&reader, &QTcpSocket::readyRead, [&]() {
+        readerBytes += reader.readAll().size();
+    });
+
+    reader.connectToHost(QHostAddress::LocalHost, port);
+    if (!check(reader.waitForConnected(2000), "reading client connects")) {
+        return false;
+    }
+
+    int slowPort = 0;
+    int slowFd = connectSlowClient(port, &slowPort);
+    if (!check(slowFd >= 0, "slow client connects")) {
+        return false;
+    }
+
+    bool ok = check(waitFor([&]() { return server.clientCount() == 2; }, 2000),
+                    "server accepts both clients");
+
+    QByteArray chunk(CHUNK_LEN, 'x');
+    qint64 broadcast = 0;
+    TcpBroadcast::ClientStats slow;
+
+    // Broadcast until the slow client is caught by the policy. The kernel
+    // buffers take some of the backlog, so this can be a few MB.
+    std::function<bool()> caught = [&]() {
+        if (policy == TcpBroadcast::SLOW_CLIENT_DISCONNECT) {
+            return server.clientsDisconnected() > 0;
+        }
+
+        return findStats(server, slowPort, &slow) && slow.dropping;
+    };
+
+    while (ok && !caught() && broadcast < BROADCAST_MAX) {
+        server.broadcastData(chunk);
+        broadcast += chunk.size();
+        QCoreApplication::processEvents();
+    }
+
+    ok = check(caught(), "slow client detected") && ok;
+
+    if (ok && policy == TcpBroadcast::SLOW_CLIENT_DROP) {
+        qint64 dropped = slow.bytesDropped;
+
+        for (int i = 0;i < 16;i++) {
+            server.broadcastData(chunk);
+            broadcast += chunk.size();
+            QCoreApplication::processEvents();
+        }
+
+        ok = check(findStats(server, slowPort, &slow), "slow client stays connected") && ok;
+        ok = check(slow.dropping, "slow client is dropping") && ok;
+        ok = check(slow.bytesDropped >= (dropped + 16 * CHUNK_LEN),
+                   "dropped bytes grow") && ok;
+        ok = check(slow.backlog <= HIGH_WATERMARK, "backlog stays below the high watermark") && ok;
+        ok = check(server.clientsDisconnected() == 0, "no client disconnected") && ok;
+    }
+
+    if (ok && policy == TcpBroadcast::SLOW_CLIENT_DISCONNECT) {
+        ok = check(server.clientsDisconnected() == 1, "one client disconnected") && ok;
+        ok = check(server.clientCount() == 1, "one client left") && ok;
+        ok = check(!findStats(server, slowPort, &slow), "slow client removed") && ok;
+
+        // Once the slow client reads, the kernel delivers what was sent and
+        // then the end of the stream. A reset means that the server aborted
+        // the connection instead of closing it.
+        DRAIN_RESULT drain = DRAIN_PENDING;
+        int err = 0;
+        ok = check(waitFor([&]() {
+            drain = drainSlowClient(slowFd, &err);
+            return drain != DRAIN_PENDING;
+        }, 5000), "slow client sees the connection closed") && ok;
+
+        if (drain == DRAIN_ERROR) {
+            qCritical() << "  Slow client read error:" << strerror(err);
+        }
+
+        ok = check(drain == DRAIN_EOF, "slow client sees a clean end of stream") && ok;
+    }
+
+    ok = check(waitFor([&]() { return readerBytes >= broadcast; }, 5000),
+               "reading client gets every byte") && ok;
+    ok = check(readerBytes == broadcast, "reading client gets no extra bytes") && ok;
+
+    TcpBroadcast::ClientStats fast;
+    if (check(findStats(server, reader.localPort(), &fast), "reading client stays connected")) {
+        ok = check(fast.bytesDropped == 0 && !fast.dropping, "reading client drops nothing") && ok;
+    } else {
+        ok = false;
+    }
+
+    qDebug() << "  Broadcast" << broadcast << "bytes, the reading client got" << readerBytes;
+
+    close(slowFd);
+    reader.abort();
+    server.stopServer();
+
+    return ok;
+}
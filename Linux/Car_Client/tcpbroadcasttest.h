@@ -0,0 +1,47 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef TCPBROADCASTTEST_H
+#define TCPBROADCASTTEST_H
+
+#include "tcpbroadcast.h"
+
+/**
+ * @brief The TcpBroadcastTest class
+ *
+ * Self test of the slow client handling in TcpBroadcast. Two clients are
+ * connected over loopback, one that reads everything and one that never
+ * reads, and data is broadcast until the backlog of the second client is
+ * far above the high watermark. With both policies the reading client
+ * must get every byte.
+ */
+class TcpBroadcastTest
+{
+public:
+    static const int LOW_WATERMARK = 16 * 1024;
+    static const int HIGH_WATERMARK = 64 * 1024;
+    static const int CHUNK_LEN = 1024;
+    static const int BROADCAST_MAX = 64 * 1024 * 1024;
+
+    static bool run(int port = 18400);
+
+private:
+    static bool runPolicy(TcpBroadcast::SLOW_CLIENT_POLICY policy, int port);
+
+};
+
+#endif // TCPBROADCASTTEST_H
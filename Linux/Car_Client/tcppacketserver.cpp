@@ -0,0 +1,394 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "tcppacketserver.h"
+#include "datatypes.h"
+#include <QDebug>
+#include <QTimer>
+
+namespace {
+// The command of the reply, when it is not the same as the request
+int replyCmd(int cmd)
+{
+    switch (cmd) {
+    case CMD_SET_SYSTEM_TIME: return CMD_SET_SYSTEM_TIME_ACK;
+    case CMD_REBOOT_SYSTEM: return CMD_REBOOT_SYSTEM_ACK;
+    case CMD_MOTE_UBX_START_BASE: return CMD_MOTE_UBX_START_BASE_ACK;
+    default: return cmd;
+    }
+}
+
+// The commands that the car answers. Everything else, e.g. driving commands,
+// CMD_SET_POS and RTCM, is sent without a reply and must not be tracked as a
+// request, as that would route an unrelated packet to the wrong client.
+bool hasReply(int cmd)
+{
+    switch (cmd) {
+    case CMD_SET_POS_ACK:
+    case CMD_SET_ENU_REF:
+    case CMD_GET_ENU_REF:
+    case CMD_AP_ADD_POINTS:
+    case CMD_AP_REMOVE_LAST_POINT:
+    case CMD_AP_CLEAR_POINTS:
+    case CMD_AP_GET_ROUTE_PART:
+    case CMD_AP_SET_ACTIVE:
+    case CMD_AP_REPLACE_ROUTE:
+    case CMD_AP_SYNC_POINT:
+    case CMD_SET_YAW_OFFSET_ACK:
+    case CMD_SET_SYSTEM_TIME:
+    case CMD_REBOOT_SYSTEM:
+    case CMD_RADAR_SETUP_SET:
+    case CMD_RADAR_SETUP_GET:
+    case CMD_SET_MAIN_CONFIG:
+    case CMD_GET_MAIN_CONFIG:
+    case CMD_GET_MAIN_CONFIG_DEFAULT:
+    case CMD_GET_STATE:
+    case CMD_MR_GET_STATE:
+    case CMD_MOTE_UBX_START_BASE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool isControlCmd(int cmd)
+{
+    return cmd == CMD_RC_CONTROL || cmd == CMD_SET_SERVO_DIRECT ||
+            cmd == CMD_MR_RC_CONTROL || cmd == CMD_MR_OVERRIDE_POWER;
+}
+}
+
+TcpPacketServer::TcpPacketServer(QObject *parent) : QObject(parent)
+{
+    mTcpServer = new QTcpServer(this);
+    mPacketOut = new Packet(this);
+    mClock.start();
+    mMaxBacklog = 256 * 1024;
+    mNextClient = 0;
+    mControlClient = 0;
+    mControlTime = 0;
+    mForwardPending = false;
+
+    connect(mTcpServer, SIGNAL(newConnection()), this, SLOT(newTcpConnection()));
+    connect(mPacketOut, SIGNAL(dataToSend(QByteArray&)),
+            this, SLOT(framedData(QByteArray&)));
+}
+
+TcpPacketServer::~TcpPacketServer()
+{
+    while (!mClients.isEmpty()) {
+        delete mClients.takeFirst();
+    }
+}
+
+bool TcpPacketServer::startServer(int port)
+{
+    return mTcpServer->listen(QHostAddress::Any, port);
+}
+
+void TcpPacketServer::stopServer()
+{
+    mTcpServer->close();
+
+    while (!mClients.isEmpty()) {
+        removeClient(mClients.first());
+    }
+}
+
+QString TcpPacketServer::errorString()
+{
+    return mTcpServer->errorString();
+}
+
+/**
+ * @brief TcpPacketServer::sendPacket
+ * Send a packet from the car to the clients. If it is the reply to a
+ * request it only goes to the client that made the request.
+ *
+ * @param data
+ * The packet, starting with the car id and the command.
+ */
+void TcpPacketServer::sendPacket(const QByteArray &data)
+{
+    if (mClients.isEmpty() || data.size() < 2) {
+        return;
+    }
+
+    quint8 id = data.at(0);
+    quint8 cmd = data.at(1);
+    qint64 now = mClock.elapsed();
+
+    while (!mRequests.isEmpty() &&
+           (now - mRequests.first().time) > REQUEST_TIMEOUT_MS) {
+        mRequests.removeFirst();
+    }
+
+    Client *dest = 0;
+    for (int i = 0;i < mRequests.size();i++) {
+        const Request &r = mRequests.at(i);
+        if ((r.id == 255 || r.id == id) && (r.cmd == cmd || replyCmd(r.cmd) == cmd)) {
+            dest = r.client;
+            mRequests.removeAt(i);
+            break;
+        }
+    }
+
+    mPacketOut->sendPacket(data);
+    QByteArray framed = mFramed;
+    mFramed.clear();
+
+    if (dest) {
+        queueTx(dest, framed);
+    } else {
+        // Rotate the order, so that no client always is the last one.
+        int n = mClients.size();
+        int start = mNextClient % n;
+        mNextClient = (start + 1) % n;
+
+        for (int i = 0;i < n;i++) {
+            queueTx(mClients.at((start + i) % n), framed);
+        }
+    }
+}
+
+/**
+ * @brief TcpPacketServer::setMaxBacklog
+ * Set the number of bytes that can be waiting for a client before its
+ * oldest packets are dropped.
+ *
+ * @param bytes
+ * The limit in bytes.
+ */
+void TcpPacketServer::setMaxBacklog(int bytes)
+{
+    mMaxBacklog = bytes;
+}
+
+int TcpPacketServer::clientCount()
+{
+    return mClients.size();
+}
+
+QList<TcpPacketServer::ClientStats> TcpPacketServer::getClientStats()
+{
+    QList<ClientStats> res;
+
+    for (Client *c: mClients) {
+        ClientStats s = c->stats;
+        s.backlog = c->txQueued + (int)c->socket->bytesToWrite();
+        res.append(s);
+    }
+
+    return res;
+}
+
+void TcpPacketServer::newTcpConnection()
+{
+    while (mTcpServer->hasPendingConnections()) {
+        Client *c = new Client;
+        c->socket = mTcpServer->nextPendingConnection();
+        c->packet = new Packet(this);
+        c->txQueued = 0;
+        c->stats.address = QString("%1:%2").
+                arg(c->socket->peerAddress().toString()).
+                arg(c->socket->peerPort());
+        c->stats.packetsRx = 0;
+        c->stats.packetsTx = 0;
+        c->stats.packetsDropped = 0;
+        c->stats.cmdRejected = 0;
+        c->stats.backlog = 0;
+        mClients.append(c);
+
+        connect(c->socket, SIGNAL(readyRead()), this, SLOT(socketDataAvailable()));
+        connect(c->socket, SIGNAL(disconnected()), this, SLOT(socketDisconnected()));
+        connect(c->socket, SIGNAL(bytesWritten(qint64)), this, SLOT(socketBytesWritten()));
+        connect(c->packet, SIGNAL(packetReceived(QByteArray&)),
+                this, SLOT(clientPacketRx(QByteArray&)));
+
+        qDebug() << "TCP packet client connected:" << c->stats.address;
+        emit connectionChanged(mClients.size());
+    }
+}
+
+void TcpPacketServer::socketDataAvailable()
+{
+    Client *c = findClient(sender());
+    if (c) {
+        c->packet->processData(c->socket->readAll());
+    }
+}
+
+void TcpPacketServer::socketDisconnected()
+{
+    Client *c = findClient(sender());
+    if (c) {
+        qDebug() << "TCP packet client disconnected:" << c->stats.address;
+        removeClient(c);
+        emit connectionChanged(mClients.size());
+    }
+}
+
+void TcpPacketServer::socketBytesWritten()
+{
+    Client *c = findClient(sender());
+    if (c) {
+        flush(c);
+    }
+}
+
+void TcpPacketServer::clientPacketRx(QByteArray &packet)
+{
+    Client *c = findClient(sender());
+    if (!c || packet.size() < 2) {
+        return;
+    }
+
+    c->stats.packetsRx++;
+
+    if (!acceptCommand(c, (quint8)packet.at(1))) {
+        c->stats.cmdRejected++;
+        return;
+    }
+
+    if (c->cmdQueue.size() >= CMD_QUEUE_MAX) {
+        c->cmdQueue.removeFirst();
+        c->stats.cmdRejected++;
+    }
+
+    c->cmdQueue.append(packet);
+
+    // Forward from the event loop, so that the commands that arrive from
+    // all clients at about the same time are interleaved.
+    if (!mForwardPending) {
+        mForwardPending = true;
+        QTimer::singleShot(0, this, SLOT(forwardCommands()));
+    }
+}
+
+void TcpPacketServer::framedData(QByteArray &data)
+{
+    mFramed = data;
+}
+
+TcpPacketServer::Client *TcpPacketServer::findClient(QObject *obj)
+{
+    for (Client *c: mClients) {
+        if (c->socket == obj || c->packet == obj) {
+            return c;
+        }
+    }
+
+    return 0;
+}
+
+void TcpPacketServer::removeClient(TcpPacketServer::Client *c)
+{
+    mClients.removeOne(c);
+
+    for (int i = mRequests.size() - 1;i >= 0;i--) {
+        if (mRequests.at(i).client == c) {
+            mRequests.removeAt(i);
+        }
+    }
+
+    if (mControlClient == c) {
+        mControlClient = 0;
+    }
+
+    disconnect(c->socket, 0, this, 0);
+    c->socket->abort();
+    c->socket->deleteLater();
+    c->packet->deleteLater();
+    delete c;
+}
+
+void TcpPacketServer::queueTx(TcpPacketServer::Client *c, const QByteArray &framed)
+{
+    c->txQueue.append(framed);
+    c->txQueued += framed.size();
+
+    while (c->txQueue.size() > 1 && c->txQueued > mMaxBacklog) {
+        c->txQueued -= c->txQueue.first().size();
+        c->txQueue.removeFirst();
+        c->stats.packetsDropped++;
+    }
+
+    flush(c);
+}
+
+void TcpPacketServer::flush(TcpPacketServer::Client *c)
+{
+    while (!c->txQueue.isEmpty() && c->socket->bytesToWrite() < SOCKET_BUFFER_MAX) {
+        QByteArray data = c->txQueue.takeFirst();
+        c->txQueued -= data.size();
+        c->socket->write(data);
+        c->stats.packetsTx++;
+    }
+}
+
+void TcpPacketServer::forwardCommands()
+{
+    mForwardPending = false;
+
+    bool sent = true;
+    while (sent) {
+        sent = false;
+
+        for (int i = 0;i < mClients.size();i++) {
+            Client *c = mClients.at(i);
+            if (c->cmdQueue.isEmpty()) {
+                continue;
+            }
+
+            QByteArray packet = c->cmdQueue.takeFirst();
+
+            if (hasReply((quint8)packet.at(1))) {
+                Request r;
+                r.client = c;
+                r.id = packet.at(0);
+                r.cmd = packet.at(1);
+                r.time = mClock.elapsed();
+                mRequests.append(r);
+
+                if (mRequests.size() > REQUESTS_MAX) {
+                    mRequests.removeFirst();
+                }
+            }
+
+            emit packetReceived(packet);
+            sent = true;
+        }
+    }
+}
+
+bool TcpPacketServer::acceptCommand(TcpPacketServer::Client *c, quint8 cmd)
+{
+    if (!isControlCmd(cmd)) {
+        return true;
+    }
+
+    qint64 now = mClock.elapsed();
+
+    if (mControlClient && mControlClient != c &&
+            (now - mControlTime) < CONTROL_TIMEOUT_MS) {
+        return false;
+    }
+
+    mControlClient = c;
+    mControlTime = now;
+    return true;
+}
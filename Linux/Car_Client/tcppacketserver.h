@@ -0,0 +1,127 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef TCPPACKETSERVER_H
+#define TCPPACKETSERVER_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QList>
+#include <QElapsedTimer>
+#include "packet.h"
+
+/**
+ * @brief The TcpPacketServer class
+ *
+ * TCP server for the packet protocol that any number of clients can
+ * connect to. Every client has its own framing state, so packets from
+ * different clients never get mixed up.
+ *
+ * Commands from the clients are forwarded to the car in round-robin order,
+ * one at a time from each client that has something queued. For the
+ * commands that the car answers, the reply goes back to the client that
+ * sent the request, matched on car id and command, and everything else
+ * from the car is sent to every client. Driving commands are only accepted from the client that drives
+ * the car, until it has been quiet for a while.
+ *
+ * Packets to a client are framed once and shared between the clients. A
+ * client that does not read loses its oldest queued packets.
+ */
+class TcpPacketServer : public QObject
+{
+    Q_OBJECT
+public:
+    typedef struct {
+        QString address;
+        int packetsRx;
+        int packetsTx;
+        int packetsDropped;
+        int cmdRejected;
+        int backlog;
+    } ClientStats;
+
+    explicit TcpPacketServer(QObject *parent = 0);
+    ~TcpPacketServer();
+    bool startServer(int port);
+    void stopServer();
+    QString errorString();
+    void sendPacket(const QByteArray &data);
+    void setMaxBacklog(int bytes);
+    int clientCount();
+    QList<ClientStats> getClientStats();
+
+signals:
+    void packetReceived(QByteArray &packet);
+    void connectionChanged(int clients);
+
+private slots:
+    void newTcpConnection();
+    void socketDataAvailable();
+    void socketDisconnected();
+    void socketBytesWritten();
+    void clientPacketRx(QByteArray &packet);
+    void framedData(QByteArray &data);
+    void forwardCommands();
+
+private:
+    // Requests that have not been answered after this time are forgotten
+    static const int REQUEST_TIMEOUT_MS = 1000;
+    static const int REQUESTS_MAX = 256;
+    // A client drives the car until it has sent no driving command for
+    // this time
+    static const int CONTROL_TIMEOUT_MS = 1000;
+    static const int CMD_QUEUE_MAX = 64;
+    static const int SOCKET_BUFFER_MAX = 16384;
+
+    typedef struct {
+        QTcpSocket *socket;
+        Packet *packet;
+        QList<QByteArray> cmdQueue;
+        QList<QByteArray> txQueue;
+        int txQueued;
+        ClientStats stats;
+    } Client;
+
+    typedef struct {
+        Client *client;
+        quint8 id;
+        quint8 cmd;
+        qint64 time;
+    } Request;
+
+    QTcpServer *mTcpServer;
+    Packet *mPacketOut;
+    QByteArray mFramed;
+    QList<Client*> mClients;
+    QList<Request> mRequests;
+    QElapsedTimer mClock;
+    int mMaxBacklog;
+    int mNextClient;
+    Client *mControlClient;
+    qint64 mControlTime;
+    bool mForwardPending;
+
+    Client *findClient(QObject *obj);
+    void removeClient(Client *c);
+    void queueTx(Client *c, const QByteArray &framed);
+    void flush(Client *c);
+    bool acceptCommand(Client *c, quint8 cmd);
+
+};
+
+#endif // TCPPACKETSERVER_H
@@ -10,6 +10,8 @@ QT       += printsupport
 QT       += serialport
 QT       += network
 QT       += opengl
+QT       += sql
+QT       += concurrent
 
 CONFIG   += c++11
 
@@ -71,19 +73,30 @@ SOURCES += main.cpp\
     networklogger.cpp \
     osmclient.cpp \
     osmtile.cpp \
+    osmtilestore.cpp \
     tcpserversimple.cpp \
     packet.cpp \
     networkinterface.cpp \
     moteconfig.cpp \
     magcal.cpp \
+    magfit.cpp \
     imuplot.cpp \
     copterinfo.cpp \
     copterinterface.cpp \
     nmeawidget.cpp \
     confcommonwidget.cpp \
     ublox.cpp \
+    gnssdemux.cpp \
+    surveyin.cpp \
+    rtcmscheduler.cpp \
+    rtcmhub.cpp \
+    packetlog.cpp \
+    logreplay.cpp \
     intersectiontest.cpp \
-    ncom.cpp
+    ncom.cpp \
+    ncomdecoder.cpp \
+    nmeaimporter.cpp \
+    enuframe.cpp
 
 HEADERS  += mainwindow.h \
     qcustomplot.h \
@@ -105,19 +118,30 @@ HEADERS  += mainwindow.h \
     networklogger.h \
     osmclient.h \
     osmtile.h \
+    osmtilestore.h \
     tcpserversimple.h \
     packet.h \
     networkinterface.h \
     moteconfig.h \
     magcal.h \
+    magfit.h \
     imuplot.h \
     copterinfo.h \
     copterinterface.h \
     nmeawidget.h \
     confcommonwidget.h \
     ublox.h \
+    gnssdemux.h \
+    surveyin.h \
+    rtcmscheduler.h \
+    rtcmhub.h \
+    packetlog.h \
+    logreplay.h \
     intersectiontest.h \
-    ncom.h
+    ncom.h \
+    ncomdecoder.h \
+    nmeaimporter.h \
+    enuframe.h
 
 FORMS    += mainwindow.ui \
     carinterface.ui \
@@ -19,6 +19,8 @@
 #include "ui_basestation.h"
 #include <QDebug>
 #include <QMessageBox>
+#include <QFileDialog>
+#include <QFile>
 #include <QIcon>
 #include <QSerialPortInfo>
 #include <cmath>
@@ -37,11 +39,12 @@ BaseStation::BaseStation(QWidget *parent) :
     mXNow = 0.0;
     mYNow = 0.0;
     mZNow = 0.0;
-    mXAvg = 0.0;
-    mYAvg = 0.0;
-    mZAvg = 0.0;
-    mAvgSamples = 0.0;
-    mBasePosCnt = 0;
+    mRtcmScheduler.setObsInterval(ui->rtcmObsIntervalBox->value());
+    mRtcmScheduler.setRefInterval(ui->rtcmRefIntervalBox->value());
+    mRtcmScheduler.setBudget(ui->rtcmBudgetBox->value());
+    mSurveyConverged = false;
+    mSurvey.setTargetAccuracy(ui->surveyTargetBox->value());
+    mSurveyClock.start();
 
     mFixNowStr = "Solution...";
     mSatNowStr = "Sats...";
@@ -64,6 +67,10 @@ BaseStation::BaseStation(QWidget *parent) :
             this, SLOT(rxGga(int,NmeaServer::nmea_gga_info_t)));
     connect(mUblox, SIGNAL(rxRawx(ubx_rxm_rawx)),
             this, SLOT(rxRawx(ubx_rxm_rawx)));
+    connect(mUblox, SIGNAL(rxHpPosEcef(ubx_nav_hpposecef)),
+            this, SLOT(rxHpPosEcef(ubx_nav_hpposecef)));
+    connect(mUblox, SIGNAL(cfgDone(int,int,int,int,int)),
+            this, SLOT(ubxCfgDone(int,int,int,int,int)));
 
     updateNmeaText();
     on_ubxSerialRefreshButton_clicked();
@@ -76,13 +83,11 @@ BaseStation::~BaseStation()
 
 int BaseStation::getAvgPosLlh(double &lat, double &lon, double &height)
 {
-    double xAvg = mXAvg / mAvgSamples;
-    double yAvg = mYAvg / mAvgSamples;
-    double zAvg = mZAvg / mAvgSamples;
+    double xyz[3];
+    mSurvey.getMean(xyz);
+    utility::xyzToLlh(xyz[0], xyz[1], xyz[2], &lat, &lon, &height);
 
-    utility::xyzToLlh(xAvg, yAvg, zAvg, &lat, &lon, &height);
-
-    return (int)mAvgSamples;
+    return mSurvey.samples();
 }
 
 void BaseStation::tcpInputConnected()
@@ -169,12 +174,24 @@ void BaseStation::rxGga(int fields, NmeaServer::nmea_gga_info_t gga)
         default: mFixNowStr = "Solution: Unknown"; break;
         }
 
-        if (gga.fix_type == 1 || gga.fix_type == 2 || gga.fix_type == 4 || gga.fix_type == 5) {
+        // Typical horizontal accuracy of the fix types, scaled with the
+        // HDOP, weights the samples.
+        double sigma = -1.0;
+        switch (gga.fix_type) {
+        case 1: sigma = 2.5; break;
+        case 2: sigma = 0.7; break;
+        case 4: sigma = 0.02; break;
+        case 5: sigma = 0.3; break;
+        default: break;
+        }
+
+        if (sigma > 0.0) {
             utility::llhToXyz(gga.lat, gga.lon, gga.height, &mXNow, &mYNow, &mZNow);
-            mXAvg += mXNow;
-            mYAvg += mYNow;
-            mZAvg += mZNow;
-            mAvgSamples += 1.0;
+
+            if (ui->surveySourceBox->currentIndex() == 0) {
+                sigma *= qMax(gga.h_dop, 0.5);
+                surveyAddSample(mXNow, mYNow, mZNow, 1.0 / (sigma * sigma));
+            }
         }
     } else {
         mFixNowStr = "Solution: Invalid";
@@ -287,33 +304,56 @@ void BaseStation::rxRawx(ubx_rxm_rawx rawx)
     }
 
     if (ui->sendVehiclesBox->isChecked()) {
+        QList<QByteArray> obsMsgs;
         if (has_gps && has_glo && ((gps_len + glo_len) < 1000)) {
             QByteArray message;
             message.append((char*)data_gps, gps_len);
             message.append((char*)data_glo, glo_len);
-            emit rtcmOut(message);
+            obsMsgs.append(message);
         } else {
             if (has_gps) {
-                emit rtcmOut(QByteArray((char*)data_gps, gps_len));
+                obsMsgs.append(QByteArray((char*)data_gps, gps_len));
             }
 
             if (has_glo) {
-                emit rtcmOut(QByteArray((char*)data_glo, glo_len));
+                obsMsgs.append(QByteArray((char*)data_glo, glo_len));
             }
         }
 
-        // Send base station position every 5 cycles to save bandwidth.
-        mBasePosCnt++;
-        if (mBasePosCnt >= 5) {
-            mBasePosCnt = 0;
+        QByteArray refMsg;
+        if (has_ref) {
+            refMsg = QByteArray((char*)data_ref, ref_len);
+        }
 
-            if (has_ref) {
-                emit rtcmOut(QByteArray((char*)data_ref, ref_len));
-            }
+        // The radio link is shared with the state traffic of all cars, so
+        // let the scheduler decide what fits.
+        QList<QByteArray> msgs = mRtcmScheduler.epoch(rawx.rcv_tow, obsMsgs, refMsg);
+        for (const QByteArray &m: msgs) {
+            emit rtcmOut(m);
         }
+
+        RtcmScheduler::Stats st = mRtcmScheduler.stats();
+        ui->rtcmRateLabel->setText(QString("%1 B/s, %2 obs dropped").
+                                   arg(st.bytesPerSec, 0, 'f', 0).
+                                   arg(st.obsDropped));
     }
 }
 
+void BaseStation::on_rtcmObsIntervalBox_valueChanged(double arg1)
+{
+    mRtcmScheduler.setObsInterval(arg1);
+}
+
+void BaseStation::on_rtcmRefIntervalBox_valueChanged(double arg1)
+{
+    mRtcmScheduler.setRefInterval(arg1);
+}
+
+void BaseStation::on_rtcmBudgetBox_valueChanged(int arg1)
+{
+    mRtcmScheduler.setBudget(arg1);
+}
+
 void BaseStation::on_nmeaConnectButton_clicked()
 {
     if (mTcpConnected) {
@@ -333,25 +373,64 @@ void BaseStation::on_nmeaConnectButton_clicked()
     }
 }
 
+void BaseStation::rxHpPosEcef(ubx_nav_hpposecef pos)
+{
+    if (ui->surveySourceBox->currentIndex() == 1 && pos.valid && pos.pAcc > 0.0) {
+        mXNow = pos.ecefX;
+        mYNow = pos.ecefY;
+        mZNow = pos.ecefZ;
+        surveyAddSample(mXNow, mYNow, mZNow, 1.0 / (pos.pAcc * pos.pAcc));
+        updateNmeaText();
+    }
+}
+
 void BaseStation::on_nmeaSampleClearButton_clicked()
 {
-    mXAvg = 0.0;
-    mYAvg = 0.0;
-    mZAvg = 0.0;
-    mAvgSamples = 0.0;
+    mSurvey.clear();
+    mSurveyConverged = false;
 
     updateNmeaText();
 }
 
+void BaseStation::on_surveyTargetBox_valueChanged(double arg1)
+{
+    mSurvey.setTargetAccuracy(arg1);
+}
+
+void BaseStation::surveyAddSample(double x, double y, double z, double weight)
+{
+    if (mSurvey.addSample((double)mSurveyClock.elapsed() / 1000.0, x, y, z, weight) ==
+            SurveyIn::SAMPLE_RESTARTED) {
+        qWarning() << "Survey-in restarted, the position has moved";
+        mSurveyConverged = false;
+    }
+
+    // Start sending the reference position as soon as it is good enough.
+    if (!mSurveyConverged && mSurvey.isConverged()) {
+        mSurveyConverged = true;
+
+        if (ui->surveyAutoRefBox->isChecked()) {
+            double lat, lon, height;
+            getAvgPosLlh(lat, lon, height);
+            ui->refSendLatBox->setValue(lat);
+            ui->refSendLonBox->setValue(lon);
+            ui->refSendHBox->setValue(height);
+            ui->sendBaseBox->setChecked(true);
+        }
+    }
+}
+
 void BaseStation::updateNmeaText()
 {
     QString sampStr;
-    sampStr.sprintf("Samples %d", (int)mAvgSamples);
+    sampStr.sprintf("Samples %d", mSurvey.samples());
     ui->nmeaSampleLabel->setText(sampStr);
 
-    double xAvg = mXAvg / mAvgSamples;
-    double yAvg = mYAvg / mAvgSamples;
-    double zAvg = mZAvg / mAvgSamples;
+    double xyzAvg[3];
+    mSurvey.getMean(xyzAvg);
+    double xAvg = xyzAvg[0];
+    double yAvg = xyzAvg[1];
+    double zAvg = xyzAvg[2];
 
     double lat_now, lon_now, height_now;
     double lat_avg, lon_avg, height_avg;
@@ -365,7 +444,14 @@ void BaseStation::updateNmeaText()
     statStr += QString().sprintf("LLH Now: %.8f, %.8f, %.3f\n\n", lat_now, lon_now, height_now);
 
     statStr += QString().sprintf("XYZ Avg: %.3f, %.3f, %.3f\n", xAvg, yAvg, zAvg);
-    statStr += QString().sprintf("LLH Avg: %.8f, %.8f, %.3f", lat_avg, lon_avg, height_avg);
+    statStr += QString().sprintf("LLH Avg: %.8f, %.8f, %.3f\n\n", lat_avg, lon_avg, height_avg);
+
+    statStr += QString().sprintf("Survey:  %d samples, %d rejected, %.0f s\n",
+                                 mSurvey.samples(), mSurvey.rejected(), mSurvey.duration());
+    statStr += QString().sprintf("Spread:  %.3f m\n", mSurvey.spread3d());
+    statStr += QString().sprintf("Acc 3D:  %.3f m (target %.3f m)\n",
+                                 mSurvey.accuracy3d(), mSurvey.targetAccuracy());
+    statStr += mSurvey.isConverged() ? "Converged" : "Not converged";
 
     ui->nmeaBrowser->setText(statStr);
 }
@@ -404,7 +490,16 @@ void BaseStation::on_ubxSerialConnectButton_clicked()
         uart.out_ubx = true;
         uart.out_nmea = true;
         uart.out_rtcm3 = true;
-        mUblox->ubxCfgPrtUart(&uart);
+
+        // The port is reconfigured on its own, and the rest is only sent
+        // after its ACK, so that no frame is lost while the port changes.
+        if (!mUblox->ubxCfgPrtUart(&uart)) {
+            qWarning() << "Ublox configuration: no ACK for the port settings";
+        }
+
+        // Queue the rest of the configuration and send it back to back. The
+        // result is reported to ubxCfgDone.
+        mUblox->cfgBegin();
 
         // Set configuration
         // Switch on RAWX and NMEA messages, set rate to 1 Hz and time reference to UTC
@@ -412,6 +507,7 @@ void BaseStation::on_ubxSerialConnectButton_clicked()
         mUblox->ubxCfgMsg(UBX_CLASS_RXM, UBX_RXM_RAWX, 1); // Every second
         mUblox->ubxCfgMsg(UBX_CLASS_RXM, UBX_RXM_SFRBX, 1); // Every second
         mUblox->ubxCfgMsg(UBX_CLASS_NMEA, UBX_NMEA_GGA, 1); // Every second
+        mUblox->ubxCfgMsg(UBX_CLASS_NAV, UBX_NAV_HPPOSECEF, 1); // Every second, for the survey
 
         // Stationary dynamic model
         ubx_cfg_nav5 nav5;
@@ -440,6 +536,23 @@ void BaseStation::on_ubxSerialConnectButton_clicked()
         tp5.rf_group_delay = 0;
         tp5.ant_cable_delay = 50;
         mUblox->ubloxCfgTp5(&tp5);
+
+        mUblox->cfgCommit();
+        ui->ubxSerialConnectedLabel->setText("Configuring...");
+    }
+}
+
+void BaseStation::ubxCfgDone(int transaction, int acked, int naked, int timedOut, int timeMs)
+{
+    (void)transaction;
+
+    if (naked == 0 && timedOut == 0) {
+        ui->ubxSerialConnectedLabel->setText(QString("Configured in %1 ms").arg(timeMs));
+    } else {
+        ui->ubxSerialConnectedLabel->setText(QString("Configuration: %1 ACK, %2 NAK, %3 timeout").
+                                             arg(acked).arg(naked).arg(timedOut));
+        qWarning() << "Ublox configuration:" << acked << "ACK," << naked <<
+                      "NAK," << timedOut << "timeout";
     }
 }
 
@@ -469,3 +582,50 @@ void BaseStation::on_tcpServerBox_toggled(bool checked)
         mTcpServer->stopServer();
     }
 }
+
+void BaseStation::on_ubxDemuxBenchmarkButton_clicked()
+{
+    QByteArray data = mUblox->getCapture();
+
+    if (data.isEmpty()) {
+        QString path = QFileDialog::getOpenFileName(this,
+                                                    tr("Choose a file with captured receiver output"));
+        if (path.isNull()) {
+            return;
+        }
+
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly)) {
+            QMessageBox::warning(this, "Parser Benchmark",
+                                 "Could not open " + path);
+            return;
+        }
+
+        data = file.readAll();
+        file.close();
+    }
+
+    if (data.isEmpty()) {
+        QMessageBox::warning(this, "Parser Benchmark",
+                             "No receiver output to run.");
+        return;
+    }
+
+    // Run through at least 50 MB to get stable numbers
+    int iterations = qMax(1, 50000000 / data.size());
+    GnssDemux::BenchmarkResult res = GnssDemux::benchmark(data, iterations);
+
+    QString str;
+    str.sprintf("%d bytes, %d passes\n\n"
+                "Frame parser: %.1f MB/s\n"
+                "  UBX: %d, RTCM3: %d, NMEA: %d\n\n"
+                "Byte by byte parser: %.1f MB/s\n"
+                "  UBX: %d, RTCM3: %d, NMEA: %d",
+                data.size(), iterations,
+                res.mbPerSec,
+                res.framesUbx, res.framesRtcm, res.framesNmea,
+                res.mbPerSecBytewise,
+                res.framesUbxBytewise, res.framesRtcmBytewise, res.framesNmeaBytewise);
+
+    QMessageBox::information(this, "Parser Benchmark", str);
+}
@@ -21,8 +21,11 @@
 #include <QWidget>
 #include <QTcpSocket>
 #include <QTimer>
+#include <QElapsedTimer>
 #include "ublox.h"
 #include "tcpbroadcast.h"
+#include "surveyin.h"
+#include "rtcmscheduler.h"
 
 namespace Ui {
 class BaseStation;
@@ -48,6 +51,8 @@ private slots:
     void timerSlot();
     void rxGga(int fields, NmeaServer::nmea_gga_info_t gga);
     void rxRawx(ubx_rxm_rawx rawx);
+    void rxHpPosEcef(ubx_nav_hpposecef pos);
+    void ubxCfgDone(int transaction, int acked, int naked, int timedOut, int timeMs);
 
     void on_nmeaConnectButton_clicked();
     void on_nmeaSampleClearButton_clicked();
@@ -56,6 +61,11 @@ private slots:
     void on_ubxSerialConnectButton_clicked();
     void on_refGetButton_clicked();
     void on_tcpServerBox_toggled(bool checked);
+    void on_surveyTargetBox_valueChanged(double arg1);
+    void on_rtcmObsIntervalBox_valueChanged(double arg1);
+    void on_rtcmRefIntervalBox_valueChanged(double arg1);
+    void on_rtcmBudgetBox_valueChanged(int arg1);
+    void on_ubxDemuxBenchmarkButton_clicked();
 
 private:
     Ui::BaseStation *ui;
@@ -64,20 +74,20 @@ private:
     QTimer *mTimer;
     Ublox *mUblox;
     TcpBroadcast *mTcpServer;
-    int mBasePosCnt;
+    RtcmScheduler mRtcmScheduler;
 
     double mXNow;
     double mYNow;
     double mZNow;
-    double mXAvg;
-    double mYAvg;
-    double mZAvg;
-    double mAvgSamples;
+    SurveyIn mSurvey;
+    QElapsedTimer mSurveyClock;
+    bool mSurveyConverged;
 
     QString mFixNowStr;
     QString mSatNowStr;
 
     void updateNmeaText();
+    void surveyAddSample(double x, double y, double z, double weight);
 };
 
 #endif // BASESTATION_H
@@ -73,6 +73,13 @@ typedef struct {
     double ap_goal_py;
     double ap_rad;
     int32_t ms_today;
+    // Summary of the VESCs on the CAN-bus
+    int can_nodes;
+    int can_nodes_alive;
+    double can_vin_min;
+    double can_temp_fet_max;
+    double can_temp_motor_max;
+    double can_current_in_tot;
 } CAR_STATE;
 
 typedef struct {
@@ -239,6 +246,7 @@ typedef enum {
     // General commands
     CMD_PRINTF = 0,
     CMD_TERMINAL_CMD,
+    CMD_TERMINAL_BATCH,
 
     // Common vehicle commands
     CMD_VESC_FWD = 50,
@@ -440,6 +448,15 @@ typedef struct {
     bool active; // Survey-in in progress flag, 1 = in-progress, otherwise 0
 } ubx_nav_svin;
 
+typedef struct {
+    uint32_t i_tow; // GPS time of week of the navigation epoch
+    double ecefX; // ECEF X coordinate (m)
+    double ecefY; // ECEF Y coordinate (m)
+    double ecefZ; // ECEF Z coordinate (m)
+    float pAcc; // Position accuracy estimate (m)
+    bool valid; // The position is valid
+} ubx_nav_hpposecef;
+
 typedef struct {
     double pr_mes;
     double cp_mes;
@@ -719,6 +736,55 @@ typedef struct {
     double mapX;
     double mapY;
     double mapYawRad;
+
+    // Source and time
+    int unit; // Index of the sending unit, in order of appearance
+    uint32_t sourceIp;
+    uint16_t sourcePort;
+    int64_t rxTimeMs; // Receive time, ms since epoch
+    int timeMs; // ms into the GPS minute
+    int32_t gpsMinutes; // Minutes since the GPS epoch, from status channel 0
+
+    // Batch A and the rest of batch B
+    int navStatus;
+    double accX;
+    double accY;
+    double accZ;
+    double rateX;
+    double rateY;
+    double rateZ;
+    double pitch;
+    double roll;
+
+    // Status channels
+    int numSats;
+    int velMode;
+    int oriMode;
+    double posAccN;
+    double posAccE;
+    double posAccD;
+    double velAccN;
+    double velAccE;
+    double velAccD;
+    double headAcc;
+    double pitchAcc;
+    double rollAcc;
+    double gyroBias[3]; // rad/s
+    double accBias[3]; // m/s^2
+    double gyroSf[3]; // Scale factor error
+    double gyroBiasAcc[3];
+    double accBiasAcc[3];
+    double gyroSfAcc[3];
+    double antPos[3]; // Primary GNSS antenna in the IMU frame, m
+    double antPosAcc[3];
+    double dualHeading; // Dual antenna orientation, rad
+    double dualPitch;
+    double dualDist; // Distance between the antennas, m
+    double dualHeadingAcc;
+    double dualPitchAcc;
+    double dualDistAcc;
+    int channel; // Status channel of this packet
+    uint8_t channelData[8]; // Raw data of the status channel
 } ncom_data;
 
 #endif /* DATATYPES_H_ */
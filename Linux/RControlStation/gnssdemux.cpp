@@ -0,0 +1,593 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "gnssdemux.h"
+#include "rtcm3_simple.h"
+#include <QElapsedTimer>
+#include <QMutexLocker>
+#include <QDebug>
+#include <cstring>
+
+namespace {
+class Crc24qTable {
+public:
+    uint32_t t[256];
+
+    Crc24qTable() {
+        for (int i = 0;i < 256;i++) {
+            uint32_t crc = (uint32_t)i << 16;
+            for (int j = 0;j < 8;j++) {
+                crc <<= 1;
+                if (crc & 0x1000000) {
+                    crc ^= 0x1864CFB;
+                }
+            }
+            t[i] = crc & 0xFFFFFF;
+        }
+    }
+};
+
+const Crc24qTable crc24q_table;
+
+uint32_t crc24q(const uint8_t *data, int len)
+{
+    uint32_t crc = 0;
+    for (int i = 0;i < len;i++) {
+        crc = ((crc << 8) & 0xFFFFFF) ^ crc24q_table.t[(crc >> 16) ^ data[i]];
+    }
+    return crc;
+}
+
+int hexValue(uint8_t c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+/*
+ * The per-byte parser that Ublox used before the demultiplexer, kept as a
+ * reference for the benchmark. Frames are only counted, and every NMEA line
+ * is copied to a QByteArray like before.
+ */
+class BytewiseParser {
+public:
+    int framesUbx;
+    int framesRtcm;
+    int framesNmea;
+
+    BytewiseParser() {
+        memset(&mState, 0, sizeof(mState));
+        rtcm3_init_state(&mRtcmState);
+        framesUbx = 0;
+        framesRtcm = 0;
+        framesNmea = 0;
+    }
+
+    void input(const uint8_t *data, int len) {
+        for (int i = 0;i < len;i++) {
+            uint8_t ch = data[i];
+            bool ch_used = false;
+
+            if (!ch_used && mState.line_pos == 0 && mState.ubx_pos == 0) {
+                int res = rtcm3_input_data(ch, &mRtcmState);
+                ch_used = res >= 0;
+                if (res > 0) {
+                    framesRtcm++;
+                }
+            }
+
+            if (!ch_used && mState.line_pos == 0) {
+                int ubx_pos_last = mState.ubx_pos;
+
+                if (mState.ubx_pos == 0) {
+                    if (ch == 0xB5) {
+                        mState.ubx_pos++;
+                    }
+                } else if (mState.ubx_pos == 1) {
+                    if (ch == 0x62) {
+                        mState.ubx_pos++;
+                        mState.ubx_ck_a = 0;
+                        mState.ubx_ck_b = 0;
+                    }
+                } else if (mState.ubx_pos < 6) {
+                    if (mState.ubx_pos == 4) {
+                        mState.ubx_len = ch;
+                    } else if (mState.ubx_pos == 5) {
+                        mState.ubx_len |= ch << 8;
+                    }
+                    mState.ubx_ck_a += ch;
+                    mState.ubx_ck_b += mState.ubx_ck_a;
+                    mState.ubx_pos++;
+                } else if ((mState.ubx_pos - 6) < mState.ubx_len) {
+                    if ((mState.ubx_pos - 6) < (int)sizeof(mState.ubx)) {
+                        mState.ubx[mState.ubx_pos - 6] = ch;
+                    }
+                    mState.ubx_ck_a += ch;
+                    mState.ubx_ck_b += mState.ubx_ck_a;
+                    mState.ubx_pos++;
+                } else if ((mState.ubx_pos - 6) == mState.ubx_len) {
+                    if (ch == mState.ubx_ck_a) {
+                        mState.ubx_pos++;
+                    }
+                } else if ((mState.ubx_pos - 6) == (mState.ubx_len + 1)) {
+                    if (ch == mState.ubx_ck_b) {
+                        framesUbx++;
+                        mState.ubx_pos = 0;
+                    }
+                }
+
+                if (ubx_pos_last != mState.ubx_pos) {
+                    ch_used = true;
+                } else {
+                    mState.ubx_pos = 0;
+                }
+            }
+
+            if (!ch_used) {
+                mState.line[mState.line_pos++] = ch;
+                if (mState.line_pos == (int)sizeof(mState.line)) {
+                    mState.line_pos = 0;
+                }
+
+                if (mState.line_pos > 0 && mState.line[mState.line_pos - 1] == '\n') {
+                    mState.line[mState.line_pos] = '\0';
+                    mState.line_pos = 0;
+
+                    QByteArray line((char*)mState.line);
+                    if (line.startsWith('$')) {
+                        framesNmea++;
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    struct {
+        uint8_t line[256];
+        uint8_t ubx[2048];
+        int line_pos;
+        int ubx_pos;
+        uint8_t ubx_ck_a;
+        uint8_t ubx_ck_b;
+        int ubx_len;
+    } mState;
+    rtcm3_state mRtcmState;
+};
+}
+
+GnssDemux::GnssDemux()
+{
+    reset();
+}
+
+void GnssDemux::reset()
+{
+    mBuffer.clear();
+    memset(&mStats, 0, sizeof(mStats));
+}
+
+/**
+ * @brief GnssDemux::input
+ * Add received data and append the complete frames to a batch.
+ *
+ * @param data
+ * Received data.
+ *
+ * @param len
+ * Length of the data.
+ *
+ * @param batch
+ * Batch to append the frames to.
+ *
+ * @return
+ * The number of frames that were appended.
+ */
+int GnssDemux::input(const char *data, int len, FrameBatch &batch)
+{
+    mStats.bytes += len;
+
+    // Only copy the data when an incomplete frame is left from before.
+    const uint8_t *buf;
+    int bufLen;
+    if (mBuffer.isEmpty()) {
+        buf = (const uint8_t*)data;
+        bufLen = len;
+    } else {
+        mBuffer.append(data, len);
+        buf = (const uint8_t*)mBuffer.constData();
+        bufLen = mBuffer.size();
+    }
+
+    int framesBefore = batch.frames.size();
+    int pos = 0;
+
+    while (pos < bufLen) {
+        const uint8_t *start = buf + pos;
+        const uint8_t *end = buf + bufLen;
+        const uint8_t *p = start;
+        while (p < end && *p != 0xB5 && *p != RTCM3PREAMB && *p != '$') {
+            p++;
+        }
+
+        mStats.bytesSkipped += p - start;
+        pos += p - start;
+
+        if (pos >= bufLen) {
+            break;
+        }
+
+        int id = 0;
+        FRAME_TYPE type;
+        int res;
+
+        if (*p == 0xB5) {
+            type = FRAME_UBX;
+            res = tryUbx(p, bufLen - pos, &id);
+        } else if (*p == RTCM3PREAMB) {
+            type = FRAME_RTCM3;
+            res = tryRtcm(p, bufLen - pos, &id);
+        } else {
+            type = FRAME_NMEA;
+            res = tryNmea(p, bufLen - pos);
+        }
+
+        if (res == 0) {
+            // Incomplete, wait for more data
+            break;
+        } else if (res < 0) {
+            mStats.framesBad++;
+            mStats.bytesSkipped++;
+            pos++;
+            continue;
+        }
+
+        Frame f;
+        f.type = type;
+        f.offset = batch.data.size();
+        f.len = res;
+        f.id = id;
+        batch.data.append((const char*)p, res);
+        batch.frames.append(f);
+
+        switch (type) {
+        case FRAME_UBX: mStats.framesUbx++; break;
+        case FRAME_RTCM3: mStats.framesRtcm++; break;
+        case FRAME_NMEA: mStats.framesNmea++; break;
+        }
+
+        pos += res;
+    }
+
+    if (mBuffer.isEmpty()) {
+        if (pos < bufLen) {
+            mBuffer.append((const char*)buf + pos, bufLen - pos);
+        }
+    } else {
+        mBuffer.remove(0, pos);
+    }
+
+    return batch.frames.size() - framesBefore;
+}
+
+GnssDemux::Stats GnssDemux::stats() const
+{
+    return mStats;
+}
+
+/**
+ * @brief GnssDemux::benchmark
+ * Run captured receiver output through the demultiplexer and through the
+ * per-byte parser that was used before, in chunks like from a serial port.
+ *
+ * @param capture
+ * Captured receiver output.
+ *
+ * @param iterations
+ * Number of times to run through the capture.
+ *
+ * @param chunkLen
+ * Number of bytes per call, like one read from the serial port.
+ *
+ * @return
+ * The throughput of both parsers and the number of frames each of them
+ * found in one pass.
+ */
+GnssDemux::BenchmarkResult GnssDemux::benchmark(const QByteArray &capture, int iterations, int chunkLen)
+{
+    BenchmarkResult res;
+    memset(&res, 0, sizeof(res));
+
+    if (capture.isEmpty() || iterations <= 0 || chunkLen <= 0) {
+        return res;
+    }
+
+    double mb = (double)capture.size() * (double)iterations / 1e6;
+    QElapsedTimer timer;
+
+    timer.start();
+    for (int i = 0;i < iterations;i++) {
+        GnssDemux demux;
+        for (int j = 0;j < capture.size();j += chunkLen) {
+            FrameBatch batch;
+            demux.input(capture.constData() + j, qMin(chunkLen, capture.size() - j), batch);
+        }
+
+        if (i == 0) {
+            res.framesUbx = demux.stats().framesUbx;
+            res.framesRtcm = demux.stats().framesRtcm;
+            res.framesNmea = demux.stats().framesNmea;
+        }
+    }
+    res.mbPerSec = mb / ((double)timer.nsecsElapsed() / 1e9);
+
+    timer.restart();
+    for (int i = 0;i < iterations;i++) {
+        BytewiseParser parser;
+        for (int j = 0;j < capture.size();j += chunkLen) {
+            parser.input((const uint8_t*)capture.constData() + j, qMin(chunkLen, capture.size() - j));
+        }
+
+        if (i == 0) {
+            res.framesUbxBytewise = parser.framesUbx;
+            res.framesRtcmBytewise = parser.framesRtcm;
+            res.framesNmeaBytewise = parser.framesNmea;
+        }
+    }
+    res.mbPerSecBytewise = mb / ((double)timer.nsecsElapsed() / 1e9);
+
+    return res;
+}
+
+/*
+ * The tryX functions return the length of a complete and valid frame at
+ * the start of data, 0 if more data is needed to tell and -1 if there is no
+ * valid frame.
+ */
+int GnssDemux::tryUbx(const uint8_t *data, int len, int *id)
+{
+    if (len < 2) {
+        return 0;
+    }
+
+    if (data[1] != 0x62) {
+        return -1;
+    }
+
+    if (len < 6) {
+        return 0;
+    }
+
+    int payloadLen = data[4] | (data[5] << 8);
+    if (payloadLen > UBX_MAX_LEN) {
+        return -1;
+    }
+
+    int frameLen = payloadLen + 8;
+    if (len < frameLen) {
+        return 0;
+    }
+
+    uint8_t ck_a = 0;
+    uint8_t ck_b = 0;
+    for (int i = 2;i < payloadLen + 6;i++) {
+        ck_a += data[i];
+        ck_b += ck_a;
+    }
+
+    if (ck_a != data[payloadLen + 6] || ck_b != data[payloadLen + 7]) {
+        return -1;
+    }
+
+    *id = (data[2] << 8) | data[3];
+    return frameLen;
+}
+
+int GnssDemux::tryRtcm(const uint8_t *data, int len, int *id)
+{
+    if (len < 3) {
+        return 0;
+    }
+
+    // The six bits before the length are reserved and always zero
+    if (data[1] & 0xFC) {
+        return -1;
+    }
+
+    int payloadLen = ((data[1] & 0x03) << 8) | data[2];
+    int frameLen = payloadLen + 6;
+    if (len < frameLen) {
+        return 0;
+    }
+
+    uint32_t crc = ((uint32_t)data[payloadLen + 3] << 16) |
+            ((uint32_t)data[payloadLen + 4] << 8) |
+            (uint32_t)data[payloadLen + 5];
+
+    if (crc24q(data, payloadLen + 3) != crc) {
+        return -1;
+    }
+
+    *id = payloadLen >= 2 ? ((data[3] << 4) | (data[4] >> 4)) : 0;
+    return frameLen;
+}
+
+int GnssDemux::tryNmea(const uint8_t *data, int len)
+{
+    int maxLen = qMin(len, NMEA_MAX_LEN);
+    uint8_t sum = 0;
+    int star = -1;
+
+    for (int i = 1;i < maxLen;i++) {
+        uint8_t c = data[i];
+
+        if (c == '\n') {
+            // The checksum is required, as a line without one can not be
+            // told apart from binary data that happens to contain '$'.
+            if (star < 0 || i < star + 3) {
+                return -1;
+            }
+
+            int hi = hexValue(data[star + 1]);
+            int lo = hexValue(data[star + 2]);
+            if (hi < 0 || lo < 0 || ((hi << 4) | lo) != sum) {
+                return -1;
+            }
+
+            return i + 1;
+        }
+
+        if (c < 0x20 && c != '\r') {
+            return -1;
+        }
+
+        if (c > 0x7E) {
+            return -1;
+        }
+
+        if (star < 0) {
+            if (c == '*') {
+                star = i;
+            } else {
+                sum ^= c;
+            }
+        }
+    }
+
+    return len < NMEA_MAX_LEN ? 0 : -1;
+}
+
+GnssSerialWorker::GnssSerialWorker(QObject *parent) : QObject(parent)
+{
+    memset(&mStats, 0, sizeof(mStats));
+
+    // The port is a child, so that it follows the worker to its thread.
+    mSerialPort = new QSerialPort(this);
+
+    connect(mSerialPort, SIGNAL(readyRead()), this, SLOT(serialDataAvailable()));
+    connect(mSerialPort, SIGNAL(error(QSerialPort::SerialPortError)),
+            this, SLOT(serialPortError(QSerialPort::SerialPortError)));
+}
+
+bool GnssSerialWorker::isOpen() const
+{
+    return mOpen.load() != 0;
+}
+
+QByteArray GnssSerialWorker::getCapture()
+{
+    QMutexLocker locker(&mMutex);
+    return mCapture;
+}
+
+GnssDemux::Stats GnssSerialWorker::getStats()
+{
+    QMutexLocker locker(&mMutex);
+    return mStats;
+}
+
+bool GnssSerialWorker::openPort(QString port, int baudrate)
+{
+    if(mSerialPort->isOpen()) {
+        mSerialPort->close();
+    }
+
+    mSerialPort->setPortName(port);
+    mSerialPort->open(QIODevice::ReadWrite);
+
+    if(!mSerialPort->isOpen()) {
+        mOpen.store(0);
+        return false;
+    }
+
+    mSerialPort->setBaudRate(baudrate);
+    mSerialPort->setDataBits(QSerialPort::Data8);
+    mSerialPort->setParity(QSerialPort::NoParity);
+    mSerialPort->setStopBits(QSerialPort::OneStop);
+    mSerialPort->setFlowControl(QSerialPort::NoFlowControl);
+
+    mDemux.reset();
+
+    mMutex.lock();
+    mCapture.clear();
+    memset(&mStats, 0, sizeof(mStats));
+    mMutex.unlock();
+
+    mOpen.store(1);
+    return true;
+}
+
+void GnssSerialWorker::closePort()
+{
+    mSerialPort->close();
+    mOpen.store(0);
+}
+
+void GnssSerialWorker::writeData(QByteArray data)
+{
+    if (mSerialPort->isOpen()) {
+        mSerialPort->write(data);
+    }
+}
+
+void GnssSerialWorker::serialDataAvailable()
+{
+    GnssDemux::FrameBatch batch;
+
+    while (mSerialPort->bytesAvailable() > 0) {
+        QByteArray data = mSerialPort->readAll();
+        mDemux.input(data.constData(), data.size(), batch);
+
+        QMutexLocker locker(&mMutex);
+        if (mCapture.size() < CAPTURE_LEN) {
+            mCapture.append(data.left(CAPTURE_LEN - mCapture.size()));
+        }
+    }
+
+    mMutex.lock();
+    mStats = mDemux.stats();
+    mMutex.unlock();
+
+    if (!batch.frames.isEmpty()) {
+        emit framesRx(batch);
+    }
+}
+
+void GnssSerialWorker::serialPortError(QSerialPort::SerialPortError error)
+{
+    QString message;
+    switch (error) {
+    case QSerialPort::NoError:
+        break;
+
+    default:
+        message = "Serial port error: " + mSerialPort->errorString();
+        break;
+    }
+
+    if(!message.isEmpty()) {
+        qDebug() << message;
+
+        if(mSerialPort->isOpen()) {
+            mSerialPort->close();
+        }
+
+        mOpen.store(0);
+    }
+}
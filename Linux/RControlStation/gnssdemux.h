@@ -0,0 +1,147 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef GNSSDEMUX_H
+#define GNSSDEMUX_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QVector>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QSerialPort>
+#include <cstdint>
+
+/**
+ * @brief The GnssDemux class
+ *
+ * Splits the output of a GNSS receiver into UBX, RTCM3 and NMEA frames. The
+ * input buffers are scanned for the sync bytes of the three protocols, and
+ * the length and checksum of every candidate are checked on the whole
+ * frame at once. Bytes that do not belong to a valid frame are skipped, and
+ * incomplete frames are kept until more data arrives.
+ *
+ * The frames found in one call to input() are copied back to back into a
+ * single batch, so that they can be passed to another thread at once.
+ */
+class GnssDemux
+{
+public:
+    typedef enum {
+        FRAME_UBX = 0,
+        FRAME_RTCM3,
+        FRAME_NMEA
+    } FRAME_TYPE;
+
+    typedef struct {
+        FRAME_TYPE type;
+        int offset;     // Offset of the frame, including the sync bytes, in the batch data
+        int len;        // Length of the frame, including the checksum
+        int id;         // UBX: class << 8 | id, RTCM3: message type, NMEA: 0
+    } Frame;
+
+    typedef struct {
+        QByteArray data;
+        QVector<Frame> frames;
+    } FrameBatch;
+
+    typedef struct {
+        qint64 bytes;
+        qint64 bytesSkipped;
+        qint64 framesUbx;
+        qint64 framesRtcm;
+        qint64 framesNmea;
+        qint64 framesBad;
+    } Stats;
+
+    typedef struct {
+        double mbPerSec;
+        double mbPerSecBytewise;
+        int framesUbx;
+        int framesRtcm;
+        int framesNmea;
+        int framesUbxBytewise;
+        int framesRtcmBytewise;
+        int framesNmeaBytewise;
+    } BenchmarkResult;
+
+    static const int UBX_MAX_LEN = 8192;
+    static const int NMEA_MAX_LEN = 256;
+
+    GnssDemux();
+    void reset();
+    int input(const char *data, int len, FrameBatch &batch);
+    Stats stats() const;
+
+    static BenchmarkResult benchmark(const QByteArray &capture, int iterations, int chunkLen = 512);
+
+private:
+    QByteArray mBuffer;
+    Stats mStats;
+
+    static int tryUbx(const uint8_t *data, int len, int *id);
+    static int tryRtcm(const uint8_t *data, int len, int *id);
+    static int tryNmea(const uint8_t *data, int len);
+
+};
+
+Q_DECLARE_METATYPE(GnssDemux::FrameBatch)
+
+/**
+ * @brief The GnssSerialWorker class
+ *
+ * Owns the serial port of a GNSS receiver and runs the demultiplexer on
+ * the thread it is moved to, so that the reading and splitting of the
+ * stream does not load the thread that decodes the frames.
+ */
+class GnssSerialWorker : public QObject
+{
+    Q_OBJECT
+public:
+    static const int CAPTURE_LEN = 2 * 1024 * 1024;
+
+    explicit GnssSerialWorker(QObject *parent = 0);
+    bool isOpen() const;
+    QByteArray getCapture();
+    GnssDemux::Stats getStats();
+
+signals:
+    void framesRx(const GnssDemux::FrameBatch &batch);
+
+public slots:
+    bool openPort(QString port, int baudrate);
+    void closePort();
+    void writeData(QByteArray data);
+
+private slots:
+    void serialDataAvailable();
+    void serialPortError(QSerialPort::SerialPortError error);
+
+private:
+    QSerialPort *mSerialPort;
+    GnssDemux mDemux;
+    QAtomicInt mOpen;
+
+    // The first bytes after opening the port, for the benchmark. mStats
+    // is a copy of the demultiplexer statistics for other threads.
+    QMutex mMutex;
+    QByteArray mCapture;
+    GnssDemux::Stats mStats;
+
+};
+
+#endif // GNSSDEMUX_H
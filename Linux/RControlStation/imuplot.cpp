@@ -25,20 +25,12 @@ ImuPlot::ImuPlot(QWidget *parent) :
     ui->setupUi(this);
     layout()->setContentsMargins(0, 0, 0, 0);
 
-    mMaxSampleSize = 1000;
-    mAccelXData.resize(mMaxSampleSize);
-    mAccelYData.resize(mMaxSampleSize);
-    mAccelZData.resize(mMaxSampleSize);
-    mGyroXData.resize(mMaxSampleSize);
-    mGyroYData.resize(mMaxSampleSize);
-    mGyroZData.resize(mMaxSampleSize);
-    mMagXData.resize(mMaxSampleSize);
-    mMagYData.resize(mMaxSampleSize);
-    mMagZData.resize(mMaxSampleSize);
-    mAccelGyroMagXAxis.resize(mMaxSampleSize);
-    for(int i = 0;i < mAccelGyroMagXAxis.size();i++) {
-        mAccelGyroMagXAxis[mAccelGyroMagXAxis.size() - i - 1] = (40.0 / 1000.0 * i);
-    }
+    // Enough for the longest window at 100 Hz
+    mMaxSampleSize = 50000;
+    mSamples.resize(mMaxSampleSize);
+    mSampleHead = 0;
+    mSampleCount = 0;
+    mTime.start();
 
     ui->accelPlot->setInteractions(QCP::iRangeDrag | QCP::iRangeZoom);
     ui->gyroPlot->setInteractions(QCP::iRangeDrag | QCP::iRangeZoom);
@@ -48,17 +40,14 @@ ImuPlot::ImuPlot(QWidget *parent) :
     ui->accelPlot->addGraph();
     ui->accelPlot->xAxis->setRangeReversed(true);
     ui->accelPlot->graph()->setPen(QPen(Qt::black));
-    ui->accelPlot->graph()->setData(mAccelGyroMagXAxis, mAccelXData);
     ui->accelPlot->graph()->setName(tr("X"));
     ui->accelPlot->addGraph();
     ui->accelPlot->graph()->setPen(QPen(Qt::green));
-    ui->accelPlot->graph()->setData(mAccelGyroMagXAxis, mAccelYData);
     ui->accelPlot->graph()->setName(tr("Y"));
     ui->accelPlot->addGraph();
     ui->accelPlot->graph()->setPen(QPen(Qt::blue));
-    ui->accelPlot->graph()->setData(mAccelGyroMagXAxis, mAccelZData);
     ui->accelPlot->graph()->setName(tr("Z"));
-    ui->accelPlot->rescaleAxes();
+    ui->accelPlot->xAxis->setRange(0, ui->windowBox->value());
     ui->accelPlot->xAxis->setLabel("Seconds");
     ui->accelPlot->yAxis->setLabel("G");
     ui->accelPlot->legend->setVisible(true);
@@ -68,17 +57,14 @@ ImuPlot::ImuPlot(QWidget *parent) :
     ui->gyroPlot->addGraph();
     ui->gyroPlot->xAxis->setRangeReversed(true);
     ui->gyroPlot->graph()->setPen(QPen(Qt::black));
-    ui->gyroPlot->graph()->setData(mAccelGyroMagXAxis, mGyroXData);
     ui->gyroPlot->graph()->setName(tr("X"));
     ui->gyroPlot->addGraph();
     ui->gyroPlot->graph()->setPen(QPen(Qt::green));
-    ui->gyroPlot->graph()->setData(mAccelGyroMagXAxis, mGyroYData);
     ui->gyroPlot->graph()->setName(tr("Y"));
     ui->gyroPlot->addGraph();
     ui->gyroPlot->graph()->setPen(QPen(Qt::blue));
-    ui->gyroPlot->graph()->setData(mAccelGyroMagXAxis, mGyroZData);
     ui->gyroPlot->graph()->setName(tr("Z"));
-    ui->gyroPlot->rescaleAxes();
+    ui->gyroPlot->xAxis->setRange(0, ui->windowBox->value());
     ui->gyroPlot->xAxis->setLabel("Seconds");
     ui->gyroPlot->yAxis->setLabel("deg/s");
     ui->gyroPlot->legend->setVisible(true);
@@ -88,17 +74,14 @@ ImuPlot::ImuPlot(QWidget *parent) :
     ui->magPlot->addGraph();
     ui->magPlot->xAxis->setRangeReversed(true);
     ui->magPlot->graph()->setPen(QPen(Qt::black));
-    ui->magPlot->graph()->setData(mAccelGyroMagXAxis, mMagXData);
     ui->magPlot->graph()->setName(tr("X"));
     ui->magPlot->addGraph();
     ui->magPlot->graph()->setPen(QPen(Qt::green));
-    ui->magPlot->graph()->setData(mAccelGyroMagXAxis, mMagYData);
     ui->magPlot->graph()->setName(tr("Y"));
     ui->magPlot->addGraph();
     ui->magPlot->graph()->setPen(QPen(Qt::blue));
-    ui->magPlot->graph()->setData(mAccelGyroMagXAxis, mMagZData);
     ui->magPlot->graph()->setName(tr("Z"));
-    ui->magPlot->rescaleAxes();
+    ui->magPlot->xAxis->setRange(0, ui->windowBox->value());
     ui->magPlot->xAxis->setLabel("Seconds");
     ui->magPlot->yAxis->setLabel("uT");
     ui->magPlot->legend->setVisible(true);
@@ -118,51 +101,147 @@ ImuPlot::~ImuPlot()
 
 void ImuPlot::addSample(double *accel, double *gyro, double *mag)
 {
-    mAccelXData.append(accel[0]);
-    mAccelXData.remove(0, 1);
-    mAccelYData.append(accel[1]);
-    mAccelYData.remove(0, 1);
-    mAccelZData.append(accel[2]);
-    mAccelZData.remove(0, 1);
-
-    mGyroXData.append(gyro[0] * 180.0 / M_PI);
-    mGyroXData.remove(0, 1);
-    mGyroYData.append(gyro[1] * 180.0 / M_PI);
-    mGyroYData.remove(0, 1);
-    mGyroZData.append(gyro[2] * 180.0 / M_PI);
-    mGyroZData.remove(0, 1);
-
-    mMagXData.append(mag[0]);
-    mMagXData.remove(0, 1);
-    mMagYData.append(mag[1]);
-    mMagYData.remove(0, 1);
-    mMagZData.append(mag[2]);
-    mMagZData.remove(0, 1);
+    imu_sample_t &s = mSamples[mSampleHead];
+
+    s.time = (double)mTime.nsecsElapsed() * 1e-9;
+    s.val[0] = accel[0];
+    s.val[1] = accel[1];
+    s.val[2] = accel[2];
+    s.val[3] = gyro[0] * 180.0 / M_PI;
+    s.val[4] = gyro[1] * 180.0 / M_PI;
+    s.val[5] = gyro[2] * 180.0 / M_PI;
+    s.val[6] = mag[0];
+    s.val[7] = mag[1];
+    s.val[8] = mag[2];
+
+    mSampleHead = (mSampleHead + 1) % mMaxSampleSize;
+    if (mSampleCount < mMaxSampleSize) {
+        mSampleCount++;
+    }
 
     mImuReplot = true;
 }
 
 void ImuPlot::timerSlot()
 {
-    if (mImuReplot) {
-        ui->accelPlot->graph(0)->setData(mAccelGyroMagXAxis, mAccelXData);
-        ui->accelPlot->graph(1)->setData(mAccelGyroMagXAxis, mAccelYData);
-        ui->accelPlot->graph(2)->setData(mAccelGyroMagXAxis, mAccelZData);
-        ui->accelPlot->rescaleAxes();
-        ui->accelPlot->replot();
-
-        ui->gyroPlot->graph(0)->setData(mAccelGyroMagXAxis, mGyroXData);
-        ui->gyroPlot->graph(1)->setData(mAccelGyroMagXAxis, mGyroYData);
-        ui->gyroPlot->graph(2)->setData(mAccelGyroMagXAxis, mGyroZData);
-        ui->gyroPlot->rescaleAxes();
-        ui->gyroPlot->replot();
-
-        ui->magPlot->graph(0)->setData(mAccelGyroMagXAxis, mMagXData);
-        ui->magPlot->graph(1)->setData(mAccelGyroMagXAxis, mMagYData);
-        ui->magPlot->graph(2)->setData(mAccelGyroMagXAxis, mMagZData);
-        ui->magPlot->rescaleAxes();
-        ui->magPlot->replot();
-
-        mImuReplot = false;
+    // Hidden plots are updated when they are shown again
+    if (!mImuReplot || !isVisible()) {
+        return;
+    }
+
+    double now = (double)mTime.nsecsElapsed() * 1e-9;
+    updatePlot(ui->accelPlot, 0, now);
+    updatePlot(ui->gyroPlot, 3, now);
+    updatePlot(ui->magPlot, 6, now);
+
+    mImuReplot = false;
+}
+
+void ImuPlot::on_windowBox_valueChanged(double arg1)
+{
+    (void)arg1;
+    mImuReplot = true;
+}
+
+/**
+ * @brief ImuPlot::sampleAge
+ * @param ind
+ * Index counted from the newest sample.
+ *
+ * @return
+ * The sample.
+ */
+const ImuPlot::imu_sample_t &ImuPlot::sampleAge(int ind) const
+{
+    return mSamples.at((mSampleHead - 1 - ind + mMaxSampleSize) % mMaxSampleSize);
+}
+
+/*
+ * Plot the age of the samples in the time window against their values. When
+ * there are more samples than pixels, only the minimum and maximum of every
+ * pixel column are plotted, which looks the same.
+ */
+void ImuPlot::updatePlot(QCustomPlot *plot, int firstVal, double now)
+{
+    const double window = ui->windowBox->value();
+    const int buckets = qMax(plot->axisRect()->width(), 1);
+
+    int samples = 0;
+    while (samples < mSampleCount && (now - sampleAge(samples).time) <= window) {
+        samples++;
+    }
+
+    const bool decimate = samples > 2 * buckets;
+    QVector<QCPGraphData> data[3];
+
+    for (int c = 0;c < 3;c++) {
+        data[c].reserve(decimate ? 2 * buckets : samples);
+    }
+
+    if (!decimate) {
+        for (int i = 0;i < samples;i++) {
+            const imu_sample_t &s = sampleAge(i);
+            for (int c = 0;c < 3;c++) {
+                data[c].append(QCPGraphData(now - s.time, s.val[firstVal + c]));
+            }
+        }
+    } else {
+        int bucket = -1;
+        QCPGraphData min[3], max[3];
+
+        // The samples come with increasing age, so the data stays sorted
+        // when the minimum and maximum are added in the order they occurred.
+        auto flush = [&]() {
+            for (int c = 0;c < 3;c++) {
+                if (min[c].key < max[c].key) {
+                    data[c].append(min[c]);
+                    data[c].append(max[c]);
+                } else if (min[c].key > max[c].key) {
+                    data[c].append(max[c]);
+                    data[c].append(min[c]);
+                } else {
+                    data[c].append(min[c]);
+                }
+            }
+        };
+
+        for (int i = 0;i < samples;i++) {
+            const imu_sample_t &s = sampleAge(i);
+            double age = now - s.time;
+            int b = qMin((int)(age / window * (double)buckets), buckets - 1);
+
+            if (b != bucket) {
+                if (bucket >= 0) {
+                    flush();
+                }
+
+                bucket = b;
+                for (int c = 0;c < 3;c++) {
+                    min[c] = QCPGraphData(age, s.val[firstVal + c]);
+                    max[c] = min[c];
+                }
+            } else {
+                for (int c = 0;c < 3;c++) {
+                    double v = s.val[firstVal + c];
+                    if (v < min[c].value) {
+                        min[c] = QCPGraphData(age, v);
+                    } else if (v > max[c].value) {
+                        max[c] = QCPGraphData(age, v);
+                    }
+                }
+            }
+        }
+
+        if (bucket >= 0) {
+            flush();
+        }
     }
+
+    for (int c = 0;c < 3;c++) {
+        plot->graph(c)->data()->set(data[c], true);
+    }
+
+    plot->rescaleAxes();
+    plot->xAxis->setRange(0, window);
+    plot->replot();
 }
@@ -19,11 +19,15 @@
 #define IMUPLOT_H
 
 #include <QWidget>
+#include <QVector>
+#include <QElapsedTimer>
 
 namespace Ui {
 class ImuPlot;
 }
 
+class QCustomPlot;
+
 class ImuPlot : public QWidget
 {
     Q_OBJECT
@@ -36,23 +40,27 @@ public:
 
 private slots:
     void timerSlot();
+    void on_windowBox_valueChanged(double arg1);
 
 private:
+    typedef struct {
+        double time;
+        double val[9]; // Accel XYZ, gyro XYZ, mag XYZ
+    } imu_sample_t;
+
     Ui::ImuPlot *ui;
     QTimer *mTimer;
     bool mImuReplot;
 
-    QVector<double> mAccelXData;
-    QVector<double> mAccelYData;
-    QVector<double> mAccelZData;
-    QVector<double> mGyroXData;
-    QVector<double> mGyroYData;
-    QVector<double> mGyroZData;
-    QVector<double> mMagXData;
-    QVector<double> mMagYData;
-    QVector<double> mMagZData;
-    QVector<double> mAccelGyroMagXAxis;
+    // Ring buffer with the newest sample before mSampleHead
+    QVector<imu_sample_t> mSamples;
+    int mSampleHead;
+    int mSampleCount;
     int mMaxSampleSize;
+    QElapsedTimer mTime;
+
+    const imu_sample_t &sampleAge(int ind) const;
+    void updatePlot(QCustomPlot *plot, int firstVal, double now);
 
 };
 
@@ -3,6 +3,7 @@
 #include "utility.h"
 
 #include <QMessageBox>
+#include <QDateTime>
 #include <cmath>
 
 IntersectionTest::IntersectionTest(QWidget *parent) :
@@ -13,7 +14,7 @@ IntersectionTest::IntersectionTest(QWidget *parent) :
     mCars = 0;
     mMap = 0;
     mPacketInterface = 0;
-    mRtRangeInt = 0;
+    mSyncLastMs = 0;
     mRunning = false;
 }
 
@@ -39,11 +40,16 @@ void IntersectionTest::setPacketInterface(PacketInterface *packet)
 
 void IntersectionTest::nComRx(const ncom_data &data)
 {
+    // Only follow the selected unit, and decimate on the receive time as
+    // the states arrive in batches.
+    if (data.unit != ui->ncomUnitBox->value()) {
+        return;
+    }
+
     mRtRangeData = data;
 
-    mRtRangeInt++;
-    if (mRtRangeInt >= 5 && mRunning) {
-        mRtRangeInt = 0;
+    if ((data.rxTimeMs - mSyncLastMs) >= SYNC_INTERVAL_MS && mRunning) {
+        mSyncLastMs = data.rxTimeMs;
 
         if (mMap && mPacketInterface) {
             LocPoint sync;
@@ -64,6 +70,10 @@ void IntersectionTest::nComRx(const ncom_data &data)
                 double a_diff = utility::angle_difference_rad(a_car, a_vel);
                 double vComp = v * cos(a_diff);
                 double tSync = dSync / vComp;
+
+                // The state waited in the queue until the map drained it, so
+                // the car has moved on since.
+                tSync -= (double)(QDateTime::currentMSecsSinceEpoch() - data.rxTimeMs) / 1000.0;
                 utility::truncate_number_abs(&tSync, 1200);
 
                 QString str;
@@ -34,8 +34,11 @@ private:
     QList<CarInterface*> *mCars;
     MapWidget *mMap;
     PacketInterface *mPacketInterface;
+    // Roughly every fifth state of a unit sending at 100 Hz
+    static const int SYNC_INTERVAL_MS = 50;
+
     ncom_data mRtRangeData;
-    int mRtRangeInt;
+    qint64 mSyncLastMs;
     bool mRunning;
 
 };
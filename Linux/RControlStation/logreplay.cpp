@@ -0,0 +1,389 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "logreplay.h"
+#include <QDir>
+#include <QFileInfo>
+#include <QDebug>
+#include <cstring>
+
+constexpr double LogReplay::SPEED_MAX;
+
+LogReplay::LogReplay(QObject *parent) : QObject(parent)
+{
+    mPacket = 0;
+    mTimer = new QTimer(this);
+    mTimer->setSingleShot(true);
+    mTimer->setTimerType(Qt::PreciseTimer);
+    mSegmentNow = -1;
+    mHasNext = false;
+    mNextPosUs = 0;
+    mPlaying = false;
+    mSpeed = 1.0;
+    mPosUs = 0;
+    mPlayStartPosUs = 0;
+    mPosUpdateLast = 0;
+    memset(&mStats, 0, sizeof(mStats));
+    mPlayClock.start();
+
+    connect(mTimer, SIGNAL(timeout()), this, SLOT(timerSlot()));
+}
+
+void LogReplay::setPacketInterface(PacketInterface *packet)
+{
+    mPacket = packet;
+}
+
+/**
+ * @brief LogReplay::openLog
+ * Open a packet log for playback.
+ *
+ * @param path
+ * A directory, in which case all segments in it are played in the order
+ * of their names, or a single segment.
+ *
+ * @return
+ * true if at least one segment with records was found.
+ */
+bool LogReplay::openLog(QString path)
+{
+    closeLog();
+
+    QStringList files;
+    QFileInfo info(path);
+
+    if (info.isDir()) {
+        QDir dir(path);
+        QStringList names = dir.entryList(QStringList() << "PKT_*.bin",
+                                          QDir::Files, QDir::Name);
+        for (QString name: names) {
+            files.append(dir.filePath(name));
+        }
+    } else if (info.isFile()) {
+        files.append(path);
+    }
+
+    for (QString file: files) {
+        Segment s;
+        s.file = file;
+
+        if (!readSegmentTimes(s)) {
+            qWarning() << "Skipping packet log segment without records:" << file;
+            continue;
+        }
+
+        if (mSegments.isEmpty()) {
+            s.startUs = 0;
+        } else {
+            const Segment &prev = mSegments.last();
+            qint64 gap = s.firstUs - prev.lastUs;
+            if (gap < 0 || gap > SEGMENT_GAP_MAX_US) {
+                gap = 0;
+            }
+            s.startUs = prev.startUs + (prev.lastUs - prev.firstUs) + gap;
+        }
+
+        mSegments.append(s);
+    }
+
+    if (mSegments.isEmpty()) {
+        mLastError = "No packet log segments with records found in " + path;
+        return false;
+    }
+
+    mPath = path;
+    mLastError.clear();
+    memset(&mStats, 0, sizeof(mStats));
+
+    return seek(0);
+}
+
+void LogReplay::closeLog()
+{
+    pause();
+    mReader.close();
+    mSegments.clear();
+    mSegmentNow = -1;
+    mHasNext = false;
+    mPosUs = 0;
+    mPath.clear();
+}
+
+bool LogReplay::isOpen()
+{
+    return !mSegments.isEmpty();
+}
+
+QString LogReplay::lastError()
+{
+    return mLastError;
+}
+
+QString LogReplay::path()
+{
+    return mPath;
+}
+
+/**
+ * @brief LogReplay::play
+ * Start or continue the playback. When the end has been reached, the
+ * playback starts over.
+ */
+void LogReplay::play()
+{
+    if (mSegments.isEmpty() || mPlaying) {
+        return;
+    }
+
+    if (!mHasNext) {
+        seek(0);
+        memset(&mStats, 0, sizeof(mStats));
+    }
+
+    restartClock();
+    mPlaying = true;
+    mTimer->start(0);
+}
+
+void LogReplay::pause()
+{
+    if (!mPlaying) {
+        return;
+    }
+
+    restartClock();
+    mPlaying = false;
+    mTimer->stop();
+}
+
+bool LogReplay::isPlaying()
+{
+    return mPlaying;
+}
+
+/**
+ * @brief LogReplay::seek
+ * Go to a position on the timeline. The playback continues from the first
+ * packet at or after the position.
+ *
+ * @param posUs
+ * The position in microseconds.
+ *
+ * @return
+ * true if there are packets left after the position.
+ */
+bool LogReplay::seek(qint64 posUs)
+{
+    if (mSegments.isEmpty()) {
+        return false;
+    }
+
+    posUs = qBound((qint64)0, posUs, durationUs());
+
+    int ind = 0;
+    for (int i = 0;i < mSegments.size();i++) {
+        if (mSegments.at(i).startUs <= posUs) {
+            ind = i;
+        }
+    }
+
+    // If the position is after the last record of the segment, readNext
+    // continues with the next segment.
+    if (openSegment(ind)) {
+        const Segment &s = mSegments.at(ind);
+        mReader.seek(s.firstUs + posUs - s.startUs);
+    }
+
+    readNext();
+
+    mPosUs = posUs;
+    restartClock();
+    emit positionChanged(mPosUs);
+
+    return mHasNext;
+}
+
+/**
+ * @brief LogReplay::setSpeed
+ * Set the playback speed.
+ *
+ * @param speed
+ * Speed relative to the recording, up to SPEED_MAX. 0 plays the log as
+ * fast as possible.
+ */
+void LogReplay::setSpeed(double speed)
+{
+    restartClock();
+    mSpeed = qBound(0.0, speed, SPEED_MAX);
+}
+
+double LogReplay::speed()
+{
+    return mSpeed;
+}
+
+qint64 LogReplay::durationUs()
+{
+    if (mSegments.isEmpty()) {
+        return 0;
+    }
+
+    const Segment &s = mSegments.last();
+    return s.startUs + s.lastUs - s.firstUs;
+}
+
+qint64 LogReplay::positionUs()
+{
+    return mPosUs;
+}
+
+LogReplay::Stats LogReplay::stats()
+{
+    Stats s = mStats;
+    if (mPlaying) {
+        s.playTime += (double)mPlayClock.nsecsElapsed() / 1e9;
+    }
+    return s;
+}
+
+void LogReplay::timerSlot()
+{
+    if (!mPlaying) {
+        return;
+    }
+
+    QElapsedTimer batch;
+    batch.start();
+
+    qint64 targetUs = durationUs();
+    if (mSpeed > 0.0) {
+        targetUs = mPlayStartPosUs + (qint64)((double)mPlayClock.nsecsElapsed() / 1e3 * mSpeed);
+    }
+
+    while (mHasNext && mNextPosUs <= targetUs) {
+        if (mNextHeader.dir == PacketLog::DIR_FROM_CAR) {
+            mStats.packets++;
+            mStats.bytes += mNextPayload.size();
+
+            if (mPacket) {
+                mPacket->processPayload(mNextPayload);
+            }
+        } else {
+            mStats.skipped++;
+        }
+
+        mPosUs = mNextPosUs;
+        readNext();
+
+        if (batch.elapsed() >= BATCH_MS) {
+            break;
+        }
+    }
+
+    bool caughtUp = !mHasNext || mNextPosUs > targetUs;
+    if (caughtUp) {
+        mPosUs = qMin(targetUs, durationUs());
+    }
+
+    if (!mHasNext) {
+        restartClock();
+        mPlaying = false;
+        emit positionChanged(mPosUs);
+        emit finished();
+        return;
+    }
+
+    if ((mPlayClock.elapsed() - mPosUpdateLast) >= POS_UPDATE_MS) {
+        mPosUpdateLast = mPlayClock.elapsed();
+        emit positionChanged(mPosUs);
+    }
+
+    if (!caughtUp || mSpeed <= 0.0) {
+        // Let the event loop run before the next batch
+        mTimer->start(0);
+    } else {
+        qint64 waitUs = (qint64)((double)(mNextPosUs - targetUs) / mSpeed);
+        mTimer->start(qBound((qint64)0, (waitUs + 999) / 1000, (qint64)POS_UPDATE_MS));
+    }
+}
+
+bool LogReplay::readSegmentTimes(LogReplay::Segment &s)
+{
+    PacketLogReader reader;
+    PacketLog::RecordHeader h;
+    QByteArray payload;
+
+    if (!reader.open(s.file) || !reader.next(h, payload)) {
+        return false;
+    }
+
+    s.firstUs = h.monoUs;
+    s.lastUs = h.monoUs;
+
+    // Only the records after the last index entry have to be read
+    if (!reader.index().isEmpty() && !reader.seek(reader.index().last().monoUs)) {
+        reader.seek(s.firstUs);
+    }
+
+    while (reader.next(h, payload)) {
+        s.lastUs = h.monoUs;
+    }
+
+    return true;
+}
+
+bool LogReplay::openSegment(int ind)
+{
+    mSegmentNow = ind;
+
+    if (!mReader.open(mSegments.at(ind).file)) {
+        qWarning() << "Could not open packet log segment" << mSegments.at(ind).file;
+        return false;
+    }
+
+    return true;
+}
+
+void LogReplay::readNext()
+{
+    for (;;) {
+        if (mSegmentNow >= 0 && mReader.next(mNextHeader, mNextPayload)) {
+            const Segment &s = mSegments.at(mSegmentNow);
+            mNextPosUs = s.startUs + mNextHeader.monoUs - s.firstUs;
+            mHasNext = true;
+            return;
+        }
+
+        if ((mSegmentNow + 1) >= mSegments.size()) {
+            mHasNext = false;
+            return;
+        }
+
+        openSegment(mSegmentNow + 1);
+    }
+}
+
+void LogReplay::restartClock()
+{
+    if (mPlaying) {
+        mStats.playTime += (double)mPlayClock.nsecsElapsed() / 1e9;
+    }
+
+    mPlayClock.restart();
+    mPlayStartPosUs = mPosUs;
+    mPosUpdateLast = 0;
+}
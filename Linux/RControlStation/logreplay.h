@@ -0,0 +1,123 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef LOGREPLAY_H
+#define LOGREPLAY_H
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QStringList>
+#include "packetinterface.h"
+#include "packetlog.h"
+
+/**
+ * @brief The LogReplay class
+ *
+ * Plays back packet logs recorded by Car_Client into a PacketInterface, so
+ * that the map, the car widgets and the network outputs get the same
+ * packets in the same order as when the log was recorded. Only packets
+ * from the car are played back.
+ *
+ * The segments of a log are put on one timeline. Segments from the same
+ * recording keep their time, while segments from different recordings are
+ * played back to back. Playback runs at a speed relative to the recording,
+ * or as fast as possible when the speed is 0. Packets are processed in
+ * batches of a limited duration, so that the UI stays responsive also when
+ * the processing can not keep up.
+ */
+class LogReplay : public QObject
+{
+    Q_OBJECT
+public:
+    typedef struct {
+        qint64 packets;
+        qint64 bytes;
+        qint64 skipped;     // Packets to the car
+        double playTime;    // Wall clock seconds spent playing
+    } Stats;
+
+    static constexpr double SPEED_MAX = 100.0;
+
+    explicit LogReplay(QObject *parent = 0);
+
+    void setPacketInterface(PacketInterface *packet);
+    bool openLog(QString path);
+    void closeLog();
+    bool isOpen();
+    QString lastError();
+    QString path();
+
+    void play();
+    void pause();
+    bool isPlaying();
+    bool seek(qint64 posUs);
+    void setSpeed(double speed);
+    double speed();
+    qint64 durationUs();
+    qint64 positionUs();
+    Stats stats();
+
+signals:
+    void positionChanged(qint64 posUs);
+    void finished();
+
+private slots:
+    void timerSlot();
+
+private:
+    typedef struct {
+        QString file;
+        qint64 firstUs;     // Monotonic time of the first record
+        qint64 lastUs;      // Monotonic time of the last record
+        qint64 startUs;     // Position of the first record on the timeline
+    } Segment;
+
+    static const int BATCH_MS = 20;
+    static const int POS_UPDATE_MS = 100;
+    // Longer gaps between segments are taken to be between recordings
+    static const qint64 SEGMENT_GAP_MAX_US = 10000000;
+
+    PacketInterface *mPacket;
+    QTimer *mTimer;
+    QString mPath;
+    QString mLastError;
+    QList<Segment> mSegments;
+    int mSegmentNow;
+    PacketLogReader mReader;
+
+    bool mHasNext;
+    qint64 mNextPosUs;
+    PacketLog::RecordHeader mNextHeader;
+    QByteArray mNextPayload;
+
+    bool mPlaying;
+    double mSpeed;
+    qint64 mPosUs;
+    qint64 mPlayStartPosUs;
+    QElapsedTimer mPlayClock;
+    qint64 mPosUpdateLast;
+    Stats mStats;
+
+    bool readSegmentTimes(Segment &s);
+    bool openSegment(int ind);
+    void readNext();
+    void restartClock();
+
+};
+
+#endif // LOGREPLAY_H
@@ -22,7 +22,9 @@
 
 #include <QFileDialog>
 #include <QMessageBox>
+#include <QElapsedTimer>
 #include <cmath>
+#include <random>
 
 MagCal::MagCal(QWidget *parent) :
     QWidget(parent),
@@ -74,6 +76,7 @@ MagCal::MagCal(QWidget *parent) :
     mTimer = new QTimer(this);
     mTimer->start(20);
     mMagReplot = false;
+    mMagCompReplot = false;
 
     connect(mTimer, SIGNAL(timeout()), this, SLOT(timerSlot()));
 }
@@ -85,14 +88,28 @@ MagCal::~MagCal()
 
 void MagCal::addSample(double x, double y, double z)
 {
-    if (ui->magSampleStoreBox->isChecked()) {
-        QVector<double> magXYZ;
-        magXYZ.append(x);
-        magXYZ.append(y);
-        magXYZ.append(z);
-        mMagSamples.append(magXYZ);
+    if (!ui->magSampleStoreBox->isChecked()) {
+        return;
+    }
 
-        plotMagPoints();
+    // The fit only accepts a bounded number of samples, so memory use does
+    // not grow while collecting.
+    int samplesBefore = mMagFit.getSamples().size();
+
+    if (mMagFit.addSample(x, y, z) == MagFit::SAMPLE_ACCEPTED) {
+        if (mMagFit.getSamples().size() == (samplesBefore + 1)) {
+            ui->magSampXyPlot->graph(0)->addData(x, y);
+            ui->magSampXzPlot->graph(0)->addData(x, z);
+            ui->magSampYzPlot->graph(0)->addData(y, z);
+            mMagReplot = true;
+        } else {
+            // Earlier samples were removed as outliers
+            plotMagPoints();
+        }
+
+        if (ui->magLiveBox->isChecked() && mMagFit.isValid()) {
+            mMagCompReplot = true;
+        }
     }
 }
 
@@ -100,7 +117,7 @@ bool MagCal::calculateCompensation()
 {
     bool res = false;
 
-    if (mMagSamples.size() >= 9) {
+    if (mMagFit.isValid()) {
         calcMagComp();
         res = true;
     }
@@ -253,9 +270,21 @@ QVector<double> MagCal::getComp()
 void MagCal::timerSlot()
 {
     static int lastMagSamples = 0;
-    if (mMagSamples.size() != lastMagSamples) {
-        ui->magSampleLabel->setText(QString::number(mMagSamples.size()) + " Samples");
-        lastMagSamples = mMagSamples.size();
+    static int lastMagDiscarded = 0;
+    int discarded = mMagFit.rejected() + mMagFit.binned();
+    if (mMagFit.samples() != lastMagSamples || discarded != lastMagDiscarded) {
+        ui->magSampleLabel->setText(QString("%1 Samples, %2 Rejected, %3 Binned").
+                                    arg(mMagFit.samples()).
+                                    arg(mMagFit.rejected()).
+                                    arg(mMagFit.binned()));
+        lastMagSamples = mMagFit.samples();
+        lastMagDiscarded = discarded;
+    }
+
+    if (mMagCompReplot) {
+        plotCompPoints();
+        mMagCompReplot = false;
+        mMagReplot = true;
     }
 
     if (mMagReplot) {
@@ -268,7 +297,8 @@ void MagCal::on_magSampleClearButton_clicked()
 {
     mMagCompCenter.clear();
     mMagComp.clear();
-    mMagSamples.clear();
+    mMagFit.clear();
+    mMagCompReplot = false;
     clearMagPlots();
 }
 
@@ -305,7 +335,7 @@ void MagCal::on_magSampleSaveButton_clicked()
     file.open(QIODevice::WriteOnly | QIODevice::Text);
     QTextStream out(&file);
 
-    QVectorIterator<QVector<double> > i(mMagSamples);
+    QVectorIterator<QVector<double> > i(mMagFit.getSamples());
     while (i.hasNext()) {
         QVector<double> element = i.next();
         out << element[0] << "\t" << element[1] << "\t" << element[2] << "\n";
@@ -318,9 +348,9 @@ void MagCal::loadMagPoints(QString path)
 {
     bool ok = true;
     QFile file(path);
-    if (file.exists()) {
-        mMagSamples.clear();
+    QVector<QVector<double> > samples;
 
+    if (file.exists()) {
         if (file.open(QIODevice::ReadOnly)) {
             QTextStream in(&file);
 
@@ -354,7 +384,7 @@ void MagCal::loadMagPoints(QString path)
                     break;
                 }
 
-                mMagSamples.append(magXYZ);
+                samples.append(magXYZ);
             }
         } else {
             ok = false;
@@ -367,6 +397,11 @@ void MagCal::loadMagPoints(QString path)
         QMessageBox::warning(this, "Mag Cal",
                              "Could not load calibration file.");
     } else {
+        on_magSampleClearButton_clicked();
+
+        // Saved samples have already been through the fit, so all of them
+        // are loaded.
+        mMagFit.setSamples(samples);
         plotMagPoints();
     }
 }
@@ -374,11 +409,12 @@ void MagCal::loadMagPoints(QString path)
 void MagCal::plotMagPoints()
 {
     QVector<double> magX, magY, magZ;
+    const QVector<QVector<double> > &samples = mMagFit.getSamples();
 
-    for (int i = 0;i < mMagSamples.size();i++) {
-        magX.append(mMagSamples.at(i).at(0));
-        magY.append(mMagSamples.at(i).at(1));
-        magZ.append(mMagSamples.at(i).at(2));
+    for (int i = 0;i < samples.size();i++) {
+        magX.append(samples.at(i).at(0));
+        magY.append(samples.at(i).at(1));
+        magZ.append(samples.at(i).at(2));
     }
 
     ui->magSampXyPlot->graph(0)->setData(magX, magY);
@@ -388,117 +424,50 @@ void MagCal::plotMagPoints()
     mMagReplot = true;
 }
 
+void MagCal::plotCompPoints()
+{
+    QVector<double> magX, magY, magZ;
+    const QVector<QVector<double> > &samples = mMagFit.getSamples();
+
+    for (int i = 0;i < samples.size();i++) {
+        double c[3];
+        mMagFit.compensate(samples.at(i).at(0),
+                           samples.at(i).at(1),
+                           samples.at(i).at(2), c);
+
+        magX.append(c[0]);
+        magY.append(c[1]);
+        magZ.append(c[2]);
+    }
+
+    ui->magSampXyPlot->graph(1)->setData(magX, magY);
+    ui->magSampXzPlot->graph(1)->setData(magX, magZ);
+    ui->magSampYzPlot->graph(1)->setData(magY, magZ);
+}
+
 void MagCal::calcMagComp()
 {
     /*
      * Inspired by
      * http://davidegironi.blogspot.it/2013/01/magnetometer-calibration-helper-01-for.html#.UriTqkMjulM
      *
-     * Ellipsoid fit from:
-     * http://www.mathworks.com/matlabcentral/fileexchange/24693-ellipsoid-fit
-     *
-     * To use Eigen to convert matlab code, have a look at Eigen/AsciiQuickReference.txt
+     * The normal equations of the ellipsoid fit are accumulated in mMagFit
+     * as the samples arrive, so this only has to solve a 9x9 system.
      */
 
-    if (mMagSamples.size() < 9) {
+    if (!mMagFit.solve()) {
         QMessageBox::warning(this, "Magnetometer compensation",
-                             "Too few points.");
+                             "Too few points, or the points do not describe an ellipsoid.");
         return;
     }
 
-    int samples = mMagSamples.size();
-    Eigen::VectorXd ex(samples);
-    Eigen::VectorXd ey(samples);
-    Eigen::VectorXd ez(samples);
-
-    for (int i = 0;i < samples;i++) {
-        ex(i) = mMagSamples.at(i).at(0);
-        ey(i) = mMagSamples.at(i).at(1);
-        ez(i) = mMagSamples.at(i).at(2);
-    }
-
-    Eigen::MatrixXd eD(samples, 9);
-
-    for (int i = 0;i < samples;i++) {
-        eD(i, 0) = ex(i) * ex(i);
-        eD(i, 1) = ey(i) * ey(i);
-        eD(i, 2) = ez(i) * ez(i);
-        eD(i, 3) = 2.0 * ex(i) * ey(i);
-        eD(i, 4) = 2.0 * ex(i) * ez(i);
-        eD(i, 5) = 2.0 * ey(i) * ez(i);
-        eD(i, 6) = 2.0 * ex(i);
-        eD(i, 7) = 2.0 * ey(i);
-        eD(i, 8) = 2.0 * ez(i);
-    }
-
-    Eigen::MatrixXd etmp1 = eD.transpose() * eD;
-    Eigen::MatrixXd etmp2 = eD.transpose() * Eigen::MatrixXd::Ones(samples, 1);
-    Eigen::VectorXd eV = etmp1.lu().solve(etmp2);
-
-    Eigen::MatrixXd eA(4, 4);
-    eA(0,0)=eV(0);   eA(0,1)=eV(3);   eA(0,2)=eV(4);   eA(0,3)=eV(6);
-    eA(1,0)=eV(3);   eA(1,1)=eV(1);   eA(1,2)=eV(5);   eA(1,3)=eV(7);
-    eA(2,0)=eV(4);   eA(2,1)=eV(5);   eA(2,2)=eV(2);   eA(2,3)=eV(8);
-    eA(3,0)=eV(6);   eA(3,1)=eV(7);   eA(3,2)=eV(8);   eA(3,3)=-1.0;
-
-    Eigen::MatrixXd eCenter = -eA.topLeftCorner(3, 3).lu().solve(eV.segment(6, 3));
-    Eigen::MatrixXd eT = Eigen::MatrixXd::Identity(4, 4);
-    eT(3, 0) = eCenter(0);
-    eT(3, 1) = eCenter(1);
-    eT(3, 2) = eCenter(2);
-
-    Eigen::MatrixXd eR = eT * eA * eT.transpose();
-
-    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eEv(eR.topLeftCorner(3, 3) * (-1.0 / eR(3, 3)));
-    Eigen::MatrixXd eVecs = eEv.eigenvectors();
-    Eigen::MatrixXd eVals = eEv.eigenvalues();
-
-    Eigen::MatrixXd eRadii(3, 1);
-    eRadii(0) = sqrt(1.0 / eVals(0));
-    eRadii(1) = sqrt(1.0 / eVals(1));
-    eRadii(2) = sqrt(1.0 / eVals(2));
-
-    Eigen::MatrixXd eScale = eRadii.asDiagonal().inverse() * eRadii.minCoeff();
-    Eigen::MatrixXd eComp = eVecs * eScale * eVecs.transpose();
-
     mMagComp.resize(9);
-    mMagComp[0] = eComp(0, 0);
-    mMagComp[1] = eComp(0, 1);
-    mMagComp[2] = eComp(0, 2);
-
-    mMagComp[3] = eComp(1, 0);
-    mMagComp[4] = eComp(1, 1);
-    mMagComp[5] = eComp(1, 2);
-
-    mMagComp[6] = eComp(2, 0);
-    mMagComp[7] = eComp(2, 1);
-    mMagComp[8] = eComp(2, 2);
+    mMagFit.getComp(mMagComp.data());
 
     mMagCompCenter.resize(3);
-    mMagCompCenter[0] = eCenter(0, 0);
-    mMagCompCenter[1] = eCenter(1, 0);
-    mMagCompCenter[2] = eCenter(2, 0);
-
-    QVector<double> magX, magY, magZ;
-
-    for (int i = 0;i < mMagSamples.size();i++) {
-        double mx = mMagSamples.at(i).at(0);
-        double my = mMagSamples.at(i).at(1);
-        double mz = mMagSamples.at(i).at(2);
-
-        mx -= mMagCompCenter.at(0);
-        my -= mMagCompCenter.at(1);
-        mz -= mMagCompCenter.at(2);
-
-        magX.append(mx * mMagComp.at(0) + my * mMagComp.at(1) + mz * mMagComp.at(2));
-        magY.append(mx * mMagComp.at(3) + my * mMagComp.at(4) + mz * mMagComp.at(5));
-        magZ.append(mx * mMagComp.at(6) + my * mMagComp.at(7) + mz * mMagComp.at(8));
-    }
-
-    ui->magSampXyPlot->graph(1)->setData(magX, magY);
-    ui->magSampXzPlot->graph(1)->setData(magX, magZ);
-    ui->magSampYzPlot->graph(1)->setData(magY, magZ);
+    mMagFit.getCenter(mMagCompCenter.data());
 
+    plotCompPoints();
     updateMagPlots();
 }
 
@@ -581,3 +550,131 @@ void MagCal::on_magCodeButton_clicked()
                              "Not enough samples to calculate compensation.");
     }
 }
+
+/**
+ * @brief MagCal::on_magBenchmarkButton_clicked
+ * Compare the incremental fit with a batch fit over all samples, on
+ * synthetic samples with a known hard and soft iron distortion. Part of the
+ * samples are in a dense cluster, like when the sensor is not moved, and
+ * some are outliers.
+ */
+void MagCal::on_magBenchmarkButton_clicked()
+{
+    const int samples = 20000;
+    const double radius = 400.0;
+    const double center[3] = {120.0, -60.0, 35.0};
+
+    Eigen::Matrix3d eSoft;
+    eSoft << 1.15, 0.08, -0.05,
+             0.08, 0.90, 0.04,
+            -0.05, 0.04, 1.05;
+
+    // The fit scales the ellipsoid to its smallest radius, so the expected
+    // compensation is the inverse of the soft iron matrix times its smallest
+    // eigenvalue.
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eSoftEv(eSoft);
+    Eigen::Matrix3d eCompTrue = eSoft.inverse() * eSoftEv.eigenvalues().minCoeff();
+
+    std::mt19937 rng(1);
+    std::normal_distribution<double> normal(0.0, 1.0);
+    std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+    Eigen::Vector3d eCluster(0.3, -0.2, 0.93);
+    eCluster.normalize();
+
+    QVector<QVector<double> > data;
+    QVector<QVector<double> > clean;
+    data.reserve(samples);
+
+    for (int i = 0;i < samples;i++) {
+        Eigen::Vector3d eU(normal(rng), normal(rng), normal(rng));
+        if (i % 5 < 2) {
+            eU = eCluster + 0.1 * eU;
+        }
+        eU.normalize();
+
+        Eigen::Vector3d eP = eSoft * eU * radius;
+        bool outlier = uniform(rng) > 0.96;
+
+        QVector<double> p(3);
+        for (int j = 0;j < 3;j++) {
+            if (outlier) {
+                p[j] = center[j] + 2.0 * radius * uniform(rng);
+            } else {
+                p[j] = center[j] + eP(j) + 2.0 * normal(rng);
+            }
+        }
+
+        data.append(p);
+        if (!outlier) {
+            clean.append(p);
+        }
+    }
+
+    // Center error, relative matrix error and spread of the compensated
+    // radius in percent.
+    auto evaluate = [&](const double *c, const double *m, double *res) {
+        Eigen::Matrix3d eComp;
+        eComp << m[0], m[1], m[2], m[3], m[4], m[5], m[6], m[7], m[8];
+        res[0] = sqrt((c[0] - center[0]) * (c[0] - center[0]) +
+                (c[1] - center[1]) * (c[1] - center[1]) +
+                (c[2] - center[2]) * (c[2] - center[2]));
+        res[1] = (eComp - eCompTrue).norm() / eCompTrue.norm() * 100.0;
+
+        double sum = 0.0, sumSq = 0.0;
+        for (int i = 0;i < clean.size();i++) {
+            Eigen::Vector3d eP(clean[i][0] - c[0], clean[i][1] - c[1], clean[i][2] - c[2]);
+            double r = (eComp * eP).norm();
+            sum += r;
+            sumSq += r * r;
+        }
+        double mean = sum / (double)clean.size();
+        res[2] = sqrt(fabs(sumSq / (double)clean.size() - mean * mean)) / mean * 100.0;
+    };
+
+    QElapsedTimer timer;
+    double batchCenter[3], batchComp[9], batchRes[3];
+    timer.start();
+    bool batchOk = MagFit::fitBatch(data, batchCenter, batchComp);
+    double batchMs = (double)timer.nsecsElapsed() / 1e6;
+
+    MagFit fit;
+    timer.restart();
+    for (int i = 0;i < data.size();i++) {
+        fit.addSample(data[i][0], data[i][1], data[i][2]);
+    }
+    double incMs = (double)timer.nsecsElapsed() / 1e6;
+
+    double incCenter[3], incComp[9], incRes[3];
+    fit.getCenter(incCenter);
+    fit.getComp(incComp);
+
+    if (!batchOk || !fit.isValid()) {
+        QMessageBox::warning(this, "Magnetometer Fit Benchmark",
+                             "The fit failed on the synthetic samples.");
+        return;
+    }
+
+    evaluate(batchCenter, batchComp, batchRes);
+    evaluate(incCenter, incComp, incRes);
+
+    QString str;
+    str.sprintf("%d synthetic samples, 40 %% in one cluster, %d outliers.\n\n"
+                "Batch fit over all samples:\n"
+                "  Time: %.2f ms per fit, %d samples stored\n"
+                "  Center error: %.2f\n"
+                "  Matrix error: %.2f %%\n"
+                "  Radius spread: %.2f %%\n\n"
+                "Incremental fit:\n"
+                "  Time: %.2f us per sample, %.2f ms in total\n"
+                "  %d accepted, %d rejected, %d binned\n"
+                "  Center error: %.2f\n"
+                "  Matrix error: %.2f %%\n"
+                "  Radius spread: %.2f %%",
+                samples, samples - clean.size(),
+                batchMs, samples, batchRes[0], batchRes[1], batchRes[2],
+                incMs * 1000.0 / (double)samples, incMs,
+                fit.samples(), fit.rejected(), fit.binned(),
+                incRes[0], incRes[1], incRes[2]);
+
+    QMessageBox::information(this, "Magnetometer Fit Benchmark", str);
+}
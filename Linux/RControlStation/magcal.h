@@ -19,6 +19,7 @@
 #define MAGCAL_H
 
 #include <QWidget>
+#include "magfit.h"
 
 namespace Ui {
 class MagCal;
@@ -63,18 +64,21 @@ private slots:
     void on_magOpenFileButton_clicked();
     void on_magSampleSaveButton_clicked();
     void on_magCodeButton_clicked();
+    void on_magBenchmarkButton_clicked();
 
 private:
     Ui::MagCal *ui;
     QTimer *mTimer;
     bool mMagReplot;
+    bool mMagCompReplot;
+    MagFit mMagFit;
 
-    QVector<QVector<double> > mMagSamples;
     QVector<double> mMagComp;
     QVector<double> mMagCompCenter;
 
     void loadMagPoints(QString path);
     void plotMagPoints();
+    void plotCompPoints();
     void calcMagComp();
     void updateMagPlots();
     void clearMagPlots();
@@ -0,0 +1,556 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "magfit.h"
+#include "Eigen/Dense"
+#include "Eigen/LU"
+
+#include <cmath>
+
+namespace {
+// Outliers are only rejected when the fit is based on this many samples
+// spread over this many bins, so that a fit from a short arc can not lock
+// out the rest of the sphere.
+const int REJECT_MIN_SAMPLES = 50;
+const int REJECT_MIN_BINS = MagFit::BINS_AZ * MagFit::BINS_EL / 4;
+
+void designRow(double x, double y, double z, double *row)
+{
+    row[0] = x * x;
+    row[1] = y * y;
+    row[2] = z * z;
+    row[3] = 2.0 * x * y;
+    row[4] = 2.0 * x * z;
+    row[5] = 2.0 * y * z;
+    row[6] = 2.0 * x;
+    row[7] = 2.0 * y;
+    row[8] = 2.0 * z;
+}
+
+/*
+ * Ellipsoid fit from:
+ * http://www.mathworks.com/matlabcentral/fileexchange/24693-ellipsoid-fit
+ *
+ * Converts the solution of the normal equations to a center and a
+ * compensation matrix that maps the ellipsoid to a sphere with the
+ * smallest radius of the ellipsoid.
+ */
+bool solutionToComp(const Eigen::VectorXd &eV, double *center, double *comp, double *radius)
+{
+    Eigen::MatrixXd eA(4, 4);
+    eA(0,0)=eV(0);   eA(0,1)=eV(3);   eA(0,2)=eV(4);   eA(0,3)=eV(6);
+    eA(1,0)=eV(3);   eA(1,1)=eV(1);   eA(1,2)=eV(5);   eA(1,3)=eV(7);
+    eA(2,0)=eV(4);   eA(2,1)=eV(5);   eA(2,2)=eV(2);   eA(2,3)=eV(8);
+    eA(3,0)=eV(6);   eA(3,1)=eV(7);   eA(3,2)=eV(8);   eA(3,3)=-1.0;
+
+    Eigen::MatrixXd eCenter = -eA.topLeftCorner(3, 3).lu().solve(eV.segment(6, 3));
+    Eigen::MatrixXd eT = Eigen::MatrixXd::Identity(4, 4);
+    eT(3, 0) = eCenter(0);
+    eT(3, 1) = eCenter(1);
+    eT(3, 2) = eCenter(2);
+
+    Eigen::MatrixXd eR = eT * eA * eT.transpose();
+
+    if (!std::isfinite(eR(3, 3)) || eR(3, 3) == 0.0) {
+        return false;
+    }
+
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eEv(eR.topLeftCorner(3, 3) * (-1.0 / eR(3, 3)));
+    Eigen::MatrixXd eVecs = eEv.eigenvectors();
+    Eigen::MatrixXd eVals = eEv.eigenvalues();
+
+    // Not an ellipsoid
+    if (eVals(0) <= 0.0 || eVals(1) <= 0.0 || eVals(2) <= 0.0) {
+        return false;
+    }
+
+    Eigen::MatrixXd eRadii(3, 1);
+    eRadii(0) = sqrt(1.0 / eVals(0));
+    eRadii(1) = sqrt(1.0 / eVals(1));
+    eRadii(2) = sqrt(1.0 / eVals(2));
+
+    Eigen::MatrixXd eScale = eRadii.asDiagonal().inverse() * eRadii.minCoeff();
+    Eigen::MatrixXd eComp = eVecs * eScale * eVecs.transpose();
+
+    for (int i = 0;i < 3;i++) {
+        center[i] = eCenter(i, 0);
+        for (int j = 0;j < 3;j++) {
+            comp[3 * i + j] = eComp(i, j);
+        }
+    }
+
+    if (radius) {
+        *radius = eRadii.minCoeff();
+    }
+
+    return true;
+}
+
+/*
+ * Solve normal equations with the upper triangle of AtA given.
+ */
+bool solveNormal(const double *ata, const double *atb, double *center, double *comp, double *radius)
+{
+    Eigen::Matrix<double, 9, 9> eAtA;
+    Eigen::Matrix<double, 9, 1> eAtb;
+
+    for (int i = 0;i < 9;i++) {
+        for (int j = i;j < 9;j++) {
+            eAtA(i, j) = ata[9 * i + j];
+            eAtA(j, i) = ata[9 * i + j];
+        }
+        eAtb(i) = atb[i];
+    }
+
+    Eigen::VectorXd eV = eAtA.ldlt().solve(eAtb);
+
+    if (!solutionToComp(eV, center, comp, radius)) {
+        return false;
+    }
+
+    for (int i = 0;i < 9;i++) {
+        if (!std::isfinite(comp[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Distance of a sample from the compensated sphere, as a fraction of its
+ * radius.
+ */
+double radiusError(const double *center, const double *comp, double radius,
+                   const QVector<double> &p)
+{
+    double x = p[0] - center[0];
+    double y = p[1] - center[1];
+    double z = p[2] - center[2];
+
+    double c0 = x * comp[0] + y * comp[1] + z * comp[2];
+    double c1 = x * comp[3] + y * comp[4] + z * comp[5];
+    double c2 = x * comp[6] + y * comp[7] + z * comp[8];
+
+    return fabs(sqrt(c0 * c0 + c1 * c1 + c2 * c2) - radius) / radius;
+}
+}
+
+MagFit::MagFit()
+{
+    mOutlierTol = 0.25;
+    clear();
+}
+
+void MagFit::clear()
+{
+    for (int i = 0;i < 81;i++) {
+        mAtA[i] = 0.0;
+    }
+
+    for (int i = 0;i < 9;i++) {
+        mAtb[i] = 0.0;
+        mComp[i] = i % 4 == 0 ? 1.0 : 0.0;
+    }
+
+    for (int i = 0;i < 3;i++) {
+        mSum[i] = 0.0;
+        mCenter[i] = 0.0;
+    }
+
+    mSamples = 0;
+    mRejected = 0;
+    mBinned = 0;
+    mBinsUsed = 0;
+    mSeen = 0;
+    mValid = false;
+    mRadius = 0.0;
+    mBins.fill(0, BINS_AZ * BINS_EL);
+    mPoints.clear();
+    mScreened = false;
+}
+
+/**
+ * @brief MagFit::addSample
+ * Add a sample to the fit. The fit is solved again after every accepted
+ * sample, which only costs a 9x9 solve.
+ *
+ * @param x
+ * @param y
+ * @param z
+ * @return
+ * SAMPLE_ACCEPTED if the sample was added to the fit, SAMPLE_REJECTED if
+ * it was rejected as an outlier and SAMPLE_BINNED if its direction bin
+ * already had enough samples.
+ */
+MagFit::SAMPLE_RES MagFit::addSample(double x, double y, double z)
+{
+    mSum[0] += x;
+    mSum[1] += y;
+    mSum[2] += z;
+    mSeen++;
+
+    bool rejectActive = mValid && mSamples >= REJECT_MIN_SAMPLES &&
+            mBinsUsed >= REJECT_MIN_BINS;
+
+    if (rejectActive && !mScreened) {
+        screen();
+        rejectActive = mValid && mSamples >= REJECT_MIN_SAMPLES &&
+                mBinsUsed >= REJECT_MIN_BINS;
+    }
+
+    if (rejectActive && isOutlier(x, y, z)) {
+        mRejected++;
+        return SAMPLE_REJECTED;
+    }
+
+    int bin = binIndex(x, y, z);
+    if (mBins[bin] >= BIN_MAX) {
+        mBinned++;
+        return SAMPLE_BINNED;
+    }
+
+    QVector<double> p(3);
+    p[0] = x;
+    p[1] = y;
+    p[2] = z;
+    mPoints.append(p);
+    accumulate(x, y, z);
+    solve();
+
+    return SAMPLE_ACCEPTED;
+}
+
+/**
+ * @brief MagFit::setSamples
+ * Replace the fit with one from the given samples, e.g. from a file that
+ * was saved before. All samples are used, without binning and outlier
+ * rejection, and samples added after this are screened as usual.
+ *
+ * @param samples
+ * x, y, z samples.
+ */
+void MagFit::setSamples(const QVector<QVector<double> > &samples)
+{
+    clear();
+
+    for (const QVector<double> &p: samples) {
+        mSum[0] += p[0];
+        mSum[1] += p[1];
+        mSum[2] += p[2];
+        mSeen++;
+    }
+
+    mPoints = samples;
+    mScreened = true;
+    rebuild();
+    solve();
+}
+
+/**
+ * @brief MagFit::getSamples
+ * @return
+ * The samples that are part of the fit.
+ */
+const QVector<QVector<double> > &MagFit::getSamples() const
+{
+    return mPoints;
+}
+
+/**
+ * @brief MagFit::solve
+ * Solve the accumulated normal equations and update the center and the
+ * compensation matrix. The previous solution is kept if this fails.
+ *
+ * @return
+ * True if the samples so far describe an ellipsoid.
+ */
+bool MagFit::solve()
+{
+    if (mSamples < 9) {
+        mValid = false;
+        return false;
+    }
+
+    double center[3], comp[9], radius;
+    if (!solveNormal(mAtA, mAtb, center, comp, &radius)) {
+        mValid = false;
+        return false;
+    }
+
+    for (int i = 0;i < 3;i++) {
+        mCenter[i] = center[i];
+    }
+
+    for (int i = 0;i < 9;i++) {
+        mComp[i] = comp[i];
+    }
+
+    mRadius = radius;
+    mValid = true;
+
+    return true;
+}
+
+bool MagFit::isValid() const
+{
+    return mValid;
+}
+
+int MagFit::samples() const
+{
+    return mSamples;
+}
+
+int MagFit::rejected() const
+{
+    return mRejected;
+}
+
+int MagFit::binned() const
+{
+    return mBinned;
+}
+
+int MagFit::binsUsed() const
+{
+    return mBinsUsed;
+}
+
+void MagFit::getCenter(double *center) const
+{
+    for (int i = 0;i < 3;i++) {
+        center[i] = mCenter[i];
+    }
+}
+
+void MagFit::getComp(double *comp) const
+{
+    for (int i = 0;i < 9;i++) {
+        comp[i] = mComp[i];
+    }
+}
+
+double MagFit::radius() const
+{
+    return mRadius;
+}
+
+void MagFit::compensate(double x, double y, double z, double *out) const
+{
+    x -= mCenter[0];
+    y -= mCenter[1];
+    z -= mCenter[2];
+
+    out[0] = x * mComp[0] + y * mComp[1] + z * mComp[2];
+    out[1] = x * mComp[3] + y * mComp[4] + z * mComp[5];
+    out[2] = x * mComp[6] + y * mComp[7] + z * mComp[8];
+}
+
+/**
+ * @brief MagFit::setOutlierTolerance
+ * Set how far from the compensated sphere a sample may be before it is
+ * rejected.
+ *
+ * @param tol
+ * Tolerance as a fraction of the sphere radius.
+ */
+void MagFit::setOutlierTolerance(double tol)
+{
+    mOutlierTol = tol;
+}
+
+double MagFit::outlierTolerance() const
+{
+    return mOutlierTol;
+}
+
+/**
+ * @brief MagFit::fitBatch
+ * Fit an ellipsoid to all samples at once by building the full design
+ * matrix. This is how the calibration was done before the incremental fit,
+ * and it is kept for comparison.
+ *
+ * @param samples
+ * x, y, z samples.
+ *
+ * @param center
+ * Array of 3 elements for the center.
+ *
+ * @param comp
+ * Array of 9 elements for the compensation matrix, row major.
+ *
+ * @return
+ * True on success.
+ */
+bool MagFit::fitBatch(const QVector<QVector<double> > &samples, double *center, double *comp)
+{
+    int n = samples.size();
+
+    if (n < 9) {
+        return false;
+    }
+
+    Eigen::MatrixXd eD(n, 9);
+    double row[9];
+
+    for (int i = 0;i < n;i++) {
+        designRow(samples.at(i).at(0), samples.at(i).at(1), samples.at(i).at(2), row);
+        for (int j = 0;j < 9;j++) {
+            eD(i, j) = row[j];
+        }
+    }
+
+    Eigen::MatrixXd etmp1 = eD.transpose() * eD;
+    Eigen::MatrixXd etmp2 = eD.transpose() * Eigen::MatrixXd::Ones(n, 1);
+    Eigen::VectorXd eV = etmp1.lu().solve(etmp2);
+
+    return solutionToComp(eV, center, comp, 0);
+}
+
+int MagFit::binIndex(double x, double y, double z) const
+{
+    double d[3];
+
+    if (mValid) {
+        compensate(x, y, z, d);
+    } else {
+        d[0] = x - mSum[0] / (double)mSeen;
+        d[1] = y - mSum[1] / (double)mSeen;
+        d[2] = z - mSum[2] / (double)mSeen;
+    }
+
+    double r = sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    if (r < 1e-12) {
+        return 0;
+    }
+
+    // Azimuth and the z component on the unit sphere give bins of equal area
+    double az = atan2(d[1], d[0]) + M_PI;
+    int ind_az = (int)(az / (2.0 * M_PI) * (double)BINS_AZ);
+    int ind_el = (int)((d[2] / r + 1.0) / 2.0 * (double)BINS_EL);
+
+    if (ind_az < 0) ind_az = 0;
+    if (ind_az >= BINS_AZ) ind_az = BINS_AZ - 1;
+    if (ind_el < 0) ind_el = 0;
+    if (ind_el >= BINS_EL) ind_el = BINS_EL - 1;
+
+    return ind_el * BINS_AZ + ind_az;
+}
+
+bool MagFit::isOutlier(double x, double y, double z) const
+{
+    QVector<double> p(3);
+    p[0] = x;
+    p[1] = y;
+    p[2] = z;
+    return radiusError(mCenter, mComp, mRadius, p) > mOutlierTol;
+}
+
+/*
+ * Screen the samples that were accepted before rejection was possible. An
+ * outlier pulls the fit towards itself, so every sample is checked against
+ * the fit without it, and the worst one is removed until all are within the
+ * tolerance. This costs one 9x9 solve per sample and round, and only runs
+ * once.
+ */
+void MagFit::screen()
+{
+    mScreened = true;
+
+    while (mPoints.size() > REJECT_MIN_SAMPLES) {
+        int worst = -1;
+        double worstErr = mOutlierTol;
+
+        for (int i = 0;i < mPoints.size();i++) {
+            double ata[81], atb[9], row[9];
+            const QVector<double> &p = mPoints.at(i);
+            designRow(p[0], p[1], p[2], row);
+
+            for (int j = 0;j < 9;j++) {
+                for (int k = j;k < 9;k++) {
+                    ata[9 * j + k] = mAtA[9 * j + k] - row[j] * row[k];
+                }
+                atb[j] = mAtb[j] - row[j];
+            }
+
+            double center[3], comp[9], radius;
+            if (!solveNormal(ata, atb, center, comp, &radius)) {
+                continue;
+            }
+
+            double err = radiusError(center, comp, radius, p);
+            if (err > worstErr) {
+                worst = i;
+                worstErr = err;
+            }
+        }
+
+        if (worst < 0) {
+            break;
+        }
+
+        mPoints.remove(worst);
+        mRejected++;
+        rebuild();
+        solve();
+    }
+}
+
+void MagFit::accumulate(double x, double y, double z)
+{
+    int bin = binIndex(x, y, z);
+    if (mBins[bin] == 0) {
+        mBinsUsed++;
+    }
+    mBins[bin]++;
+
+    double row[9];
+    designRow(x, y, z, row);
+
+    for (int i = 0;i < 9;i++) {
+        for (int j = i;j < 9;j++) {
+            mAtA[9 * i + j] += row[i] * row[j];
+        }
+        mAtb[i] += row[i];
+    }
+
+    mSamples++;
+}
+
+/*
+ * Accumulate the normal equations and the bins again from the kept samples.
+ * The bins use the current solution.
+ */
+void MagFit::rebuild()
+{
+    for (int i = 0;i < 81;i++) {
+        mAtA[i] = 0.0;
+    }
+
+    for (int i = 0;i < 9;i++) {
+        mAtb[i] = 0.0;
+    }
+
+    mSamples = 0;
+    mBinsUsed = 0;
+    mBins.fill(0, BINS_AZ * BINS_EL);
+
+    for (const QVector<double> &p: mPoints) {
+        accumulate(p[0], p[1], p[2]);
+    }
+}
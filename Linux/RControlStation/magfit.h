@@ -0,0 +1,107 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef MAGFIT_H
+#define MAGFIT_H
+
+#include <QVector>
+
+/**
+ * @brief The MagFit class
+ *
+ * Incremental ellipsoid fit for magnetometer calibration. Every accepted
+ * sample is added to the 9x9 normal equation matrix and right hand side of
+ * the least squares problem, so solving costs the same regardless of how
+ * many samples have been collected.
+ *
+ * Samples are sorted into bins of equal area by their direction from the
+ * current center, and each bin only takes a limited number of samples. That
+ * way dense clusters, e.g. from standing still, do not dominate the fit and
+ * the number of samples that have to be kept is bounded. When the fit is
+ * good enough, samples that do not end up close to the sphere after
+ * compensation are rejected as outliers. At that point the samples that
+ * were accepted before are screened once too, so that an early spike does
+ * not stay in the fit.
+ */
+class MagFit
+{
+public:
+    typedef enum {
+        SAMPLE_ACCEPTED = 0,
+        SAMPLE_REJECTED,
+        SAMPLE_BINNED
+    } SAMPLE_RES;
+
+    static const int BINS_AZ = 16;
+    static const int BINS_EL = 8;
+    static const int BIN_MAX = 8;
+    static const int SAMPLES_MAX = BINS_AZ * BINS_EL * BIN_MAX;
+
+    MagFit();
+
+    void clear();
+    SAMPLE_RES addSample(double x, double y, double z);
+    void setSamples(const QVector<QVector<double> > &samples);
+    const QVector<QVector<double> > &getSamples() const;
+    bool solve();
+
+    bool isValid() const;
+    int samples() const;
+    int rejected() const;
+    int binned() const;
+    int binsUsed() const;
+    void getCenter(double *center) const;
+    void getComp(double *comp) const;
+    double radius() const;
+    void compensate(double x, double y, double z, double *out) const;
+
+    void setOutlierTolerance(double tol);
+    double outlierTolerance() const;
+
+    static bool fitBatch(const QVector<QVector<double> > &samples,
+                         double *center, double *comp);
+
+private:
+    double mAtA[81];    // Upper triangle only
+    double mAtb[9];
+    int mSamples;
+    int mRejected;
+    int mBinned;
+    int mBinsUsed;
+    QVector<int> mBins;
+    QVector<QVector<double> > mPoints;
+    bool mScreened;
+
+    // Mean of all samples, used as center for the bins before the fit is valid
+    double mSum[3];
+    int mSeen;
+
+    bool mValid;
+    double mCenter[3];
+    double mComp[9];
+    double mRadius;
+    double mOutlierTol;
+
+    int binIndex(double x, double y, double z) const;
+    bool isOutlier(double x, double y, double z) const;
+    void screen();
+    void accumulate(double x, double y, double z);
+    void rebuild();
+
+};
+
+#endif // MAGFIT_H
@@ -22,6 +22,7 @@
 #include <cmath>
 #include <QMessageBox>
 #include <QFileDialog>
+#include <QDir>
 #include <QHostInfo>
 #include <QInputDialog>
 #include <QXmlStreamWriter>
@@ -87,10 +88,19 @@ MainWindow::MainWindow(QWidget *parent) :
 #endif
 
     mPing = new Ping(this);
+    mNmeaImporter = new NmeaImporter(this);
+    mLogReplay = new LogReplay(this);
+    mLogReplay->setPacketInterface(mPacketInterface);
     mNmea = new NmeaServer(this);
     mUdpSocket = new QUdpSocket(this);
     mTcpSocket = new QTcpSocket(this);
 
+    // All corrections go through the hub, so that the cars get them even
+    // when a TCP client is slow.
+    mRtcmHub = new RtcmHub(this);
+    mRtcmCarDest = mRtcmHub->addSignalDestination("Cars");
+    ui->rtcmWidget->setRtcmHub(mRtcmHub);
+
     mIntersectionTest = new IntersectionTest(this);
     mIntersectionTest->setCars(&mCars);
     mIntersectionTest->setMap(ui->mapWidget);
@@ -132,8 +142,18 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(ui->baseStationWidget, SIGNAL(rtcmOut(QByteArray)),
             this, SLOT(rtcmReceived(QByteArray)));
     connect(ui->rtcmWidget, SIGNAL(refPosGet()), this, SLOT(rtcmRefPosGet()));
+    connect(mRtcmHub, SIGNAL(rtcmOut(int,QByteArray)),
+            this, SLOT(rtcmHubOut(int,QByteArray)));
     connect(mPing, SIGNAL(pingRx(int,QString)), this, SLOT(pingRx(int,QString)));
     connect(mPing, SIGNAL(pingError(QString,QString)), this, SLOT(pingError(QString,QString)));
+    connect(mNmeaImporter, SIGNAL(importProgress(int)),
+            this, SLOT(nmeaImportProgress(int)));
+    connect(mNmeaImporter, SIGNAL(finished()),
+            this, SLOT(nmeaImportFinished()));
+    connect(mLogReplay, SIGNAL(positionChanged(qint64)),
+            this, SLOT(logReplayPositionChanged(qint64)));
+    connect(mLogReplay, SIGNAL(finished()),
+            this, SLOT(logReplayFinished()));
     connect(mPacketInterface, SIGNAL(enuRefReceived(quint8,double,double,double)),
             this, SLOT(enuRx(quint8,double,double,double)));
     connect(mNmea, SIGNAL(clientGgaRx(int,NmeaServer::nmea_gga_info_t)),
@@ -148,6 +168,8 @@ MainWindow::MainWindow(QWidget *parent) :
             this, SLOT(tcpInputDisconnected()));
     connect(mTcpSocket, SIGNAL(error(QAbstractSocket::SocketError)),
             this, SLOT(tcpInputError(QAbstractSocket::SocketError)));
+    connect(ui->mapWidget->osmClient(), SIGNAL(seedProgress(int,int)),
+            this, SLOT(osmSeedProgress(int,int)));
 
     connect(ui->actionAboutQt, SIGNAL(triggered(bool)),
             qApp, SLOT(aboutQt()));
@@ -489,7 +511,7 @@ void MainWindow::ackReceived(quint8 id, CMD_PACKET cmd, QString msg)
 
 void MainWindow::rtcmReceived(QByteArray data)
 {
-    mPacketInterface->sendRtcmUsb(255, data);
+    mRtcmHub->publish(data);
 
     if (ui->mapEnuBaseBox->isChecked()) {
         rtcm3_init_state(&mRtcmState);
@@ -504,6 +526,13 @@ void MainWindow::rtcmReceived(QByteArray data)
     }
 }
 
+void MainWindow::rtcmHubOut(int dest, QByteArray data)
+{
+    if (dest == mRtcmCarDest) {
+        mPacketInterface->sendRtcmUsb(255, data);
+    }
+}
+
 void MainWindow::rtcmRefPosGet()
 {
     double lat, lon, height;
@@ -556,7 +585,7 @@ void MainWindow::nmeaGgaRx(int fields, NmeaServer::nmea_gga_info_t gga)
             llh[0] = gga.lat;
             llh[1] = gga.lon;
             llh[2] = gga.height;
-            utility::llhToEnu(i_llh, llh, xyz);
+            ui->mapWidget->getEnuFrame().llhToEnu(llh, xyz);
 
             LocPoint p;
             p.setXY(xyz[0], xyz[1]);
@@ -688,6 +717,11 @@ void MainWindow::tcpInputError(QAbstractSocket::SocketError socketError)
     mTcpSocket->close();
 }
 
+void MainWindow::osmSeedProgress(int done, int total)
+{
+    showStatusInfo(QString("Downloading tiles: %1 / %2").arg(done).arg(total), true);
+}
+
 void MainWindow::on_carAddButton_clicked()
 {
     CarInterface *car = new CarInterface(this);
@@ -1220,85 +1254,119 @@ void MainWindow::on_mapChooseNmeaButton_clicked()
 
 void MainWindow::on_mapImportNmeaButton_clicked()
 {
-    QFile file;
-    file.setFileName(ui->mapImportNmeaEdit->text());
-    bool mapUpdated = false;
+    if (mNmeaImporter->isRunning()) {
+        mNmeaImporter->cancelImport();
+        return;
+    }
 
-    if (file.exists()) {
-        bool ok = file.open(QIODevice::ReadOnly | QIODevice::Text);
+    QString path = ui->mapImportNmeaEdit->text();
 
-        if (ok) {
-            QTextStream in(&file);
+    if (QFile::exists(path)) {
+        double i_llh[3];
+        ui->mapWidget->getEnuRef(i_llh);
+        mNmeaImporter->startImport(path, ui->mapImportNmeaZeroEnuBox->isChecked(), i_llh);
+    } else {
+        QMessageBox::warning(this, "Open Error", "Please select a valid log file");
+    }
+}
 
-            double i_llh[3];
-            bool i_llh_set = false;
+void MainWindow::on_mapImportNmeaBenchmarkButton_clicked()
+{
+    bool ok;
+    double gb = QInputDialog::getDouble(this, "NMEA Import Benchmark",
+                                        "Size of the synthetic log (GB). It is written to "
+                                        "the temporary directory and removed afterwards.",
+                                        2.0, 0.1, 64.0, 1, &ok);
+    if (!ok) {
+        return;
+    }
 
-            while(!in.atEnd()) {
-                QString line = in.readLine();
+    QString path = QDir::temp().filePath("rcontrolstation_nmea_benchmark.txt");
 
-                NmeaServer::nmea_gga_info_t gga;
-                int res = NmeaServer::decodeNmeaGGA(line.toLocal8Bit(), gga);
+    showStatusInfo("Running NMEA import benchmark...", true);
+    QApplication::setOverrideCursor(Qt::WaitCursor);
+    QCoreApplication::processEvents(QEventLoop::ExcludeUserInputEvents);
 
-                if (res > 5) {
-                    if (!i_llh_set) {
-                        if (ui->mapImportNmeaZeroEnuBox->isChecked()) {
-                            i_llh[0] = gga.lat;
-                            i_llh[1] = gga.lon;
-                            i_llh[2] = gga.height;
-                            ui->mapWidget->setEnuRef(i_llh[0], i_llh[1], i_llh[2]);
-                        } else {
-                            ui->mapWidget->getEnuRef(i_llh);
-                        }
+    // The reference is limited to 256 MB, as it takes minutes for larger logs
+    NmeaImporter::BenchmarkResult res = NmeaImporter::benchmark(path, (qint64)(gb * 1e9),
+                                                                256 * 1000 * 1000);
+    QFile::remove(path);
+    QApplication::restoreOverrideCursor();
 
-                        i_llh_set = true;
-                    }
+    if (res.bytes == 0) {
+        QMessageBox::warning(this, "NMEA Import Benchmark",
+                             "Could not write " + path);
+        return;
+    }
 
-                    double llh[3];
-                    double xyz[3];
-
-                    llh[0] = gga.lat;
-                    llh[1] = gga.lon;
-                    llh[2] = gga.height;
-                    utility::llhToEnu(i_llh, llh, xyz);
-
-                    LocPoint p;
-                    p.setXY(xyz[0], xyz[1]);
-                    QString info;
-
-                    QString fix_t = "Unknown";
-                    if (gga.fix_type == 4) {
-                        fix_t = "RTK fix";
-                        p.setColor(Qt::green);
-                    } else if (gga.fix_type == 5) {
-                        fix_t = "RTK float";
-                        p.setColor(Qt::yellow);
-                    } else if (gga.fix_type == 1) {
-                        fix_t = "Single";
-                        p.setColor(Qt::red);
-                    }
+    QString str;
+    str.sprintf("Synthetic log: %.2f GB, written in %.1f s\n\n"
+                "Import: %.2f s, %.1f MB/s, %d points\n\n"
+                "Line by line reference (first %.0f MB, without the map):\n"
+                "  %.1f MB/s, %d points",
+                (double)res.bytes / 1e9, res.writeTime,
+                res.importTime, res.mbPerSec, res.points,
+                (double)res.bytesReference / 1e6,
+                res.mbPerSecReference, res.pointsReference);
 
-                    info.sprintf("Fix type: %s\n"
-                                 "Height  : %.2f",
-                                 fix_t.toLocal8Bit().data(),
-                                 gga.height);
+    showStatusInfo("NMEA import benchmark done", true);
+    QMessageBox::information(this, "NMEA Import Benchmark", str);
+}
 
-                    p.setInfo(info);
+void MainWindow::nmeaImportProgress(int percent)
+{
+    showStatusInfo(QString("Importing NMEA log: %1 %").arg(percent), true);
+}
 
-                    if (!mapUpdated) {
-                        mapUpdated = true;
-                        ui->mapWidget->setNextEmptyOrCreateNewInfoTrace();
-                    }
+void MainWindow::nmeaImportFinished()
+{
+    if (!mNmeaImporter->getLastError().isEmpty()) {
+        QMessageBox::warning(this, "Open Error", mNmeaImporter->getLastError());
+        return;
+    }
 
-                    ui->mapWidget->addInfoPoint(p);
-                }
-            }
-        } else {
-            QMessageBox::warning(this, "Open Error", "Could not open " + file.fileName());
-        }
+    QList<LocPoint> points = mNmeaImporter->takePoints();
 
-    } else {
-        QMessageBox::warning(this, "Open Error", "Please select a valid log file");
+    if (points.isEmpty()) {
+        showStatusInfo("No GGA messages imported", false);
+        return;
+    }
+
+    if (mNmeaImporter->wasEnuRefSet()) {
+        double i_llh[3];
+        mNmeaImporter->getEnuRef(i_llh);
+        ui->mapWidget->setEnuRef(i_llh[0], i_llh[1], i_llh[2]);
+    }
+
+    ui->mapWidget->setNextEmptyOrCreateNewInfoTrace();
+    ui->mapWidget->addInfoPoints(points);
+
+    showStatusInfo(QString("Imported %1 points in %2 s (%3 MB/s)").
+                   arg(points.size()).
+                   arg(mNmeaImporter->getImportTime(), 0, 'f', 2).
+                   arg((double)mNmeaImporter->getImportBytes() / 1e6 /
+                       qMax(mNmeaImporter->getImportTime(), 1e-6), 0, 'f', 1), true);
+}
+
+void MainWindow::logReplayPositionChanged(qint64 posUs)
+{
+    if (!ui->mapReplayPosSlider->isSliderDown()) {
+        ui->mapReplayPosSlider->setValue(posUs / 1000);
     }
+
+    ui->mapReplayPosLabel->setText(QString("%1 / %2 s").
+                                   arg((double)posUs / 1e6, 0, 'f', 1).
+                                   arg((double)mLogReplay->durationUs() / 1e6, 0, 'f', 1));
+}
+
+void MainWindow::logReplayFinished()
+{
+    LogReplay::Stats stats = mLogReplay->stats();
+
+    showStatusInfo(QString("Replayed %1 packets in %2 s (%3 packets/s)").
+                   arg(stats.packets).
+                   arg(stats.playTime, 0, 'f', 2).
+                   arg((double)stats.packets / qMax(stats.playTime, 1e-6), 0, 'f', 0), true);
 }
 
 void MainWindow::on_mapRemoveInfoAllButton_clicked()
@@ -1322,6 +1390,52 @@ void MainWindow::on_mapOsmClearCacheButton_clicked()
     ui->mapWidget->update();
 }
 
+void MainWindow::on_mapOsmSeedButton_clicked()
+{
+    OsmClient *osm = ui->mapWidget->osmClient();
+
+    if (osm->isSeeding()) {
+        osm->cancelSeed();
+        showStatusInfo("Tile download cancelled", true);
+        return;
+    }
+
+    double llhMin[3], llhMax[3];
+    ui->mapWidget->getViewBoundsLlh(llhMin, llhMax);
+
+    int zoomMin = ui->mapWidget->getOsmZoomLevel();
+    int zoomMax = ui->mapWidget->getOsmMaxZoomLevel();
+
+    int tiles = osm->seedArea(llhMin[0], llhMin[1], llhMax[0], llhMax[1],
+                              zoomMin, zoomMax);
+
+    if (tiles == -2) {
+        qint64 count = OsmClient::countAreaTiles(llhMin[0], llhMin[1], llhMax[0], llhMax[1],
+                                                 zoomMin, zoomMax);
+
+        QMessageBox::StandardButton reply;
+        reply = QMessageBox::warning(this,
+                                     tr("Download Tiles"),
+                                     tr("This will download up to %1 tiles (zoom %2 to %3), "
+                                        "which puts a lot of load on the tile server. "
+                                        "Zoom in or lower the max zoom level to download "
+                                        "fewer tiles. Are you sure that you want to continue?").
+                                     arg(count).arg(zoomMin).arg(zoomMax),
+                                     QMessageBox::Yes | QMessageBox::Cancel);
+
+        if (reply != QMessageBox::Yes) {
+            return;
+        }
+
+        tiles = osm->seedArea(llhMin[0], llhMin[1], llhMax[0], llhMax[1],
+                              zoomMin, zoomMax, true);
+    }
+
+    if (tiles < 0) {
+        showStatusInfo("Could not start tile download", false);
+    }
+}
+
 void MainWindow::on_mapOsmServerOsmButton_toggled(bool checked)
 {
     if (checked) {
@@ -1409,6 +1523,55 @@ void MainWindow::on_mapStreamNmeaClearTraceButton_clicked()
     ui->mapWidget->clearInfoTrace();
 }
 
+void MainWindow::on_mapChooseReplayButton_clicked()
+{
+    QString path;
+    path = QFileDialog::getExistingDirectory(this, tr("Choose packet log directory"));
+    if (path.isNull()) {
+        return;
+    }
+
+    ui->mapReplayEdit->setText(path);
+}
+
+void MainWindow::on_mapReplayButton_clicked()
+{
+    if (mLogReplay->isPlaying()) {
+        mLogReplay->pause();
+        return;
+    }
+
+    QString path = ui->mapReplayEdit->text();
+
+    if (!mLogReplay->isOpen() || mLogReplay->path() != path) {
+        if (!mLogReplay->openLog(path)) {
+            QMessageBox::warning(this, "Open Error", mLogReplay->lastError());
+            return;
+        }
+
+        ui->mapReplayPosSlider->setMaximum(mLogReplay->durationUs() / 1000);
+    }
+
+    mLogReplay->setSpeed(ui->mapReplaySpeedBox->value());
+    mLogReplay->play();
+}
+
+void MainWindow::on_mapReplayStopButton_clicked()
+{
+    mLogReplay->pause();
+    mLogReplay->seek(0);
+}
+
+void MainWindow::on_mapReplaySpeedBox_valueChanged(double arg1)
+{
+    mLogReplay->setSpeed(arg1);
+}
+
+void MainWindow::on_mapReplayPosSlider_sliderReleased()
+{
+    mLogReplay->seek((qint64)ui->mapReplayPosSlider->value() * 1000);
+}
+
 void MainWindow::on_mapRouteBox_valueChanged(int arg1)
 {
     ui->mapWidget->setRouteNow(arg1);
@@ -1664,6 +1827,7 @@ void MainWindow::on_actionLoadTrajectoryFile_triggered()
         double llh[3];
         double xyz[3];
         map->getEnuRef(llh_ref);
+        EnuFrame enuFrame(llh_ref);
 
         qDebug() << "{mRefLat,mRefLon,mRefHeight}\n" << "{"
                  << llh_ref[0] << "," << llh_ref[1] << "," << llh_ref[2] << "}";
@@ -1690,7 +1854,7 @@ void MainWindow::on_actionLoadTrajectoryFile_triggered()
                 llh[1] = xyz[0] / ((M_PI/180)*6378137.0*cos(((llh[0] + llh_ref[0])/2)*(M_PI/180))) + llh_ref[1];
                 llh[2] = llh_ref[2] + xyz[2];
 
-                utility::llhToEnu(llh_ref,llh,xyz);
+                enuFrame.llhToEnu(llh, xyz);
 
                 trace.append(LocPoint(xyz[0],xyz[1]));
 
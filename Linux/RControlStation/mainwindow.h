@@ -28,8 +28,11 @@
 #include "copterinterface.h"
 #include "packetinterface.h"
 #include "ping.h"
+#include "nmeaimporter.h"
 #include "nmeaserver.h"
 #include "rtcm3_simple.h"
+#include "rtcmhub.h"
+#include "logreplay.h"
 #include "intersectiontest.h"
 
 #ifdef HAS_JOYSTICK
@@ -61,6 +64,7 @@ private slots:
     void ackReceived(quint8 id, CMD_PACKET cmd, QString msg);
     void rtcmReceived(QByteArray data);
     void rtcmRefPosGet();
+    void rtcmHubOut(int dest, QByteArray data);
     void pingRx(int time, QString msg);
     void pingError(QString msg, QString error);
     void enuRx(quint8 id, double lat, double lon, double height);
@@ -71,6 +75,11 @@ private slots:
     void tcpInputDisconnected();
     void tcpInputDataAvailable();
     void tcpInputError(QAbstractSocket::SocketError socketError);
+    void osmSeedProgress(int done, int total);
+    void nmeaImportProgress(int percent);
+    void nmeaImportFinished();
+    void logReplayPositionChanged(qint64 posUs);
+    void logReplayFinished();
 
     void on_carAddButton_clicked();
     void on_copterAddButton_clicked();
@@ -106,10 +115,12 @@ private slots:
     void on_mapOsmResSlider_valueChanged(int value);
     void on_mapChooseNmeaButton_clicked();
     void on_mapImportNmeaButton_clicked();
+    void on_mapImportNmeaBenchmarkButton_clicked();
     void on_mapRemoveInfoAllButton_clicked();
     void on_traceInfoMinZoomBox_valueChanged(double arg1);
     void on_removeRouteExtraButton_clicked();
     void on_mapOsmClearCacheButton_clicked();
+    void on_mapOsmSeedButton_clicked();
     void on_mapOsmServerOsmButton_toggled(bool checked);
     void on_mapOsmServerHiResButton_toggled(bool checked);
     void on_mapOsmServerVedderButton_toggled(bool checked);
@@ -124,6 +135,11 @@ private slots:
     void on_mapStreamNmeaConnectButton_clicked();
     void on_mapStreamNmeaDisconnectButton_clicked();
     void on_mapStreamNmeaClearTraceButton_clicked();
+    void on_mapChooseReplayButton_clicked();
+    void on_mapReplayButton_clicked();
+    void on_mapReplayStopButton_clicked();
+    void on_mapReplaySpeedBox_valueChanged(double arg1);
+    void on_mapReplayPosSlider_sliderReleased();
     void on_mapRouteBox_valueChanged(int arg1);
     void on_mapRemoveRouteAllButton_clicked();
     void on_mapUpdateTimeButton_clicked();
@@ -157,11 +173,15 @@ private:
     double mThrottle;
     double mSteering;
     Ping *mPing;
+    NmeaImporter *mNmeaImporter;
+    LogReplay *mLogReplay;
     NmeaServer *mNmea;
     QUdpSocket *mUdpSocket;
     QTcpSocket *mTcpSocket;
     QString mVersion;
     rtcm3_state mRtcmState;
+    RtcmHub *mRtcmHub;
+    int mRtcmCarDest;
     IntersectionTest *mIntersectionTest;
 
 #ifdef HAS_JOYSTICK
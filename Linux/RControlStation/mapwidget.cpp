@@ -189,6 +189,7 @@ MapWidget::MapWidget(QWidget *parent) : QWidget(parent)
     mRefLat = 57.777360; // LATb
     mRefLon = 12.780472; // LONb
     mRefHeight = 201.934115075;
+    mEnuFrame.setRef(mRefLat, mRefLon, mRefHeight);
 
 
     // Home
@@ -197,7 +198,8 @@ MapWidget::MapWidget(QWidget *parent) : QWidget(parent)
     //    mRefHeight = 204.626;
 
     // Hardcoded for now
-    mOsm->setCacheDir("osm_tiles");
+    mOsm->setCacheFile("osm_tiles.mbtiles");
+    mOsm->migrateCacheDir("osm_tiles");
     //    mOsm->setTileServerUrl("http://tile.openstreetmap.org");
     //    mOsm->setTileServerUrl("http://c.osm.rrze.fau.de/osmhd"); // Also https
     //    mOsm->setTileServerUrl("http://tiles.vedder.se/osm_tiles");
@@ -458,6 +460,15 @@ void MapWidget::addInfoPoint(LocPoint &info, bool updateMap)
     }
 }
 
+void MapWidget::addInfoPoints(const QList<LocPoint> &info, bool updateMap)
+{
+    mInfoTraces[mInfoTraceNow].append(info);
+
+    if (updateMap) {
+        update();
+    }
+}
+
 void MapWidget::clearInfoTrace()
 {
     mInfoTraces[mInfoTraceNow].clear();
@@ -692,7 +703,7 @@ void MapWidget::paintEvent(QPaintEvent *event)
         llh_t[2] = 0.0;
 
         double xyz[3];
-        utility::llhToEnu(i_llh, llh_t, xyz);
+        mEnuFrame.llhToEnu(llh_t, xyz);
 
         // Calculate scale at ENU origin
         double w = OsmTile::lat2width(i_llh[0], mOsmZoomLevel);
@@ -706,6 +717,11 @@ void MapWidget::paintEvent(QPaintEvent *event)
         trans.scale(1, -1);
         painter.setTransform(trans);
 
+        int vis_x_min = xt - t_ofs_x;
+        int vis_y_min = yt - t_ofs_y;
+        int vis_x_max = vis_x_min;
+        int vis_y_max = vis_y_min;
+
         for (int j = 0;j < 40;j++) {
             for (int i = 0;i < 40;i++) {
                 int xt_i = xt + i - t_ofs_x;
@@ -733,9 +749,15 @@ void MapWidget::paintEvent(QPaintEvent *event)
                 if (res == 0 && !mOsm->downloadQueueFull()) {
                     mOsm->downloadTile(mOsmZoomLevel, xt_i, yt_i);
                 }
+
+                vis_x_max = qMax(vis_x_max, xt_i);
+                vis_y_max = qMax(vis_y_max, yt_i);
             }
         }
 
+        mOsm->setVisibleTiles(mOsmZoomLevel, vis_x_min, vis_y_min,
+                              vis_x_max, vis_y_max, mOsmMaxZoomLevel);
+
         // Restore painter
         painter.setTransform(transOld);
         painter.setRenderHint(QPainter::SmoothPixmapTransform, mAntialiasDrawings);
@@ -1306,6 +1328,20 @@ void MapWidget::paintEvent(QPaintEvent *event)
             txt.sprintf("RAM Tiles: %d", mOsm->getRamTilesLoaded());
             painter.drawText(width() - txtOffset, start_txt, txt);
             start_txt += txt_row_h;
+
+            int lookups = mOsm->getMemoryHits() + mOsm->getMemoryMisses();
+            txt.sprintf("RAM Hit: %.1f %%", lookups > 0 ?
+                            100.0 * (double)mOsm->getMemoryHits() / (double)lookups : 0.0);
+            painter.drawText(width() - txtOffset, start_txt, txt);
+            start_txt += txt_row_h;
+
+            txt.sprintf("RAM Cache: %.1f MB", (double)mOsm->getMemoryBytesNow() / 1048576.0);
+            painter.drawText(width() - txtOffset, start_txt, txt);
+            start_txt += txt_row_h;
+
+            txt.sprintf("Prefetched: %d", mOsm->getTilesPrefetched());
+            painter.drawText(width() - txtOffset, start_txt, txt);
+            start_txt += txt_row_h;
         }
     }
 
@@ -1454,17 +1490,15 @@ void MapWidget::mousePressEvent(QMouseEvent *e)
     } else if (ctrl_shift) {
         if (e->buttons() & Qt::LeftButton) {
             QPoint p = getMousePosRelative();
-            double iLlh[3], llh[3], xyz[3];
-            iLlh[0] = mRefLat;
-            iLlh[1] = mRefLon;
-            iLlh[2] = mRefHeight;
+            double llh[3], xyz[3];
             xyz[0] = p.x() / 1000.0;
             xyz[1] = p.y() / 1000.0;
             xyz[2] = 0.0;
-            utility::enuToLlh(iLlh, xyz, llh);
+            mEnuFrame.enuToLlh(xyz, llh);
             mRefLat = llh[0];
             mRefLon = llh[1];
             mRefHeight = 0.0;
+            mEnuFrame.setRef(mRefLat, mRefLon, mRefHeight);
         }
 
         update();
@@ -1834,6 +1868,7 @@ void MapWidget::setEnuRef(double lat, double lon, double height)
     mRefLat = lat;
     mRefLon = lon;
     mRefHeight = height;
+    mEnuFrame.setRef(mRefLat, mRefLon, mRefHeight);
     update();
 }
 
@@ -1843,3 +1878,38 @@ void MapWidget::getEnuRef(double *llh)
     llh[1] = mRefLon;
     llh[2] = mRefHeight;
 }
+
+const EnuFrame &MapWidget::getEnuFrame() const
+{
+    return mEnuFrame;
+}
+
+/**
+ * @brief MapWidget::getViewBoundsLlh
+ * Get the bounding box of the current view. The rotation of the view is
+ * not taken into account.
+ *
+ * @param llhMin
+ * South-west corner of the view.
+ *
+ * @param llhMax
+ * North-east corner of the view.
+ */
+void MapWidget::getViewBoundsLlh(double *llhMin, double *llhMax)
+{
+    double xyz[3];
+
+    const double cx = -mXOffset / mScaleFactor / 1000.0;
+    const double cy = -mYOffset / mScaleFactor / 1000.0;
+    const double view_w = width() / mScaleFactor / 1000.0;
+    const double view_h = height() / mScaleFactor / 1000.0;
+
+    xyz[0] = cx - view_w / 2.0;
+    xyz[1] = cy - view_h / 2.0;
+    xyz[2] = 0.0;
+    mEnuFrame.enuToLlh(xyz, llhMin);
+
+    xyz[0] = cx + view_w / 2.0;
+    xyz[1] = cy + view_h / 2.0;
+    mEnuFrame.enuToLlh(xyz, llhMax);
+}
@@ -34,6 +34,7 @@
 #include "copterinfo.h"
 #include "perspectivepixmap.h"
 #include "osmclient.h"
+#include "enuframe.h"
 
 class MapWidget : public QWidget
 {
@@ -71,6 +72,7 @@ public:
     void clearAllRoutes();
     void setRoutePointSpeed(double speed);
     void addInfoPoint(LocPoint &info, bool updateMap = true);
+    void addInfoPoints(const QList<LocPoint> &info, bool updateMap = true);
     void clearInfoTrace();
     void clearAllInfoTraces();
     void addPerspectivePixmap(PerspectivePixmap map);
@@ -82,6 +84,8 @@ public:
     void setDrawOpenStreetmap(bool drawOpenStreetmap);
     void setEnuRef(double lat, double lon, double height);
     void getEnuRef(double *llh);
+    const EnuFrame &getEnuFrame() const;
+    void getViewBoundsLlh(double *llhMin, double *llhMax);
     double getOsmRes() const;
     void setOsmRes(double osmRes);
     double getInfoTraceTextZoom() const;
@@ -171,6 +175,7 @@ private:
     double mRefLat;
     double mRefLon;
     double mRefHeight;
+    EnuFrame mEnuFrame;
     LocPoint mClosestInfo;
     bool mDrawGrid;
     int mRoutePointSelected;
@@ -3,99 +3,9 @@
 #include "utility.h"
 
 #include <QDebug>
+#include <QCoreApplication>
 #include <cmath>
-
-namespace
-{
-int32_t get_I3(uint8_t *msg, int *ind) {
-    int32_t res =	((uint32_t) msg[*ind + 2]) << 16 |
-                    ((uint32_t) msg[*ind + 1]) << 8 |
-                    ((uint32_t) msg[*ind + 0]);
-    *ind += 3;
-
-    if (res & 0b00000000100000000000000000000000) {
-        res |= 0xFF000000;
-    }
-
-    return res;
-}
-
-float get_R4(uint8_t *msg, int *ind) {
-    uint32_t res =	((uint32_t) msg[*ind + 3]) << 24 |
-                    ((uint32_t) msg[*ind + 2]) << 16 |
-                    ((uint32_t) msg[*ind + 1]) << 8 |
-                    ((uint32_t) msg[*ind + 0]);
-    *ind += 4;
-
-    union asd {
-        float f;
-        uint32_t i;
-    } x;
-
-    x.i = res;
-
-    return x.f;
-}
-
-double get_R8(uint8_t *msg, int *ind) {
-    uint64_t res =	((uint64_t) msg[*ind + 7]) << 56 |
-                    ((uint64_t) msg[*ind + 6]) << 48 |
-                    ((uint64_t) msg[*ind + 5]) << 40 |
-                    ((uint64_t) msg[*ind + 4]) << 32 |
-                    ((uint64_t) msg[*ind + 3]) << 24 |
-                    ((uint64_t) msg[*ind + 2]) << 16 |
-                    ((uint64_t) msg[*ind + 1]) << 8 |
-                    ((uint64_t) msg[*ind + 0]);
-    *ind += 8;
-
-    union asd {
-        double f;
-        uint64_t i;
-    } x;
-
-    x.i = res;
-
-    return x.f;
-}
-
-void put_I3(uint8_t *msg, int *ind, int32_t data) {
-    msg[(*ind)++] = data;
-    msg[(*ind)++] = data >> 8;
-    msg[(*ind)++] = data >> 16;
-}
-
-void put_R4(uint8_t *msg, int *ind, float data) {
-    union asd {
-        float f;
-        uint32_t i;
-    } x;
-
-    x.f = data;
-
-    msg[(*ind)++] = x.i;
-    msg[(*ind)++] = x.i >> 8;
-    msg[(*ind)++] = x.i >> 16;
-    msg[(*ind)++] = x.i >> 24;
-}
-
-void put_R8(uint8_t *msg, int *ind, double data) {
-    union asd {
-        double f;
-        uint64_t i;
-    } x;
-
-    x.f = data;
-
-    msg[(*ind)++] = x.i;
-    msg[(*ind)++] = x.i >> 8;
-    msg[(*ind)++] = x.i >> 16;
-    msg[(*ind)++] = x.i >> 24;
-    msg[(*ind)++] = x.i >> 32;
-    msg[(*ind)++] = x.i >> 40;
-    msg[(*ind)++] = x.i >> 48;
-    msg[(*ind)++] = x.i >> 56;
-}
-}
+#include <cstring>
 
 NCom::NCom(QWidget *parent) :
     QWidget(parent),
@@ -103,24 +13,21 @@ NCom::NCom(QWidget *parent) :
 {
     ui->setupUi(this);
     mUdpSocket = new QUdpSocket(this);
-    mPacketCounter = 0;
+    mDecoder = new NcomDecoder(this);
     mMap = 0;
-    mMapCnt = 0;
     mTimer = new QTimer(this);
     mTimer->start(40);
-    mUpdateMap = false;
-
-    memset(&mData, 0, sizeof(mData));
-    mData.posMode = -1;
+    mEnuRef[0] = 0.0;
+    mEnuRef[1] = 0.0;
+    mEnuRef[2] = 0.0;
 
     connect(mTimer, SIGNAL(timeout()),
             this, SLOT(timerSlot()));
-    connect(mUdpSocket, SIGNAL(readyRead()),
-            this, SLOT(readPendingDatagrams()));
 }
 
 NCom::~NCom()
 {
+    mDecoder->stopRx();
     delete ui;
 }
 
@@ -146,189 +53,266 @@ void NCom::sendNcom(double *illh,
     double head = heading + (M_PI / 2.0);
     utility::norm_angle_rad(&head);
 
-    double velN = vel * cos(head);
-    double velE = vel * sin(head);
-    double velD = 0.0;
-
-    unsigned char packet[72];
-    memset(packet, 0, sizeof(packet));
-
-    int ind = 23;
-    put_R8(packet, &ind, llh[0] * (M_PI / 180.0));
-    put_R8(packet, &ind, llh[1] * (M_PI / 180.0));
-    put_R4(packet, &ind, llh[2] * (M_PI / 180.0));
-    ind = 43;
-    put_I3(packet, &ind, (int32_t)(velN * 1e4));
-    put_I3(packet, &ind, (int32_t)(velE * 1e4));
-    put_I3(packet, &ind, (int32_t)(velD * 1e4));
-    put_I3(packet, &ind, (int32_t)(head * 1e6));
-
-    mUdpSocket->writeDatagram((char*)packet, sizeof(packet), QHostAddress::Broadcast, 3000);
+    QByteArray packet = NcomDecoder::encode(llh, head, vel * cos(head), vel * sin(head), 0.0);
+    mUdpSocket->writeDatagram(packet, QHostAddress::Broadcast, 3000);
 }
 
+/*
+ * Drain the states that the decoder thread has queued since the last frame
+ * and update the map once.
+ */
 void NCom::timerSlot()
 {
-    if (mUpdateMap && mMap) {
-        mMap->update();
-    }
-}
-
-void NCom::readPendingDatagrams()
-{
-    while (mUdpSocket->hasPendingDatagrams()) {
-        QByteArray datagram;
-        datagram.resize(mUdpSocket->pendingDatagramSize());
-        QHostAddress sender;
-        quint16 senderPort;
+    if (mMap) {
+        double llh[3];
+        mMap->getEnuRef(llh);
 
-        mUdpSocket->readDatagram(datagram.data(), datagram.size(),
-                                 &sender, &senderPort);
+        if (memcmp(llh, mEnuRef, sizeof(mEnuRef)) != 0) {
+            memcpy(mEnuRef, llh, sizeof(mEnuRef));
+            mDecoder->setEnuRef(mEnuRef);
+        }
+    }
 
-        QHostAddress listenTo(ui->ipEdit->text());
+    QVector<bool> updated(mUnits.size(), false);
+    bool updateMap = false;
+    ncom_data d;
 
-        if (!ui->ipAnyBox->isChecked() && listenTo.toIPv4Address() != sender.toIPv4Address()) {
-//            qDebug() << listenTo << sender;
-            return;
+    while (mDecoder->takeState(d)) {
+        if (d.unit >= mUnits.size()) {
+            mUnits.resize(d.unit + 1);
+            mMapCnt.resize(d.unit + 1);
+            updated.resize(d.unit + 1);
         }
 
-        int ind = 23;
-        mData.lat = get_R8((uint8_t*)datagram.data(), &ind) * 180.0 / M_PI;
-        mData.lon = get_R8((uint8_t*)datagram.data(), &ind) * 180.0 / M_PI;
-        mData.alt = get_R4((uint8_t*)datagram.data(), &ind);
-        ind = 43;
-        mData.velN = (double)get_I3((uint8_t*)datagram.data(), &ind) * 1e-4;
-        mData.velE = (double)get_I3((uint8_t*)datagram.data(), &ind) * 1e-4;
-        mData.velD = (double)get_I3((uint8_t*)datagram.data(), &ind) * 1e-4;
-        mData.yaw = (double)get_I3((uint8_t*)datagram.data(), &ind) * 1e-6;
-
-//        qDebug() << fixed << qSetRealNumberPrecision(7) << lon << lat << alt;
-
-        QString posModeStr;
-
-        ind = 62;
-        int channel = datagram.data()[ind++];
-        if (channel == 0) {
-            ind += 5;
-            mData.posMode = datagram.data()[ind++];
-
-            switch (mData.posMode) {
-            case 0: posModeStr = "None"; break;
-            case 1: posModeStr = "Search"; break;
-            case 2: posModeStr = "Doppler"; break;
-            case 3: posModeStr = "SPS"; break;
-            case 4: posModeStr = "Differential"; break;
-            case 5: posModeStr = "RTK Float"; break;
-            case 6: posModeStr = "RTK Integer"; break;
-            case 255: posModeStr = "Invalid"; break;
-            default: posModeStr = "Unknown"; break;;
+        mUnits[d.unit] = d;
+        updated[d.unit] = true;
+
+        // Every decoded state, so that consumers can decimate on its time
+        emit dataRx(d);
+
+        // Plot every fifth point of every unit
+        mMapCnt[d.unit]++;
+        if (mMap && mMapCnt[d.unit] >= 5) {
+            mMapCnt[d.unit] = 0;
+
+            if (ui->mapPlotPointsBox->isChecked()) {
+                LocPoint p;
+                p.setXY(d.mapX, d.mapY);
+                QString info;
+
+                info.sprintf("Unit    : %d\n"
+                             "Head    : %.2f\n"
+                             "X       : %.2f\n"
+                             "Y       : %.2f\n"
+                             "Height  : %.2f\n"
+                             "velN    : %.2f\n"
+                             "velE    : %.2f\n"
+                             "velD    : %.2f\n",
+                             d.unit,
+                             d.mapYawRad * 180 / M_PI,
+                             d.mapX, d.mapY, d.alt,
+                             d.velN, d.velE, d.velD
+                        );
+
+                p.setInfo(info);
+                mMap->addInfoPoint(p, false);
+                updateMap = true;
             }
+        }
+    }
 
-            QString tmp;
-            tmp.sprintf(" (%d)", mData.posMode);
-            posModeStr.append(tmp);
-
-            ui->posModeLabel->setText("Pos mode: " + posModeStr);
+    bool anyUpdated = false;
+    for (int i = 0;i < updated.size();i++) {
+        if (updated.at(i)) {
+            anyUpdated = true;
         }
+    }
 
-        if (mMap) {
-            mPacketCounter++;
-
-            QString pktStr;
-            pktStr.sprintf("Packets RX: %d", mPacketCounter);
-            ui->packetLabel->setText(pktStr);
-
-            double illh[3], llh[3], xyz[3];
-            mMap->getEnuRef(illh);
-            llh[0] = mData.lat;
-            llh[1] = mData.lon;
-            llh[2] = mData.alt;
-
-            utility::llhToEnu(illh, llh, xyz);
-
-            mData.mapX = xyz[0];
-            mData.mapY = xyz[1];
-            mData.mapYawRad = mData.yaw - (M_PI / 2.0);
-            utility::norm_angle_rad(&mData.mapYawRad);
-
-            emit dataRx(mData);
-
-            mMapCnt++;
-            if (mMapCnt >= 5) {
-                mMapCnt = 0;
-
-                QString posStr;
-                posStr.sprintf("X %.2f, Y: %.2f, H: %.2f, YAW: %.2f",
-                               xyz[0], xyz[1], xyz[2], mData.mapYawRad * 180 / M_PI);
-                ui->posLabel->setText(posStr);
-
-                if (ui->mapPlotPointsBox->isChecked()) {
-                    LocPoint p;
-                    p.setXY(xyz[0], xyz[1]);
-                    QString info;
-
-                    info.sprintf("Head    : %.2f\n"
-                                 "X       : %.2f\n"
-                                 "Y       : %.2f\n"
-                                 "Height  : %.2f\n"
-                                 "velN    : %.2f\n"
-                                 "velE    : %.2f\n"
-                                 "velD    : %.2f\n",
-                                 mData.mapYawRad * 180 / M_PI,
-                                 xyz[0], xyz[1], xyz[2],
-                                 mData.velN, mData.velE, mData.velD
-                            );
-
-                    p.setInfo(info);
-                    mMap->addInfoPoint(p, false);
-                    mUpdateMap = true;
-                }
-
-                if (ui->mapDrawCarBox->isChecked()) {
-                    CarInfo *car = mMap->getCarInfo(220);
-                    if (car) {
-                        LocPoint p;
-                        p.setXY(xyz[0], xyz[1]);
-                        p.setYaw(mData.mapYawRad);
-                        car->setLocation(p);
-                        mUpdateMap = true;
-                    }
-                }
-            }
+    if (!anyUpdated) {
+        if (updateMap) {
+            mMap->update();
         }
+        return;
+    }
+
+    QString pktStr;
+    pktStr.sprintf("Packets RX: %lld, Units: %d, Bad: %lld, Dropped: %lld",
+                   mDecoder->getPacketsRx(), mUnits.size(),
+                   mDecoder->getPacketsBad(), mDecoder->getQueueDropped());
+    ui->packetLabel->setText(pktStr);
+
+    const ncom_data &first = mUnits.first();
+    QString posModeStr;
+
+    switch (first.posMode) {
+    case 0: posModeStr = "None"; break;
+    case 1: posModeStr = "Search"; break;
+    case 2: posModeStr = "Doppler"; break;
+    case 3: posModeStr = "SPS"; break;
+    case 4: posModeStr = "Differential"; break;
+    case 5: posModeStr = "RTK Float"; break;
+    case 6: posModeStr = "RTK Integer"; break;
+    case 255: posModeStr = "Invalid"; break;
+    default: posModeStr = "Unknown"; break;;
+    }
+
+    QString tmp;
+    tmp.sprintf(" (%d), Sats: %d", first.posMode, first.numSats);
+    posModeStr.append(tmp);
+    ui->posModeLabel->setText("Pos mode: " + posModeStr);
+
+    QString posStr;
+    posStr.sprintf("X %.2f, Y: %.2f, H: %.2f, YAW: %.2f",
+                   first.mapX, first.mapY, first.alt, first.mapYawRad * 180 / M_PI);
+    ui->posLabel->setText(posStr);
+
+    if (mMap && ui->mapDrawCarBox->isChecked()) {
+        updateCars();
+        updateMap = true;
+    }
+
+    if (updateMap) {
+        mMap->update();
     }
 }
 
 void NCom::on_connectButton_clicked()
 {
     mUdpSocket->close();
-    mUdpSocket->bind(QHostAddress::Any, ui->portBox->value(), QUdpSocket::ShareAddress);
+
+    if (mMap) {
+        for (int i = 0;i < mUnits.size();i++) {
+            mMap->removeCar(220 + i);
+        }
+    }
+
+    mUnits.clear();
+    mMapCnt.clear();
+    updateSourceFilter();
+    mDecoder->setEnuRef(mEnuRef);
+    mDecoder->startRx(ui->portBox->value());
 }
 
 void NCom::on_disconnectButton_clicked()
 {
     mUdpSocket->close();
-    mPacketCounter = 0;
+    mDecoder->stopRx();
     ui->packetLabel->setText("Packets RX: 0");
 }
 
 void NCom::on_ipAnyBox_toggled(bool checked)
 {
     ui->ipEdit->setEnabled(!checked);
+    updateSourceFilter();
+}
+
+void NCom::on_ipEdit_editingFinished()
+{
+    updateSourceFilter();
 }
 
 void NCom::on_mapDrawCarBox_toggled(bool checked)
 {
     if (mMap) {
-        CarInfo *car = mMap->getCarInfo(220);
+        if (checked) {
+            updateCars();
+        } else {
+            for (int i = 0;i < mUnits.size();i++) {
+                mMap->removeCar(220 + i);
+            }
+        }
+    }
+}
 
-        if (car && !checked) {
-            mMap->removeCar(220);
-        } else if (!car && checked) {
+/*
+ * Replay the captured datagrams, or synthetic ones if nothing has been
+ * received, through a UDP socket and the decoder queue at the given rate
+ * per unit. The unit count is doubled until the rate no longer is
+ * sustained, one second per step. This blocks the GUI while running.
+ */
+void NCom::on_benchmarkButton_clicked()
+{
+    QList<QByteArray> packets = mDecoder->getCapture();
+    QString source = "Captured";
+
+    if (packets.isEmpty()) {
+        source = "Synthetic";
+
+        for (int i = 0;i < 100;i++) {
+            double xyz[3], llh[3];
+            xyz[0] = (double)i * 0.1;
+            xyz[1] = (double)i * 0.05;
+            xyz[2] = 0.0;
+            utility::enuToLlh(mEnuRef, xyz, llh);
+            packets.append(NcomDecoder::encode(llh, 0.5, 1.0, 0.5, 0.0));
+        }
+    }
+
+    int rate = ui->benchmarkRateBox->value();
+    NcomDecoder::ReplayResult best;
+    memset(&best, 0, sizeof(best));
+
+    for (int units = 1;units <= 1024;units *= 2) {
+        ui->benchmarkLabel->setText(QString("Replaying %1 units at %2 Hz...").
+                                    arg(units).arg(rate));
+        QCoreApplication::processEvents(QEventLoop::ExcludeUserInputEvents);
+
+        NcomDecoder::ReplayResult res = NcomDecoder::replay(packets, units, rate, 1000);
+
+        qDebug() << "NCOM replay:" << res.units << "units at" << res.rateHz << "Hz, sent"
+                 << res.sent << "received" << res.received << "taken" << res.taken
+                 << "dropped" << res.queueDropped << "latency avg" << res.latencyAvgMs
+                 << "ms max" << res.latencyMaxMs << "ms";
+
+        if (!res.sustained) {
+            break;
+        }
+
+        best = res;
+    }
+
+    if (best.units == 0) {
+        ui->benchmarkLabel->setText(QString("%1 (%2 packets): 1 unit at %3 Hz not sustained").
+                                    arg(source).arg(packets.size()).arg(rate));
+    } else {
+        ui->benchmarkLabel->setText(QString("%1 (%2 packets): %3 units at %4 Hz, "
+                                            "latency %5 ms avg, %6 ms max").
+                                    arg(source).arg(packets.size()).
+                                    arg(best.units).arg(rate).
+                                    arg(best.latencyAvgMs, 0, 'f', 1).
+                                    arg(best.latencyMaxMs, 0, 'f', 1));
+    }
+}
+
+void NCom::updateSourceFilter()
+{
+    if (ui->ipAnyBox->isChecked()) {
+        mDecoder->setSourceFilter(QHostAddress());
+    } else {
+        mDecoder->setSourceFilter(QHostAddress(ui->ipEdit->text()));
+    }
+}
+
+void NCom::updateCars()
+{
+    for (int i = 0;i < mUnits.size();i++) {
+        int id = 220 + i;
+        CarInfo *car = mMap->getCarInfo(id);
+
+        if (!car) {
             CarInfo carNew;
             carNew.setColor(Qt::blue);
-            carNew.setId(220);
-            carNew.setName("RtRange (ID 220)");
+            carNew.setId(id);
+            carNew.setName(QString("RtRange (ID %1)").arg(id));
             mMap->addCar(carNew);
+            car = mMap->getCarInfo(id);
+        }
+
+        if (car) {
+            LocPoint p;
+            p.setXY(mUnits.at(i).mapX, mUnits.at(i).mapY);
+            p.setYaw(mUnits.at(i).mapYawRad);
+            car->setLocation(p);
         }
     }
 }
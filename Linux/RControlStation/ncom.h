@@ -6,6 +6,7 @@
 #include <QTimer>
 #include "mapwidget.h"
 #include "datatypes.h"
+#include "ncomdecoder.h"
 
 namespace Ui {
 class NCom;
@@ -31,21 +32,25 @@ signals:
 
 private slots:
     void timerSlot();
-    void readPendingDatagrams();
     void on_connectButton_clicked();
     void on_disconnectButton_clicked();
     void on_ipAnyBox_toggled(bool checked);
+    void on_ipEdit_editingFinished();
     void on_mapDrawCarBox_toggled(bool checked);
+    void on_benchmarkButton_clicked();
 
 private:
     Ui::NCom *ui;
     QUdpSocket *mUdpSocket;
-    int mPacketCounter;
+    NcomDecoder *mDecoder;
     MapWidget *mMap;
-    unsigned int mMapCnt;
-    ncom_data mData;
+    QVector<ncom_data> mUnits;
+    QVector<unsigned int> mMapCnt;
     QTimer *mTimer;
-    bool mUpdateMap;
+    double mEnuRef[3];
+
+    void updateSourceFilter();
+    void updateCars();
 
 };
 
@@ -0,0 +1,765 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "ncomdecoder.h"
+#include "utility.h"
+
+#include <QUdpSocket>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QMutexLocker>
+#include <QDebug>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+const uint8_t NCOM_SYNC = 0xE7;
+const int NCOM_LEN = 72;
+
+inline int32_t get_I3(const uint8_t *msg, int *ind) {
+    int32_t res =	((uint32_t) msg[*ind + 2]) << 16 |
+                    ((uint32_t) msg[*ind + 1]) << 8 |
+                    ((uint32_t) msg[*ind + 0]);
+    *ind += 3;
+
+    if (res & 0b00000000100000000000000000000000) {
+        res |= 0xFF000000;
+    }
+
+    return res;
+}
+
+inline uint16_t get_U2(const uint8_t *msg, int *ind) {
+    uint16_t res =	((uint16_t) msg[*ind + 1]) << 8 |
+                    ((uint16_t) msg[*ind + 0]);
+    *ind += 2;
+    return res;
+}
+
+inline int16_t get_I2(const uint8_t *msg, int *ind) {
+    return (int16_t)get_U2(msg, ind);
+}
+
+inline int32_t get_I4(const uint8_t *msg, int *ind) {
+    uint32_t res =	((uint32_t) msg[*ind + 3]) << 24 |
+                    ((uint32_t) msg[*ind + 2]) << 16 |
+                    ((uint32_t) msg[*ind + 1]) << 8 |
+                    ((uint32_t) msg[*ind + 0]);
+    *ind += 4;
+    return (int32_t)res;
+}
+
+inline float get_R4(const uint8_t *msg, int *ind) {
+    union asd {
+        float f;
+        uint32_t i;
+    } x;
+
+    x.i = (uint32_t)get_I4(msg, ind);
+    return x.f;
+}
+
+inline double get_R8(const uint8_t *msg, int *ind) {
+    uint64_t res =	((uint64_t) msg[*ind + 7]) << 56 |
+                    ((uint64_t) msg[*ind + 6]) << 48 |
+                    ((uint64_t) msg[*ind + 5]) << 40 |
+                    ((uint64_t) msg[*ind + 4]) << 32 |
+                    ((uint64_t) msg[*ind + 3]) << 24 |
+                    ((uint64_t) msg[*ind + 2]) << 16 |
+                    ((uint64_t) msg[*ind + 1]) << 8 |
+                    ((uint64_t) msg[*ind + 0]);
+    *ind += 8;
+
+    union asd {
+        double f;
+        uint64_t i;
+    } x;
+
+    x.i = res;
+
+    return x.f;
+}
+
+void put_I3(uint8_t *msg, int *ind, int32_t data) {
+    msg[(*ind)++] = data;
+    msg[(*ind)++] = data >> 8;
+    msg[(*ind)++] = data >> 16;
+}
+
+void put_R4(uint8_t *msg, int *ind, float data) {
+    union asd {
+        float f;
+        uint32_t i;
+    } x;
+
+    x.f = data;
+
+    msg[(*ind)++] = x.i;
+    msg[(*ind)++] = x.i >> 8;
+    msg[(*ind)++] = x.i >> 16;
+    msg[(*ind)++] = x.i >> 24;
+}
+
+void put_R8(uint8_t *msg, int *ind, double data) {
+    union asd {
+        double f;
+        uint64_t i;
+    } x;
+
+    x.f = data;
+
+    msg[(*ind)++] = x.i;
+    msg[(*ind)++] = x.i >> 8;
+    msg[(*ind)++] = x.i >> 16;
+    msg[(*ind)++] = x.i >> 24;
+    msg[(*ind)++] = x.i >> 32;
+    msg[(*ind)++] = x.i >> 40;
+    msg[(*ind)++] = x.i >> 48;
+    msg[(*ind)++] = x.i >> 56;
+}
+
+// The NCOM checksums are the sum of all bytes after the sync byte
+inline uint8_t checksum(const uint8_t *msg, int end) {
+    uint8_t sum = 0;
+    for (int i = 1;i < end;i++) {
+        sum += msg[i];
+    }
+    return sum;
+}
+
+// Sends packets to a local port at a fixed rate, from one socket per unit
+// so that every unit has its own source port like real units.
+class ReplaySender : public QThread
+{
+public:
+    ReplaySender(const QList<QByteArray> &packets, int units, int rateHz,
+                 int durationMs, quint16 port) :
+        mPackets(packets), mUnits(units), mRateHz(rateHz),
+        mDurationMs(durationMs), mPort(port), sent(0), finishMs(0) {}
+
+    qint64 expected() const {
+        return (qint64)mDurationMs * mRateHz / 1000 * mUnits;
+    }
+
+protected:
+    void run() {
+        QList<QUdpSocket*> sockets;
+        for (int i = 0;i < mUnits;i++) {
+            sockets.append(new QUdpSocket);
+        }
+
+        qint64 periodNs = 1000000000LL / mRateHz;
+        qint64 ticks = (qint64)mDurationMs * mRateHz / 1000;
+        int ind = 0;
+
+        QElapsedTimer timer;
+        timer.start();
+
+        for (qint64 tick = 0;tick < ticks;tick++) {
+            qint64 waitNs = tick * periodNs - timer.nsecsElapsed();
+            if (waitNs > 0) {
+                QThread::usleep(waitNs / 1000);
+            }
+
+            for (QUdpSocket *s: sockets) {
+                const QByteArray &p = mPackets.at(ind++ % mPackets.size());
+                if (s->writeDatagram(p, QHostAddress::LocalHost, mPort) == p.size()) {
+                    sent++;
+                }
+            }
+        }
+
+        finishMs = timer.elapsed();
+        qDeleteAll(sockets);
+    }
+
+private:
+    QList<QByteArray> mPackets;
+    int mUnits;
+    int mRateHz;
+    int mDurationMs;
+    quint16 mPort;
+
+public:
+    qint64 sent;
+    qint64 finishMs;
+};
+}
+
+NcomDecoder::NcomDecoder(QObject *parent) : QThread(parent)
+{
+    mPort = 0;
+    mBoundPort = 0;
+    mSourceFilter = 0;
+    mQueue.resize(QUEUE_LEN);
+    mHead = 0;
+    mTail = 0;
+    mPacketsRx = 0;
+    mPacketsBad = 0;
+    mQueueDropped = 0;
+    mRefLlh[0] = 0.0;
+    mRefLlh[1] = 0.0;
+    mRefLlh[2] = 0.0;
+    mRefGen = 0;
+    mCaptureDone = 0;
+}
+
+NcomDecoder::~NcomDecoder()
+{
+    stopRx();
+}
+
+/**
+ * @brief NcomDecoder::startRx
+ * Start receiving on a UDP port. Restarts the reception if it is running.
+ *
+ * @param port
+ * The UDP port.
+ *
+ * @return
+ * true on success.
+ */
+bool NcomDecoder::startRx(quint16 port)
+{
+    stopRx();
+
+    mPort = port;
+    mBoundPort = 0;
+    mHead = 0;
+    mTail = 0;
+    mPacketsRx = 0;
+    mPacketsBad = 0;
+    mQueueDropped = 0;
+    mUnitIndex.clear();
+    mUnits.clear();
+
+    mCaptureMutex.lock();
+    mCapture.clear();
+    mCaptureDone = 0;
+    mCaptureMutex.unlock();
+
+    start();
+    return true;
+}
+
+void NcomDecoder::stopRx()
+{
+    if (isRunning()) {
+        requestInterruption();
+        wait();
+    }
+}
+
+/**
+ * @brief NcomDecoder::setSourceFilter
+ * Only accept datagrams from one address.
+ *
+ * @param addr
+ * The address, or a null address to accept datagrams from any address.
+ */
+void NcomDecoder::setSourceFilter(const QHostAddress &addr)
+{
+    mSourceFilter.storeRelease(addr.isNull() ? 0 : addr.toIPv4Address());
+}
+
+void NcomDecoder::setEnuRef(const double *llh)
+{
+    QMutexLocker locker(&mRefMutex);
+    mRefLlh[0] = llh[0];
+    mRefLlh[1] = llh[1];
+    mRefLlh[2] = llh[2];
+    mRefGen.fetchAndAddRelease(1);
+}
+
+/**
+ * @brief NcomDecoder::takeState
+ * Take the oldest decoded state from the queue. Must always be called from
+ * the same thread.
+ *
+ * @param data
+ * The state.
+ *
+ * @return
+ * false if the queue was empty.
+ */
+bool NcomDecoder::takeState(ncom_data &data)
+{
+    int tail = mTail.load();
+
+    if (tail == mHead.loadAcquire()) {
+        return false;
+    }
+
+    data = mQueue.at(tail);
+    mTail.storeRelease((tail + 1) & (QUEUE_LEN - 1));
+    return true;
+}
+
+qint64 NcomDecoder::getPacketsRx() const
+{
+    return mPacketsRx.load();
+}
+
+qint64 NcomDecoder::getPacketsBad() const
+{
+    return mPacketsBad.load();
+}
+
+qint64 NcomDecoder::getQueueDropped() const
+{
+    return mQueueDropped.load();
+}
+
+/**
+ * @brief NcomDecoder::getBoundPort
+ * @return
+ * The port that the receive thread listens on, or 0 if it has not bound
+ * the socket yet. Useful when starting on port 0.
+ */
+quint16 NcomDecoder::getBoundPort() const
+{
+    return (quint16)mBoundPort.loadAcquire();
+}
+
+/**
+ * @brief NcomDecoder::getCapture
+ * @return
+ * The first datagrams that were received after starting.
+ */
+QList<QByteArray> NcomDecoder::getCapture()
+{
+    QMutexLocker locker(&mCaptureMutex);
+    return mCapture;
+}
+
+/**
+ * @brief NcomDecoder::decode
+ * Decode an NCOM packet into the state of the unit that sent it. The
+ * fields from the status channel are only updated when that channel is
+ * received. Channels 0 and 3 to 15, the GNSS status and the Kalman filter
+ * states and accuracies, are decoded. The other channels, e.g. the
+ * innovations and the receiver internals, are only available as raw
+ * channelData. Packets without sync byte, as sent by older versions of the
+ * simulators, are accepted without checking the checksums.
+ *
+ * @param data
+ * The packet.
+ *
+ * @param len
+ * The length of the packet.
+ *
+ * @param d
+ * The state to update.
+ *
+ * @return
+ * false if the packet is too short or the checksum of the navigation
+ * data is wrong.
+ */
+bool NcomDecoder::decode(const uint8_t *data, int len, ncom_data &d)
+{
+    if (len < NCOM_LEN) {
+        return false;
+    }
+
+    bool checked = data[0] == NCOM_SYNC;
+
+    // Checksum 1 covers batch A and checksum 2 batches A and B
+    if (checked && (checksum(data, 22) != data[22] ||
+                    checksum(data, 61) != data[61])) {
+        return false;
+    }
+
+    // Batch A
+    int ind = 1;
+    d.timeMs = get_U2(data, &ind);
+    d.accX = (double)get_I3(data, &ind) * 1e-4;
+    d.accY = (double)get_I3(data, &ind) * 1e-4;
+    d.accZ = (double)get_I3(data, &ind) * 1e-4;
+    d.rateX = (double)get_I3(data, &ind) * 1e-5;
+    d.rateY = (double)get_I3(data, &ind) * 1e-5;
+    d.rateZ = (double)get_I3(data, &ind) * 1e-5;
+    d.navStatus = data[ind++];
+
+    // Batch B
+    ind = 23;
+    d.lat = get_R8(data, &ind) * 180.0 / M_PI;
+    d.lon = get_R8(data, &ind) * 180.0 / M_PI;
+    d.alt = get_R4(data, &ind);
+    d.velN = (double)get_I3(data, &ind) * 1e-4;
+    d.velE = (double)get_I3(data, &ind) * 1e-4;
+    d.velD = (double)get_I3(data, &ind) * 1e-4;
+    d.yaw = (double)get_I3(data, &ind) * 1e-6;
+    d.pitch = (double)get_I3(data, &ind) * 1e-6;
+    d.roll = (double)get_I3(data, &ind) * 1e-6;
+
+    // Batch S
+    ind = 62;
+    d.channel = data[ind++];
+    memcpy(d.channelData, data + ind, sizeof(d.channelData));
+
+    if (checked && checksum(data, 71) != data[71]) {
+        d.channel = -1;
+        return true;
+    }
+
+    switch (d.channel) {
+    case 0:
+        d.gpsMinutes = get_I4(data, &ind);
+        d.numSats = data[ind++];
+        d.posMode = data[ind++];
+        d.velMode = data[ind++];
+        d.oriMode = data[ind++];
+        break;
+
+    case 3:
+        d.posAccN = (double)get_U2(data, &ind) * 1e-3;
+        d.posAccE = (double)get_U2(data, &ind) * 1e-3;
+        d.posAccD = (double)get_U2(data, &ind) * 1e-3;
+        break;
+
+    case 4:
+        d.velAccN = (double)get_U2(data, &ind) * 1e-3;
+        d.velAccE = (double)get_U2(data, &ind) * 1e-3;
+        d.velAccD = (double)get_U2(data, &ind) * 1e-3;
+        break;
+
+    case 5:
+        d.headAcc = (double)get_U2(data, &ind) * 1e-5;
+        d.pitchAcc = (double)get_U2(data, &ind) * 1e-5;
+        d.rollAcc = (double)get_U2(data, &ind) * 1e-5;
+        break;
+
+    case 6:
+        for (int i = 0;i < 3;i++) {
+            d.gyroBias[i] = (double)get_I2(data, &ind) * 5e-6;
+        }
+        break;
+
+    case 7:
+        for (int i = 0;i < 3;i++) {
+            d.accBias[i] = (double)get_I2(data, &ind) * 1e-4;
+        }
+        break;
+
+    case 8:
+        for (int i = 0;i < 3;i++) {
+            d.gyroSf[i] = (double)get_I2(data, &ind) * 1e-6;
+        }
+        break;
+
+    case 9:
+        for (int i = 0;i < 3;i++) {
+            d.gyroBiasAcc[i] = (double)get_U2(data, &ind) * 1e-6;
+        }
+        break;
+
+    case 10:
+        for (int i = 0;i < 3;i++) {
+            d.accBiasAcc[i] = (double)get_U2(data, &ind) * 1e-4;
+        }
+        break;
+
+    case 11:
+        for (int i = 0;i < 3;i++) {
+            d.gyroSfAcc[i] = (double)get_U2(data, &ind) * 1e-6;
+        }
+        break;
+
+    case 12:
+        for (int i = 0;i < 3;i++) {
+            d.antPos[i] = (double)get_I2(data, &ind) * 1e-3;
+        }
+        break;
+
+    case 13:
+        d.dualHeading = (double)get_I2(data, &ind) * 1e-4;
+        d.dualPitch = (double)get_I2(data, &ind) * 1e-4;
+        d.dualDist = (double)get_U2(data, &ind) * 1e-3;
+        break;
+
+    case 14:
+        for (int i = 0;i < 3;i++) {
+            d.antPosAcc[i] = (double)get_U2(data, &ind) * 1e-4;
+        }
+        break;
+
+    case 15:
+        d.dualHeadingAcc = (double)get_U2(data, &ind) * 1e-4;
+        d.dualPitchAcc = (double)get_U2(data, &ind) * 1e-4;
+        d.dualDistAcc = (double)get_U2(data, &ind) * 1e-4;
+        break;
+
+    default:
+        break;
+    }
+
+    return true;
+}
+
+/**
+ * @brief NcomDecoder::encode
+ * Create an NCOM packet with position, velocity and heading, with the
+ * other fields set to zero.
+ *
+ * @param llh
+ * Latitude, longitude and height.
+ *
+ * @param heading
+ * NCOM heading in radians, clockwise from north.
+ *
+ * @param velN
+ * North velocity.
+ *
+ * @param velE
+ * East velocity.
+ *
+ * @param velD
+ * Down velocity.
+ *
+ * @return
+ * The packet.
+ */
+QByteArray NcomDecoder::encode(const double *llh, double heading, double velN,
+                               double velE, double velD)
+{
+    uint8_t packet[NCOM_LEN];
+    memset(packet, 0, sizeof(packet));
+
+    packet[0] = NCOM_SYNC;
+
+    int ind = 23;
+    put_R8(packet, &ind, llh[0] * (M_PI / 180.0));
+    put_R8(packet, &ind, llh[1] * (M_PI / 180.0));
+    put_R4(packet, &ind, llh[2]);
+    put_I3(packet, &ind, (int32_t)(velN * 1e4));
+    put_I3(packet, &ind, (int32_t)(velE * 1e4));
+    put_I3(packet, &ind, (int32_t)(velD * 1e4));
+    put_I3(packet, &ind, (int32_t)(heading * 1e6));
+
+    packet[22] = checksum(packet, 22);
+    packet[61] = checksum(packet, 61);
+    packet[71] = checksum(packet, 71);
+
+    return QByteArray((const char*)packet, sizeof(packet));
+}
+
+/**
+ * @brief NcomDecoder::replay
+ * Replay packets to a new decoder over UDP on the local host, from one
+ * socket per unit at a fixed rate, and drain its queue every
+ * DRAIN_INTERVAL_MS like the map does. Blocks for the duration.
+ *
+ * @param packets
+ * Packets to send. They are sent over and over again, spread over the
+ * units.
+ *
+ * @param units
+ * The number of units to simulate.
+ *
+ * @param rateHz
+ * The rate per unit.
+ *
+ * @param durationMs
+ * How long to send for.
+ *
+ * @return
+ * The result. The rate is sustained if the sender kept up and every packet
+ * that was sent was decoded and taken from the queue.
+ */
+NcomDecoder::ReplayResult NcomDecoder::replay(const QList<QByteArray> &packets, int units,
+                                              int rateHz, int durationMs)
+{
+    ReplayResult res;
+    memset(&res, 0, sizeof(res));
+    res.units = units;
+    res.rateHz = rateHz;
+
+    if (packets.isEmpty() || units <= 0 || rateHz <= 0 || durationMs <= 0) {
+        return res;
+    }
+
+    NcomDecoder decoder;
+    decoder.startRx(0);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    while (decoder.getBoundPort() == 0) {
+        if (timer.elapsed() > 2000) {
+            qWarning() << "NCOM replay: the decoder did not start";
+            return res;
+        }
+
+        QThread::msleep(1);
+    }
+
+    ReplaySender sender(packets, units, rateHz, durationMs, decoder.getBoundPort());
+    sender.start();
+
+    ncom_data d;
+    double latencySum = 0.0;
+    qint64 doneMs = -1;
+
+    // Drain until the sender is done and the rest has arrived, or stopped
+    // arriving.
+    for (;;) {
+        bool senderDone = sender.isFinished();
+        qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+        while (decoder.takeState(d)) {
+            double latency = (double)(now - d.rxTimeMs);
+            latencySum += latency;
+            if (latency > res.latencyMaxMs) {
+                res.latencyMaxMs = latency;
+            }
+            res.taken++;
+        }
+
+        if (senderDone) {
+            if (doneMs < 0) {
+                doneMs = timer.elapsed();
+            }
+
+            qint64 accounted = res.taken + decoder.getQueueDropped() + decoder.getPacketsBad();
+            if (accounted >= sender.sent || (timer.elapsed() - doneMs) > 500) {
+                break;
+            }
+        }
+
+        QThread::msleep(DRAIN_INTERVAL_MS);
+    }
+
+    sender.wait();
+    decoder.stopRx();
+
+    res.sent = sender.sent;
+    res.received = decoder.getPacketsRx();
+    res.queueDropped = decoder.getQueueDropped();
+    res.latencyAvgMs = res.taken > 0 ? latencySum / (double)res.taken : 0.0;
+
+    // The sender may finish one period late without falling behind
+    res.sustained = res.sent == sender.expected() && res.taken == res.sent &&
+            sender.finishMs <= (durationMs + 1000 / rateHz + 20);
+
+    return res;
+}
+
+void NcomDecoder::run()
+{
+    QUdpSocket socket;
+
+    if (!socket.bind(QHostAddress::Any, mPort, QUdpSocket::ShareAddress)) {
+        qWarning() << "NCOM: Could not bind to port" << mPort;
+        return;
+    }
+
+    mBoundPort.storeRelease(socket.localPort());
+
+    QByteArray datagram;
+    QHostAddress sender;
+    quint16 senderPort;
+    int refGen = mRefGen.load() - 1;
+
+    while (!isInterruptionRequested()) {
+        if (!socket.waitForReadyRead(100)) {
+            continue;
+        }
+
+        if (mRefGen.loadAcquire() != refGen) {
+            QMutexLocker locker(&mRefMutex);
+            refGen = mRefGen.load();
+            mEnuFrame.setRef(mRefLlh);
+        }
+
+        while (socket.hasPendingDatagrams()) {
+            datagram.resize(socket.pendingDatagramSize());
+            socket.readDatagram(datagram.data(), datagram.size(),
+                                &sender, &senderPort);
+            processDatagram(datagram, sender.toIPv4Address(), senderPort);
+        }
+    }
+}
+
+void NcomDecoder::processDatagram(const QByteArray &datagram, quint32 ip, quint16 port)
+{
+    quint32 filter = mSourceFilter.loadAcquire();
+    if (filter != 0 && filter != ip) {
+        return;
+    }
+
+    mPacketsRx.fetchAndAddRelaxed(1);
+
+    if (!mCaptureDone.loadAcquire()) {
+        QMutexLocker locker(&mCaptureMutex);
+        mCapture.append(datagram);
+        if (mCapture.size() >= CAPTURE_LEN) {
+            mCaptureDone.storeRelease(1);
+        }
+    }
+
+    quint64 key = (quint64)ip << 16 | port;
+    int unit = mUnitIndex.value(key, -1);
+
+    if (unit < 0) {
+        ncom_data d;
+        memset(&d, 0, sizeof(d));
+        d.posMode = -1;
+        d.unit = mUnits.size();
+        d.sourceIp = ip;
+        d.sourcePort = port;
+        unit = d.unit;
+        mUnitIndex.insert(key, unit);
+        mUnits.append(d);
+    }
+
+    ncom_data &d = mUnits[unit];
+
+    if (!decode((const uint8_t*)datagram.constData(), datagram.size(), d)) {
+        mPacketsBad.fetchAndAddRelaxed(1);
+        return;
+    }
+
+    d.rxTimeMs = QDateTime::currentMSecsSinceEpoch();
+    toMap(mEnuFrame, d);
+
+    int head = mHead.load();
+    int next = (head + 1) & (QUEUE_LEN - 1);
+
+    if (next == mTail.loadAcquire()) {
+        mQueueDropped.fetchAndAddRelaxed(1);
+        return;
+    }
+
+    mQueue[head] = d;
+    mHead.storeRelease(next);
+}
+
+void NcomDecoder::toMap(const EnuFrame &frame, ncom_data &d)
+{
+    double llh[3], xyz[3];
+    llh[0] = d.lat;
+    llh[1] = d.lon;
+    llh[2] = d.alt;
+
+    frame.llhToEnu(llh, xyz);
+
+    d.mapX = xyz[0];
+    d.mapY = xyz[1];
+    d.mapYawRad = d.yaw - (M_PI / 2.0);
+    utility::norm_angle_rad(&d.mapYawRad);
+}
@@ -0,0 +1,121 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef NCOMDECODER_H
+#define NCOMDECODER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QList>
+#include <QHash>
+#include <QVector>
+#include <QByteArray>
+#include <QHostAddress>
+#include <QAtomicInteger>
+
+#include "datatypes.h"
+#include "enuframe.h"
+
+/**
+ * @brief The NcomDecoder class
+ *
+ * Receives and decodes OxTS NCOM datagrams on a background thread. The
+ * decoded states, with ENU coordinates from a precomputed frame, are put in
+ * a single-producer single-consumer queue without locks that the GUI drains
+ * with takeState() once per frame. The state of every unit is kept, so that
+ * values from the status channels that are sent in turns stay available.
+ */
+class NcomDecoder : public QThread
+{
+    Q_OBJECT
+public:
+    typedef struct {
+        int units;
+        int rateHz;
+        qint64 sent;
+        qint64 received; // By the decoder thread
+        qint64 taken; // From the queue
+        qint64 queueDropped;
+        double latencyAvgMs; // From decoding to taking from the queue
+        double latencyMaxMs;
+        bool sustained;
+    } ReplayResult;
+
+    NcomDecoder(QObject *parent = 0);
+    ~NcomDecoder();
+    bool startRx(quint16 port);
+    void stopRx();
+    void setSourceFilter(const QHostAddress &addr);
+    void setEnuRef(const double *llh);
+
+    bool takeState(ncom_data &data);
+    qint64 getPacketsRx() const;
+    qint64 getPacketsBad() const;
+    qint64 getQueueDropped() const;
+    quint16 getBoundPort() const;
+    QList<QByteArray> getCapture();
+
+    static bool decode(const uint8_t *data, int len, ncom_data &d);
+    static QByteArray encode(const double *llh, double heading, double velN,
+                             double velE, double velD);
+    static ReplayResult replay(const QList<QByteArray> &packets, int units,
+                               int rateHz, int durationMs);
+
+protected:
+    void run();
+
+private:
+    static const int QUEUE_LEN = 8192; // Power of two
+    static const int CAPTURE_LEN = 1000;
+    static const int DRAIN_INTERVAL_MS = 40; // As the map
+
+    quint16 mPort;
+    QAtomicInt mBoundPort;
+    QAtomicInteger<quint32> mSourceFilter;
+
+    // Queue. mHead is only written by the receive thread and mTail by the
+    // thread that calls takeState.
+    QVector<ncom_data> mQueue;
+    QAtomicInt mHead;
+    QAtomicInt mTail;
+
+    QAtomicInteger<qint64> mPacketsRx;
+    QAtomicInteger<qint64> mPacketsBad;
+    QAtomicInteger<qint64> mQueueDropped;
+
+    // ENU reference updates are rare, so the receive thread only takes the
+    // lock when the generation counter has changed.
+    QMutex mRefMutex;
+    double mRefLlh[3];
+    QAtomicInt mRefGen;
+
+    // The first datagrams after starting, for the replay benchmark
+    QMutex mCaptureMutex;
+    QList<QByteArray> mCapture;
+    QAtomicInt mCaptureDone;
+
+    // Only used by the receive thread
+    EnuFrame mEnuFrame;
+    QHash<quint64, int> mUnitIndex;
+    QVector<ncom_data> mUnits;
+
+    void processDatagram(const QByteArray &datagram, quint32 ip, quint16 port);
+    static void toMap(const EnuFrame &frame, ncom_data &d);
+
+};
+
+#endif // NCOMDECODER_H
@@ -18,6 +18,104 @@
 #include "networkinterface.h"
 #include "ui_networkinterface.h"
 #include <QMessageBox>
+#include <QElapsedTimer>
+
+namespace {
+// Describe one message the way the reader sees it, up to the end of the
+// root element.
+QString dump_xml(QXmlStreamReader &stream)
+{
+    QString res;
+    int depth = 0;
+
+    while (!stream.atEnd()) {
+        stream.readNext();
+
+        if (stream.isStartElement()) {
+            res += "<" + stream.name().toString();
+            depth++;
+        } else if (stream.isEndElement()) {
+            res += ">";
+            depth--;
+            if (depth == 0) {
+                break;
+            }
+        } else if (stream.isCharacters() && !stream.isWhitespace()) {
+            res += "=" + stream.text().toString();
+        }
+    }
+
+    if (stream.hasError()) {
+        res += " error: " + stream.errorString();
+    }
+
+    return res;
+}
+
+// Messages like the ones CarNetworkTester sends
+QList<QByteArray> test_messages()
+{
+    QList<QByteArray> res;
+
+    for (int i = 0;i < 40;i++) {
+        QByteArray data;
+        QXmlStreamWriter stream(&data);
+        stream.setAutoFormatting(true);
+
+        stream.writeStartDocument();
+        stream.writeStartElement("message");
+
+        switch (i % 4) {
+        case 0:
+            stream.writeStartElement("getState");
+            stream.writeTextElement("id", QString::number(i));
+            stream.writeEndElement();
+            break;
+
+        case 1:
+            stream.writeStartElement("replaceRoute");
+            stream.writeTextElement("id", "0");
+            for (int j = 0;j < 20;j++) {
+                stream.writeStartElement("point");
+                stream.writeTextElement("px", QString::number(j * 1.25 + i));
+                stream.writeTextElement("py", QString::number(-j * 0.5));
+                stream.writeTextElement("speed", "1.5");
+                stream.writeTextElement("time", QString::number(j * 100));
+                stream.writeEndElement();
+            }
+            stream.writeEndElement();
+            break;
+
+        case 2:
+            stream.writeStartElement("setEnuRef");
+            stream.writeTextElement("id", "1");
+            stream.writeTextElement("lat", "57.71495867");
+            stream.writeTextElement("lon", "12.89134921");
+            stream.writeTextElement("height", "219.0");
+            stream.writeEndElement();
+            break;
+
+        default:
+            // Two commands in one message
+            stream.writeStartElement("getState");
+            stream.writeTextElement("id", "2");
+            stream.writeEndElement();
+            stream.writeStartElement("rcControl");
+            stream.writeTextElement("id", "2");
+            stream.writeTextElement("mode", "1");
+            stream.writeTextElement("value", "0.1");
+            stream.writeTextElement("steering", "-0.2");
+            stream.writeEndElement();
+            break;
+        }
+
+        stream.writeEndDocument();
+        res.append(data);
+    }
+
+    return res;
+}
+}
 
 NetworkInterface::NetworkInterface(QWidget *parent) :
     QWidget(parent),
@@ -34,6 +132,15 @@ NetworkInterface::NetworkInterface(QWidget *parent) :
     mPollTimerCarId = -1;
     mPollTimer->setSingleShot(false);
     mCars = 0;
+    mStatsTimer = new QTimer(this);
+    mStatsTimer->start(1000);
+    mStatsMessages = 0;
+    mStatsBytes = 0;
+    mStatsParseNs = 0;
+    mTestLog = 0;
+
+    resetXml();
+    mRxTail.clear();
 
     connect(mTcpServer, SIGNAL(dataRx(QByteArray)),
             this, SLOT(tcpDataRx(QByteArray)));
@@ -43,6 +150,8 @@ NetworkInterface::NetworkInterface(QWidget *parent) :
             this, SLOT(udpReadReady()));
     connect(mPollTimer, SIGNAL(timeout()),
             this, SLOT(pollTimerSlot()));
+    connect(mStatsTimer, SIGNAL(timeout()),
+            this, SLOT(statsTimerSlot()));
 
     tcpConnectionChanged(false);
 }
@@ -113,6 +222,12 @@ void NetworkInterface::sendState(quint8 id, const CAR_STATE &state)
     stream.writeTextElement("ap_goal_py", QString::number(state.ap_goal_py));
     stream.writeTextElement("ap_rad", QString::number(state.ap_rad));
     stream.writeTextElement("ms_today", QString::number(state.ms_today));
+    stream.writeTextElement("can_nodes", QString::number(state.can_nodes));
+    stream.writeTextElement("can_nodes_alive", QString::number(state.can_nodes_alive));
+    stream.writeTextElement("can_vin_min", QString::number(state.can_vin_min));
+    stream.writeTextElement("can_temp_fet_max", QString::number(state.can_temp_fet_max));
+    stream.writeTextElement("can_temp_motor_max", QString::number(state.can_temp_motor_max));
+    stream.writeTextElement("can_current_in_tot", QString::number(state.can_current_in_tot));
 
     stream.writeEndDocument();
     sendData(data);
@@ -143,6 +258,11 @@ void NetworkInterface::sendEnuRef(quint8 id, double lat, double lon, double heig
 
 void NetworkInterface::sendError(const QString &txt, const QString &cmd)
 {
+    if (mTestLog) {
+        mTestLog->append("error: " + txt);
+        return;
+    }
+
     QByteArray data;
     QXmlStreamWriter stream(&data);
     stream.setAutoFormatting(true);
@@ -207,6 +327,141 @@ void NetworkInterface::pollTimerSlot()
     }
 }
 
+void NetworkInterface::statsTimerSlot()
+{
+    double usPerMsg = 0.0;
+    if (mStatsMessages > 0) {
+        usPerMsg = (double)mStatsParseNs / (double)mStatsMessages / 1000.0;
+    }
+
+    ui->rxStatsLabel->setText(tr("Rx: %1 msg/s, %2 kB/s, %3 us/msg").
+                              arg(mStatsMessages).
+                              arg((double)mStatsBytes / 1000.0, 0, 'f', 1).
+                              arg(usPerMsg, 0, 'f', 1));
+
+    mStatsMessages = 0;
+    mStatsBytes = 0;
+    mStatsParseNs = 0;
+}
+
+/**
+ * @brief NetworkInterface::parserSelfTest
+ * Feed test messages through the persistent XML reader one per read,
+ * all coalesced in one read, byte by byte and in random fragments, and
+ * check that every message is read the same way as by a fresh reader.
+ * Then check that an oversized message is dropped without affecting the
+ * next one. The messages are only read, not executed, and errors are not
+ * sent to the client.
+ *
+ * @param log
+ * The result of every case.
+ *
+ * @return
+ * true if all cases passed, false otherwise or if TCP or UDP is active.
+ */
+bool NetworkInterface::parserSelfTest(QString &log)
+{
+    if (ui->tcpActivateBox->isChecked() || ui->udpActivateBox->isChecked()) {
+        log = "Deactivate TCP and UDP before running the test.";
+        return false;
+    }
+
+    QList<QByteArray> msgs = test_messages();
+    const char *separators[4] = {"", "\n", "\r\n  \n", "junk "};
+    QByteArray stream;
+    QStringList expected;
+
+    for (int i = 0;i < msgs.size();i++) {
+        stream.append(separators[i % 4]);
+        stream.append(msgs.at(i));
+
+        QXmlStreamReader reader;
+        reader.addData(msgs.at(i));
+        expected.append(dump_xml(reader));
+    }
+
+    QStringList result;
+    bool ok = true;
+    log.clear();
+
+    auto check = [&](const QString &name, const QStringList &exp) {
+        bool pass = result == exp;
+        log += QString("%1: %2 of %3 messages, %4\n").arg(name).
+                arg(result.size()).arg(exp.size()).arg(pass ? "ok" : "FAILED");
+
+        if (!pass) {
+            for (int i = 0;i < qMax(result.size(), exp.size());i++) {
+                QString r = i < result.size() ? result.at(i) : "(missing)";
+                QString e = i < exp.size() ? exp.at(i) : "(none)";
+                if (r != e) {
+                    log += QString("  first difference at %1:\n  got: %2\n  expected: %3\n").
+                            arg(i).arg(r.left(200)).arg(e.left(200));
+                    break;
+                }
+            }
+            ok = false;
+        }
+
+        result.clear();
+        resetXml();
+        mRxTail.clear();
+    };
+
+    mTestLog = &result;
+    resetXml();
+    mRxTail.clear();
+
+    for (int i = 0;i < msgs.size();i++) {
+        processData(QByteArray(separators[i % 4]) + msgs.at(i));
+    }
+    check("One message per read", expected);
+
+    processData(stream);
+    check("All messages in one read", expected);
+
+    for (int i = 0;i < stream.size();i++) {
+        processData(stream.mid(i, 1));
+    }
+    check("Byte by byte", expected);
+
+    int maxLens[3] = {16, 512, 8192};
+    for (int i = 0;i < 3;i++) {
+        qsrand(1234 + i);
+        int pos = 0;
+        while (pos < stream.size()) {
+            int len = qrand() % maxLens[i] + 1;
+            processData(stream.mid(pos, len));
+            pos += len;
+        }
+        check(QString("Random reads of 1 to %1 bytes").arg(maxLens[i]), expected);
+    }
+
+    // A message over the 5 MB limit, in 64 kB reads, and then a normal
+    // message in the same read as the end of it.
+    QByteArray big = "<?xml version=\"1.0\"?><message><getState><id>";
+    big.append(QByteArray(6000000, '1'));
+    big.append("</id></getState></message>");
+    big.append(msgs.first());
+
+    for (int pos = 0;pos < big.size();pos += 65536) {
+        processData(big.mid(pos, 65536));
+    }
+    check("Oversized message dropped", QStringList() << "error: Message too long" << expected.first());
+
+    mTestLog = 0;
+    return ok;
+}
+
+void NetworkInterface::on_parserTestButton_clicked()
+{
+    QString log;
+    if (parserSelfTest(log)) {
+        QMessageBox::information(this, "Parser Test", log);
+    } else {
+        QMessageBox::warning(this, "Parser Test", log);
+    }
+}
+
 void NetworkInterface::stateReceived(quint8 id, CAR_STATE state)
 {
     sendState(id, state);
@@ -255,34 +510,77 @@ void NetworkInterface::on_udpActivateBox_toggled(bool checked)
 
 void NetworkInterface::processData(const QByteArray &data)
 {
-    mRxBuffer.append(data);
+    // The data is fed to a persistent XML reader as it arrives. Only the new
+    // bytes, plus the last few bytes of the previous read, are searched for
+    // the end of a message, so the time spent here is linear in the amount
+    // of received data regardless of how it is fragmented.
+    static const QByteArray endTag("</message>");
+
+    QElapsedTimer timer;
+    timer.start();
+
+    const QByteArray search = mRxTail + data;
+    const int overlap = mRxTail.size();
+    int fed = 0;
+    int from = 0;
+    int end;
+
+    auto feed = [&](int start, int stop) {
+        if (mRxDiscard) {
+            return;
+        }
 
-    int start = mRxBuffer.indexOf("<message>");
-    int end = mRxBuffer.indexOf("</message>");
+        // Skip whitespace and junk between messages, the XML declaration
+        // must be at the start of the document.
+        if (mRxWaitStart) {
+            int ind = data.indexOf('<', start);
+            if (ind < 0 || ind >= stop) {
+                return;
+            }
 
-    while (start >= 0 && end >= 0) {
-        QByteArray xml = mRxBuffer.mid(start, end - start + 10);
-        mRxBuffer.remove(start, end - start + 10);
-        processXml(xml);
+            start = ind;
+            mRxWaitStart = false;
+        }
 
-        start = mRxBuffer.indexOf("<message>");
-        end = mRxBuffer.indexOf("</message>");
-    }
+        mXmlReader.addData(data.mid(start, stop - start));
+        mRxPending += stop - start;
+    };
 
-    // Clear buffer if it becomes too long
-    if (mRxBuffer.size() > 5e6) {
-        mRxBuffer.clear();
+    while ((end = search.indexOf(endTag, from)) >= 0) {
+        end += endTag.size();
+        feed(fed, end - overlap);
+        fed = end - overlap;
+        from = end;
+
+        if (!mRxDiscard) {
+            if (mTestLog) {
+                mTestLog->append(dump_xml(mXmlReader));
+            } else {
+                processXml();
+            }
+            mStatsMessages++;
+        }
+
+        resetXml();
     }
 
-    // Clear buffer if no message part is present
-    if (mRxBuffer.indexOf("<message>") < 0) {
-        mRxBuffer.clear();
+    feed(fed, data.size());
+    mRxTail = search.mid(qMax(from, search.size() - endTag.size() + 1));
+
+    // Drop the current message if it becomes too long
+    if (mRxPending > 5e6) {
+        resetXml();
+        mRxDiscard = true;
+        sendError("Message too long");
     }
+
+    mStatsBytes += data.size();
+    mStatsParseNs += timer.nsecsElapsed();
 }
 
-void NetworkInterface::processXml(const QByteArray &xml)
+void NetworkInterface::processXml()
 {
-    QXmlStreamReader stream(xml);
+    QXmlStreamReader &stream = mXmlReader;
     stream.readNextStartElement();
     QString name;
 
@@ -713,6 +1011,14 @@ void NetworkInterface::processXml(const QByteArray &xml)
     }
 }
 
+void NetworkInterface::resetXml()
+{
+    mXmlReader.clear();
+    mRxPending = 0;
+    mRxWaitStart = true;
+    mRxDiscard = false;
+}
+
 void NetworkInterface::sendData(const QByteArray &data)
 {
     if (ui->tcpActivateBox->isChecked()) {
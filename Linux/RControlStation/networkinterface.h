@@ -22,6 +22,7 @@
 #include <QUdpSocket>
 #include <QXmlStreamWriter>
 #include <QXmlStreamReader>
+#include <QStringList>
 #include "tcpserversimple.h"
 #include "packetinterface.h"
 #include "carinterface.h"
@@ -45,33 +46,46 @@ public:
     void sendState(quint8 id, const CAR_STATE &state);
     void sendEnuRef(quint8 id, double lat, double lon, double height);
     void sendError(const QString &txt, const QString &cmd = "");
+    bool parserSelfTest(QString &log);
 
 private slots:
     void tcpDataRx(const QByteArray &data);
     void tcpConnectionChanged(bool connected);
     void udpReadReady();
     void pollTimerSlot();
+    void statsTimerSlot();
 
     void stateReceived(quint8 id, CAR_STATE state);
     void enuRefReceived(quint8 id, double lat, double lon, double height);
 
     void on_tcpActivateBox_toggled(bool checked);
     void on_udpActivateBox_toggled(bool checked);
+    void on_parserTestButton_clicked();
 
 private:
     Ui::NetworkInterface *ui;
     QUdpSocket *mUdpSocket;
     TcpServerSimple *mTcpServer;
     QHostAddress mLastHostAddress;
-    QByteArray mRxBuffer;
+    QXmlStreamReader mXmlReader;
+    QByteArray mRxTail;
+    int mRxPending;
+    bool mRxWaitStart;
+    bool mRxDiscard;
     MapWidget *mMap;
     PacketInterface *mPacketInterface;
     QTimer *mPollTimer;
     int mPollTimerCarId;
     QList<CarInterface*> *mCars;
+    QTimer *mStatsTimer;
+    int mStatsMessages;
+    qint64 mStatsBytes;
+    qint64 mStatsParseNs;
+    QStringList *mTestLog;
 
     void processData(const QByteArray &data);
-    void processXml(const QByteArray &xml);
+    void processXml();
+    void resetXml();
     void sendData(const QByteArray &data);
 
 };
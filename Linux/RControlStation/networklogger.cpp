@@ -137,15 +137,13 @@ void NetworkLogger::tcpInputDataAvailable()
 
         // Plot local position on map
         if (pingOk && mMap) {
-            double i_llh[3];
             double llh[3];
             double xyz[3];
 
-            mMap->getEnuRef(i_llh);
             llh[0] = gga.lat;
             llh[1] = gga.lon;
             llh[2] = gga.height;
-            utility::llhToEnu(i_llh, llh, xyz);
+            mMap->getEnuFrame().llhToEnu(llh, xyz);
 
             mLastPoint.setXY(xyz[0], xyz[1]);
 
@@ -368,6 +366,7 @@ void NetworkLogger::on_statLogOpenButton_clicked()
 
                 double i_llh[3];
                 bool i_llh_set = false;
+                EnuFrame enuFrame;
                 for (int i = 0;i < mLogLoaded.size();i++) {
                     const LOGPOINT &lp = mLogLoaded.at(i);
 
@@ -381,6 +380,7 @@ void NetworkLogger::on_statLogOpenButton_clicked()
                         }
 
                         i_llh_set = true;
+                        enuFrame.setRef(i_llh);
 
                         if (mMap) {
                             mMap->setEnuRef(i_llh[0], i_llh[1], i_llh[2]);
@@ -388,7 +388,7 @@ void NetworkLogger::on_statLogOpenButton_clicked()
                     }
 
                     double xyz[3];
-                    utility::llhToEnu(i_llh, lp.llh, xyz);
+                    enuFrame.llhToEnu(lp.llh, xyz);
 
                     LocPoint p;
                     p.setXY(xyz[0], xyz[1]);
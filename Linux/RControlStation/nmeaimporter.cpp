@@ -0,0 +1,767 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "nmeaimporter.h"
+#include "utility.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QElapsedTimer>
+#include <QtConcurrent>
+#include <QDebug>
+#include <cmath>
+#include <cstring>
+
+namespace {
+// Chunks are a few MB, so that the progress is updated often and the
+// work is spread evenly over the threads.
+const qint64 chunk_size = 4 * 1024 * 1024;
+
+inline double parse_double(const char *str, const char *end, bool *ok)
+{
+    double sign = 1.0;
+    double res = 0.0;
+    bool digits = false;
+
+    if (str < end && (*str == '-' || *str == '+')) {
+        if (*str == '-') {
+            sign = -1.0;
+        }
+        str++;
+    }
+
+    while (str < end && *str >= '0' && *str <= '9') {
+        res = res * 10.0 + (double)(*str - '0');
+        digits = true;
+        str++;
+    }
+
+    if (str < end && *str == '.') {
+        double scale = 0.1;
+        str++;
+
+        while (str < end && *str >= '0' && *str <= '9') {
+            res += (double)(*str - '0') * scale;
+            scale *= 0.1;
+            digits = true;
+            str++;
+        }
+    }
+
+    *ok = digits;
+    return sign * res;
+}
+
+inline int parse_int(const char *str, const char *end, bool *ok)
+{
+    int res = 0;
+    *ok = false;
+
+    while (str < end && *str >= '0' && *str <= '9') {
+        res = res * 10 + (*str - '0');
+        *ok = true;
+        str++;
+    }
+
+    return res;
+}
+
+// Convert ddmm.mmmm to degrees
+inline double parse_deg_min(const char *str, const char *end)
+{
+    bool ok;
+    double val = parse_double(str, end, &ok);
+
+    if (!ok) {
+        return 0.0;
+    }
+
+    double deg = floor(val / 100.0);
+    return deg + (val - deg * 100.0) / 60.0;
+}
+
+// Format degrees as ddmm.mmmmmmmm, with degDigits digits for the degrees
+void format_deg_min(char *buf, int len, double deg, int degDigits)
+{
+    deg = fabs(deg);
+    int d = (int)deg;
+    qsnprintf(buf, len, "%0*d%011.8f", degDigits, d, (deg - (double)d) * 60.0);
+}
+
+// Append a NMEA sentence with checksum to buf
+int append_sentence(char *buf, int len, const char *body)
+{
+    uint8_t sum = 0;
+    for (const char *c = body;*c;c++) {
+        sum ^= (uint8_t)*c;
+    }
+
+    return qsnprintf(buf, len, "$%s*%02X\r\n", body, sum);
+}
+}
+
+NmeaImporter::NmeaImporter(QObject *parent) : QThread(parent)
+{
+    mZeroEnu = false;
+    mEnuRefSet = false;
+    mRefLlh[0] = 0.0;
+    mRefLlh[1] = 0.0;
+    mRefLlh[2] = 0.0;
+    mImportTime = 0.0;
+    mImportBytes = 0;
+}
+
+NmeaImporter::~NmeaImporter()
+{
+    cancelImport();
+    this->wait();
+}
+
+/**
+ * @brief NmeaImporter::startImport
+ * Start importing a NMEA log in the background.
+ *
+ * @param path
+ * Path to the log file.
+ *
+ * @param zeroEnu
+ * Use the first GGA position in the log as ENU reference.
+ *
+ * @param refLlh
+ * ENU reference to use when zeroEnu is false.
+ *
+ * @return
+ * false if an import already is running, true otherwise.
+ */
+bool NmeaImporter::startImport(QString path, bool zeroEnu, const double *refLlh)
+{
+    if (this->isRunning()) {
+        return false;
+    }
+
+    mPath = path;
+    mZeroEnu = zeroEnu;
+    mEnuRefSet = false;
+    mRefLlh[0] = refLlh[0];
+    mRefLlh[1] = refLlh[1];
+    mRefLlh[2] = refLlh[2];
+    mPoints.clear();
+    mLastError.clear();
+    mImportTime = 0.0;
+    mImportBytes = 0;
+    mBytesDone = 0;
+    mLastPercent = -1;
+
+    this->start();
+    return true;
+}
+
+void NmeaImporter::cancelImport()
+{
+    requestInterruption();
+}
+
+QList<LocPoint> NmeaImporter::takePoints()
+{
+    QList<LocPoint> res;
+    res.swap(mPoints);
+    return res;
+}
+
+void NmeaImporter::getEnuRef(double *llh)
+{
+    llh[0] = mRefLlh[0];
+    llh[1] = mRefLlh[1];
+    llh[2] = mRefLlh[2];
+}
+
+bool NmeaImporter::wasEnuRefSet() const
+{
+    return mEnuRefSet;
+}
+
+QString NmeaImporter::getLastError() const
+{
+    return mLastError;
+}
+
+double NmeaImporter::getImportTime() const
+{
+    return mImportTime;
+}
+
+qint64 NmeaImporter::getImportBytes() const
+{
+    return mImportBytes;
+}
+
+/**
+ * @brief NmeaImporter::decodeGgaFast
+ * Decode a NMEA GGA message without copying it. Gives the same result
+ * as NmeaServer::decodeNmeaGGA, but only handles '.' as decimal separator.
+ *
+ * @param str
+ * The NMEA line, without the need for null termination.
+ *
+ * @param len
+ * Length of the line.
+ *
+ * @param gga
+ * GGA struct to fill.
+ *
+ * @return
+ * -1: Type is not GGA
+ * >= 0: Number of decoded fields.
+ */
+int NmeaImporter::decodeGgaFast(const char *str, int len, NmeaServer::nmea_gga_info_t &gga)
+{
+    int ms = -1;
+    double lat = 0.0;
+    double lon = 0.0;
+    double height = 0.0;
+    int fix_type = 0;
+    int sats = 0;
+    double hdop = 0.0;
+    double diff_age = -1.0;
+
+    int dec_fields = 0;
+    const char *start = 0;
+
+    for (int i = 0;i < 10;i++) {
+        if ((i + 5) >= len) {
+            break;
+        }
+
+        if (    str[i] == 'G' &&
+                str[i + 1] == 'G' &&
+                str[i + 2] == 'A' &&
+                str[i + 3] == ',') {
+            start = str + i + 4;
+            break;
+        }
+    }
+
+    if (!start) {
+        return -1;
+    }
+
+    const char *end = str + len;
+    int ind = 0;
+
+    while (start <= end) {
+        const char *f_end = start;
+        while (f_end < end && *f_end != ',') {
+            f_end++;
+        }
+
+        bool ok = false;
+
+        switch (ind) {
+        case 0: {
+            // Time
+            dec_fields++;
+            ms = -1;
+
+            if ((f_end - start) >= 8 && start[6] == '.') {
+                bool ok_h, ok_m, ok_s, ok_ds;
+                int h = parse_int(start, start + 2, &ok_h);
+                int m = parse_int(start + 2, start + 4, &ok_m);
+                int s = parse_int(start + 4, start + 6, &ok_s);
+                int ds = parse_int(start + 7, f_end, &ok_ds);
+
+                if (ok_h && ok_m && ok_s && ok_ds) {
+                    ms = h * 60 * 60 * 1000;
+                    ms += m * 60 * 1000;
+                    ms += s * 1000;
+                    ms += ds * 10;
+                }
+            }
+        } break;
+
+        case 1:
+            // Latitude
+            dec_fields++;
+            lat = parse_deg_min(start, f_end);
+            break;
+
+        case 2:
+            // Latitude direction
+            dec_fields++;
+            if (start < f_end && (*start == 'S' || *start == 's')) {
+                lat = -lat;
+            }
+            break;
+
+        case 3:
+            // Longitude
+            dec_fields++;
+            lon = parse_deg_min(start, f_end);
+            break;
+
+        case 4:
+            // Longitude direction
+            dec_fields++;
+            if (start < f_end && (*start == 'W' || *start == 'w')) {
+                lon = -lon;
+            }
+            break;
+
+        case 5:
+            // Fix type
+            dec_fields++;
+            fix_type = parse_int(start, f_end, &ok);
+            if (!ok) {
+                fix_type = 0;
+            }
+            break;
+
+        case 6:
+            // Sattelites
+            dec_fields++;
+            sats = parse_int(start, f_end, &ok);
+            if (!ok) {
+                sats = 0;
+            }
+            break;
+
+        case 7:
+            // hdop
+            dec_fields++;
+            hdop = parse_double(start, f_end, &ok);
+            if (!ok) {
+                hdop = 0.0;
+            }
+            break;
+
+        case 8:
+            // Altitude
+            dec_fields++;
+            height = parse_double(start, f_end, &ok);
+            if (!ok) {
+                height = 0.0;
+            }
+            break;
+
+        case 10: {
+            // Altitude 2
+            dec_fields++;
+            double h2 = parse_double(start, f_end, &ok);
+            if (ok) {
+                height += h2;
+            }
+        } break;
+
+        case 12:
+            // Correction age
+            dec_fields++;
+            diff_age = parse_double(start, f_end, &ok);
+            if (!ok) {
+                diff_age = -1.0;
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        start = f_end + 1;
+        ind++;
+    }
+
+    gga.lat = lat;
+    gga.lon = lon;
+    gga.height = height;
+    gga.fix_type = fix_type;
+    gga.n_sat = sats;
+    gga.t_tow = ms;
+    gga.h_dop = hdop;
+    gga.diff_age = diff_age;
+
+    return dec_fields;
+}
+
+/**
+ * @brief NmeaImporter::writeSyntheticLog
+ * Write a synthetic 10 Hz NMEA log that drives around in a circle, for
+ * benchmarking. Every epoch has GGA, RMC and GSA sentences and GSV
+ * sentences for three constellations, like a multi-GNSS receiver.
+ *
+ * @param path
+ * The file to write. It is overwritten.
+ *
+ * @param bytes
+ * The approximate size of the log.
+ *
+ * @param refLlh
+ * The center of the circle.
+ *
+ * @return
+ * true on success, false if the file could not be written.
+ */
+bool NmeaImporter::writeSyntheticLog(QString path, qint64 bytes, const double *refLlh)
+{
+    QFile file(path);
+
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        return false;
+    }
+
+    const char *gsvTalkers[3] = {"GP", "GL", "GA"};
+    QByteArray buffer;
+    buffer.reserve(1024 * 1024 + 4096);
+    qint64 written = 0;
+    qint64 epoch = 0;
+
+    while (written < bytes) {
+        char body[256];
+        char line[300];
+        char lat[32], lon[32], time[16];
+
+        // 10 Hz, one lap every two minutes with a radius of 50 m
+        double t = (double)epoch / 10.0;
+        double ang = t * 2.0 * M_PI / 120.0;
+        double llh[3];
+        llh[0] = refLlh[0] + 50.0 * sin(ang) / 111320.0;
+        llh[1] = refLlh[1] + 50.0 * cos(ang) / (111320.0 * cos(refLlh[0] * M_PI / 180.0));
+        llh[2] = refLlh[2] + 2.0 * sin(ang * 3.0);
+
+        int tod = (int)(epoch % 864000);
+        qsnprintf(time, sizeof(time), "%02d%02d%02d.%02d",
+                  tod / 36000, (tod / 600) % 60, (tod / 10) % 60, (tod % 10) * 10);
+        format_deg_min(lat, sizeof(lat), llh[0], 2);
+        format_deg_min(lon, sizeof(lon), llh[1], 3);
+
+        int fix = 4;
+        if (epoch % 500 == 0) {
+            fix = 1;
+        } else if (epoch % 50 == 0) {
+            fix = 5;
+        }
+
+        qsnprintf(body, sizeof(body), "GPGGA,%s,%s,%c,%s,%c,%d,12,0.6,%.3f,M,%.3f,M,1.0,0000",
+                  time, lat, llh[0] < 0.0 ? 'S' : 'N', lon, llh[1] < 0.0 ? 'W' : 'E',
+                  fix, llh[2] - 40.0, 40.0);
+        buffer.append(line, append_sentence(line, sizeof(line), body));
+
+        qsnprintf(body, sizeof(body), "GPRMC,%s,A,%s,%c,%s,%c,%.3f,%.2f,191026,,,R",
+                  time, lat, llh[0] < 0.0 ? 'S' : 'N', lon, llh[1] < 0.0 ? 'W' : 'E',
+                  50.0 * 2.0 * M_PI / 120.0 * 1.943844,
+                  fmod(360.0 - ang * 180.0 / M_PI, 360.0));
+        buffer.append(line, append_sentence(line, sizeof(line), body));
+
+        buffer.append(line, append_sentence(line, sizeof(line), "GPGSA,A,3,02,05,07,09,13,15,18,20,21,26,29,30,1.1,0.6,0.9"));
+
+        for (int i = 0;i < 3;i++) {
+            for (int j = 0;j < 3;j++) {
+                int sat = i * 32 + j * 4 + 1;
+                qsnprintf(body, sizeof(body), "%sGSV,3,%d,12,%02d,45,120,42,%02d,30,200,38,%02d,60,310,45,%02d,15,040,33",
+                          gsvTalkers[i], j + 1, sat, sat + 1, sat + 2, sat + 3);
+                buffer.append(line, append_sentence(line, sizeof(line), body));
+            }
+        }
+
+        if (buffer.size() >= 1024 * 1024) {
+            if (file.write(buffer) != buffer.size()) {
+                return false;
+            }
+
+            written += buffer.size();
+            buffer.clear();
+        }
+
+        epoch++;
+    }
+
+    if (!buffer.isEmpty() && file.write(buffer) != buffer.size()) {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief NmeaImporter::benchmark
+ * Write a synthetic log and import it, and import the start of it with the
+ * line by line reader that was used before for reference. The reference
+ * does not add the points to the map, so it is faster than it was.
+ *
+ * @param path
+ * Where to write the log. It is left for the caller to remove.
+ *
+ * @param bytes
+ * The approximate size of the log.
+ *
+ * @param bytesReference
+ * How much of the log to import with the reference, as it takes minutes
+ * for multi-GB logs.
+ *
+ * @return
+ * The time to write and import the log, the throughput and the number of
+ * points. Everything is 0 if the log could not be written.
+ */
+NmeaImporter::BenchmarkResult NmeaImporter::benchmark(QString path, qint64 bytes, qint64 bytesReference)
+{
+    BenchmarkResult res;
+    memset(&res, 0, sizeof(res));
+
+    double refLlh[3] = {57.71495867, 12.89134921, 219.0};
+    QElapsedTimer timer;
+
+    timer.start();
+    if (!writeSyntheticLog(path, bytes, refLlh)) {
+        return res;
+    }
+    res.writeTime = (double)timer.nsecsElapsed() / 1e9;
+    res.bytes = QFileInfo(path).size();
+
+    NmeaImporter importer;
+    importer.startImport(path, true, refLlh);
+    importer.wait();
+    res.importTime = importer.getImportTime();
+    res.mbPerSec = (double)res.bytes / 1e6 / qMax(res.importTime, 1e-9);
+    res.points = importer.takePoints().size();
+
+    // The reference, like MainWindow::on_mapImportNmeaButton_clicked did
+    // before except for adding the points to the map.
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        return res;
+    }
+
+    QTextStream in(&file);
+    QList<LocPoint> points;
+    double i_llh[3];
+    bool i_llh_set = false;
+
+    timer.restart();
+    while (!in.atEnd() && res.bytesReference < bytesReference) {
+        QString line = in.readLine();
+        res.bytesReference += line.size() + 2;
+
+        NmeaServer::nmea_gga_info_t gga;
+        int ret = NmeaServer::decodeNmeaGGA(line.toLocal8Bit(), gga);
+
+        if (ret > 5) {
+            if (!i_llh_set) {
+                i_llh[0] = gga.lat;
+                i_llh[1] = gga.lon;
+                i_llh[2] = gga.height;
+                i_llh_set = true;
+            }
+
+            double llh[3];
+            double xyz[3];
+
+            llh[0] = gga.lat;
+            llh[1] = gga.lon;
+            llh[2] = gga.height;
+            utility::llhToEnu(i_llh, llh, xyz);
+
+            LocPoint p;
+            p.setXY(xyz[0], xyz[1]);
+            QString info;
+
+            QString fix_t = "Unknown";
+            if (gga.fix_type == 4) {
+                fix_t = "RTK fix";
+                p.setColor(Qt::green);
+            } else if (gga.fix_type == 5) {
+                fix_t = "RTK float";
+                p.setColor(Qt::yellow);
+            } else if (gga.fix_type == 1) {
+                fix_t = "Single";
+                p.setColor(Qt::red);
+            }
+
+            info.sprintf("Fix type: %s\n"
+                         "Height  : %.2f",
+                         fix_t.toLocal8Bit().data(),
+                         gga.height);
+
+            p.setInfo(info);
+            points.append(p);
+        }
+    }
+
+    res.mbPerSecReference = (double)res.bytesReference / 1e6 /
+            qMax((double)timer.nsecsElapsed() / 1e9, 1e-9);
+    res.pointsReference = points.size();
+
+    return res;
+}
+
+void NmeaImporter::run()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QFile file(mPath);
+
+    if (!file.open(QIODevice::ReadOnly)) {
+        mLastError = "Could not open " + mPath + ": " + file.errorString();
+        return;
+    }
+
+    qint64 size = file.size();
+
+    if (size == 0) {
+        return;
+    }
+
+    const char *data = (const char*)file.map(0, size);
+
+    if (!data) {
+        mLastError = "Could not map " + mPath + ": " + file.errorString();
+        return;
+    }
+
+    // Split the file into chunks that end at line boundaries.
+    QVector<chunk_t> chunks;
+    const char *end = data + size;
+    const char *pos = data;
+
+    while (pos < end) {
+        chunk_t c;
+        c.start = pos;
+        c.end = (end - pos) > chunk_size ? pos + chunk_size : end;
+
+        while (c.end < end && *(c.end - 1) != '\n') {
+            c.end++;
+        }
+
+        chunks.append(c);
+        pos = c.end;
+    }
+
+    mImportBytes = size;
+    QtConcurrent::blockingMap(chunks, [this](chunk_t &c) {parseChunk(c);});
+
+    if (isInterruptionRequested()) {
+        file.unmap((uchar*)data);
+        return;
+    }
+
+    // The ENU reference is known first when the first fix is parsed, so
+    // the conversion is done as a second pass.
+    if (mZeroEnu) {
+        for (const chunk_t &c: chunks) {
+            if (!c.gga.isEmpty()) {
+                mRefLlh[0] = c.gga.first().lat;
+                mRefLlh[1] = c.gga.first().lon;
+                mRefLlh[2] = c.gga.first().height;
+                mEnuRefSet = true;
+                break;
+            }
+        }
+    }
+
+    mEnuFrame.setRef(mRefLlh);
+
+    QtConcurrent::blockingMap(chunks, [this](chunk_t &c) {convertChunk(c);});
+
+    int points = 0;
+    for (const chunk_t &c: chunks) {
+        points += c.points.size();
+    }
+
+    mPoints.reserve(points);
+    for (const chunk_t &c: chunks) {
+        mPoints.append(c.points);
+    }
+
+    file.unmap((uchar*)data);
+
+    mImportTime = (double)timer.nsecsElapsed() / 1e9;
+    emit importProgress(100);
+}
+
+void NmeaImporter::parseChunk(NmeaImporter::chunk_t &chunk)
+{
+    const char *pos = chunk.start;
+
+    while (pos < chunk.end) {
+        if (isInterruptionRequested()) {
+            return;
+        }
+
+        const char *line_end = (const char*)memchr(pos, '\n', chunk.end - pos);
+        if (!line_end) {
+            line_end = chunk.end;
+        }
+
+        NmeaServer::nmea_gga_info_t gga;
+        int res = decodeGgaFast(pos, line_end - pos, gga);
+
+        if (res > 5) {
+            gga_point_t p;
+            p.lat = gga.lat;
+            p.lon = gga.lon;
+            p.height = gga.height;
+            p.fix_type = gga.fix_type;
+            chunk.gga.append(p);
+        }
+
+        pos = line_end + 1;
+    }
+
+    // The parsing is the bulk of the work, so only report progress for it.
+    qint64 len = chunk.end - chunk.start;
+    qint64 done = mBytesDone.fetchAndAddRelaxed(len) + len;
+    int percent = (int)(done * 99 / mImportBytes);
+
+    if (mLastPercent.fetchAndStoreRelaxed(percent) != percent) {
+        emit importProgress(percent);
+    }
+}
+
+void NmeaImporter::convertChunk(NmeaImporter::chunk_t &chunk)
+{
+    chunk.points.reserve(chunk.gga.size());
+
+    for (const gga_point_t &gga: chunk.gga) {
+        double llh[3], xyz[3];
+        llh[0] = gga.lat;
+        llh[1] = gga.lon;
+        llh[2] = gga.height;
+        mEnuFrame.llhToEnu(llh, xyz);
+
+        LocPoint p;
+        p.setXY(xyz[0], xyz[1]);
+        QString info;
+
+        QString fix_t = "Unknown";
+        if (gga.fix_type == 4) {
+            fix_t = "RTK fix";
+            p.setColor(Qt::green);
+        } else if (gga.fix_type == 5) {
+            fix_t = "RTK float";
+            p.setColor(Qt::yellow);
+        } else if (gga.fix_type == 1) {
+            fix_t = "Single";
+            p.setColor(Qt::red);
+        }
+
+        info.sprintf("Fix type: %s\n"
+                     "Height  : %.2f",
+                     fix_t.toLocal8Bit().data(),
+                     gga.height);
+
+        p.setInfo(info);
+        chunk.points.append(p);
+    }
+}
@@ -0,0 +1,110 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef NMEAIMPORTER_H
+#define NMEAIMPORTER_H
+
+#include <QObject>
+#include <QThread>
+#include <QString>
+#include <QList>
+#include <QVector>
+#include <QAtomicInteger>
+
+#include "locpoint.h"
+#include "nmeaserver.h"
+#include "enuframe.h"
+
+/**
+ * @brief The NmeaImporter class
+ *
+ * Imports the GGA messages of a NMEA log as an info trace in the background.
+ * The log is memory mapped and split into chunks at line boundaries that
+ * are parsed in parallel on all cores. When the import is done, the
+ * finished() signal is emitted and the trace can be fetched with
+ * takePoints() and added to the map in one batch.
+ */
+class NmeaImporter : public QThread
+{
+    Q_OBJECT
+public:
+    typedef struct {
+        qint64 bytes;
+        double writeTime;
+        double importTime;
+        double mbPerSec;
+        int points;
+        qint64 bytesReference; // Only a part of the log for the reference
+        double mbPerSecReference;
+        int pointsReference;
+    } BenchmarkResult;
+
+    NmeaImporter(QObject *parent = 0);
+    ~NmeaImporter();
+    bool startImport(QString path, bool zeroEnu, const double *refLlh);
+    void cancelImport();
+
+    QList<LocPoint> takePoints();
+    void getEnuRef(double *llh);
+    bool wasEnuRefSet() const;
+    QString getLastError() const;
+    double getImportTime() const;
+    qint64 getImportBytes() const;
+
+    static int decodeGgaFast(const char *str, int len, NmeaServer::nmea_gga_info_t &gga);
+    static bool writeSyntheticLog(QString path, qint64 bytes, const double *refLlh);
+    static BenchmarkResult benchmark(QString path, qint64 bytes, qint64 bytesReference);
+
+signals:
+    void importProgress(int percent);
+
+protected:
+    void run();
+
+private:
+    typedef struct {
+        double lat;
+        double lon;
+        double height;
+        int fix_type;
+    } gga_point_t;
+
+    typedef struct {
+        const char *start;
+        const char *end;
+        QVector<gga_point_t> gga;
+        QList<LocPoint> points;
+    } chunk_t;
+
+    QString mPath;
+    bool mZeroEnu;
+    bool mEnuRefSet;
+    double mRefLlh[3];
+    QList<LocPoint> mPoints;
+    QString mLastError;
+    double mImportTime;
+    qint64 mImportBytes;
+    EnuFrame mEnuFrame;
+    QAtomicInteger<qint64> mBytesDone;
+    QAtomicInt mLastPercent;
+
+    void parseChunk(chunk_t &chunk);
+    void convertChunk(chunk_t &chunk);
+
+};
+
+#endif // NMEAIMPORTER_H
@@ -0,0 +1,296 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "osmtilestore.h"
+#include <QSqlError>
+#include <QVariant>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QDebug>
+
+OsmTileStore::OsmTileStore()
+{
+    mConnectionName = "osm_tile_store_" + QString::number((quintptr)this);
+    mReadQuery = 0;
+    mHasQuery = 0;
+    mStoreQuery = 0;
+    mInTransaction = false;
+    mPendingWrites = 0;
+}
+
+OsmTileStore::~OsmTileStore()
+{
+    close();
+}
+
+bool OsmTileStore::open(QString path)
+{
+    close();
+
+    mDb = QSqlDatabase::addDatabase("QSQLITE", mConnectionName);
+    mDb.setDatabaseName(path);
+
+    if (!mDb.open()) {
+        mLastError = mDb.lastError().text();
+        close();
+        return false;
+    }
+
+    bool ok = exec("PRAGMA synchronous = NORMAL") &&
+            exec("CREATE TABLE IF NOT EXISTS metadata (name TEXT, value TEXT)") &&
+            exec("CREATE TABLE IF NOT EXISTS tiles (zoom_level INTEGER, tile_column INTEGER, "
+                 "tile_row INTEGER, tile_data BLOB)") &&
+            exec("CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles "
+                 "(zoom_level, tile_column, tile_row)");
+
+    if (ok && tileCount() == 0) {
+        ok = exec("DELETE FROM metadata") &&
+                exec("INSERT INTO metadata (name, value) VALUES ('name', 'OSM tile cache')") &&
+                exec("INSERT INTO metadata (name, value) VALUES ('format', 'png')");
+    }
+
+    if (!ok) {
+        close();
+        return false;
+    }
+
+    mReadQuery = new QSqlQuery(mDb);
+    mReadQuery->prepare("SELECT tile_data FROM tiles WHERE "
+                        "zoom_level = ? AND tile_column = ? AND tile_row = ?");
+    mHasQuery = new QSqlQuery(mDb);
+    mHasQuery->prepare("SELECT 1 FROM tiles WHERE "
+                       "zoom_level = ? AND tile_column = ? AND tile_row = ?");
+    mStoreQuery = new QSqlQuery(mDb);
+    mStoreQuery->prepare("INSERT OR REPLACE INTO tiles "
+                         "(zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?)");
+
+    return true;
+}
+
+void OsmTileStore::close()
+{
+    flush();
+
+    delete mReadQuery;
+    delete mHasQuery;
+    delete mStoreQuery;
+    mReadQuery = 0;
+    mHasQuery = 0;
+    mStoreQuery = 0;
+
+    if (mDb.isValid()) {
+        mDb.close();
+        mDb = QSqlDatabase();
+        QSqlDatabase::removeDatabase(mConnectionName);
+    }
+}
+
+bool OsmTileStore::isOpen() const
+{
+    return mReadQuery != 0;
+}
+
+QString OsmTileStore::lastError() const
+{
+    return mLastError;
+}
+
+bool OsmTileStore::hasTile(int zoom, int x, int y)
+{
+    if (!isOpen()) {
+        return false;
+    }
+
+    mHasQuery->addBindValue(zoom);
+    mHasQuery->addBindValue(x);
+    mHasQuery->addBindValue((1 << zoom) - 1 - y);
+
+    bool res = mHasQuery->exec() && mHasQuery->next();
+    mHasQuery->finish();
+    return res;
+}
+
+QByteArray OsmTileStore::readTile(int zoom, int x, int y)
+{
+    QByteArray res;
+
+    if (!isOpen()) {
+        return res;
+    }
+
+    mReadQuery->addBindValue(zoom);
+    mReadQuery->addBindValue(x);
+    mReadQuery->addBindValue((1 << zoom) - 1 - y);
+
+    if (mReadQuery->exec() && mReadQuery->next()) {
+        res = mReadQuery->value(0).toByteArray();
+    }
+
+    mReadQuery->finish();
+    return res;
+}
+
+bool OsmTileStore::storeTile(int zoom, int x, int y, const QByteArray &data)
+{
+    if (!isOpen()) {
+        return false;
+    }
+
+    if (!mInTransaction) {
+        if (!mDb.transaction()) {
+            mLastError = mDb.lastError().text();
+            return false;
+        }
+
+        mInTransaction = true;
+    }
+
+    mStoreQuery->addBindValue(zoom);
+    mStoreQuery->addBindValue(x);
+    mStoreQuery->addBindValue((1 << zoom) - 1 - y);
+    mStoreQuery->addBindValue(data);
+
+    bool res = mStoreQuery->exec();
+    if (!res) {
+        mLastError = mStoreQuery->lastError().text();
+    }
+
+    mStoreQuery->finish();
+
+    mPendingWrites++;
+    if (mPendingWrites >= BATCH_LEN) {
+        res = flush() && res;
+    }
+
+    return res;
+}
+
+/**
+ * @brief OsmTileStore::flush
+ * Commit the tiles that have been stored since the last commit.
+ *
+ * @return
+ * true on success, false otherwise.
+ */
+bool OsmTileStore::flush()
+{
+    if (!mInTransaction) {
+        return true;
+    }
+
+    mInTransaction = false;
+    mPendingWrites = 0;
+
+    if (!mDb.commit()) {
+        mLastError = mDb.lastError().text();
+        qWarning() << "Tile store error:" << mLastError;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief OsmTileStore::importDirectory
+ * Import the tiles from a z/x/y.png directory tree, like the one that was
+ * used as cache before. Tiles that already are stored are replaced.
+ *
+ * @param path
+ * The root of the directory tree.
+ *
+ * @return
+ * The number of imported tiles, or -1 if the store is not open or a tile
+ * could not be stored.
+ */
+int OsmTileStore::importDirectory(QString path)
+{
+    if (!isOpen()) {
+        return -1;
+    }
+
+    QDir root(path);
+    QDirIterator it(path, QStringList() << "*.png", QDir::Files,
+                    QDirIterator::Subdirectories);
+    int tiles = 0;
+
+    while (it.hasNext()) {
+        QString file = it.next();
+        QStringList parts = root.relativeFilePath(file).split("/");
+
+        if (parts.size() != 3) {
+            continue;
+        }
+
+        bool okZ, okX, okY;
+        int zoom = parts.at(0).toInt(&okZ);
+        int x = parts.at(1).toInt(&okX);
+        int y = parts.at(2).left(parts.at(2).length() - 4).toInt(&okY);
+
+        if (!okZ || !okX || !okY || zoom < 0 || zoom > 30) {
+            continue;
+        }
+
+        QFile f(file);
+        if (!f.open(QIODevice::ReadOnly)) {
+            continue;
+        }
+
+        QByteArray data = f.readAll();
+        if (data.isEmpty()) {
+            continue;
+        }
+
+        if (!storeTile(zoom, x, y, data)) {
+            flush();
+            return -1;
+        }
+
+        tiles++;
+    }
+
+    return flush() ? tiles : -1;
+}
+
+bool OsmTileStore::clear()
+{
+    // VACUUM cannot run in a transaction
+    return isOpen() && flush() && exec("DELETE FROM tiles") && exec("VACUUM");
+}
+
+int OsmTileStore::tileCount()
+{
+    QSqlQuery q(mDb);
+    if (q.exec("SELECT COUNT(*) FROM tiles") && q.next()) {
+        return q.value(0).toInt();
+    }
+
+    return 0;
+}
+
+bool OsmTileStore::exec(const QString &query)
+{
+    QSqlQuery q(mDb);
+
+    if (!q.exec(query)) {
+        mLastError = q.lastError().text();
+        qWarning() << "Tile store error:" << mLastError;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,166 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef PACKETLOG_H
+#define PACKETLOG_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QList>
+#include <QVector>
+#include <cstdint>
+
+/**
+ * @brief The PacketLog class
+ *
+ * Records the packets to and from the car in binary segment files. Each
+ * record has the time from a monotonic clock and, once the GNSS time is
+ * known, the UTC time from the receiver.
+ *
+ * log() only copies the record into a block in memory and never waits for
+ * the disk. Full blocks are written by a thread that also computes the
+ * checksums, rotates the segments by size and age and writes a sparse
+ * time index next to every segment. When all blocks are full, packets are
+ * dropped and counted.
+ *
+ * Segments and indexes are only appended to and are synced every second.
+ * After a power loss everything up to the last sync is intact, and a torn
+ * record at the end is detected by its checksum.
+ */
+class PacketLog : public QThread
+{
+    Q_OBJECT
+public:
+    typedef enum {
+        DIR_TO_CAR = 0,
+        DIR_FROM_CAR
+    } DIRECTION;
+
+    // Followed by len bytes of packet payload, without the framing
+    typedef struct __attribute__((packed)) {
+        uint16_t sync;
+        uint16_t len;
+        uint8_t dir;
+        uint8_t flags;
+        uint16_t reserved;
+        int64_t monoUs;
+        int64_t utcMs;      // Only valid with RECORD_FLAG_UTC
+        uint32_t crc;       // CRC32 of the header with crc = 0 and the payload
+    } RecordHeader;
+
+    typedef struct __attribute__((packed)) {
+        int64_t monoUs;
+        int64_t offset;
+    } IndexEntry;
+
+    typedef struct {
+        qint64 records;
+        qint64 bytes;
+        qint64 dropped;
+        int segments;
+    } Stats;
+
+    static const uint16_t RECORD_SYNC = 0x5AA5;
+    static const uint8_t RECORD_FLAG_UTC = 0x01;
+    static const int FILE_HEADER_LEN = 32;
+    static const char SEGMENT_MAGIC[9];
+    static const char INDEX_MAGIC[9];
+
+    explicit PacketLog(QObject *parent = 0);
+    ~PacketLog();
+
+    bool startLog(QString directory);
+    void stopLog();
+    void setRotation(qint64 segmentBytes, int segmentSeconds);
+    void setGnssTime(qint64 utcMs);
+    bool log(DIRECTION dir, const char *data, int len);
+    Stats stats();
+
+    static uint32_t crc32(const uint8_t *data, int len, uint32_t crc = 0);
+
+protected:
+    void run();
+
+private:
+    static const int BLOCK_SIZE = 64 * 1024;
+    static const int BLOCKS = 16;
+    static const int FLUSH_MS = 200;
+    static const int SYNC_MS = 1000;
+    static const int INDEX_INTERVAL_US = 1000000;
+
+    typedef struct {
+        char *data;
+        int len;
+        qint64 firstMonoUs;
+    } Block;
+
+    QMutex mMutex;
+    QWaitCondition mCondition;
+    Block mBlocks[BLOCKS];
+    QList<Block*> mFree;
+    QList<Block*> mFull;
+    Block *mCurrent;
+    bool mRunning;
+    bool mStop;
+    QElapsedTimer mClock;
+    qint64 mUtcOffsetMs;
+    bool mUtcValid;
+    Stats mStats;
+
+    // Only used by the writer thread
+    QString mDirectory;
+    qint64 mSegmentBytesMax;
+    int mSegmentSecondsMax;
+    QFile mSegment;
+    QFile mIndex;
+    qint64 mSegmentStartUs;
+    qint64 mIndexLastUs;
+    qint64 mSyncLastUs;
+
+    bool openSegment(qint64 monoUs);
+    void closeSegment();
+    void writeBlock(Block *b);
+    void sync();
+
+};
+
+/**
+ * @brief The PacketLogReader class
+ *
+ * Reads a segment written by PacketLog. seek() does a binary search in the
+ * index and then reads forward, and reading stops at the first record that
+ * is incomplete or has a bad checksum.
+ */
+class PacketLogReader
+{
+public:
+    bool open(QString segment);
+    void close();
+    bool seek(qint64 monoUs);
+    bool next(PacketLog::RecordHeader &header, QByteArray &payload);
+    const QVector<PacketLog::IndexEntry> &index() const;
+
+private:
+    QFile mFile;
+    QVector<PacketLog::IndexEntry> mIndex;
+
+};
+
+#endif // PACKETLOG_H
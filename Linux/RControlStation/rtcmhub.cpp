@@ -0,0 +1,427 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "rtcmhub.h"
+#include <QTcpSocket>
+#include <QDebug>
+
+RtcmHub::RtcmHub(QObject *parent) : QObject(parent)
+{
+    mNextId = 0;
+    mClock.start();
+    mTcpServer = new QTcpServer(this);
+    mUdpSocket = new QUdpSocket(this);
+
+    connect(mTcpServer, SIGNAL(newConnection()), this, SLOT(newTcpConnection()));
+}
+
+RtcmHub::~RtcmHub()
+{
+    while (!mDests.isEmpty()) {
+        removeDestination(mDests.firstKey());
+    }
+}
+
+/**
+ * @brief RtcmHub::addSignalDestination
+ * Add a destination that gets its epochs from the rtcmOut signal. It is
+ * never blocked, so the queue only matters when it is filtered.
+ *
+ * @param name
+ * Name of the destination, for the statistics.
+ *
+ * @return
+ * The id of the destination.
+ */
+int RtcmHub::addSignalDestination(QString name)
+{
+    return addDest(name, DEST_SIGNAL);
+}
+
+/**
+ * @brief RtcmHub::addDevice
+ * Add a destination that writes to a device, e.g. a TCP socket or a serial
+ * port. Epochs are only written when the write buffer of the device is
+ * small, otherwise they wait in the queue. The destination is removed when
+ * the device is destroyed or, for sockets, disconnected.
+ *
+ * @param name
+ * Name of the destination, for the statistics.
+ *
+ * @param dev
+ * The device. It is not owned by the hub.
+ *
+ * @param type
+ * DEST_TCP or DEST_SERIAL.
+ *
+ * @return
+ * The id of the destination.
+ */
+int RtcmHub::addDevice(QString name, QIODevice *dev, DEST_TYPE type)
+{
+    int id = addDest(name, type);
+    Destination *d = mDests[id];
+    d->dev = dev;
+
+    connect(dev, SIGNAL(bytesWritten(qint64)), this, SLOT(deviceBytesWritten()));
+    connect(dev, SIGNAL(destroyed(QObject*)), this, SLOT(deviceGone()));
+
+    QTcpSocket *socket = qobject_cast<QTcpSocket*>(dev);
+    if (socket) {
+        connect(socket, SIGNAL(disconnected()), this, SLOT(deviceGone()));
+    }
+
+    return id;
+}
+
+int RtcmHub::addUdp(QString name, QHostAddress host, quint16 port)
+{
+    int id = addDest(name, DEST_UDP);
+    mDests[id]->udpHost = host;
+    mDests[id]->udpPort = port;
+    return id;
+}
+
+void RtcmHub::removeDestination(int id)
+{
+    Destination *d = mDests.take(id);
+    if (!d) {
+        return;
+    }
+
+    if (d->dev) {
+        disconnect(d->dev, 0, this, 0);
+
+        if (d->ownsDev) {
+            d->dev->deleteLater();
+        }
+    }
+
+    delete d;
+}
+
+QList<int> RtcmHub::destinations() const
+{
+    return mDests.keys();
+}
+
+/**
+ * @brief RtcmHub::setQueueLimits
+ * Set the size of the queue of a destination. When any of the limits is
+ * exceeded the oldest epochs are dropped.
+ *
+ * @param id
+ * The destination.
+ *
+ * @param maxEpochs
+ * Maximum number of epochs in the queue.
+ *
+ * @param maxBytes
+ * Maximum number of bytes in the queue.
+ *
+ * @param maxAgeMs
+ * Maximum age of a queued epoch in milliseconds.
+ */
+void RtcmHub::setQueueLimits(int id, int maxEpochs, int maxBytes, int maxAgeMs)
+{
+    Destination *d = mDests.value(id, 0);
+    if (d) {
+        d->maxEpochs = maxEpochs;
+        d->maxBytes = maxBytes;
+        d->maxAgeMs = maxAgeMs;
+    }
+}
+
+/**
+ * @brief RtcmHub::setFilter
+ * Only send some message types to a destination.
+ *
+ * @param id
+ * The destination.
+ *
+ * @param msgTypes
+ * The RTCM3 message types to send. Empty to send all of them.
+ */
+void RtcmHub::setFilter(int id, QList<int> msgTypes)
+{
+    Destination *d = mDests.value(id, 0);
+    if (d) {
+        d->filter = msgTypes;
+    }
+}
+
+RtcmHub::DestStats RtcmHub::destStats(int id) const
+{
+    Destination *d = mDests.value(id, 0);
+    if (!d) {
+        DestStats s;
+        s.type = DEST_SIGNAL;
+        s.epochsQueued = 0;
+        s.bytesQueued = 0;
+        s.bytesDelivered = 0;
+        s.epochsDelivered = 0;
+        s.epochsDropped = 0;
+        s.msgFiltered = 0;
+        s.ageAvgMs = 0.0;
+        s.ageMaxMs = 0.0;
+        return s;
+    }
+
+    DestStats s = d->stats;
+    s.epochsQueued = d->queue.size();
+    s.ageAvgMs = s.epochsDelivered > 0 ? d->ageSum / (double)s.epochsDelivered : 0.0;
+    return s;
+}
+
+/**
+ * @brief RtcmHub::startTcpServer
+ * Start a TCP server. Every client that connects becomes a destination with
+ * the default queue limits.
+ *
+ * @param port
+ * The port to listen on.
+ *
+ * @return
+ * true for success, false otherwise.
+ */
+bool RtcmHub::startTcpServer(int port)
+{
+    if (!mTcpServer->listen(QHostAddress::Any, port)) {
+        qWarning() << "Unable to start TCP server: " << mTcpServer->errorString();
+        return false;
+    }
+
+    return true;
+}
+
+void RtcmHub::stopTcpServer()
+{
+    mTcpServer->close();
+
+    for (int id: mDests.keys()) {
+        if (mDests[id]->ownsDev) {
+            removeDestination(id);
+        }
+    }
+}
+
+QString RtcmHub::getLastError()
+{
+    return mTcpServer->errorString();
+}
+
+void RtcmHub::publish(QByteArray data)
+{
+    if (data.isEmpty()) {
+        return;
+    }
+
+    qint64 now = mClock.elapsed();
+
+    for (int id: mDests.keys()) {
+        Destination *d = mDests.value(id, 0);
+        if (!d) {
+            continue;
+        }
+
+        Epoch e;
+        e.time = now;
+
+        if (d->filter.isEmpty()) {
+            e.data = data;
+        } else {
+            int removed = 0;
+            e.data = filtered(data, d->filter, &removed);
+            d->stats.msgFiltered += removed;
+        }
+
+        if (!e.data.isEmpty()) {
+            d->queue.append(e);
+            d->stats.bytesQueued += e.data.size();
+        }
+
+        while (d->queue.size() > 1 &&
+               (d->queue.size() > d->maxEpochs || d->stats.bytesQueued > d->maxBytes)) {
+            d->stats.bytesQueued -= d->queue.first().data.size();
+            d->queue.removeFirst();
+            d->stats.epochsDropped++;
+        }
+
+        flush(id, d);
+    }
+}
+
+void RtcmHub::newTcpConnection()
+{
+    while (mTcpServer->hasPendingConnections()) {
+        QTcpSocket *socket = mTcpServer->nextPendingConnection();
+        QString name = QString("TCP %1:%2").
+                arg(socket->peerAddress().toString()).
+                arg(socket->peerPort());
+        int id = addDevice(name, socket, DEST_TCP);
+        mDests[id]->ownsDev = true;
+        qDebug() << "RTCM TCP connection accepted:" << socket->peerAddress();
+    }
+}
+
+void RtcmHub::deviceBytesWritten()
+{
+    for (int id: mDests.keys()) {
+        Destination *d = mDests.value(id, 0);
+        if (d && d->dev.data() == sender()) {
+            flush(id, d);
+        }
+    }
+}
+
+void RtcmHub::deviceGone()
+{
+    // The QPointer is already cleared when the device is destroyed, so
+    // remove every destination that lost or disconnected its device.
+    for (int id: mDests.keys()) {
+        Destination *d = mDests[id];
+        bool isDev = d->stats.type == DEST_TCP || d->stats.type == DEST_SERIAL;
+        if (isDev && (!d->dev || d->dev.data() == sender())) {
+            removeDestination(id);
+        }
+    }
+}
+
+int RtcmHub::addDest(QString name, DEST_TYPE type)
+{
+    Destination *d = new Destination;
+    d->stats.name = name;
+    d->stats.type = type;
+    d->stats.epochsQueued = 0;
+    d->stats.bytesQueued = 0;
+    d->stats.bytesDelivered = 0;
+    d->stats.epochsDelivered = 0;
+    d->stats.epochsDropped = 0;
+    d->stats.msgFiltered = 0;
+    d->stats.ageAvgMs = 0.0;
+    d->stats.ageMaxMs = 0.0;
+    d->ownsDev = false;
+    d->udpPort = 0;
+    d->maxEpochs = 10;
+    d->maxBytes = 16384;
+    d->maxAgeMs = 5000;
+    d->ageSum = 0.0;
+
+    int id = mNextId++;
+    mDests.insert(id, d);
+    return id;
+}
+
+void RtcmHub::flush(int id, Destination *d)
+{
+    qint64 now = mClock.elapsed();
+
+    while (!d->queue.isEmpty()) {
+        const Epoch &e = d->queue.first();
+
+        if ((now - e.time) > d->maxAgeMs) {
+            d->stats.bytesQueued -= e.data.size();
+            d->queue.removeFirst();
+            d->stats.epochsDropped++;
+            continue;
+        }
+
+        switch (d->stats.type) {
+        case DEST_SIGNAL:
+            emit rtcmOut(id, e.data);
+            break;
+
+        case DEST_UDP:
+            mUdpSocket->writeDatagram(e.data, d->udpHost, d->udpPort);
+            break;
+
+        case DEST_TCP:
+        case DEST_SERIAL:
+            if (!d->dev || !d->dev->isOpen()) {
+                return;
+            }
+
+            if (d->dev->bytesToWrite() >= DEV_BUFFER_MAX) {
+                // Wait for bytesWritten
+                return;
+            }
+
+            d->dev->write(e.data);
+            break;
+        }
+
+        double age = (double)(now - e.time);
+        d->ageSum += age;
+        if (age > d->stats.ageMaxMs) {
+            d->stats.ageMaxMs = age;
+        }
+
+        d->stats.bytesDelivered += e.data.size();
+        d->stats.epochsDelivered++;
+        d->stats.bytesQueued -= e.data.size();
+        d->queue.removeFirst();
+    }
+}
+
+/**
+ * @brief RtcmHub::filtered
+ * Remove the messages that are not in a list of types.
+ *
+ * @param data
+ * RTCM3 frames back to back. If something that is not a frame is found the
+ * rest of the data is kept as it is.
+ *
+ * @param types
+ * The message types to keep.
+ *
+ * @param removed
+ * Incremented by the number of removed messages.
+ *
+ * @return
+ * The frames that were kept.
+ */
+QByteArray RtcmHub::filtered(const QByteArray &data, const QList<int> &types, int *removed)
+{
+    QByteArray res;
+    const uint8_t *d = (const uint8_t*)data.constData();
+    int ind = 0;
+
+    while (ind < data.size()) {
+        int left = data.size() - ind;
+        if (left < 6 || d[ind] != 0xD3) {
+            res.append(data.mid(ind));
+            break;
+        }
+
+        int len = ((d[ind + 1] & 0x03) << 8 | d[ind + 2]) + 6;
+        if (len > left) {
+            res.append(data.mid(ind));
+            break;
+        }
+
+        int type = d[ind + 3] << 4 | d[ind + 4] >> 4;
+        if (types.contains(type)) {
+            res.append(data.mid(ind, len));
+        } else {
+            (*removed)++;
+        }
+
+        ind += len;
+    }
+
+    return res;
+}
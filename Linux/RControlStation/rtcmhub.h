@@ -0,0 +1,133 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef RTCMHUB_H
+#define RTCMHUB_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QList>
+#include <QMap>
+#include <QPointer>
+#include <QIODevice>
+#include <QTcpServer>
+#include <QUdpSocket>
+#include <QHostAddress>
+#include <QElapsedTimer>
+
+/**
+ * @brief The RtcmHub class
+ *
+ * Distributes RTCM3 corrections to a number of destinations: the cars over
+ * the packet interface, TCP clients, UDP and serial ports. Every destination
+ * has its own bounded queue, so a destination that can not keep up only
+ * loses its own corrections and never delays the others.
+ *
+ * Each call to publish() is one epoch. When the queue of a destination is
+ * full the oldest epoch is dropped, since a new correction always is more
+ * useful than an old one. Epochs older than the maximum age are dropped
+ * too. The message types that a destination gets can be filtered.
+ */
+class RtcmHub : public QObject
+{
+    Q_OBJECT
+public:
+    typedef enum {
+        DEST_SIGNAL = 0,
+        DEST_TCP,
+        DEST_UDP,
+        DEST_SERIAL
+    } DEST_TYPE;
+
+    typedef struct {
+        QString name;
+        DEST_TYPE type;
+        int epochsQueued;
+        int bytesQueued;
+        qint64 bytesDelivered;
+        int epochsDelivered;
+        int epochsDropped;
+        int msgFiltered;
+        double ageAvgMs;    // Time from publish() to delivery
+        double ageMaxMs;
+    } DestStats;
+
+    explicit RtcmHub(QObject *parent = 0);
+    ~RtcmHub();
+
+    int addSignalDestination(QString name);
+    int addDevice(QString name, QIODevice *dev, DEST_TYPE type);
+    int addUdp(QString name, QHostAddress host, quint16 port);
+    void removeDestination(int id);
+    QList<int> destinations() const;
+
+    void setQueueLimits(int id, int maxEpochs, int maxBytes, int maxAgeMs);
+    void setFilter(int id, QList<int> msgTypes);
+    DestStats destStats(int id) const;
+
+    bool startTcpServer(int port);
+    void stopTcpServer();
+    QString getLastError();
+
+signals:
+    void rtcmOut(int dest, QByteArray data);
+
+public slots:
+    void publish(QByteArray data);
+
+private slots:
+    void newTcpConnection();
+    void deviceBytesWritten();
+    void deviceGone();
+
+private:
+    // Bytes that may be waiting in the write buffer of a device before the
+    // epochs are kept in the queue of the destination instead.
+    static const int DEV_BUFFER_MAX = 4096;
+
+    typedef struct {
+        QByteArray data;
+        qint64 time;
+    } Epoch;
+
+    typedef struct {
+        DestStats stats;
+        QPointer<QIODevice> dev;
+        bool ownsDev;
+        QHostAddress udpHost;
+        quint16 udpPort;
+        QList<int> filter;
+        QList<Epoch> queue;
+        int maxEpochs;
+        int maxBytes;
+        int maxAgeMs;
+        double ageSum;
+    } Destination;
+
+    QMap<int, Destination*> mDests;
+    int mNextId;
+    QElapsedTimer mClock;
+    QTcpServer *mTcpServer;
+    QUdpSocket *mUdpSocket;
+
+    int addDest(QString name, DEST_TYPE type);
+    void flush(int id, Destination *d);
+    QByteArray filtered(const QByteArray &data, const QList<int> &types, int *removed);
+
+};
+
+#endif // RTCMHUB_H
@@ -0,0 +1,169 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "rtcmscheduler.h"
+#include <QtGlobal>
+
+constexpr double RtcmScheduler::BURST_TIME;
+constexpr double RtcmScheduler::RATE_WINDOW;
+
+namespace {
+// Epochs come from the receiver clock, so only rounding has to be tolerated
+const double INTERVAL_TOL = 0.01;
+}
+
+RtcmScheduler::RtcmScheduler()
+{
+    mObsInterval = 1.0;
+    mRefInterval = 10.0;
+    mBudget = 0.0;
+    reset();
+}
+
+void RtcmScheduler::reset()
+{
+    mStarted = false;
+    mTimeLast = 0.0;
+    mObsLast = 0.0;
+    mRefLast = 0.0;
+    mTokens = 0.0;
+    mStats.bytesPerSec = 0.0;
+    mStats.obsSent = 0;
+    mStats.obsDropped = 0;
+    mStats.refSent = 0;
+    mStats.refDelayed = 0;
+    mSent.clear();
+}
+
+void RtcmScheduler::setObsInterval(double seconds)
+{
+    mObsInterval = seconds;
+}
+
+void RtcmScheduler::setRefInterval(double seconds)
+{
+    mRefInterval = seconds;
+}
+
+/**
+ * @brief RtcmScheduler::setBudget
+ * Set the number of bytes per second that the link can take for
+ * corrections.
+ *
+ * @param bytesPerSec
+ * The budget. 0 means no limit.
+ */
+void RtcmScheduler::setBudget(double bytesPerSec)
+{
+    mBudget = bytesPerSec;
+}
+
+/**
+ * @brief RtcmScheduler::epoch
+ * Offer the messages of an epoch.
+ *
+ * @param time
+ * Time of the epoch in seconds, e.g. the receiver time of week. If it goes
+ * backwards the schedule starts over.
+ *
+ * @param obs
+ * The observation messages of the epoch. They are sent together or not
+ * at all.
+ *
+ * @param ref
+ * The reference station position message, or empty.
+ *
+ * @return
+ * The messages to send now.
+ */
+QList<QByteArray> RtcmScheduler::epoch(double time, const QList<QByteArray> &obs, const QByteArray &ref)
+{
+    QList<QByteArray> res;
+    bool unlimited = mBudget <= 0.0;
+    double burst = mBudget * BURST_TIME;
+
+    if (!mStarted || time < mTimeLast) {
+        mStarted = true;
+        mTimeLast = time;
+        mObsLast = time - mObsInterval;
+        mRefLast = time - mRefInterval;
+        mTokens = burst;
+        mSent.clear();
+    }
+
+    mTokens = qMin(mTokens + (time - mTimeLast) * mBudget, burst);
+    mTimeLast = time;
+
+    // A message larger than the burst is allowed when the bucket is full,
+    // and the debt is paid back before anything else can be sent.
+    int obsBytes = 0;
+    for (const QByteArray &b: obs) {
+        obsBytes += b.size();
+    }
+
+    if (!obs.isEmpty() && (time - mObsLast) >= (mObsInterval - INTERVAL_TOL)) {
+        if (unlimited || mTokens >= qMin((double)obsBytes, burst)) {
+            res.append(obs);
+            mTokens -= obsBytes;
+            mObsLast = time;
+            mStats.obsSent++;
+            sent(time, obsBytes);
+        } else {
+            mStats.obsDropped++;
+        }
+    }
+
+    if (!ref.isEmpty() && (time - mRefLast) >= (mRefInterval - INTERVAL_TOL)) {
+        if (unlimited || mTokens >= qMin((double)ref.size(), burst)) {
+            res.append(ref);
+            mTokens -= ref.size();
+            mRefLast = time;
+            mStats.refSent++;
+            sent(time, ref.size());
+        } else {
+            mStats.refDelayed++;
+        }
+    }
+
+    // Update the rate also when nothing was sent
+    sent(time, 0);
+
+    return res;
+}
+
+RtcmScheduler::Stats RtcmScheduler::stats() const
+{
+    return mStats;
+}
+
+void RtcmScheduler::sent(double time, int bytes)
+{
+    if (bytes > 0) {
+        mSent.append(qMakePair(time, bytes));
+    }
+
+    while (!mSent.isEmpty() && (time - mSent.first().first) >= RATE_WINDOW) {
+        mSent.removeFirst();
+    }
+
+    int total = 0;
+    for (const QPair<double, int> &s: mSent) {
+        total += s.second;
+    }
+
+    mStats.bytesPerSec = (double)total / RATE_WINDOW;
+}
@@ -0,0 +1,79 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef RTCMSCHEDULER_H
+#define RTCMSCHEDULER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+
+/**
+ * @brief The RtcmScheduler class
+ *
+ * Decides which RTCM messages of an epoch to send over a link with limited
+ * bandwidth. Observations and the reference station position are sent at
+ * their own intervals, and a token bucket with the byte budget of the link
+ * limits the output. Observations have priority: they are dropped when the
+ * budget does not allow them, which decimates the observation rate, while
+ * the reference position waits until there are bytes left over after the
+ * observations.
+ */
+class RtcmScheduler
+{
+public:
+    typedef struct {
+        double bytesPerSec;
+        int obsSent;
+        int obsDropped;
+        int refSent;
+        int refDelayed;
+    } Stats;
+
+    RtcmScheduler();
+
+    void reset();
+    void setObsInterval(double seconds);
+    void setRefInterval(double seconds);
+    void setBudget(double bytesPerSec);
+
+    QList<QByteArray> epoch(double time, const QList<QByteArray> &obs, const QByteArray &ref);
+    Stats stats() const;
+
+private:
+    // Up to this many seconds of unused budget can be spent at once
+    static constexpr double BURST_TIME = 2.0;
+    static constexpr double RATE_WINDOW = 10.0;
+
+    double mObsInterval;
+    double mRefInterval;
+    double mBudget;
+
+    bool mStarted;
+    double mTimeLast;
+    double mObsLast;
+    double mRefLast;
+    double mTokens;
+
+    Stats mStats;
+    QList<QPair<double, int> > mSent;
+
+    void sent(double time, int bytes);
+
+};
+
+#endif // RTCMSCHEDULER_H
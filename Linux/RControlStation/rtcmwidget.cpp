@@ -29,7 +29,7 @@ RtcmWidget::RtcmWidget(QWidget *parent) :
     mRtcm = new RtcmClient(this);
     mTimer = new QTimer(this);
     mTimer->start(20);
-    mTcpServer = new TcpBroadcast(this);
+    mRtcmHub = 0;
 
     connect(mRtcm, SIGNAL(rtcmReceived(QByteArray,int,bool)),
             this, SLOT(rtcmRx(QByteArray,int,bool)));
@@ -74,6 +74,11 @@ void RtcmWidget::setRefPos(double lat, double lon, double height, double antenna
     ui->refSendAntHBox->setValue(antenna_height);
 }
 
+void RtcmWidget::setRtcmHub(RtcmHub *hub)
+{
+    mRtcmHub = hub;
+}
+
 void RtcmWidget::timerSlot()
 {
     // Update ntrip connected label
@@ -113,9 +118,34 @@ void RtcmWidget::timerSlot()
                         ui->refSendAntHBox->value());
 
             emit rtcmReceived(data);
-            mTcpServer->broadcastData(data);
         }
     }
+
+    // Update the hub statistics every second
+    static int hubCnt = 0;
+    hubCnt++;
+    if (mRtcmHub && hubCnt >= (1000 / mTimer->interval())) {
+        hubCnt = 0;
+        QString str;
+
+        for (int id: mRtcmHub->destinations()) {
+            RtcmHub::DestStats s = mRtcmHub->destStats(id);
+
+            if (!str.isEmpty()) {
+                str += "\n";
+            }
+
+            str += QString("%1: %2 kB, %3 dropped, %4 queued, age %5 / %6 ms").
+                    arg(s.name).
+                    arg((double)s.bytesDelivered / 1000.0, 0, 'f', 1).
+                    arg(s.epochsDropped).
+                    arg(s.epochsQueued).
+                    arg(s.ageAvgMs, 0, 'f', 1).
+                    arg(s.ageMaxMs, 0, 'f', 0);
+        }
+
+        ui->hubStatsLabel->setText(str);
+    }
 }
 
 void RtcmWidget::rtcmRx(QByteArray data, int type, bool sync)
@@ -156,12 +186,10 @@ void RtcmWidget::rtcmRx(QByteArray data, int type, bool sync)
     if (!sync || tooLarge) {
         if (!ui->sendRefPosBox->isChecked() || (type != 1005 && type != 1006)) {
             emit rtcmReceived(mRtcmBuffer);
-            mTcpServer->broadcastData(mRtcmBuffer);
             mRtcmBuffer.clear();
 
             if (tooLarge) {
                 emit rtcmReceived(data);
-                mTcpServer->broadcastData(data);
             }
         }
     }
@@ -264,15 +292,19 @@ void RtcmWidget::on_refGetButton_clicked()
 
 void RtcmWidget::on_tcpServerBox_toggled(bool checked)
 {
+    if (!mRtcmHub) {
+        return;
+    }
+
     if (checked) {
-        if (!mTcpServer->startTcpServer(ui->tcpServerPortBox->value())) {
+        if (!mRtcmHub->startTcpServer(ui->tcpServerPortBox->value())) {
             QMessageBox::warning(this, "TCP Server Error",
                                  "Creating TCP server for RTCM data failed. Make sure that the port is not "
                                  "already in use.");
             ui->tcpServerBox->setChecked(false);
         }
     } else {
-        mTcpServer->stopServer();
+        mRtcmHub->stopTcpServer();
     }
 }
 
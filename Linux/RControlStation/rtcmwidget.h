@@ -21,7 +21,7 @@
 #include <QWidget>
 #include <QTimer>
 #include "rtcmclient.h"
-#include "tcpbroadcast.h"
+#include "rtcmhub.h"
 
 namespace Ui {
 class RtcmWidget;
@@ -35,6 +35,7 @@ public:
     explicit RtcmWidget(QWidget *parent = 0);
     ~RtcmWidget();
     void setRefPos(double lat, double lon, double height, double antenna_height = 0.0);
+    void setRtcmHub(RtcmHub *hub);
 
 signals:
     void rtcmReceived(QByteArray data);
@@ -60,7 +61,7 @@ private:
     Ui::RtcmWidget *ui;
     RtcmClient *mRtcm;
     QTimer *mTimer;
-    TcpBroadcast *mTcpServer;
+    RtcmHub *mRtcmHub;
     QByteArray mRtcmBuffer;
 };
 
@@ -0,0 +1,267 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "surveyin.h"
+#include <cmath>
+
+constexpr double SurveyIn::OUTLIER_FLOOR;
+
+SurveyIn::SurveyIn()
+{
+    mTargetAcc = 2.0;
+    mMinDuration = 60.0;
+    mOutlierSigma = 4.0;
+    clear();
+}
+
+void SurveyIn::clear()
+{
+    mSamples = 0;
+    mRejected = 0;
+    mRejectedInRow = 0;
+    mWeightSum = 0.0;
+    mWeightSqSum = 0.0;
+    mTimeFirst = 0.0;
+    mTimeLast = 0.0;
+
+    for (int i = 0;i < 3;i++) {
+        mMean[i] = 0.0;
+    }
+
+    for (int i = 0;i < 9;i++) {
+        mM2[i] = 0.0;
+    }
+}
+
+/**
+ * @brief SurveyIn::addSample
+ * Add a position sample.
+ *
+ * @param time
+ * Time of the sample in seconds, from any monotonic clock.
+ *
+ * @param x
+ * ECEF X in meters.
+ *
+ * @param y
+ * ECEF Y in meters.
+ *
+ * @param z
+ * ECEF Z in meters.
+ *
+ * @param weight
+ * Weight of the sample, e.g. 1 / sigma^2 of the solution.
+ *
+ * @return
+ * SAMPLE_ACCEPTED if the sample was added, SAMPLE_REJECTED if it was
+ * rejected as an outlier and SAMPLE_RESTARTED if too many samples in a row
+ * were rejected, so that the survey was started over from this sample.
+ */
+SurveyIn::SAMPLE_RES SurveyIn::addSample(double time, double x, double y, double z, double weight)
+{
+    SAMPLE_RES res = SAMPLE_ACCEPTED;
+    double d[3] = {x - mMean[0], y - mMean[1], z - mMean[2]};
+
+    if (weight <= 0.0 || !std::isfinite(weight)) {
+        return SAMPLE_REJECTED;
+    }
+
+    if (mSamples >= OUTLIER_MIN_SAMPLES) {
+        // Mahalanobis distance with the floor added to the variances.
+        double c[9];
+        getCovariance(c);
+        double f = OUTLIER_FLOOR * OUTLIER_FLOOR;
+        c[0] += f;
+        c[4] += f;
+        c[8] += f;
+
+        double i0 = c[4] * c[8] - c[5] * c[7];
+        double i1 = c[2] * c[7] - c[1] * c[8];
+        double i2 = c[1] * c[5] - c[2] * c[4];
+        double i4 = c[0] * c[8] - c[2] * c[6];
+        double i5 = c[2] * c[3] - c[0] * c[5];
+        double i8 = c[0] * c[4] - c[1] * c[3];
+        double det = c[0] * i0 + c[1] * (c[5] * c[6] - c[3] * c[8]) + c[2] * (c[3] * c[7] - c[4] * c[6]);
+
+        if (det > 0.0) {
+            // The covariance is symmetric, so the inverse is too.
+            double dist2 = (d[0] * (i0 * d[0] + i1 * d[1] + i2 * d[2]) +
+                    d[1] * (i1 * d[0] + i4 * d[1] + i5 * d[2]) +
+                    d[2] * (i2 * d[0] + i5 * d[1] + i8 * d[2])) / det;
+
+            if (dist2 > (mOutlierSigma * mOutlierSigma)) {
+                mRejected++;
+                mRejectedInRow++;
+
+                if (mRejectedInRow < RESTART_REJECTED) {
+                    return SAMPLE_REJECTED;
+                }
+
+                clear();
+                d[0] = x;
+                d[1] = y;
+                d[2] = z;
+                res = SAMPLE_RESTARTED;
+            }
+        }
+    }
+
+    mRejectedInRow = 0;
+
+    if (mSamples == 0) {
+        mTimeFirst = time;
+    }
+    mTimeLast = time;
+
+    mSamples++;
+    mWeightSum += weight;
+    mWeightSqSum += weight * weight;
+
+    double r = weight / mWeightSum;
+    for (int i = 0;i < 3;i++) {
+        mMean[i] += r * d[i];
+    }
+
+    double d2[3] = {x - mMean[0], y - mMean[1], z - mMean[2]};
+    for (int i = 0;i < 3;i++) {
+        for (int j = 0;j < 3;j++) {
+            mM2[3 * i + j] += weight * d[i] * d2[j];
+        }
+    }
+
+    return res;
+}
+
+/**
+ * @brief SurveyIn::setTargetAccuracy
+ * Set the 3D accuracy of the mean that is needed for convergence.
+ *
+ * @param acc
+ * Accuracy in meters.
+ */
+void SurveyIn::setTargetAccuracy(double acc)
+{
+    mTargetAcc = acc;
+}
+
+double SurveyIn::targetAccuracy() const
+{
+    return mTargetAcc;
+}
+
+/**
+ * @brief SurveyIn::setMinDuration
+ * Set the time the survey has to run before it can converge. Errors of GNSS
+ * solutions are correlated over minutes, so the accuracy from the spread
+ * of a short survey is too optimistic.
+ *
+ * @param seconds
+ * Minimum duration in seconds.
+ */
+void SurveyIn::setMinDuration(double seconds)
+{
+    mMinDuration = seconds;
+}
+
+double SurveyIn::minDuration() const
+{
+    return mMinDuration;
+}
+
+void SurveyIn::setOutlierSigma(double sigma)
+{
+    mOutlierSigma = sigma;
+}
+
+double SurveyIn::outlierSigma() const
+{
+    return mOutlierSigma;
+}
+
+int SurveyIn::samples() const
+{
+    return mSamples;
+}
+
+int SurveyIn::rejected() const
+{
+    return mRejected;
+}
+
+double SurveyIn::duration() const
+{
+    return mTimeLast - mTimeFirst;
+}
+
+void SurveyIn::getMean(double *xyz) const
+{
+    for (int i = 0;i < 3;i++) {
+        xyz[i] = mMean[i];
+    }
+}
+
+/**
+ * @brief SurveyIn::getCovariance
+ * Get the weighted sample covariance of the positions.
+ *
+ * @param cov
+ * Array of 9 elements for the covariance matrix, row major.
+ */
+void SurveyIn::getCovariance(double *cov) const
+{
+    // Unbiased for reliability weights
+    double div = mWeightSum - mWeightSqSum / mWeightSum;
+
+    for (int i = 0;i < 9;i++) {
+        cov[i] = (mSamples > 1 && div > 0.0) ? mM2[i] / div : 0.0;
+    }
+}
+
+/**
+ * @brief SurveyIn::spread3d
+ * @return
+ * The 3D standard deviation of the samples in meters.
+ */
+double SurveyIn::spread3d() const
+{
+    double c[9];
+    getCovariance(c);
+    return sqrt(c[0] + c[4] + c[8]);
+}
+
+/**
+ * @brief SurveyIn::accuracy3d
+ * @return
+ * The 3D standard deviation of the mean in meters, using the effective
+ * number of samples for the weights. -1 if there are too few samples.
+ */
+double SurveyIn::accuracy3d() const
+{
+    if (mSamples < 2) {
+        return -1.0;
+    }
+
+    double nEff = mWeightSum * mWeightSum / mWeightSqSum;
+    return spread3d() / sqrt(nEff);
+}
+
+bool SurveyIn::isConverged() const
+{
+    double acc = accuracy3d();
+    return mSamples >= OUTLIER_MIN_SAMPLES && duration() >= mMinDuration &&
+            acc >= 0.0 && acc <= mTargetAcc;
+}
@@ -0,0 +1,90 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef SURVEYIN_H
+#define SURVEYIN_H
+
+/**
+ * @brief The SurveyIn class
+ *
+ * Survey-in of a base station position in ECEF. The weighted mean and
+ * covariance of the samples are updated with Welford's method, so that
+ * neither precision nor memory depends on how long the survey runs.
+ *
+ * Samples further than a number of standard deviations from the mean,
+ * measured with the covariance so far, are rejected. If the position
+ * really has moved, e.g. because the antenna was moved, many samples in a
+ * row are rejected and the survey starts over.
+ *
+ * The survey has converged when it has run for a minimum time and the 3D
+ * accuracy of the mean is better than the target.
+ */
+class SurveyIn
+{
+public:
+    typedef enum {
+        SAMPLE_ACCEPTED = 0,
+        SAMPLE_REJECTED,
+        SAMPLE_RESTARTED
+    } SAMPLE_RES;
+
+    SurveyIn();
+
+    void clear();
+    SAMPLE_RES addSample(double time, double x, double y, double z, double weight = 1.0);
+
+    void setTargetAccuracy(double acc);
+    double targetAccuracy() const;
+    void setMinDuration(double seconds);
+    double minDuration() const;
+    void setOutlierSigma(double sigma);
+    double outlierSigma() const;
+
+    int samples() const;
+    int rejected() const;
+    double duration() const;
+    void getMean(double *xyz) const;
+    void getCovariance(double *cov) const;
+    double spread3d() const;
+    double accuracy3d() const;
+    bool isConverged() const;
+
+private:
+    // Samples closer than this to the mean are never rejected, so that a
+    // survey from a receiver with a very stable solution is not stuck on
+    // rounding.
+    static constexpr double OUTLIER_FLOOR = 0.02;
+    static const int OUTLIER_MIN_SAMPLES = 10;
+    static const int RESTART_REJECTED = 60;
+
+    int mSamples;
+    int mRejected;
+    int mRejectedInRow;
+    double mWeightSum;
+    double mWeightSqSum;
+    double mMean[3];
+    double mM2[9];
+    double mTimeFirst;
+    double mTimeLast;
+
+    double mTargetAcc;
+    double mMinDuration;
+    double mOutlierSigma;
+
+};
+
+#endif // SURVEYIN_H
@@ -24,11 +24,40 @@
 #include <QTcpSocket>
 #include <QList>
 #include <QFile>
+#include <QElapsedTimer>
 
+/**
+ * @brief The TcpBroadcast class
+ *
+ * Sends the same data to every connected TCP client. Every client has a
+ * queue of payloads that are shared between the clients, so a payload is
+ * only copied when it is written to a socket. Payloads are written when the
+ * write buffer of the socket is below the low watermark.
+ *
+ * When the backlog of a client, queued plus not yet written by the socket,
+ * goes above the high watermark the client is slow. Depending on the policy
+ * new data for it is dropped until the backlog is below the low watermark
+ * again, or it is disconnected.
+ */
 class TcpBroadcast : public QObject
 {
     Q_OBJECT
 public:
+    typedef enum {
+        SLOW_CLIENT_DROP = 0,
+        SLOW_CLIENT_DISCONNECT
+    } SLOW_CLIENT_POLICY;
+
+    typedef struct {
+        QString address;
+        qint64 bytesSent;       // Written by the socket
+        qint64 bytesDropped;
+        int backlog;            // Bytes queued and in the socket buffer
+        double lagMs;           // Age of the oldest queued payload
+        double bytesPerSec;
+        bool dropping;
+    } ClientStats;
+
     explicit TcpBroadcast(QObject *parent = 0);
     ~TcpBroadcast();
     bool startTcpServer(int port);
@@ -38,6 +67,12 @@ public:
     bool logToFile(QString file);
     void logStop();
 
+    void setWatermarks(int low, int high);
+    void setSlowClientPolicy(SLOW_CLIENT_POLICY policy);
+    int clientCount();
+    QList<ClientStats> getClientStats();
+    int clientsDisconnected();
+
 signals:
 
 public slots:
@@ -45,11 +80,43 @@ public slots:
 
 private slots:
     void newTcpConnection();
+    void socketBytesWritten(qint64 bytes);
+    void socketDisconnected();
 
 private:
+    typedef struct {
+        QByteArray data;
+        qint64 time;
+    } Payload;
+
+    typedef struct {
+        QTcpSocket *socket;
+        QList<Payload> queue;
+        int queued;
+        bool dropping;
+        qint64 bytesSent;
+        qint64 bytesDropped;
+        qint64 rateBytes;
+        qint64 rateTime;
+        double bytesPerSec;
+    } Client;
+
+    // Time that a removed client gets to read what is left before the
+    // connection is aborted
+    static const int CLOSE_TIMEOUT_MS = 5000;
+
     QTcpServer *mTcpServer;
-    QList<QTcpSocket*> mSockets;
+    QList<Client*> mClients;
     QFile mLog;
+    QElapsedTimer mClock;
+    int mLowWatermark;
+    int mHighWatermark;
+    SLOW_CLIENT_POLICY mPolicy;
+    int mClientsDisconnected;
+
+    Client *findClient(QObject *socket);
+    void removeClient(Client *c);
+    void flush(Client *c);
 
 };
 
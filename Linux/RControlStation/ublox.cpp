@@ -17,6 +17,7 @@
 
 #include "ublox.h"
 #include <QEventLoop>
+#include <QDebug>
 #include <cmath>
 
 namespace {
@@ -201,14 +202,26 @@ static void ubx_put_R8(uint8_t *msg, int *ind, double data) {
 
 Ublox::Ublox(QObject *parent) : QObject(parent)
 {
-    memset(&mDecoderState, 0, sizeof(decoder_state));
-    rtcm3_init_state(&mRtcmState);
+    qRegisterMetaType<GnssDemux::FrameBatch>("GnssDemux::FrameBatch");
 
-    mSerialPort = new QSerialPort(this);
+    mWaitingAck = false;
+    mIoThread = new QThread(this);
+    mWorker = new GnssSerialWorker;
+    mWorker->moveToThread(mIoThread);
+
+    connect(mIoThread, SIGNAL(finished()), mWorker, SLOT(deleteLater()));
+    connect(mWorker, SIGNAL(framesRx(GnssDemux::FrameBatch)),
+            this, SLOT(framesRx(GnssDemux::FrameBatch)));
+
+    mIoThread->start();
+
+    mCfgOpen = false;
+    mCfgNext = 0;
+    mCfgClock.start();
+    mCfgTimer = new QTimer(this);
+    mCfgTimer->setInterval(10);
 
-    connect(mSerialPort, SIGNAL(readyRead()), this, SLOT(serialDataAvailable()));
-    connect(mSerialPort, SIGNAL(error(QSerialPort::SerialPortError)),
-            this, SLOT(serialPortError(QSerialPort::SerialPortError)));
+    connect(mCfgTimer, SIGNAL(timeout()), this, SLOT(cfgTimerSlot()));
 
     // Prevent unused warnings
     (void)ubx_get_U1;
@@ -236,37 +249,35 @@ Ublox::Ublox(QObject *parent) : QObject(parent)
     (void)ubx_put_R8;
 }
 
-bool Ublox::connectSerial(QString port, int baudrate)
+Ublox::~Ublox()
 {
-    if(mSerialPort->isOpen()) {
-        mSerialPort->close();
-    }
+    mIoThread->quit();
+    mIoThread->wait();
+}
 
-    mSerialPort->setPortName(port);
-    mSerialPort->open(QIODevice::ReadWrite);
+bool Ublox::connectSerial(QString port, int baudrate)
+{
+    bool res = false;
     mWaitingAck = false;
+    cfgAbort();
 
-    if(!mSerialPort->isOpen()) {
-        return false;
-    }
-
-    mSerialPort->setBaudRate(baudrate);
-    mSerialPort->setDataBits(QSerialPort::Data8);
-    mSerialPort->setParity(QSerialPort::NoParity);
-    mSerialPort->setStopBits(QSerialPort::OneStop);
-    mSerialPort->setFlowControl(QSerialPort::NoFlowControl);
+    QMetaObject::invokeMethod(mWorker, "openPort", Qt::BlockingQueuedConnection,
+                              Q_RETURN_ARG(bool, res),
+                              Q_ARG(QString, port),
+                              Q_ARG(int, baudrate));
 
-    return true;
+    return res;
 }
 
 void Ublox::disconnectSerial()
 {
-    mSerialPort->close();
+    cfgAbort();
+    QMetaObject::invokeMethod(mWorker, "closePort", Qt::BlockingQueuedConnection);
 }
 
 bool Ublox::isSerialConnected()
 {
-    return mSerialPort->isOpen();
+    return mWorker->isOpen();
 }
 
 void Ublox::ubxPoll(uint8_t msg_class, uint8_t id)
@@ -544,126 +555,264 @@ bool Ublox::ubloxCfgTp5(ubx_cfg_tp5 *cfg)
     return ubx_encode_send(UBX_CLASS_CFG, UBX_CFG_TP5, buffer, ind, 10);
 }
 
-void Ublox::serialDataAvailable()
+/**
+ * @brief Ublox::ubxCfgValset
+ * Set configuration items with CFG-VALSET, for receivers with protocol
+ * version 23.01 or later (e.g. ZED-F9P).
+ *
+ * @param layers
+ * Or of UBX_CFG_LAYER_RAM, UBX_CFG_LAYER_BBR and UBX_CFG_LAYER_FLASH.
+ *
+ * @param values
+ * Up to 64 keys and values. The size of each value is taken from its key.
+ *
+ * @return
+ * true: ack received, or queued if a transaction is open
+ * false: nak received, timeout or invalid key
+ */
+bool Ublox::ubxCfgValset(uint8_t layers, const QVector<ubx_cfg_val> &values)
 {
-    while (mSerialPort->bytesAvailable() > 0) {
-        QByteArray data = mSerialPort->readAll();
+    uint8_t buffer[4 + 64 * 12];
+    int ind = 0;
 
-        for (int i = 0;i < data.size();i++) {
-            uint8_t ch = data.at(i);
-            bool ch_used = false;
+    if (values.size() > 64) {
+        return false;
+    }
 
-            // RTCM
-            if (!ch_used && mDecoderState.line_pos == 0 && mDecoderState.ubx_pos == 0) {
-                ch_used = rtcm3_input_data(ch, &mRtcmState) >= 0;
-            }
+    ubx_put_U1(buffer, &ind, 0); // Version
+    ubx_put_X1(buffer, &ind, layers);
+    ubx_put_U1(buffer, &ind, 0);
+    ubx_put_U1(buffer, &ind, 0);
 
-            // Ubx
-            if (!ch_used && mDecoderState.line_pos == 0) {
-                int ubx_pos_last = mDecoderState.ubx_pos;
-
-                if (mDecoderState.ubx_pos == 0) {
-                    if (ch == 0xB5) {
-                        mDecoderState.ubx_pos++;
-                    }
-                } else if (mDecoderState.ubx_pos == 1) {
-                    if (ch == 0x62) {
-                        mDecoderState.ubx_pos++;
-                        mDecoderState.ubx_ck_a = 0;
-                        mDecoderState.ubx_ck_b = 0;
-                    }
-                } else if (mDecoderState.ubx_pos == 2) {
-                    mDecoderState.ubx_class = ch;
-                    mDecoderState.ubx_ck_a += ch;
-                    mDecoderState.ubx_ck_b += mDecoderState.ubx_ck_a;
-                    mDecoderState.ubx_pos++;
-                } else if (mDecoderState.ubx_pos == 3) {
-                    mDecoderState.ubx_id = ch;
-                    mDecoderState.ubx_ck_a += ch;
-                    mDecoderState.ubx_ck_b += mDecoderState.ubx_ck_a;
-                    mDecoderState.ubx_pos++;
-                } else if (mDecoderState.ubx_pos == 4) {
-                    mDecoderState.ubx_len = ch;
-                    mDecoderState.ubx_ck_a += ch;
-                    mDecoderState.ubx_ck_b += mDecoderState.ubx_ck_a;
-                    mDecoderState.ubx_pos++;
-                } else if (mDecoderState.ubx_pos == 5) {
-                    mDecoderState.ubx_len |= ch << 8;
-                    mDecoderState.ubx_ck_a += ch;
-                    mDecoderState.ubx_ck_b += mDecoderState.ubx_ck_a;
-                    mDecoderState.ubx_pos++;
-                } else if ((mDecoderState.ubx_pos - 6) < mDecoderState.ubx_len) {
-                    mDecoderState.ubx[mDecoderState.ubx_pos - 6] = ch;
-                    mDecoderState.ubx_ck_a += ch;
-                    mDecoderState.ubx_ck_b += mDecoderState.ubx_ck_a;
-                    mDecoderState.ubx_pos++;
-                } else if ((mDecoderState.ubx_pos - 6) == mDecoderState.ubx_len) {
-                    if (ch == mDecoderState.ubx_ck_a) {
-                        mDecoderState.ubx_pos++;
-                    }
-                } else if ((mDecoderState.ubx_pos - 6) == (mDecoderState.ubx_len + 1)) {
-                    if (ch == mDecoderState.ubx_ck_b) {
-                        ubx_decode(mDecoderState.ubx_class, mDecoderState.ubx_id,
-                                   mDecoderState.ubx, mDecoderState.ubx_len);
-                        mDecoderState.ubx_pos = 0;
-                    }
-                }
+    for (const ubx_cfg_val &v: values) {
+        ubx_put_U4(buffer, &ind, v.key);
+
+        switch ((v.key >> 28) & 0x07) {
+        case 1: // One bit, stored in one byte
+        case 2: ubx_put_U1(buffer, &ind, v.value); break;
+        case 3: ubx_put_U2(buffer, &ind, v.value); break;
+        case 4: ubx_put_U4(buffer, &ind, v.value); break;
+        case 5:
+            ubx_put_U4(buffer, &ind, v.value);
+            ubx_put_U4(buffer, &ind, v.value >> 32);
+            break;
+        default:
+            qWarning() << "Invalid CFG-VALSET key" << v.key;
+            return false;
+        }
+    }
 
-                if (ubx_pos_last != mDecoderState.ubx_pos) {
-                    ch_used = true;
-                } else {
-                    mDecoderState.ubx_pos = 0;
-                }
-            }
+    return ubx_encode_send(UBX_CLASS_CFG, UBX_CFG_VALSET, buffer, ind, 10);
+}
 
-            // NMEA
-            if (!ch_used) {
-                mDecoderState.line[mDecoderState.line_pos++] = ch;
-                if (mDecoderState.line_pos == sizeof(mDecoderState.line)) {
-                    mDecoderState.line_pos = 0;
-                }
+/**
+ * @brief Ublox::cfgBegin
+ * Start a configuration transaction. Until cfgCommit is called, the ubxCfg
+ * functions only queue their messages and return true without waiting
+ * for an ACK.
+ */
+void Ublox::cfgBegin()
+{
+    mCfgBuilding.clear();
+    mCfgOpen = true;
+}
+
+/**
+ * @brief Ublox::cfgCommit
+ * Send the messages queued since cfgBegin back to back, with up to
+ * CFG_IN_FLIGHT_MAX of them waiting for their ACK at the same time. Every
+ * ACK or NAK is matched to the oldest sent message with the same class and
+ * id. cfgDone is emitted when all messages of the transaction have been
+ * acknowledged or have timed out.
+ *
+ * @param timeoutMs
+ * Time to wait for the ACK of each message after it is sent.
+ *
+ * @return
+ * The transaction number that cfgDone will report, or -1 if there was
+ * nothing to send.
+ */
+int Ublox::cfgCommit(int timeoutMs)
+{
+    mCfgOpen = false;
 
-                if (mDecoderState.line_pos > 0 && mDecoderState.line[mDecoderState.line_pos - 1] == '\n') {
-                    mDecoderState.line[mDecoderState.line_pos] = '\0';
-                    mDecoderState.line_pos = 0;
+    if (mCfgBuilding.isEmpty()) {
+        return -1;
+    }
+
+    int transaction = mCfgNext++;
+
+    cfg_transaction t;
+    t.total = mCfgBuilding.size();
+    t.acked = 0;
+    t.naked = 0;
+    t.timedOut = 0;
+    t.startMs = mCfgClock.elapsed();
+    mCfgTransactions.insert(transaction, t);
+
+    for (cfg_msg m: mCfgBuilding) {
+        m.transaction = transaction;
+        m.timeoutMs = timeoutMs;
+        mCfgQueue.append(m);
+    }
+
+    mCfgBuilding.clear();
+    cfgSendQueued();
+
+    if (!mCfgTimer->isActive()) {
+        mCfgTimer->start();
+    }
 
-                    QByteArray line((char*)mDecoderState.line);
-                    NmeaServer::nmea_gga_info_t gga;
-                    int fields = NmeaServer::decodeNmeaGGA(line, gga);
-                    if (fields > 0) {
-                        emit rxGga(fields, gga);
-                    }
+    return transaction;
+}
+
+bool Ublox::isCfgBusy()
+{
+    return !mCfgQueue.isEmpty() || !mCfgInFlight.isEmpty();
+}
+
+/**
+ * @brief Ublox::getCapture
+ * Get the first received bytes after connecting, e.g. for
+ * GnssDemux::benchmark.
+ *
+ * @return
+ * Up to GnssSerialWorker::CAPTURE_LEN bytes of receiver output.
+ */
+QByteArray Ublox::getCapture()
+{
+    return mWorker->getCapture();
+}
+
+GnssDemux::Stats Ublox::getDemuxStats()
+{
+    return mWorker->getStats();
+}
+
+void Ublox::framesRx(const GnssDemux::FrameBatch &batch)
+{
+    // ubx_decode takes non-const pointers, so detach once for the batch.
+    QByteArray data = batch.data;
+    uint8_t *buf = (uint8_t*)data.data();
+
+    for (const GnssDemux::Frame &f: batch.frames) {
+        uint8_t *frame = buf + f.offset;
+
+        switch (f.type) {
+        case GnssDemux::FRAME_UBX:
+            emit ubxRx(data.mid(f.offset, f.len));
+            ubx_decode(frame[2], frame[3], frame + 6, f.len - 8);
+            break;
+
+        case GnssDemux::FRAME_RTCM3:
+            emit rtcmRx(data.mid(f.offset, f.len), f.id);
+            break;
+
+        case GnssDemux::FRAME_NMEA:
+            // Only GGA is used, so skip the other sentences before copying.
+            if (f.len > 7 && frame[3] == 'G' && frame[4] == 'G' && frame[5] == 'A') {
+                NmeaServer::nmea_gga_info_t gga;
+                int fields = NmeaServer::decodeNmeaGGA(data.mid(f.offset, f.len), gga);
+                if (fields > 0) {
+                    emit rxGga(fields, gga);
                 }
             }
+            break;
         }
     }
 }
 
-void Ublox::serialPortError(QSerialPort::SerialPortError error)
+void Ublox::cfgTimerSlot()
 {
-    QString message;
-    switch (error) {
-    case QSerialPort::NoError:
-        break;
+    qint64 now = mCfgClock.elapsed();
+
+    for (int i = 0;i < mCfgInFlight.size();i++) {
+        const cfg_msg &m = mCfgInFlight.at(i);
+        if ((now - m.sentMs) > m.timeoutMs) {
+            int transaction = m.transaction;
+            mCfgInFlight.removeAt(i--);
+            cfgResult(transaction, CFG_TIMEOUT);
+        }
+    }
 
-    default:
-        message = "Serial port error: " + mSerialPort->errorString();
-        break;
+    cfgSendQueued();
+
+    if (!isCfgBusy()) {
+        mCfgTimer->stop();
+    }
+}
+
+void Ublox::cfgSendQueued()
+{
+    while (mCfgInFlight.size() < CFG_IN_FLIGHT_MAX && !mCfgQueue.isEmpty()) {
+        cfg_msg m = mCfgQueue.takeFirst();
+        m.sentMs = mCfgClock.elapsed();
+        ubx_send(m.data);
+        mCfgInFlight.append(m);
+    }
+}
+
+void Ublox::cfgResult(int transaction, CFG_RESULT result)
+{
+    if (!mCfgTransactions.contains(transaction)) {
+        return;
     }
 
-    if(!message.isEmpty()) {
-        qDebug() << message;
+    cfg_transaction &t = mCfgTransactions[transaction];
 
-        if(mSerialPort->isOpen()) {
-            mSerialPort->close();
+    switch (result) {
+    case CFG_ACK: t.acked++; break;
+    case CFG_NAK: t.naked++; break;
+    case CFG_TIMEOUT: t.timedOut++; break;
+    }
+
+    if ((t.acked + t.naked + t.timedOut) >= t.total) {
+        cfg_transaction done = t;
+        mCfgTransactions.remove(transaction);
+        emit cfgDone(transaction, done.acked, done.naked, done.timedOut,
+                     mCfgClock.elapsed() - done.startMs);
+    }
+}
+
+void Ublox::cfgAckRx(uint8_t cls_id, uint8_t msg_id, bool ack)
+{
+    for (int i = 0;i < mCfgInFlight.size();i++) {
+        const cfg_msg &m = mCfgInFlight.at(i);
+        if (m.cls == cls_id && m.id == msg_id) {
+            int transaction = m.transaction;
+            mCfgInFlight.removeAt(i);
+            cfgResult(transaction, ack ? CFG_ACK : CFG_NAK);
+            break;
         }
     }
+
+    cfgSendQueued();
+}
+
+/**
+ * @brief Ublox::cfgAbort
+ * Give up on all queued and sent configuration messages, e.g. when the
+ * port is closed. They are reported as timed out.
+ */
+void Ublox::cfgAbort()
+{
+    QList<cfg_msg> msgs = mCfgInFlight + mCfgQueue;
+    mCfgInFlight.clear();
+    mCfgQueue.clear();
+    mCfgBuilding.clear();
+    mCfgOpen = false;
+    mCfgTimer->stop();
+
+    for (const cfg_msg &m: msgs) {
+        cfgResult(m.transaction, CFG_TIMEOUT);
+    }
 }
 
 void Ublox::ubx_send(QByteArray data)
 {
-    if (mSerialPort->isOpen()) {
-        mSerialPort->write(data);
+    if (mWorker->isOpen()) {
+        QMetaObject::invokeMethod(mWorker, "writeData", Qt::QueuedConnection,
+                                  Q_ARG(QByteArray, data));
     }
 }
 
@@ -672,7 +821,17 @@ bool Ublox::ubx_encode_send(uint8_t msg_class, uint8_t id, uint8_t *msg, int len
     auto ubx = ubx_encode(msg_class, id, QByteArray((const char*)msg, len));
 
     bool retVal = false;
-    if (timeoutMs > 0) {
+    if (timeoutMs > 0 && mCfgOpen) {
+        cfg_msg m;
+        m.data = ubx;
+        m.cls = msg_class;
+        m.id = id;
+        m.transaction = -1;
+        m.timeoutMs = timeoutMs;
+        m.sentMs = -1;
+        mCfgBuilding.append(m);
+        retVal = true;
+    } else if (timeoutMs > 0) {
         if (mWaitingAck) {
             qDebug() << "Already waiting for ack";
         } else {
@@ -683,14 +842,25 @@ bool Ublox::ubx_encode_send(uint8_t msg_class, uint8_t id, uint8_t *msg, int len
             timeoutTimer.setSingleShot(true);
             timeoutTimer.start(timeoutMs);
             auto conn = connect(this, &Ublox::rxAck,
-                                [&loop, &retVal](uint8_t, uint8_t){retVal = true; loop.quit();});
-            connect(this, SIGNAL(rxNak(uint8_t,uint8_t)), &loop, SLOT(quit()));
+                                [&loop, &retVal, msg_class, id](uint8_t cls_id, uint8_t msg_id) {
+                if (cls_id == msg_class && msg_id == id) {
+                    retVal = true;
+                    loop.quit();
+                }
+            });
+            auto connNak = connect(this, &Ublox::rxNak,
+                                   [&loop, msg_class, id](uint8_t cls_id, uint8_t msg_id) {
+                if (cls_id == msg_class && msg_id == id) {
+                    loop.quit();
+                }
+            });
             connect(&timeoutTimer, SIGNAL(timeout()), &loop, SLOT(quit()));
 
             ubx_send(ubx);
             loop.exec();
 
             disconnect(conn);
+            disconnect(connNak);
 
             mWaitingAck = false;
         }
@@ -742,8 +912,6 @@ QByteArray Ublox::ubx_encode(uint8_t msg_class, uint8_t id, const QByteArray &da
 
 void Ublox::ubx_decode(uint8_t msg_class, uint8_t id, uint8_t *msg, int len)
 {
-    emit ubxRx(ubx_encode(msg_class, id, QByteArray((const char*)msg, len)));
-
     switch (msg_class) {
     case UBX_CLASS_NAV: {
         switch (id) {
@@ -753,6 +921,9 @@ void Ublox::ubx_decode(uint8_t msg_class, uint8_t id, uint8_t *msg, int len)
         case UBX_NAV_SVIN:
             ubx_decode_svin(msg, len);
             break;
+        case UBX_NAV_HPPOSECEF:
+            ubx_decode_hpposecef(msg, len);
+            break;
         default:
             break;
         }
@@ -841,6 +1012,28 @@ void Ublox::ubx_decode_svin(uint8_t *msg, int len)
     emit rxSvin(svin);
 }
 
+void Ublox::ubx_decode_hpposecef(uint8_t *msg, int len)
+{
+    if (len < 28) {
+        return;
+    }
+
+    ubx_nav_hpposecef pos;
+    int ind = 4;
+
+    pos.i_tow = ubx_get_U4(msg, &ind);
+    pos.ecefX = (double)ubx_get_I4(msg, &ind) / D(100.0);
+    pos.ecefY = (double)ubx_get_I4(msg, &ind) / D(100.0);
+    pos.ecefZ = (double)ubx_get_I4(msg, &ind) / D(100.0);
+    pos.ecefX += (double)ubx_get_I1(msg, &ind) / D(10000.0);
+    pos.ecefY += (double)ubx_get_I1(msg, &ind) / D(10000.0);
+    pos.ecefZ += (double)ubx_get_I1(msg, &ind) / D(10000.0);
+    pos.valid = !(ubx_get_X1(msg, &ind) & 0x01);
+    pos.pAcc = (float)ubx_get_U4(msg, &ind) / 10000.0;
+
+    emit rxHpPosEcef(pos);
+}
+
 void Ublox::ubx_decode_ack(uint8_t *msg, int len)
 {
     (void)len;
@@ -851,6 +1044,7 @@ void Ublox::ubx_decode_ack(uint8_t *msg, int len)
     uint8_t msg_id = ubx_get_I1(msg, &ind);
 
     emit rxAck(cls_id, msg_id);
+    cfgAckRx(cls_id, msg_id, true);
 }
 
 void Ublox::ubx_decode_nak(uint8_t *msg, int len)
@@ -863,6 +1057,7 @@ void Ublox::ubx_decode_nak(uint8_t *msg, int len)
     uint8_t msg_id = ubx_get_I1(msg, &ind);
 
     emit rxNak(cls_id, msg_id);
+    cfgAckRx(cls_id, msg_id, false);
 }
 
 void Ublox::ubx_decode_rawx(uint8_t *msg, int len)
@@ -881,6 +1076,13 @@ void Ublox::ubx_decode_rawx(uint8_t *msg, int len)
     raw.leap_sec = flags & 0x01;
     raw.clk_reset = flags & 0x02;
 
+    // The frame length is already checked, so only trust as many
+    // measurements as fit in both the message and the struct.
+    int meas_max = qBound(0, (len - 16) / 32, 64);
+    if (raw.num_meas > meas_max) {
+        raw.num_meas = meas_max;
+    }
+
     ind = 16;
 
     for (int i = 0;i < raw.num_meas;i++) {
@@ -19,18 +19,31 @@
 #define UBLOX_H
 
 #include <QObject>
-#include <QSerialPort>
+#include <QThread>
 #include <QTimer>
+#include <QElapsedTimer>
+#include <QList>
+#include <QHash>
+#include <QVector>
 #include <cstdint>
 #include "nmeaserver.h"
 #include "rtcm3_simple.h"
 #include "datatypes.h"
+#include "gnssdemux.h"
+
+typedef struct {
+    uint32_t key;
+    uint64_t value;
+} ubx_cfg_val;
 
 class Ublox : public QObject
 {
     Q_OBJECT
 public:
+    static const int CFG_IN_FLIGHT_MAX = 8;
+
     explicit Ublox(QObject *parent = 0);
+    ~Ublox();
     bool connectSerial(QString port, int baudrate = 115200);
     void disconnectSerial();
     bool isSerialConnected();
@@ -42,40 +55,80 @@ public:
     bool ubxCfgRate(uint16_t meas_rate_ms, uint16_t nav_rate_ms, uint16_t time_ref);
     bool ubxCfgNav5(ubx_cfg_nav5 *cfg);
     bool ubloxCfgTp5(ubx_cfg_tp5 *cfg);
+    bool ubxCfgValset(uint8_t layers, const QVector<ubx_cfg_val> &values);
+
+    void cfgBegin();
+    int cfgCommit(int timeoutMs = 1000);
+    bool isCfgBusy();
+
+    QByteArray getCapture();
+    GnssDemux::Stats getDemuxStats();
 
 signals:
     void rxGga(int fields, NmeaServer::nmea_gga_info_t gga);
     void rxRelPosNed(ubx_nav_relposned pos);
     void rxSvin(ubx_nav_svin svin);
+    void rxHpPosEcef(ubx_nav_hpposecef pos);
     void rxAck(uint8_t cls_id, uint8_t msg_id);
     void rxNak(uint8_t cls_id, uint8_t msg_id);
     void rxRawx(ubx_rxm_rawx rawx);
     void ubxRx(const QByteArray &data);
+    void rtcmRx(QByteArray data, int type);
+    void cfgDone(int transaction, int acked, int naked, int timedOut, int timeMs);
 
 public slots:
 
 private slots:
-    void serialDataAvailable();
-    void serialPortError(QSerialPort::SerialPortError error);
+    void framesRx(const GnssDemux::FrameBatch &batch);
+    void cfgTimerSlot();
 
 private:
-    typedef struct {
-        uint8_t line[256];
-        uint8_t ubx[2048];
-        int line_pos;
-        int ubx_pos;
-        uint8_t ubx_class;
-        uint8_t ubx_id;
-        uint8_t ubx_ck_a;
-        uint8_t ubx_ck_b;
-        int ubx_len;
-    } decoder_state;
-
-    QSerialPort *mSerialPort;
-    decoder_state mDecoderState;
-    rtcm3_state mRtcmState;
+    // The serial port and the demultiplexer run on mIoThread, and the
+    // frames are decoded on the thread of this object.
+    QThread *mIoThread;
+    GnssSerialWorker *mWorker;
     bool mWaitingAck;
 
+    // Configuration transactions. Messages are queued in mCfgQueue while a
+    // transaction is built, and up to CFG_IN_FLIGHT_MAX of them wait for
+    // their ACK or NAK in mCfgInFlight at the same time.
+    typedef struct {
+        QByteArray data;
+        uint8_t cls;
+        uint8_t id;
+        int transaction;
+        int timeoutMs;
+        qint64 sentMs;
+    } cfg_msg;
+
+    typedef struct {
+        int total;
+        int acked;
+        int naked;
+        int timedOut;
+        qint64 startMs;
+    } cfg_transaction;
+
+    QTimer *mCfgTimer;
+    QElapsedTimer mCfgClock;
+    QList<cfg_msg> mCfgQueue;
+    QList<cfg_msg> mCfgInFlight;
+    QHash<int, cfg_transaction> mCfgTransactions;
+    QList<cfg_msg> mCfgBuilding;
+    bool mCfgOpen;
+    int mCfgNext;
+
+    typedef enum {
+        CFG_ACK = 0,
+        CFG_NAK,
+        CFG_TIMEOUT
+    } CFG_RESULT;
+
+    void cfgSendQueued();
+    void cfgResult(int transaction, CFG_RESULT result);
+    void cfgAckRx(uint8_t cls_id, uint8_t msg_id, bool ack);
+    void cfgAbort();
+
     void ubx_send(QByteArray data);
     bool ubx_encode_send(uint8_t msg_class, uint8_t id, uint8_t *msg, int len, int timeoutMs = -1);
     QByteArray ubx_encode(uint8_t msg_class, uint8_t id, const QByteArray &data);
@@ -83,6 +136,7 @@ private:
     void ubx_decode(uint8_t msg_class, uint8_t id, uint8_t *msg, int len);
     void ubx_decode_relposned(uint8_t *msg, int len);
     void ubx_decode_svin(uint8_t *msg, int len);
+    void ubx_decode_hpposecef(uint8_t *msg, int len);
     void ubx_decode_ack(uint8_t *msg, int len);
     void ubx_decode_nak(uint8_t *msg, int len);
     void ubx_decode_rawx(uint8_t *msg, int len);
@@ -109,6 +163,7 @@ private:
 // Navigation (NAV) messages
 #define UBX_NAV_RELPOSNED				0x3C
 #define UBX_NAV_SVIN					0x3B
+#define UBX_NAV_HPPOSECEF				0x13
 
 // Receiver Manager (RXM) messages
 #define UBX_RXM_RAWX					0x15
@@ -125,6 +180,12 @@ private:
 #define UBX_CFG_NAV5					0x24
 #define UBX_CFG_TP5						0x31
 #define UBX_CFG_TMODE3					0x71
+#define UBX_CFG_VALSET					0x8A
+
+// Layers for CFG-VALSET
+#define UBX_CFG_LAYER_RAM				0x01
+#define UBX_CFG_LAYER_BBR				0x02
+#define UBX_CFG_LAYER_FLASH				0x04
 
 // RTCM3 messages
 #define UBX_RTCM3_1005					0x05
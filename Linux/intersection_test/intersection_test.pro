@@ -4,13 +4,15 @@
 #
 #-------------------------------------------------
 
-QT       += core gui network
+QT       += core gui network sql
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 TARGET = intersection_test
 TEMPLATE = app
 
+CONFIG += c++11
+
 release_win {
     DESTDIR = build/win
     OBJECTS_DIR = build/win/obj
@@ -50,8 +52,10 @@ SOURCES += main.cpp\
     mapwidget.cpp \
     osmclient.cpp \
     osmtile.cpp \
+    osmtilestore.cpp \
     perspectivepixmap.cpp \
-    utility.cpp
+    utility.cpp \
+    trafficsim.cpp
 
 HEADERS  += mainwindow.h \
     carinfo.h \
@@ -60,7 +64,9 @@ HEADERS  += mainwindow.h \
     mapwidget.h \
     osmclient.h \
     osmtile.h \
+    osmtilestore.h \
     perspectivepixmap.h \
-    utility.h
+    utility.h \
+    trafficsim.h
 
 FORMS    += mainwindow.ui
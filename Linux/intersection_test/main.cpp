@@ -1,8 +1,122 @@
 #include "mainwindow.h"
+#include "trafficsim.h"
 #include <QApplication>
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QUdpSocket>
+#include <QThread>
+#include <QDebug>
+
+namespace
+{
+/*
+ * Run the traffic simulation without the GUI, e.g. to load test the NCOM
+ * ingest of the station with many vehicles. The steps are paced to real
+ * time against a monotonic clock, so that the streams have the rate that
+ * real units would send at, unless --fast is given. Then it runs as fast
+ * as possible, which measures the simulation itself.
+ */
+int runHeadless(QCommandLineParser &parser)
+{
+    TrafficSim sim;
+    sim.setSpeed(parser.value("speed").toDouble() / 3.6);
+    sim.setLegLength(parser.value("leg").toDouble());
+    sim.setStep(parser.value("step").toDouble() * 1e-3);
+    sim.reset(parser.value("vehicles").toInt(), parser.value("seed").toUInt());
+
+    const double duration = parser.value("duration").toDouble();
+    const int streams = parser.value("streams").toInt();
+    const quint16 port = parser.value("port").toUShort();
+    const bool fast = parser.isSet("fast");
+
+    // Same reference as the map in the GUI
+    double illh[3] = {57.78100308, 12.76925422, 253.76};
+    QUdpSocket udpSocket;
+
+    // Monotonic, so that changes of the system time do not affect the pace
+    QElapsedTimer timer;
+    timer.start();
+    qint64 lateSteps = 0;
+    double maxLag = 0.0;
+
+    while (sim.time() < duration) {
+        sim.run();
+
+        for (int i = 0;i < qMin(streams, sim.vehicles().size());i++) {
+            if (sim.vehicles().at(i).active) {
+                udpSocket.writeDatagram(TrafficSim::ncomPacket(illh, sim.vehicles().at(i)),
+                                        QHostAddress::Broadcast, port + i);
+            }
+        }
+
+        if (!fast) {
+            // Wait until the wall time has caught up with the simulation. Steps
+            // that are late are not skipped, the next ones run without waiting
+            // until the simulation is back in time.
+            double ahead = sim.time() - (double)timer.nsecsElapsed() * 1e-9;
+
+            if (ahead > 0.0) {
+                QThread::usleep((unsigned long)(ahead * 1e6));
+            } else if (-ahead > sim.step()) {
+                lateSteps++;
+                maxLag = qMax(maxLag, -ahead);
+            }
+        }
+    }
+
+    double wall = (double)timer.nsecsElapsed() * 1e-9;
+
+    qDebug() << "Vehicles:        " << sim.vehicles().size();
+    qDebug() << "Steps:           " << sim.steps();
+    qDebug() << "Simulated time:  " << sim.time() << "s";
+    qDebug() << "Wall time:       " << wall << "s";
+    qDebug() << "Real time factor:" << sim.time() / wall;
+
+    if (!fast) {
+        qDebug() << "Late steps:      " << lateSteps;
+        qDebug() << "Max lag:         " << maxLag << "s";
+    }
+
+    qDebug() << "Conflicts:       " << sim.conflictsTotal();
+    qDebug() << "Min TTC:         " << sim.minTtc() << "s";
+
+    return 0;
+}
+}
 
 int main(int argc, char *argv[])
 {
+    bool headless = false;
+    for (int i = 1;i < argc;i++) {
+        if (QString(argv[i]) == "--headless") {
+            headless = true;
+        }
+    }
+
+    if (headless) {
+        QCoreApplication a(argc, argv);
+
+        QCommandLineParser parser;
+        parser.setApplicationDescription("Intersection traffic simulation");
+        parser.addHelpOption();
+        parser.addOptions({
+                              {"headless", "Run the simulation without GUI in real time."},
+                              {"fast", "Run the headless simulation as fast as possible."},
+                              {"vehicles", "Number of vehicles.", "n", "100"},
+                              {"duration", "Simulated time.", "s", "60"},
+                              {"speed", "Target speed.", "km/h", "20"},
+                              {"leg", "Length of the intersection arms.", "m", "50"},
+                              {"step", "Simulation step.", "ms", "20"},
+                              {"seed", "Seed for the vehicle speeds.", "seed", "1"},
+                              {"streams", "Number of vehicles to send NCOM for.", "n", "0"},
+                              {"port", "UDP port of the first NCOM stream.", "port", "3000"}
+                          });
+        parser.process(a);
+
+        return runHeadless(parser);
+    }
+
     QApplication a(argc, argv);
     MainWindow w;
     w.show();
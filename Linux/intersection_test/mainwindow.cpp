@@ -3,97 +3,14 @@
 #include "utility.h"
 
 #include <cmath>
+#include <QSet>
 
 namespace
 {
-int32_t get_I3(uint8_t *msg, int *ind) {
-    int32_t res =	((uint32_t) msg[*ind + 2]) << 16 |
-                    ((uint32_t) msg[*ind + 1]) << 8 |
-                    ((uint32_t) msg[*ind + 0]);
-    *ind += 3;
-
-    if (res & 0b00000000100000000000000000000000) {
-        res |= 0xFF000000;
-    }
-
-    return res;
-}
-
-float get_R4(uint8_t *msg, int *ind) {
-    uint32_t res =	((uint32_t) msg[*ind + 3]) << 24 |
-                    ((uint32_t) msg[*ind + 2]) << 16 |
-                    ((uint32_t) msg[*ind + 1]) << 8 |
-                    ((uint32_t) msg[*ind + 0]);
-    *ind += 4;
-
-    union asd {
-        float f;
-        uint32_t i;
-    } x;
-
-    x.i = res;
-
-    return x.f;
-}
-
-double get_R8(uint8_t *msg, int *ind) {
-    uint64_t res =	((uint64_t) msg[*ind + 7]) << 56 |
-                    ((uint64_t) msg[*ind + 6]) << 48 |
-                    ((uint64_t) msg[*ind + 5]) << 40 |
-                    ((uint64_t) msg[*ind + 4]) << 32 |
-                    ((uint64_t) msg[*ind + 3]) << 24 |
-                    ((uint64_t) msg[*ind + 2]) << 16 |
-                    ((uint64_t) msg[*ind + 1]) << 8 |
-                    ((uint64_t) msg[*ind + 0]);
-    *ind += 8;
-
-    union asd {
-        double f;
-        uint64_t i;
-    } x;
-
-    x.i = res;
-
-    return x.f;
-}
-
-void put_I3(uint8_t *msg, int *ind, int32_t data) {
-    msg[(*ind)++] = data;
-    msg[(*ind)++] = data >> 8;
-    msg[(*ind)++] = data >> 16;
-}
-
-void put_R4(uint8_t *msg, int *ind, float data) {
-    union asd {
-        float f;
-        uint32_t i;
-    } x;
-
-    x.f = data;
-
-    msg[(*ind)++] = x.i;
-    msg[(*ind)++] = x.i >> 8;
-    msg[(*ind)++] = x.i >> 16;
-    msg[(*ind)++] = x.i >> 24;
-}
-
-void put_R8(uint8_t *msg, int *ind, double data) {
-    union asd {
-        double f;
-        uint64_t i;
-    } x;
-
-    x.f = data;
-
-    msg[(*ind)++] = x.i;
-    msg[(*ind)++] = x.i >> 8;
-    msg[(*ind)++] = x.i >> 16;
-    msg[(*ind)++] = x.i >> 24;
-    msg[(*ind)++] = x.i >> 32;
-    msg[(*ind)++] = x.i >> 40;
-    msg[(*ind)++] = x.i >> 48;
-    msg[(*ind)++] = x.i >> 56;
-}
+// Catch up at most this much simulation time per timer tick, so that a
+// stalled GUI does not cause a burst of steps afterwards.
+const double SIM_MAX_BEHIND = 0.5;
+const quint16 NCOM_PORT = 3000;
 }
 
 MainWindow::MainWindow(QWidget *parent) :
@@ -102,8 +19,13 @@ MainWindow::MainWindow(QWidget *parent) :
 {
     ui->setupUi(this);
 
+    mSimBehind = 0.0;
+    mMapCars = 0;
+
     mTimer = new QTimer(this);
     mTimer->start(20);
+    mRenderTimer = new QTimer(this);
+    mRenderTimer->start(50);
     mUdpSocket = new QUdpSocket(this);
 
     // Center map at city area
@@ -113,6 +35,8 @@ MainWindow::MainWindow(QWidget *parent) :
 
     connect(mTimer, SIGNAL(timeout()),
             this, SLOT(timerSlot()));
+    connect(mRenderTimer, SIGNAL(timeout()),
+            this, SLOT(renderTimerSlot()));
 
     on_resetSim_clicked();
 }
@@ -122,39 +46,74 @@ MainWindow::~MainWindow()
     delete ui;
 }
 
+/*
+ * Run as many fixed simulation steps as the wall time that has passed
+ * since the last tick, independent of the timer period and the rendering.
+ */
 void MainWindow::timerSlot()
 {
+    double elapsed = (double)mSimClock.restart() * 1e-3;
+
     if (ui->runSim->text() == "Stop simulation") {
-        CarInfo *car = ui->map->getCarInfo(0);
+        mSimBehind += elapsed;
 
-        if (car) {
-            LocPoint loc = car->getLocation();
+        if (mSimBehind > SIM_MAX_BEHIND) {
+            mSimBehind = SIM_MAX_BEHIND;
+        }
 
-            double x = loc.getX();
-            double y = loc.getY();
-            double yaw = loc.getYaw();
-            double dist = loc.getSpeed() * (double)mTimer->interval() * 1e-3;
+        while (mSimBehind >= mSim.step()) {
+            mSim.run();
+            mSimBehind -= mSim.step();
+            sendNcom();
+        }
+    }
+}
 
-            x += dist * cos(yaw);
-            y -= dist * sin(yaw);
+void MainWindow::renderTimerSlot()
+{
+    const QVector<TrafficSim::Vehicle> &vehicles = mSim.vehicles();
 
-            loc.setXY(x, y);
-            loc.setSpeed(ui->speedBox->value() / 3.6);
-            car->setLocation(loc);
-            ui->map->update();
+    QSet<int> conflicting;
+    for (const TrafficSim::Conflict &c: mSim.conflicts()) {
+        conflicting.insert(c.a);
+        conflicting.insert(c.b);
+    }
 
-            LocPoint locCenter;
-            locCenter.setXY(43.75, -900.215);
-            if (locCenter.getDistanceTo(loc) > fabs(ui->posBox->value()) * 1.1) {
-                on_resetSim_clicked();
-            }
+    for (const TrafficSim::Vehicle &v: vehicles) {
+        CarInfo *car = ui->map->getCarInfo(v.id);
 
-            double illh[3];
-            ui->map->getEnuRef(illh);
+        if (!v.active) {
+            if (car) {
+                ui->map->removeCar(v.id);
+            }
+            continue;
+        }
 
-            sendNcom(illh, x, y, 0, yaw, loc.getSpeed());
+        if (!car) {
+            ui->map->addCar(CarInfo(v.id));
+            car = ui->map->getCarInfo(v.id);
         }
+
+        LocPoint loc = car->getLocation();
+        loc.setXY(v.x, v.y);
+        loc.setYaw(v.yaw);
+        loc.setSpeed(v.speed);
+        car->setLocation(loc);
+        car->setColor(conflicting.contains(v.id) ? Qt::yellow : Qt::red);
     }
+
+    ui->map->update();
+
+    QString status = QString("t: %1 s  Conflicts: %2  Min TTC: ").
+            arg(mSim.time(), 0, 'f', 1).arg(mSim.conflicts().size());
+
+    if (mSim.minTtc() >= 0.0) {
+        status += QString("%1 s").arg(mSim.minTtc(), 0, 'f', 2);
+    } else {
+        status += "-";
+    }
+
+    ui->simStatusLabel->setText(status);
 }
 
 void MainWindow::on_runSim_clicked()
@@ -164,56 +123,48 @@ void MainWindow::on_runSim_clicked()
     } else {
         ui->runSim->setText("Stop simulation");
     }
+
+    mSimClock.start();
+    mSimBehind = 0.0;
 }
 
 void MainWindow::on_resetSim_clicked()
 {
-    ui->map->removeCar(0);
-
-    // Add simulated car
-    CarInfo car;
-    LocPoint loc;
-    loc.setXY(cos(18.0 * M_PI / 180.0) * ui->posBox->value() + 43.75,
-              -sin(18.0 * M_PI / 180.0) * ui->posBox->value() - 900.215);
-    loc.setYaw(18.0 * (M_PI / 180.0));
-    loc.setSpeed(ui->speedBox->value() / 3.6);
-    car.setLocation(loc);
-    ui->map->addCar(car);
+    for (int i = 0;i < mMapCars;i++) {
+        ui->map->removeCar(i);
+    }
+
+    mSim.setLegLength(fabs(ui->posBox->value()));
+    mSim.setSpeed(ui->speedBox->value() / 3.6);
+    mSim.reset(ui->vehiclesBox->value());
+    mMapCars = ui->vehiclesBox->value();
+
+    mSimClock.start();
+    mSimBehind = 0.0;
+    renderTimerSlot();
 }
 
-void MainWindow::sendNcom(double *illh,
-                          double px,
-                          double py,
-                          double pz,
-                          double heading,
-                          double vel)
+void MainWindow::on_speedBox_valueChanged(double arg1)
 {
-    double llh[3], xyz[3];
-
-    xyz[0] = px;
-    xyz[1] = py;
-    xyz[2] = pz;
-
-    utility::enuToLlh(illh, xyz, llh);
-    double head = heading + (M_PI / 2.0);
-    utility::norm_angle_rad(&head);
-
-    double velN = vel * cos(head);
-    double velE = vel * sin(head);
-    double velD = 0.0;
-
-    unsigned char packet[72];
-    memset(packet, 0, sizeof(packet));
-
-    int ind = 23;
-    put_R8(packet, &ind, llh[0] * (M_PI / 180.0));
-    put_R8(packet, &ind, llh[1] * (M_PI / 180.0));
-    put_R4(packet, &ind, llh[2] * (M_PI / 180.0));
-    ind = 43;
-    put_I3(packet, &ind, (int32_t)(velN * 1e4));
-    put_I3(packet, &ind, (int32_t)(velE * 1e4));
-    put_I3(packet, &ind, (int32_t)(velD * 1e4));
-    put_I3(packet, &ind, (int32_t)(head * 1e6));
-
-    mUdpSocket->writeDatagram((char*)packet, sizeof(packet), QHostAddress::Broadcast, 3000);
+    mSim.setSpeed(arg1 / 3.6);
+}
+
+/*
+ * Send one NCOM stream per vehicle, up to the number of streams, to
+ * consecutive ports.
+ */
+void MainWindow::sendNcom()
+{
+    double illh[3];
+    ui->map->getEnuRef(illh);
+
+    const QVector<TrafficSim::Vehicle> &vehicles = mSim.vehicles();
+    int streams = qMin(ui->streamsBox->value(), vehicles.size());
+
+    for (int i = 0;i < streams;i++) {
+        if (vehicles.at(i).active) {
+            mUdpSocket->writeDatagram(TrafficSim::ncomPacket(illh, vehicles.at(i)),
+                                      QHostAddress::Broadcast, NCOM_PORT + i);
+        }
+    }
 }
@@ -4,6 +4,8 @@
 #include <QMainWindow>
 #include <QTimer>
 #include <QUdpSocket>
+#include <QElapsedTimer>
+#include "trafficsim.h"
 
 namespace Ui {
 class MainWindow;
@@ -19,21 +21,23 @@ public:
 
 private slots:
     void timerSlot();
+    void renderTimerSlot();
 
     void on_runSim_clicked();
     void on_resetSim_clicked();
+    void on_speedBox_valueChanged(double arg1);
 
 private:
     Ui::MainWindow *ui;
     QTimer *mTimer;
+    QTimer *mRenderTimer;
     QUdpSocket *mUdpSocket;
+    TrafficSim mSim;
+    QElapsedTimer mSimClock;
+    double mSimBehind;
+    int mMapCars;
 
-    void sendNcom(double *illh,
-                  double px,
-                  double py,
-                  double pz,
-                  double heading,
-                  double vel);
+    void sendNcom();
 
 };
 
@@ -189,7 +189,8 @@ MapWidget::MapWidget(QWidget *parent) : QWidget(parent)
     mRefHeight = 253.76;
 
     // Hardcoded for now
-    mOsm->setCacheDir("osm_tiles");
+    mOsm->setCacheFile("osm_tiles.mbtiles");
+    mOsm->migrateCacheDir("osm_tiles");
     //    mOsm->setTileServerUrl("http://tile.openstreetmap.org");
     //    mOsm->setTileServerUrl("http://c.osm.rrze.fau.de/osmhd"); // Also https
     //    mOsm->setTileServerUrl("http://tiles.vedder.se/osm_tiles");
@@ -635,6 +636,11 @@ void MapWidget::paintEvent(QPaintEvent *event)
         trans.scale(1, -1);
         painter.setTransform(trans);
 
+        int vis_x_min = xt - t_ofs_x;
+        int vis_y_min = yt - t_ofs_y;
+        int vis_x_max = vis_x_min;
+        int vis_y_max = vis_y_min;
+
         for (int j = 0;j < 40;j++) {
             for (int i = 0;i < 40;i++) {
                 int xt_i = xt + i - t_ofs_x;
@@ -662,9 +668,15 @@ void MapWidget::paintEvent(QPaintEvent *event)
                 if (res == 0 && !mOsm->downloadQueueFull()) {
                     mOsm->downloadTile(mOsmZoomLevel, xt_i, yt_i);
                 }
+
+                vis_x_max = qMax(vis_x_max, xt_i);
+                vis_y_max = qMax(vis_y_max, yt_i);
             }
         }
 
+        mOsm->setVisibleTiles(mOsmZoomLevel, vis_x_min, vis_y_min,
+                              vis_x_max, vis_y_max, mOsmMaxZoomLevel);
+
         // Restore painter
         painter.setTransform(transOld);
         painter.setRenderHint(QPainter::SmoothPixmapTransform, mAntialiasDrawings);
@@ -1232,6 +1244,20 @@ void MapWidget::paintEvent(QPaintEvent *event)
             txt.sprintf("RAM Tiles: %d", mOsm->getRamTilesLoaded());
             painter.drawText(width() - 140.0, start_txt, txt);
             start_txt += txt_row_h;
+
+            int lookups = mOsm->getMemoryHits() + mOsm->getMemoryMisses();
+            txt.sprintf("RAM Hit: %.1f %%", lookups > 0 ?
+                            100.0 * (double)mOsm->getMemoryHits() / (double)lookups : 0.0);
+            painter.drawText(width() - 140.0, start_txt, txt);
+            start_txt += txt_row_h;
+
+            txt.sprintf("RAM Cache: %.1f MB", (double)mOsm->getMemoryBytesNow() / 1048576.0);
+            painter.drawText(width() - 140.0, start_txt, txt);
+            start_txt += txt_row_h;
+
+            txt.sprintf("Prefetched: %d", mOsm->getTilesPrefetched());
+            painter.drawText(width() - 140.0, start_txt, txt);
+            start_txt += txt_row_h;
         }
     }
 
@@ -21,11 +21,31 @@
 
 OsmClient::OsmClient(QObject *parent) : QObject(parent)
 {
-    mMaxMemoryTiles = 600;
     mMaxDownloadingTiles = 6;
     mHddTilesLoaded = 0;
     mTilesDownloaded = 0;
     mRamTilesLoaded = 0;
+    mMemoryHits = 0;
+    mMemoryMisses = 0;
+    mTilesPrefetched = 0;
+    mSeedTotal = 0;
+    mSeedDone = 0;
+    mPrefetchEnabled = true;
+    mVisibleZoom = -1;
+
+    // The cost of each tile in the memory cache is its size in bytes.
+    mMemoryTiles.setMaxCost(300 * 1024 * 1024);
+
+    // Prefetching only runs after the view has been still for a while.
+    mPrefetchTimer = new QTimer(this);
+    mPrefetchTimer->setSingleShot(true);
+    mPrefetchTimer->setInterval(300);
+
+    // Downloaded tiles are committed to the cache file in batches, and
+    // partial batches after a second without downloads.
+    mStoreFlushTimer = new QTimer(this);
+    mStoreFlushTimer->setSingleShot(true);
+    mStoreFlushTimer->setInterval(1000);
 
     // Generate status pixmaps
     for (int i = 0;i < 4;i++) {
@@ -109,23 +129,70 @@ OsmClient::OsmClient(QObject *parent) : QObject(parent)
 
     connect(&mWebCtrl, SIGNAL(finished(QNetworkReply*)),
             this, SLOT(fileDownloaded(QNetworkReply*)));
+    connect(mPrefetchTimer, SIGNAL(timeout()),
+            this, SLOT(prefetchTimerSlot()));
+    connect(mStoreFlushTimer, SIGNAL(timeout()),
+            this, SLOT(storeFlushTimerSlot()));
 }
 
-bool OsmClient::setCacheDir(QString path)
+/**
+ * @brief OsmClient::setCacheFile
+ * Set the file used as disk cache. All tiles are stored in this file, so
+ * it can be copied as a whole to other computers for offline use.
+ *
+ * @param path
+ * Path to the cache file. It will be created if it does not exist.
+ *
+ * @return
+ * true on success, false otherwise.
+ */
+bool OsmClient::setCacheFile(QString path)
 {
-    QDir().mkpath(path);
-    QFileInfo file;
-    file.setFile(path);
+    QDir().mkpath(QFileInfo(path).absolutePath());
 
-    if (file.isDir()) {
-        mCacheDir = path;
+    if (mStore.open(path)) {
         return true;
     } else {
-        qWarning() << "Invalid cache directory provided.";
+        qWarning() << "Could not open tile cache file:" << mStore.lastError();
         return false;
     }
 }
 
+/**
+ * @brief OsmClient::migrateCacheDir
+ * Import the tiles of a z/x/y.png directory cache, as used before the
+ * cache file, into the cache file. The directory is renamed with the
+ * suffix _migrated afterwards, so that it is only imported once and can
+ * be removed by the user.
+ *
+ * @param path
+ * The cache directory. Nothing is done if it does not exist.
+ *
+ * @return
+ * The number of imported tiles, or -1 on failure.
+ */
+int OsmClient::migrateCacheDir(QString path)
+{
+    if (!QDir(path).exists()) {
+        return 0;
+    }
+
+    int tiles = mStore.importDirectory(path);
+
+    if (tiles < 0) {
+        qWarning() << "Could not migrate tile cache directory:" << mStore.lastError();
+        return -1;
+    }
+
+    QString newPath = path + "_migrated";
+    if (!QDir().rename(path, newPath)) {
+        qWarning() << "Could not rename migrated tile cache directory" << path;
+    }
+
+    qDebug() << "Migrated" << tiles << "tiles from" << path << "to the cache file";
+    return tiles;
+}
+
 bool OsmClient::setTileServerUrl(QString path)
 {
     QUrl url(path);
@@ -171,30 +238,35 @@ OsmTile OsmClient::getTile(int zoom, int x, int y, int &res)
     res = 0;
 
     quint64 key = calcKey(zoom, x, y);
-    OsmTile t = mMemoryTiles.value(key);
+    OsmTile t;
 
-    if (x < 0 || y < 0 ||
-            x >= (1 << zoom) ||
-            y >= (1 << zoom)) {
+    if (!tileInMap(zoom, x, y)) {
         res = -1;
-        t = OsmTile(mStatusPixmaps.at(3), zoom, x, y);
-    } else if (!t.pixmap().isNull()) {
+        return OsmTile(mStatusPixmaps.at(3), zoom, x, y);
+    }
+
+    // Looking up the tile also marks it as most recently used.
+    OsmTile *tm = mMemoryTiles.object(key);
+
+    if (tm) {
+        t = *tm;
         res = 1;
         mRamTilesLoaded++;
-    } else if (!mCacheDir.isEmpty()) {
-        QString path = mCacheDir + "/" + QString::number(zoom) + "/" +
-                QString::number(x) + "/" + QString::number(y) + ".png";
-        QFile file;
-        file.setFileName(path);
-
-        if (file.exists()) {
-            res = 2;
-            t = OsmTile(QPixmap(path), zoom, x, y);
-            storeTileMemory(key, t);
-            mHddTilesLoaded++;
-        } else {
-            t = OsmTile(getStatusPixmap(key), zoom, x, y);
-        }
+        mMemoryHits++;
+        return t;
+    }
+
+    mMemoryMisses++;
+
+    QByteArray data = mStore.readTile(zoom, x, y);
+
+    if (!data.isEmpty()) {
+        QPixmap pm;
+        pm.loadFromData(data, "PNG");
+        res = 2;
+        t = OsmTile(pm, zoom, x, y);
+        storeTileMemory(key, t);
+        mHddTilesLoaded++;
     } else {
         t = OsmTile(getStatusPixmap(key), zoom, x, y);
     }
@@ -229,6 +301,13 @@ int OsmClient::downloadTile(int zoom, int x, int y)
     if (!mTileServer.isEmpty()) {
         if (mDownloadingTiles.size() < mMaxDownloadingTiles) {
             quint64 key = calcKey(zoom, x, y);
+
+            // The tile is needed now, so don't treat it as a prefetch any more.
+            mPrefetchingTiles.remove(key);
+            if (mSeedingTiles.remove(key) > 0) {
+                mSeedDone++;
+            }
+
             if (!mDownloadingTiles.contains(key)) {
                 // Only add if this tile is not already downloading
                 QString path = mTileServer + "/" + QString::number(zoom) +
@@ -258,10 +337,209 @@ bool OsmClient::downloadQueueFull()
 
 void OsmClient::clearCache()
 {
-    QDir dir(mCacheDir);
-    dir.removeRecursively();
+    cancelSeed();
+    mStore.clear();
     mMemoryTiles.clear();
-    mMemoryTilesOrder.clear();
+    mPrefetchQueue.clear();
+}
+
+/**
+ * @brief OsmClient::setVisibleTiles
+ * Tell the client which tiles are currently visible. Tiles around the view
+ * in the direction it is panned, as well as the tiles one zoom level up
+ * and down, will be prefetched in the background when the view has been
+ * still for a while. Prefetching only uses free download slots, so the
+ * maximum number of concurrent downloads is still respected.
+ *
+ * @param zoom
+ * zoom level
+ *
+ * @param xMin
+ * Lowest visible x index
+ *
+ * @param yMin
+ * Lowest visible y index
+ *
+ * @param xMax
+ * Highest visible x index
+ *
+ * @param yMax
+ * Highest visible y index
+ *
+ * @param maxZoom
+ * The highest zoom level that should be prefetched.
+ */
+void OsmClient::setVisibleTiles(int zoom, int xMin, int yMin, int xMax, int yMax, int maxZoom)
+{
+    QRect visible(QPoint(xMin, yMin), QPoint(xMax, yMax));
+
+    if (!mPrefetchEnabled || (zoom == mVisibleZoom && visible == mVisibleTiles)) {
+        return;
+    }
+
+    int dx = 0;
+    int dy = 0;
+
+    if (zoom == mVisibleZoom) {
+        QPoint d = visible.center() - mVisibleTiles.center();
+        dx = (d.x() > 0) - (d.x() < 0);
+        dy = (d.y() > 0) - (d.y() < 0);
+    }
+
+    mVisibleZoom = zoom;
+    mVisibleTiles = visible;
+    mPrefetchQueue.clear();
+
+    // Neighbours in the pan direction first, or all around when not panning.
+    if (dx == 0 && dy == 0) {
+        addPrefetchRect(zoom, xMin - 1, yMin - 1, xMax + 1, yMax + 1);
+    } else {
+        if (dx != 0) {
+            int x = dx > 0 ? xMax + 1 : xMin - 1;
+            addPrefetchRect(zoom, qMin(x, x + dx), yMin - 1, qMax(x, x + dx), yMax + 1);
+        }
+
+        if (dy != 0) {
+            int y = dy > 0 ? yMax + 1 : yMin - 1;
+            addPrefetchRect(zoom, xMin - 1, qMin(y, y + dy), xMax + 1, qMax(y, y + dy));
+        }
+    }
+
+    // One zoom level out
+    if (zoom > 0) {
+        addPrefetchRect(zoom - 1, xMin / 2, yMin / 2, xMax / 2, yMax / 2);
+    }
+
+    // One zoom level in
+    if (zoom < maxZoom) {
+        addPrefetchRect(zoom + 1, xMin * 2, yMin * 2, xMax * 2 + 1, yMax * 2 + 1);
+    }
+
+    mPrefetchTimer->start();
+}
+
+/**
+ * @brief OsmClient::seedArea
+ * Download all tiles in an area to the disk cache, so that it can be used
+ * offline. Tiles that already are in the cache are skipped. The downloads
+ * run in the background and use the free download slots, and progress is
+ * reported with the seedProgress signal.
+ *
+ * @param latMin
+ * Southern border of the area.
+ *
+ * @param lonMin
+ * Western border of the area.
+ *
+ * @param latMax
+ * Northern border of the area.
+ *
+ * @param lonMax
+ * Eastern border of the area.
+ *
+ * @param zoomMin
+ * Lowest zoom level to download.
+ *
+ * @param zoomMax
+ * Highest zoom level to download.
+ *
+ * @param confirmed
+ * The user has confirmed seeding more than SEED_CONFIRM_TILES tiles.
+ *
+ * @return
+ * The number of tiles to go through, or
+ * -1: The tile server or cache file is not set.
+ * -2: More than SEED_CONFIRM_TILES tiles and not confirmed.
+ * -3: More than SEED_MAX_TILES tiles.
+ * Nothing is queued in the error cases.
+ */
+int OsmClient::seedArea(double latMin, double lonMin, double latMax, double lonMax,
+                        int zoomMin, int zoomMax, bool confirmed)
+{
+    if (mTileServer.isEmpty() || !mStore.isOpen()) {
+        emit errorGetTile("Seeding requires a tile server and a cache file.");
+        return -1;
+    }
+
+    qint64 count = countAreaTiles(latMin, lonMin, latMax, lonMax, zoomMin, zoomMax);
+
+    if (count > SEED_MAX_TILES) {
+        emit errorGetTile(QString("Seeding %1 tiles is not allowed, the maximum is %2.").
+                          arg(count).arg(SEED_MAX_TILES));
+        return -3;
+    }
+
+    if (count > SEED_CONFIRM_TILES && !confirmed) {
+        return -2;
+    }
+
+    if (!isSeeding()) {
+        mSeedTotal = 0;
+        mSeedDone = 0;
+    }
+
+    for (int zoom = zoomMin;zoom <= zoomMax;zoom++) {
+        // Tile y indexes grow southwards
+        int xMin = OsmTile::long2tilex(lonMin, zoom);
+        int xMax = OsmTile::long2tilex(lonMax, zoom);
+        int yMin = OsmTile::lat2tiley(latMax, zoom);
+        int yMax = OsmTile::lat2tiley(latMin, zoom);
+
+        for (int x = xMin;x <= xMax;x++) {
+            for (int y = yMin;y <= yMax;y++) {
+                if (tileInMap(zoom, x, y)) {
+                    mSeedQueue.append(calcKey(zoom, x, y));
+                    mSeedTotal++;
+                }
+            }
+        }
+    }
+
+    emit seedProgress(mSeedDone, mSeedTotal);
+    mPrefetchTimer->start();
+
+    return mSeedTotal - mSeedDone;
+}
+
+/**
+ * @brief OsmClient::countAreaTiles
+ * Count the tiles that seedArea would go through for an area, without
+ * listing them.
+ *
+ * @return
+ * The number of tiles in the area over all zoom levels.
+ */
+qint64 OsmClient::countAreaTiles(double latMin, double lonMin, double latMax, double lonMax,
+                                 int zoomMin, int zoomMax)
+{
+    qint64 count = 0;
+
+    for (int zoom = zoomMin;zoom <= zoomMax;zoom++) {
+        int last = (1 << zoom) - 1;
+        qint64 xMin = qBound(0, OsmTile::long2tilex(lonMin, zoom), last);
+        qint64 xMax = qBound(0, OsmTile::long2tilex(lonMax, zoom), last);
+        qint64 yMin = qBound(0, OsmTile::lat2tiley(latMax, zoom), last);
+        qint64 yMax = qBound(0, OsmTile::lat2tiley(latMin, zoom), last);
+
+        if (xMax >= xMin && yMax >= yMin) {
+            count += (xMax - xMin + 1) * (yMax - yMin + 1);
+        }
+    }
+
+    return count;
+}
+
+void OsmClient::cancelSeed()
+{
+    mSeedQueue.clear();
+    mSeedingTiles.clear();
+    mSeedTotal = 0;
+    mSeedDone = 0;
+}
+
+bool OsmClient::isSeeding() const
+{
+    return mSeedDone < mSeedTotal;
 }
 
 void OsmClient::fileDownloaded(QNetworkReply *pReply)
@@ -279,6 +557,18 @@ void OsmClient::fileDownloaded(QNetworkReply *pReply)
     quint64 key = calcKey(zoom, x, y);
 
     mDownloadingTiles.remove(key);
+    bool prefetched = mPrefetchingTiles.remove(key) > 0;
+    bool seeded = mSeedingTiles.remove(key) > 0;
+
+    if (seeded) {
+        mSeedDone++;
+        emit seedProgress(mSeedDone, mSeedTotal);
+    }
+
+    if ((!mPrefetchQueue.isEmpty() || !mSeedQueue.isEmpty()) &&
+            !mPrefetchTimer->isActive()) {
+        mPrefetchTimer->start();
+    }
 
     if (pReply->error() == QNetworkReply::NoError) {
         QPixmap pm;
@@ -286,29 +576,91 @@ void OsmClient::fileDownloaded(QNetworkReply *pReply)
         pm.loadFromData(data, "PNG");
 
         // Try to cache tile
-        if (!mCacheDir.isEmpty()) {
-            QString path = mCacheDir + "/" + QString::number(zoom) + "/" +
-                    QString::number(x) + "/" + QString::number(y) + ".png";
-            QFile file;
-            file.setFileName(path);
-            if (!file.exists()) {
-                QDir().mkpath(mCacheDir + "/" + QString::number(zoom) + "/" + QString::number(x));
-                if (file.open(QIODevice::ReadWrite)) {
-                    file.write(data);
-                    file.close();
-                } else {
-                    emit errorGetTile("Cache error: " + file.errorString());
-                }
+        if (mStore.isOpen()) {
+            if (!mStore.storeTile(zoom, x, y, data)) {
+                emit errorGetTile("Cache error: " + mStore.lastError());
             }
+
+            mStoreFlushTimer->start();
         }
 
         mTilesDownloaded++;
         mDownloadErrorTiles.remove(key);
-        emitTile(OsmTile(pm, zoom, x, y));
+
+        // Prefetched and seeded tiles are not visible, so there is no need to redraw.
+        if (seeded) {
+            // Only stored on disk, to not push visible tiles out of memory.
+        } else if (prefetched) {
+            storeTileMemory(key, OsmTile(pm, zoom, x, y));
+            mTilesPrefetched++;
+        } else {
+            emitTile(OsmTile(pm, zoom, x, y));
+        }
     } else {
         mDownloadErrorTiles.insert(key, true);
         emit errorGetTile("Download error: " + pReply->errorString());
     }
+
+    pReply->deleteLater();
+}
+
+void OsmClient::storeFlushTimerSlot()
+{
+    if (!mStore.flush()) {
+        emit errorGetTile("Cache error: " + mStore.lastError());
+    }
+}
+
+void OsmClient::prefetchTimerSlot()
+{
+    // Limit the amount of disk reads per iteration to keep the UI responsive.
+    int diskReads = 0;
+
+    while (!mPrefetchQueue.isEmpty() && diskReads < 4) {
+        quint64 key = mPrefetchQueue.first();
+        int zoom, x, y;
+        keyToZxy(key, zoom, x, y);
+
+        if (mMemoryTiles.contains(key) || mDownloadingTiles.contains(key) ||
+                mDownloadErrorTiles.contains(key)) {
+            mPrefetchQueue.removeFirst();
+            continue;
+        }
+
+        QByteArray data = mStore.readTile(zoom, x, y);
+        if (!data.isEmpty()) {
+            mPrefetchQueue.removeFirst();
+            QPixmap pm;
+            pm.loadFromData(data, "PNG");
+            storeTileMemory(key, OsmTile(pm, zoom, x, y));
+            mTilesPrefetched++;
+            diskReads++;
+            continue;
+        }
+
+        if (mTileServer.isEmpty()) {
+            mPrefetchQueue.removeFirst();
+            continue;
+        }
+
+        if (downloadQueueFull()) {
+            // Continue when a download slot is free.
+            return;
+        }
+
+        mPrefetchQueue.removeFirst();
+        downloadTile(zoom, x, y);
+        mPrefetchingTiles.insert(key, true);
+    }
+
+    // Seeding has lower priority than prefetching for the current view.
+    if (mPrefetchQueue.isEmpty()) {
+        processSeedQueue();
+    }
+
+    if (!mPrefetchQueue.isEmpty() || !mSeedQueue.isEmpty()) {
+        mPrefetchTimer->start();
+    }
 }
 
 int OsmClient::getRamTilesLoaded() const
@@ -326,6 +678,26 @@ int OsmClient::getMemoryTilesNow() const
     return mMemoryTiles.size();
 }
 
+int OsmClient::getMemoryBytesNow() const
+{
+    return mMemoryTiles.totalCost();
+}
+
+int OsmClient::getMemoryHits() const
+{
+    return mMemoryHits;
+}
+
+int OsmClient::getMemoryMisses() const
+{
+    return mMemoryMisses;
+}
+
+int OsmClient::getTilesPrefetched() const
+{
+    return mTilesPrefetched;
+}
+
 int OsmClient::getHddTilesLoaded() const
 {
     return mHddTilesLoaded;
@@ -341,14 +713,30 @@ void OsmClient::setMaxDownloadingTiles(int maxDownloadingTiles)
     mMaxDownloadingTiles = maxDownloadingTiles;
 }
 
-int OsmClient::getMaxMemoryTiles() const
+int OsmClient::getMaxMemoryBytes() const
+{
+    return mMemoryTiles.maxCost();
+}
+
+void OsmClient::setMaxMemoryBytes(int maxMemoryBytes)
+{
+    mMemoryTiles.setMaxCost(maxMemoryBytes);
+}
+
+bool OsmClient::getPrefetchEnabled() const
 {
-    return mMaxMemoryTiles;
+    return mPrefetchEnabled;
 }
 
-void OsmClient::setMaxMemoryTiles(int maxMemoryTiles)
+void OsmClient::setPrefetchEnabled(bool prefetchEnabled)
 {
-    mMaxMemoryTiles = maxMemoryTiles;
+    mPrefetchEnabled = prefetchEnabled;
+
+    if (!mPrefetchEnabled) {
+        mPrefetchQueue.clear();
+        mPrefetchTimer->stop();
+        mVisibleZoom = -1;
+    }
 }
 
 void OsmClient::emitTile(OsmTile tile)
@@ -366,15 +754,59 @@ quint64 OsmClient::calcKey(int zoom, int x, int y)
     return (quint64)0 | ((quint64)zoom << 50) | ((quint64)x << 25) | (quint64)y;
 }
 
+void OsmClient::keyToZxy(quint64 key, int &zoom, int &x, int &y)
+{
+    zoom = (int)(key >> 50);
+    x = (int)((key >> 25) & 0x1FFFFFF);
+    y = (int)(key & 0x1FFFFFF);
+}
+
+bool OsmClient::tileInMap(int zoom, int x, int y)
+{
+    return x >= 0 && y >= 0 && x < (1 << zoom) && y < (1 << zoom);
+}
+
 void OsmClient::storeTileMemory(quint64 key, const OsmTile &tile)
 {
-    mMemoryTiles.insert(key, tile);
-    mMemoryTilesOrder.append(key);
+    QPixmap pm = tile.pixmap();
+    int cost = pm.width() * pm.height() * pm.depth() / 8;
+
+    // The least recently used tiles are removed if the memory budget
+    // is exceeded.
+    mMemoryTiles.insert(key, new OsmTile(tile), qMax(cost, 1));
+}
+
+void OsmClient::processSeedQueue()
+{
+    // Limit the amount of cache lookups per iteration to keep the UI responsive.
+    int lookups = 0;
+
+    while (!mSeedQueue.isEmpty() && !downloadQueueFull() && lookups < 200) {
+        quint64 key = mSeedQueue.takeFirst();
+        int zoom, x, y;
+        keyToZxy(key, zoom, x, y);
+        lookups++;
+
+        if (mStore.hasTile(zoom, x, y) || mDownloadingTiles.contains(key)) {
+            mSeedDone++;
+            continue;
+        }
+
+        downloadTile(zoom, x, y);
+        mSeedingTiles.insert(key, true);
+    }
 
-    // Remove old tiles from memory if too much memory is used.
-    while (mMemoryTilesOrder.size() > mMaxMemoryTiles) {
-        quint64 k = mMemoryTilesOrder.takeFirst();
-        mMemoryTiles.remove(k);
+    emit seedProgress(mSeedDone, mSeedTotal);
+}
+
+void OsmClient::addPrefetchRect(int zoom, int xMin, int yMin, int xMax, int yMax)
+{
+    for (int x = xMin;x <= xMax;x++) {
+        for (int y = yMin;y <= yMax;y++) {
+            if (tileInMap(zoom, x, y)) {
+                mPrefetchQueue.append(calcKey(zoom, x, y));
+            }
+        }
     }
 }
 
@@ -31,8 +31,12 @@
 #include <QNetworkReply>
 #include <QHash>
 #include <QList>
+#include <QCache>
+#include <QTimer>
+#include <QRect>
 
 #include "osmtile.h"
+#include "osmtilestore.h"
 
 /**
  * @brief The OsmClient class
@@ -76,16 +80,32 @@ class OsmClient : public QObject
 {
     Q_OBJECT
 public:
+    // Seeding more tiles than this has to be confirmed, as it puts a lot of
+    // load on the tile server. More than SEED_MAX_TILES are never seeded.
+    static const int SEED_CONFIRM_TILES = 5000;
+    static const int SEED_MAX_TILES = 1000000;
+
     explicit OsmClient(QObject *parent = 0);
-    bool setCacheDir(QString path);
+    bool setCacheFile(QString path);
+    int migrateCacheDir(QString path);
     bool setTileServerUrl(QString path);
     OsmTile getTile(int zoom, int x, int y, int &res);
     int downloadTile(int zoom, int x, int y);
     bool downloadQueueFull();
     void clearCache();
+    void setVisibleTiles(int zoom, int xMin, int yMin, int xMax, int yMax, int maxZoom);
+    static qint64 countAreaTiles(double latMin, double lonMin, double latMax, double lonMax,
+                                 int zoomMin, int zoomMax);
+    int seedArea(double latMin, double lonMin, double latMax, double lonMax,
+                 int zoomMin, int zoomMax, bool confirmed = false);
+    void cancelSeed();
+    bool isSeeding() const;
+
+    int getMaxMemoryBytes() const;
+    void setMaxMemoryBytes(int maxMemoryBytes);
 
-    int getMaxMemoryTiles() const;
-    void setMaxMemoryTiles(int maxMemoryTiles);
+    bool getPrefetchEnabled() const;
+    void setPrefetchEnabled(bool prefetchEnabled);
 
     int getMaxDownloadingTiles() const;
     void setMaxDownloadingTiles(int maxDownloadingTiles);
@@ -94,35 +114,59 @@ public:
     int getTilesDownloaded() const;
     int getMemoryTilesNow() const;
     int getRamTilesLoaded() const;
+    int getMemoryBytesNow() const;
+    int getMemoryHits() const;
+    int getMemoryMisses() const;
+    int getTilesPrefetched() const;
 
 signals:
     void tileReady(OsmTile tile);
     void errorGetTile(QString reason);
+    void seedProgress(int done, int total);
 
 public slots:
 
 private slots:
     void fileDownloaded(QNetworkReply *pReply);
+    void prefetchTimerSlot();
+    void storeFlushTimerSlot();
 
 private:
-    QString mCacheDir;
+    OsmTileStore mStore;
     QString mTileServer;
     QNetworkAccessManager mWebCtrl;
-    QHash<quint64, OsmTile> mMemoryTiles;
-    QList<quint64> mMemoryTilesOrder;
+    QCache<quint64, OsmTile> mMemoryTiles;
     QHash<quint64, bool> mDownloadingTiles;
     QHash<quint64, bool> mDownloadErrorTiles;
+    QHash<quint64, bool> mPrefetchingTiles;
+    QList<quint64> mPrefetchQueue;
+    QHash<quint64, bool> mSeedingTiles;
+    QList<quint64> mSeedQueue;
     QList<QPixmap> mStatusPixmaps;
+    QTimer *mPrefetchTimer;
+    QTimer *mStoreFlushTimer;
 
-    int mMaxMemoryTiles;
     int mMaxDownloadingTiles;
     int mHddTilesLoaded;
     int mTilesDownloaded;
     int mRamTilesLoaded;
+    int mMemoryHits;
+    int mMemoryMisses;
+    int mTilesPrefetched;
+    int mSeedTotal;
+    int mSeedDone;
+
+    bool mPrefetchEnabled;
+    int mVisibleZoom;
+    QRect mVisibleTiles;
 
     void emitTile(OsmTile tile);
     quint64 calcKey(int zoom, int x, int y);
+    void keyToZxy(quint64 key, int &zoom, int &x, int &y);
+    bool tileInMap(int zoom, int x, int y);
     void storeTileMemory(quint64 key, const OsmTile &tile);
+    void addPrefetchRect(int zoom, int xMin, int yMin, int xMax, int yMax);
+    void processSeedQueue();
     const QPixmap& getStatusPixmap(quint64 key);
 
 };
@@ -0,0 +1,78 @@
+/*
+    Copyright 2018 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef OSMTILESTORE_H
+#define OSMTILESTORE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+
+/**
+ * @brief The OsmTileStore class
+ *
+ * Single-file tile cache using the MBTiles layout in an SQLite database.
+ * Every tile lookup is one indexed read, and the whole cache can be copied
+ * as one file.
+ *
+ * See:
+ * https://github.com/mapbox/mbtiles-spec/blob/master/1.3/spec.md
+ *
+ * Note that MBTiles uses the TMS tile row numbering, so the y index is
+ * flipped compared to the slippy map tile names used by OsmClient.
+ *
+ * Stored tiles are written in transactions of BATCH_LEN tiles, as every
+ * commit is a sync to disk. Call flush() to commit a partial batch.
+ */
+class OsmTileStore
+{
+public:
+    OsmTileStore();
+    ~OsmTileStore();
+
+    bool open(QString path);
+    void close();
+    bool isOpen() const;
+    QString lastError() const;
+
+    bool hasTile(int zoom, int x, int y);
+    QByteArray readTile(int zoom, int x, int y);
+    bool storeTile(int zoom, int x, int y, const QByteArray &data);
+    bool flush();
+    int importDirectory(QString path);
+    bool clear();
+    int tileCount();
+
+private:
+    // Number of stored tiles per transaction
+    static const int BATCH_LEN = 64;
+
+    QString mConnectionName;
+    QString mLastError;
+    QSqlDatabase mDb;
+    QSqlQuery *mReadQuery;
+    QSqlQuery *mHasQuery;
+    QSqlQuery *mStoreQuery;
+    bool mInTransaction;
+    int mPendingWrites;
+
+    bool exec(const QString &query);
+
+};
+
+#endif // OSMTILESTORE_H
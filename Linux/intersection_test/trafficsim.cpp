@@ -0,0 +1,454 @@
+/*
+    Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "trafficsim.h"
+#include "utility.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+namespace
+{
+// Road layout
+const double ARM_YAW_0 = 18.0 * M_PI / 180.0;
+const int ARMS = 4;
+const double LANE_OFFSET = 1.75; // Drive on the right side of the center line
+
+// Intelligent driver model
+const double IDM_ACC = 1.5;
+const double IDM_DEC = 2.0;
+const double IDM_MIN_GAP = 2.0;
+const double IDM_HEADWAY = 1.2;
+const double VEHICLE_LEN = 4.5;
+
+// Conflict detection
+const double CONFLICT_ZONE = 40.0;
+const double CONFLICT_DIST = 3.0;
+const double CONFLICT_HORIZON = 5.0;
+
+void put_I3(uint8_t *msg, int *ind, int32_t data) {
+    msg[(*ind)++] = data;
+    msg[(*ind)++] = data >> 8;
+    msg[(*ind)++] = data >> 16;
+}
+
+void put_R4(uint8_t *msg, int *ind, float data) {
+    union asd {
+        float f;
+        uint32_t i;
+    } x;
+
+    x.f = data;
+
+    msg[(*ind)++] = x.i;
+    msg[(*ind)++] = x.i >> 8;
+    msg[(*ind)++] = x.i >> 16;
+    msg[(*ind)++] = x.i >> 24;
+}
+
+void put_R8(uint8_t *msg, int *ind, double data) {
+    union asd {
+        double f;
+        uint64_t i;
+    } x;
+
+    x.f = data;
+
+    msg[(*ind)++] = x.i;
+    msg[(*ind)++] = x.i >> 8;
+    msg[(*ind)++] = x.i >> 16;
+    msg[(*ind)++] = x.i >> 24;
+    msg[(*ind)++] = x.i >> 32;
+    msg[(*ind)++] = x.i >> 40;
+    msg[(*ind)++] = x.i >> 48;
+    msg[(*ind)++] = x.i >> 56;
+}
+
+// The NCOM checksums are the sum of all bytes after the sync byte
+uint8_t checksum(const uint8_t *msg, int end) {
+    uint8_t sum = 0;
+    for (int i = 1;i < end;i++) {
+        sum += msg[i];
+    }
+    return sum;
+}
+}
+
+TrafficSim::TrafficSim()
+{
+    mCenterX = 43.75;
+    mCenterY = -900.215;
+    mLegLength = 50.0;
+    mSpeed = 20.0 / 3.6;
+    mStep = 0.02;
+    mTime = 0.0;
+    mSteps = 0;
+    mConflictsTotal = 0;
+    mMinTtc = -1.0;
+    mLanes.resize(2 * ARMS);
+
+    // Every arm can be left straight ahead or by turning left or right. Route 0
+    // goes straight through from arm 0.
+    for (int arm = 0;arm < ARMS;arm++) {
+        const int turns[] = {2, 1, 3};
+        for (int t: turns) {
+            Route r;
+            r.arm_in = arm;
+            r.arm_out = (arm + t) % ARMS;
+            r.yaw_in = armYaw(r.arm_in);
+            r.yaw_out = armYaw(r.arm_out) + M_PI;
+            utility::norm_angle_rad(&r.yaw_out);
+            mRoutes.append(r);
+        }
+    }
+}
+
+void TrafficSim::setCenter(double x, double y)
+{
+    mCenterX = x;
+    mCenterY = y;
+}
+
+void TrafficSim::setLegLength(double len)
+{
+    mLegLength = len;
+}
+
+void TrafficSim::setSpeed(double speed)
+{
+    // The driver model divides by the target speed
+    speed = std::max(speed, 0.1);
+
+    for (Vehicle &v: mVehicles) {
+        v.speedTarget *= speed / mSpeed;
+    }
+
+    mSpeed = speed;
+}
+
+void TrafficSim::setStep(double step)
+{
+    mStep = step;
+}
+
+double TrafficSim::step() const
+{
+    return mStep;
+}
+
+/**
+ * @brief TrafficSim::reset
+ * Restart the simulation. The vehicles are spread over the routes and queued
+ * up before the start of the arms, so that they enter one after another.
+ *
+ * @param vehicles
+ * The number of vehicles.
+ *
+ * @param seed
+ * Seed for the speed variation. The same seed gives the same simulation.
+ */
+void TrafficSim::reset(int vehicles, unsigned int seed)
+{
+    mRng.seed(seed);
+    std::uniform_real_distribution<double> speedDist(0.8, 1.2);
+
+    mTime = 0.0;
+    mSteps = 0;
+    mConflictsTotal = 0;
+    mMinTtc = -1.0;
+    mConflicts.clear();
+    mVehicles.resize(vehicles);
+
+    const int routesPerArm = mRoutes.size() / ARMS;
+    const double spacing = mSpeed * 2.0 * IDM_HEADWAY + VEHICLE_LEN + IDM_MIN_GAP;
+
+    for (int i = 0;i < vehicles;i++) {
+        Vehicle &v = mVehicles[i];
+        int queue = i / ARMS;
+        v.id = i;
+        v.route = (i % ARMS) * routesPerArm + queue % routesPerArm;
+        v.s = -(double)queue * spacing;
+        v.speedTarget = i == 0 ? mSpeed : mSpeed * speedDist(mRng);
+        v.speed = v.speedTarget;
+        updatePosition(v);
+    }
+}
+
+/**
+ * @brief TrafficSim::run
+ * Advance the simulation.
+ *
+ * @param steps
+ * The number of fixed steps to run.
+ */
+void TrafficSim::run(int steps)
+{
+    for (int i = 0;i < steps;i++) {
+        updateSpeeds();
+
+        const double routeLen = 2.0 * mLegLength;
+        for (Vehicle &v: mVehicles) {
+            v.s += v.speed * mStep;
+
+            // Start over from the beginning of the same route
+            if (v.s > routeLen) {
+                v.s -= routeLen;
+            }
+
+            updatePosition(v);
+        }
+
+        detectConflicts();
+
+        mTime += mStep;
+        mSteps++;
+    }
+}
+
+double TrafficSim::time() const
+{
+    return mTime;
+}
+
+qint64 TrafficSim::steps() const
+{
+    return mSteps;
+}
+
+const QVector<TrafficSim::Vehicle> &TrafficSim::vehicles() const
+{
+    return mVehicles;
+}
+
+/**
+ * @brief TrafficSim::conflicts
+ * @return
+ * The conflicts predicted in the last step.
+ */
+const QVector<TrafficSim::Conflict> &TrafficSim::conflicts() const
+{
+    return mConflicts;
+}
+
+qint64 TrafficSim::conflictsTotal() const
+{
+    return mConflictsTotal;
+}
+
+/**
+ * @brief TrafficSim::minTtc
+ * @return
+ * The lowest time to collision since the reset, or -1 if there has not
+ * been any conflict.
+ */
+double TrafficSim::minTtc() const
+{
+    return mMinTtc;
+}
+
+/**
+ * @brief TrafficSim::ncomPacket
+ * Create an NCOM packet with the position, velocity and heading of a
+ * vehicle.
+ *
+ * @param illh
+ * The ENU reference.
+ *
+ * @param v
+ * The vehicle.
+ *
+ * @return
+ * The packet.
+ */
+QByteArray TrafficSim::ncomPacket(const double *illh, const Vehicle &v)
+{
+    double llh[3], xyz[3];
+
+    xyz[0] = v.x;
+    xyz[1] = v.y;
+    xyz[2] = 0.0;
+
+    utility::enuToLlh(illh, xyz, llh);
+    double head = v.yaw + (M_PI / 2.0);
+    utility::norm_angle_rad(&head);
+
+    double velN = v.speed * cos(head);
+    double velE = v.speed * sin(head);
+    double velD = 0.0;
+
+    unsigned char packet[72];
+    memset(packet, 0, sizeof(packet));
+
+    packet[0] = 0xE7;
+
+    int ind = 23;
+    put_R8(packet, &ind, llh[0] * (M_PI / 180.0));
+    put_R8(packet, &ind, llh[1] * (M_PI / 180.0));
+    put_R4(packet, &ind, llh[2]);
+    ind = 43;
+    put_I3(packet, &ind, (int32_t)(velN * 1e4));
+    put_I3(packet, &ind, (int32_t)(velE * 1e4));
+    put_I3(packet, &ind, (int32_t)(velD * 1e4));
+    put_I3(packet, &ind, (int32_t)(head * 1e6));
+
+    packet[22] = checksum(packet, 22);
+    packet[61] = checksum(packet, 61);
+    packet[71] = checksum(packet, 71);
+
+    return QByteArray((const char*)packet, sizeof(packet));
+}
+
+double TrafficSim::armYaw(int arm) const
+{
+    double yaw = ARM_YAW_0 + (double)arm * M_PI / 2.0;
+    utility::norm_angle_rad(&yaw);
+    return yaw;
+}
+
+void TrafficSim::updatePosition(Vehicle &v) const
+{
+    const Route &r = mRoutes.at(v.route);
+
+    if (v.s < mLegLength) {
+        double d = mLegLength - std::max(v.s, 0.0);
+        v.yaw = r.yaw_in;
+        v.x = mCenterX - d * cos(v.yaw);
+        v.y = mCenterY + d * sin(v.yaw);
+    } else {
+        double d = v.s - mLegLength;
+        v.yaw = r.yaw_out;
+        v.x = mCenterX + d * cos(v.yaw);
+        v.y = mCenterY - d * sin(v.yaw);
+    }
+
+    v.x -= LANE_OFFSET * sin(v.yaw);
+    v.y -= LANE_OFFSET * cos(v.yaw);
+
+    v.active = v.s >= 0.0;
+}
+
+/*
+ * Vehicles before the center follow each other per arm they enter from, and
+ * after the center per arm they leave through.
+ */
+int TrafficSim::laneOf(const Vehicle &v, double *pos) const
+{
+    const Route &r = mRoutes.at(v.route);
+
+    if (v.s < mLegLength) {
+        *pos = v.s;
+        return r.arm_in;
+    } else {
+        *pos = v.s - mLegLength;
+        return ARMS + r.arm_out;
+    }
+}
+
+void TrafficSim::updateSpeeds()
+{
+    for (QVector<int> &lane: mLanes) {
+        lane.clear();
+    }
+
+    QVector<double> pos(mVehicles.size());
+    for (int i = 0;i < mVehicles.size();i++) {
+        mLanes[laneOf(mVehicles.at(i), &pos[i])].append(i);
+    }
+
+    for (QVector<int> &lane: mLanes) {
+        std::sort(lane.begin(), lane.end(), [&pos](int a, int b) {
+            return pos.at(a) > pos.at(b);
+        });
+
+        for (int i = 0;i < lane.size();i++) {
+            Vehicle &v = mVehicles[lane.at(i)];
+            double acc = IDM_ACC * (1.0 - pow(v.speed / v.speedTarget, 4));
+
+            if (i > 0) {
+                const Vehicle &l = mVehicles.at(lane.at(i - 1));
+                double gap = std::max(pos.at(lane.at(i - 1)) - pos.at(lane.at(i)) - VEHICLE_LEN, 0.1);
+                double gapDes = IDM_MIN_GAP + std::max(0.0, v.speed * IDM_HEADWAY +
+                        v.speed * (v.speed - l.speed) / (2.0 * sqrt(IDM_ACC * IDM_DEC)));
+                acc -= IDM_ACC * (gapDes / gap) * (gapDes / gap);
+            }
+
+            v.speed = std::max(v.speed + acc * mStep, 0.0);
+        }
+    }
+}
+
+/*
+ * Extrapolate the vehicles close to the center with constant velocity and
+ * report the pairs from different lanes that get closer than CONFLICT_DIST
+ * within CONFLICT_HORIZON.
+ */
+void TrafficSim::detectConflicts()
+{
+    mConflicts.clear();
+
+    QVector<int> near;
+    for (const Vehicle &v: mVehicles) {
+        if (v.active && hypot(v.x - mCenterX, v.y - mCenterY) < CONFLICT_ZONE) {
+            near.append(v.id);
+        }
+    }
+
+    for (int i = 0;i < near.size();i++) {
+        const Vehicle &a = mVehicles.at(near.at(i));
+        double posA;
+        int laneA = laneOf(a, &posA);
+
+        for (int j = i + 1;j < near.size();j++) {
+            const Vehicle &b = mVehicles.at(near.at(j));
+            double posB;
+
+            if (laneOf(b, &posB) == laneA) {
+                continue;
+            }
+
+            double px = b.x - a.x;
+            double py = b.y - a.y;
+            double vx = b.speed * cos(b.yaw) - a.speed * cos(a.yaw);
+            double vy = -b.speed * sin(b.yaw) + a.speed * sin(a.yaw);
+            double vv = vx * vx + vy * vy;
+
+            double t = vv > 1e-6 ? -(px * vx + py * vy) / vv : 0.0;
+            t = std::max(t, 0.0);
+
+            if (t > CONFLICT_HORIZON) {
+                continue;
+            }
+
+            double dist = hypot(px + vx * t, py + vy * t);
+            if (dist < CONFLICT_DIST) {
+                Conflict c;
+                c.a = a.id;
+                c.b = b.id;
+                c.ttc = t;
+                c.dist = dist;
+                mConflicts.append(c);
+
+                if (mMinTtc < 0.0 || t < mMinTtc) {
+                    mMinTtc = t;
+                }
+            }
+        }
+    }
+
+    mConflictsTotal += mConflicts.size();
+}
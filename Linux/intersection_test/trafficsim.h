@@ -0,0 +1,104 @@
+/*
+    Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef TRAFFICSIM_H
+#define TRAFFICSIM_H
+
+#include <QVector>
+#include <QByteArray>
+#include <random>
+
+/*
+ * Fixed-step traffic simulation of vehicles driving through a four-way
+ * intersection. The simulation does not depend on any timer or widget, so
+ * it can be stepped from a GUI timer or as fast as possible when headless.
+ */
+class TrafficSim
+{
+public:
+    typedef struct {
+        int id;
+        int route;
+        double s;           // Distance along the route. Negative while queued before the start.
+        double speed;       // m/s
+        double speedTarget; // m/s
+        double x;
+        double y;
+        double yaw;         // Same convention as LocPoint
+        bool active;
+    } Vehicle;
+
+    typedef struct {
+        int a;
+        int b;
+        double ttc;         // Predicted time to the closest approach
+        double dist;        // Predicted distance at the closest approach
+    } Conflict;
+
+    TrafficSim();
+
+    void setCenter(double x, double y);
+    void setLegLength(double len);
+    void setSpeed(double speed);
+    void setStep(double step);
+    double step() const;
+
+    void reset(int vehicles, unsigned int seed = 1);
+    void run(int steps = 1);
+
+    double time() const;
+    qint64 steps() const;
+    const QVector<Vehicle> &vehicles() const;
+    const QVector<Conflict> &conflicts() const;
+    qint64 conflictsTotal() const;
+    double minTtc() const;
+
+    static QByteArray ncomPacket(const double *illh, const Vehicle &v);
+
+private:
+    typedef struct {
+        int arm_in;
+        int arm_out;
+        double yaw_in;
+        double yaw_out;
+    } Route;
+
+    double mCenterX;
+    double mCenterY;
+    double mLegLength;
+    double mSpeed;
+    double mStep;
+    double mTime;
+    qint64 mSteps;
+    qint64 mConflictsTotal;
+    double mMinTtc;
+
+    QVector<Route> mRoutes;
+    QVector<Vehicle> mVehicles;
+    QVector<Conflict> mConflicts;
+    QVector<QVector<int> > mLanes;
+    std::mt19937 mRng;
+
+    double armYaw(int arm) const;
+    void updatePosition(Vehicle &v) const;
+    int laneOf(const Vehicle &v, double *pos) const;
+    void updateSpeeds();
+    void detectConflicts();
+
+};
+
+#endif // TRAFFICSIM_H